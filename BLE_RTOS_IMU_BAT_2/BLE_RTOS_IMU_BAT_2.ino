@@ -16,6 +16,7 @@ LSM6DS3 myIMU(I2C_MODE, 0x6A);    //I2C device address 0x6A
 // IMU variables
 unsigned long miliBuffer[5];
 int sensorBuffer[30];
+#define IMU_BURST_LEN 12  // OUTX_L_G .. OUTZ_H_XL, gyro XYZ then accel XYZ
 int bufferIndex = 0;
 bool bufferOverflow = false;
 SemaphoreHandle_t bufferSemaphore;
@@ -96,6 +97,21 @@ void updateClock()
 
 }
 
+// Read all six axes in one auto-increment I2C transaction into
+// axes[0..5] as accel XYZ then gyro XYZ
+bool readImuBurst(int *axes)
+{
+  uint8_t raw[IMU_BURST_LEN];
+  if (myIMU.readRegisterRegion(raw, LSM6DS3_ACC_GYRO_OUTX_L_G, IMU_BURST_LEN) != IMU_SUCCESS) {
+    return false;
+  }
+  for (int i = 0; i < 3; i++) {
+    axes[i]     = (int16_t)(raw[6 + 2 * i] | (raw[7 + 2 * i] << 8));
+    axes[i + 3] = (int16_t)(raw[2 * i]     | (raw[2 * i + 1] << 8));
+  }
+  return true;
+}
+
 // Define a task function for the IMU reading
 void SensorTask(void *pvParameters) {
   (void) pvParameters;
@@ -103,21 +119,15 @@ void SensorTask(void *pvParameters) {
   for (;;) { // A Task shall never return or exit.
       if (bleConnected){
     bufferOverflow = false; // Set overflow flag
-    // Read accelerometer data
+    // Read accelerometer and gyroscope data in one burst, a failed read leaves
+    // the slot to the next sample rather than sending stale axes
     miliBuffer[bufferIndex] = millis() - startTime;
-    sensorBuffer[(bufferIndex * 6)] = myIMU.readRawAccelX();
-    sensorBuffer[(bufferIndex * 6) + 1] = myIMU.readRawAccelY();
-    sensorBuffer[(bufferIndex * 6) + 2] = myIMU.readRawAccelZ();
-
-    // Read gyroscope data
-    sensorBuffer[(bufferIndex * 6) + 3] = myIMU.readRawGyroX();
-    sensorBuffer[(bufferIndex * 6) + 4] = myIMU.readRawGyroY();
-    sensorBuffer[(bufferIndex * 6) + 5] = myIMU.readRawGyroZ();
-
-    bufferIndex++;
-    if (bufferIndex >= 5) {
-      bufferIndex = 0;
-      bufferOverflow = true; // Set overflow flag
+    if (readImuBurst(&sensorBuffer[bufferIndex * 6])) {
+      bufferIndex++;
+      if (bufferIndex >= 5) {
+        bufferIndex = 0;
+        bufferOverflow = true; // Set overflow flag
+        }
       }
     }
     vTaskDelay(pdMS_TO_TICKS(baseFrequency)); // Delay for a period of time
@@ -285,6 +295,7 @@ void setup() {
   
   //Configure IMU
   myIMU.begin();
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_CTRL3_C, 0x44); // BDU | IF_INC for burst reads
 
   // initialize BLE
   setupBLE();
@@ -1,76 +1,377 @@
 #include <bluefruit.h>
 #include "FreeRTOS.h"
+#include "message_buffer.h"
+#include "timers.h"
 #include "RTClib.h"
 #include "LSM6DS3.h"
 #include "Wire.h"
+#include <Adafruit_LittleFS.h>
+#include <InternalFileSystem.h>
+#include <Adafruit_SPIFlash.h>
+#include "src/SampleClock.h"
+#include "src/WallClock.h"
+#include "src/ClockSync.h"
+#include "src/SpscRing.h"
+#include "src/ImuSample.h"
+#include "src/ImuBus.h"
+#include "src/FrameEncoder.h"
+#include "src/TextWriter.h"
+#include "src/TextSample.h"
+#include "src/CommandParser.h"
+#include "src/TxQueue.h"
+#include "src/LinkModel.h"
+#include "src/MadgwickFilter.h"
+#include "src/GaitDetector.h"
+#include "src/Decimator.h"
+#include "src/FlashLog.h"
+#include "src/BatterySoc.h"
+#include "src/BatteryEstimator.h"
+#include "src/PowerState.h"
+#include "src/WakeOnMotion.h"
+
+using namespace Adafruit_LittleFS_Namespace;
 
 //Device name
-String deviceName = "IMU1";
+const char deviceName[] = "IMU1";
+const uint8_t deviceId = 1;  // Carried in every binary frame header
 
 //************************ Signal ************************
-// Base frequency for D8
-const int baseFrequency = 1024 / 32;  // One frame frequency 1024/8=>8Hz 1024/16=>16Hz     1024/32=>32Hz 
+// IMU output data rate, SensorTask is paced by the LSM6DS3 INT1 interrupt.
+// These are the LSM6DS3TR-C ODR steps the gyro shares with the accel, whose
+// 3.33 and 6.66 kHz have no gyro counterpart. The lowest is 12.5 Hz, see imuPeriodUs().
+const uint16_t imuRates[] = {13, 26, 52, 104, 208, 416, 833, 1660};
+#define IMU_LOWEST_PERIOD_US 80000
+volatile bool streamEnabled = true;  // CMD_START_STREAM / CMD_STOP_STREAM
+
+// Sensor configuration, changed at runtime over BLE and kept in internal flash
+// as a version byte followed by the struct
+#define IMU_CONFIG_VERSION 1
+#define IMU_CONFIG_PATH    "/imu.cfg"
+typedef struct {
+    uint16_t sampleRate;      // Hz, one of imuRates, accel and gyro alike
+    uint16_t accelRange;      // g, 2/4/8/16
+    uint16_t gyroRange;       // dps, 125/245/500/1000/2000
+    uint16_t accelBandwidth;  // Hz, accel low-pass 50/100/200/400, rounded down to the filter steps at the ODR
+} ImuConfig;
+
+ImuConfig imuConfig = {52, 16, 2000, 100};  // Library defaults apart from the rate
+MessageBufferHandle_t imuConfigRequests;    // Validated configs waiting for SensorTask
+const uint32_t imuTimeoutMs = 100;  // Give up waiting for data-ready after this long
+
+// Accel digital low-pass of the LSM6DS3TR-C: LPF1 at ODR/2 or ODR/4
+// (CTRL1_XL LPF1_BW_SEL), or LPF2 behind it at ODR/9 to ODR/400 (CTRL8_XL
+// LPF2_XL_EN and HPCF_XL). Cutoffs are fractions of the ODR, ordered widest first.
+typedef struct {
+    uint16_t divisor;
+    uint8_t ctrl1;  // LPF1_BW_SEL, BW0_XL stays 0 (1.5 kHz analog chain)
+    uint8_t ctrl8;
+} AccelFilter;
+
+const AccelFilter accelFilters[] = {
+  {2, 0x00, 0x00}, {4, 0x02, 0x00}, {9, 0x00, 0xC0}, {50, 0x00, 0x80}, {100, 0x00, 0xA0}, {400, 0x00, 0xE0}
+};
+
+// Acquisition modes
+typedef enum {
+    ACQ_DATA_READY,  // One interrupt and one burst read per sample
+    ACQ_FIFO         // LSM6DS3 FIFO drained in batches on the watermark interrupt
+} AcquisitionMode;
+
+AcquisitionMode acquisitionMode = ACQ_DATA_READY;
+uint16_t fifoWatermarkSamples = 16;       // Samples buffered in the IMU per wakeup, follows the ODR
+volatile uint32_t fifoOverruns = 0;       // FIFO_OVER seen while draining
+#define IMU_INT1_PIN PIN_LSM6DS3TR_C_INT1
 //Create a instance of class LSM6DS3
 LSM6DS3 myIMU(I2C_MODE, 0x6A);    //I2C device address 0x6A
 // IMU variables
-unsigned long miliBuffer;
-float sensorBuffer[6];
-int bufferIndex = 0;
-bool bufferOverflow = false;
-SemaphoreHandle_t bufferSemaphore;
+TaskHandle_t sensorTaskHandle = NULL;
+#define SENSOR_TASK_INT1        0x01    // SensorTask notification bits: INT1 fired
+#define SENSOR_TASK_RECONFIGURE 0x02    // Power state or settings changed, no new sample
+volatile uint32_t sampleInstantUs = 0;  // Latched by the INT1 ISR
+volatile uint32_t missedDataReady = 0;  // Data-ready timeouts
+
+PeriodStats samplePeriodStats = {0, UINT32_MAX, 0, 0, 0};  // Data-ready periods, see src/SampleClock.h
+
+// Samples handed from SensorTask to ble_uart_task
+const uint16_t txBatchSamples = 16;  // Samples drained per transmit wakeup
+SpscRing<ImuSample, 64> sampleRing;
+TaskHandle_t bleTxTaskHandle = NULL;
+volatile uint16_t txWakeThreshold = 1;  // Ring depth at which SensorTask wakes ble_uart_task
+volatile bool txFramePending = false;   // ble_uart_task holds a partial frame and a deadline
+
+// Application task wakeups, sample it twice to get wakeups per second
+volatile uint32_t appWakeups = 0;
+
+//************************ Sample clock ************************
+// RTC2 free-runs un-prescaled on the 32.768 kHz LFCLK (RTC0 belongs to the SoftDevice,
+// RTC1 to the FreeRTOS tick), so timestamps resolve to ~30.5 us and keep counting in sleep.
+volatile uint32_t sampleClockOverflows = 0; // Upper bits above the 24-bit RTC counter
+
+//************************ Packet ************************
+// Frame formats are described in src/FrameEncoder.h and command framing in
+// src/CommandParser.h. Every command is answered on the TX stream with a
+// response frame
+//   [version << 4 | FRAME_TYPE_RESPONSE][status][device id][opcode][payload length][payload]
+// except CMD_SYNC_REQUEST, which is answered by its sync reply.
+#define CMD_MAX_REPLY       80
+#define FRAME_TYPE_RESPONSE 3
+#define RESPONSE_HEADER_LEN 5
+
+typedef enum {
+    CMD_SET_TIME     = 0x01,  // u32 local time in seconds since 1970
+    CMD_SET_ODR      = 0x02,  // u16 Hz, one of imuRates
+    CMD_START_STREAM = 0x03,
+    CMD_STOP_STREAM  = 0x04,
+    CMD_GET_STATS    = 0x05,  // Replies with TxStats followed by AcqStats
+    CMD_SYNC_REQUEST = 0x06,  // u8 seq, u64 t1
+    CMD_SYNC_RESULT  = 0x07,  // u8 seq, i64 offset, u32 delay
+    CMD_OFFLOAD      = 0x08,  // u8, same actions as the offload characteristic
+    CMD_SET_CONFIG   = 0x09,  // ImuConfig, applied and saved
+    CMD_GET_CONFIG   = 0x0A,  // Replies with ImuConfig
+    CMD_SET_STREAM   = 0x0B,  // u8 StreamFormat, u8 fusion divider (samples per quaternion)
+                              // or for STREAM_GAIT the gyro axis 0-2, | 0x80 to invert it,
+                              // ignored by the other formats
+    CMD_GET_FUSION   = 0x0C,  // Replies with FusionStats
+    CMD_SET_DECIMATION = 0x0D,// u8 factor 1/2/4/8, u8 DECIMATION_* flags
+    CMD_SET_MOTION   = 0x0E   // MotionConfig
+} CommandOpcode;
+
+typedef enum {
+    CMD_OK         = 0,
+    CMD_UNKNOWN    = 1,
+    CMD_BAD_LENGTH = 2,
+    CMD_BAD_VALUE  = 3,
+    CMD_BUSY       = 4,
+    CMD_UNAVAILABLE = 5,   // Offload characteristic not subscribed
+    CMD_ABORTED    = 6,    // Offload stopped, the host did not take the notifications
+    CMD_NO_REPLY   = 0xFF  // Handler answers some other way
+} CommandStatus;
+
+// Handlers get the payload, its arrival time on the sample clock and room for
+// a reply payload of up to CMD_MAX_REPLY bytes
+typedef CommandStatus (*CommandHandler)(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen);
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t length;  // Exact payload length
+    CommandHandler handler;
+} CommandEntry;
+
+// Two-way time sync against sampleClockMicros64(), see src/ClockSync.h
+//   CMD_SYNC_REQUEST  host -> device  seq, t1 host send
+//   sync reply        device -> host  [version << 4 | FRAME_TYPE_SYNC][flags][device id][seq]
+//                                     [t1 u64][t2 device receive u64][t3 device send u64]
+//   CMD_SYNC_RESULT   host -> device  seq, offset ((t1 - t2) + (t4 - t3)) / 2, delay (t4 - t1) - (t3 - t2)
+#define FRAME_TYPE_SYNC    2
+#define SYNC_REPLY_LEN     28
+
+// Transmit statistics, published on the stats characteristic (little-endian)
+typedef struct __attribute__((packed)) {
+    uint32_t samplesDropped;  // Ring overflows, SensorTask outran ble_uart_task
+    uint32_t framesSent;      // Frames fully accepted by the stack
+    uint32_t framesRetried;   // Notifications the stack refused, retried later
+    uint32_t framesDropped;   // Frames evicted from a full TX queue
+    uint32_t bytesAccepted;
+    uint32_t bytesRejected;   // Of the notifications refused, each refusal once
+    uint32_t txCompleted;     // Notifications the SoftDevice reported sent
+    uint32_t wakeups;         // appWakeups
+    uint16_t queueDepth;
+    uint16_t queueHighWater;
+} TxStats;
+
+// Sampling, recording and command health, second half of the CMD_GET_STATS reply
+typedef struct __attribute__((packed)) {
+    uint32_t periods;          // Sample periods measured, data-ready mode only
+    uint32_t periodMinUs;
+    uint32_t periodMaxUs;
+    uint32_t periodMeanUs;
+    uint32_t jitterRmsUs;      // Deviation from the nominal ODR period
+    uint32_t missedDataReady;  // Data-ready or FIFO watermark waits that timed out
+    uint32_t fifoOverruns;     // FIFO_OVER seen while draining
+    uint32_t framesLogged;     // Frames appended to the flash log
+    uint32_t logWriteErrors;   // Frames the flash log could not take
+    uint32_t commandErrors;    // Command frames with a bad length or CRC
+} AcqStats;
+
+// Negotiated link parameters, published on the link characteristic (little-endian)
+typedef struct __attribute__((packed)) {
+    uint16_t mtu;                 // ATT MTU
+    uint16_t dataLength;          // LL payload octets
+    uint8_t phy;                  // BLE_GAP_PHY_1MBPS / BLE_GAP_PHY_2MBPS
+    uint16_t interval;            // Connection interval in 1.25 ms units
+    uint16_t requestedInterval;   // What the link optimizer asked for
+    uint32_t capacityBytesPerSec; // Notification payload the link model allows for
+    uint32_t requiredBytesPerSec; // Stream payload at the configured ODR
+} LinkInfo;
+
+// Link optimizer, requested by the peripheral after every connect. Targets
+// and the throughput model in src/LinkModel.h.
+#define LINK_SUP_TIMEOUT      400    // 4 s, in units of 10 ms
+#define LINK_INTERVAL_RETRIES 3      // Re-requests while another procedure kept the interval from being applied
+
+// Output formats for the sample stream
+typedef enum {
+    STREAM_TEXT,       // Legacy "IMU1,87%,25.3^,15:0:3,..." line per sample
+    STREAM_BINARY,     // FrameEncoder frames
+    STREAM_QUATERNION, // Fused orientation, FRAME_TYPE_QUAT frames
+    STREAM_GAIT,       // Gait events and stride features, FRAME_TYPE_GAIT frames
+    STREAM_PACKED,     // Raw samples losslessly compressed, FRAME_TYPE_PACKED frames
+    STREAM_FORMATS
+} StreamFormat;
+
+StreamFormat streamFormat = STREAM_BINARY;
+volatile StreamFormat requestedFormat = STREAM_BINARY;  // CMD_SET_STREAM, switched by ble_uart_task between frames
+FrameEncoder frameEncoder(deviceId);
+const uint32_t maxBatchLatencyMs = 100;  // A partly filled frame is sent once its oldest sample is this old
+const uint32_t txRetryMs = 20;           // Retry interval for a stalled TX queue without TX-complete events
+TxQueue txQueue;
+TxStats txStats = {0};
+volatile uint32_t txCompleted = 0;       // From BLE_GATTS_EVT_HVN_TX_COMPLETE
+TimerHandle_t statsTimer;
+uint32_t reportedOverflows = 0;  // Ring overflows already flagged to the host
+
+//************************ Fusion ************************
+// MadgwickFilter (src/MadgwickFilter.h), run by ble_uart_task on every sample
+// in STREAM_QUATERNION mode
+#define FUSION_BETA       0.1f     // Accel correction gain, Madgwick's suggested value
+#define FUSION_MAX_GAP_US 250000   // Longer gaps restart the filter from the accel tilt
+
+// Fusion cost, CPU cycles from the DWT cycle counter around each update.
+// Preemption by SensorTask lands in the count, so the maximum is an upper bound.
+typedef struct __attribute__((packed)) {
+    uint32_t updates;
+    uint32_t cyclesAvg;
+    uint32_t cyclesMax;
+    uint32_t cyclesLast;
+} FusionStats;
+
+MadgwickFilter fusion(FUSION_BETA);
+volatile uint8_t fusionDivider = 4;  // Samples per quaternion sent
+uint8_t fusionPhase = 0;             // Samples since the last quaternion
+uint32_t fusionLastUs = 0;           // Timestamp of the previous fused sample
+uint64_t fusionCycles = 0;           // Sum over all updates, for the average
+FusionStats fusionStats = {0};
+
+//************************ Gait ************************
+// GaitDetector (src/GaitDetector.h), run by ble_uart_task in STREAM_GAIT mode
+GaitDetector gaitDetector;
+volatile uint8_t gaitAxis = 0;  // Gyro axis facing mediolateral, | 0x80 when mounted the other way round
+
+//************************ Decimation ************************
+// Decimator (src/Decimator.h) in front of every stream format. Optionally
+// the full-rate samples go to the flash log at the same time, packed. That
+// only fills a RAM segment, TaskFlashLog does the flash writes, so the live
+// stream never waits for a sector erase.
+#define DECIMATION_LOG_FULL_RATE   0x01   // CMD_SET_DECIMATION flag
+
+Decimator decimator;
+volatile uint8_t requestedDecimation = 1;  // CMD_SET_DECIMATION, applied by ble_uart_task
+volatile uint8_t requestedDecimationFlags = 0;
+bool fullRateLog = false;                  // Full-rate samples are being logged
+FrameEncoder logEncoder(deviceId);         // Packs them, independent of the live stream
+
+//************************ Flash log ************************
+// While nobody listens to the stream, sealed frames go to a FlashLog
+// (src/FlashLog.h) on the 2 Mbyte QSPI flash of the XIAO Sense, away from
+// the small internal file system that keeps imu.cfg and the bonds. Frames
+// are gathered in RAM and written a whole 4 kbyte segment at a time by
+// TaskFlashLog, the only task touching the QSPI flash, which also offloads
+// and erases the log.
+#define LOG_TASK_OFFLOAD    0x01   // TaskFlashLog notification bits, 0x01 and 0x02 as written
+#define LOG_TASK_ERASE      0x02   // to the offload characteristic
+#define LOG_TASK_WRITE      0x04   // A segment was sealed
+#define LOG_FLUSH_MS        60000  // A partly filled segment goes to flash after this long, bounds the loss on a reset
+#define OFFLOAD_MAX_RETRIES 50     // Refused notifications in a row, txRetryMs apart, before an offload gives up
+
+Adafruit_FlashTransport_QSPI qspiTransport;
+Adafruit_SPIFlash qspiFlash(&qspiTransport);
+
+// FlashLog storage on the QSPI flash, one segment per 4 kbyte sector
+class QspiLogStorage {
+public:
+  uint32_t sectors() { return qspiFlash.size() / LOG_SEGMENT_BYTES; }
+  bool eraseSector(uint32_t sector) { return qspiFlash.eraseSector(sector); }
+  bool program(uint32_t address, const uint8_t *data, uint32_t length) {
+    return qspiFlash.writeBuffer(address, data, length) == length;
+  }
+  bool read(uint32_t address, uint8_t *data, uint32_t length) {
+    return qspiFlash.readBuffer(address, data, length) == length;
+  }
+};
+
+QspiLogStorage logStorage;
+FlashLog<QspiLogStorage> flashLog(logStorage);
+TaskHandle_t flashLogTaskHandle = NULL;
+volatile bool offloadActive = false;
+volatile uint32_t framesLogged = 0;
+volatile uint32_t logWriteErrors = 0;
+
+//************************ Power ************************
+// Connection and stream state decide which parts of the device stay awake,
+// see src/PowerState.h. Parked tasks block on their task notification at a
+// safe point in their loop, so they neither wake nor get stopped halfway
+// through an I2C transfer or a battery measurement. ble_uart_task needs no
+// parking, it only wakes for work.
+
+#define ADV_FAST_INTERVAL 32    // 20 ms, in units of 0.625 ms
+#define ADV_SLOW_INTERVAL 244   // 152.5 ms
+#define ADV_IDLE_INTERVAL 1636  // 1022.5 ms, nobody is waiting for an idle device
+
+volatile PowerState powerState = POWER_RECORDING;
+volatile bool sensorEnabled = true;   // SensorTask samples, otherwise the IMU is powered down
+volatile bool batteryEnabled = true;  // TaskBattery measures
+TaskHandle_t batteryTaskHandle = NULL;
+bool advertisingIdle = false;         // Advertising at ADV_IDLE_INTERVAL
+
+// Wake on motion: once the stream has been still for idleSeconds, SensorTask
+// hands the IMU over to its wake-up detector and blocks. Meanwhile the FIFO
+// keeps the newest preRollMs of samples, which are sent first on wake so the
+// motion onset is not lost.
+#define MOTION_MAX_IDLE_S    3600
+#define MOTION_SLAVE_LATENCY 30    // Connection events the peripheral may skip while waiting
+
+typedef struct __attribute__((packed)) {
+    uint8_t enabled;
+    uint8_t threshold;     // Accel slope in 1/64 of full scale (WAKE_UP_THS), 1-63
+    uint16_t idleSeconds;  // Still for this long arms the wake-up, up to MOTION_MAX_IDLE_S
+    uint16_t preRollMs;    // History sent on wake, up to MOTION_FIFO_SAMPLES samples
+} MotionConfig;
+
+MotionConfig motionConfig = {0, 1, 30, 1000};
+volatile bool motionWaiting = false;  // Wake-up armed, SensorTask blocked
+volatile uint32_t lastMotionUs = 0;   // Last sample whose slope crossed the threshold
 
 //************************ Battery ************************
 // Define battery
-#define VBAT_DIVIDER      (0.332888F)   // 1M + 0.499M voltage divider on VBAT
-#define VBAT_DIVIDER_COMP (3.004008F)        // Compensation factor for the VBAT divider
-const int batterySampleNum = 8;
-int batteryValues[batterySampleNum] = {0}; // buffer to store the last 10 battery readings
-int percentage; // average battery buffer
-int currentSampleIndex = 0; // index to keep track of the current sample
-float mv_per_lsb = 3600.0F/1024.0F; // 10-bit ADC with 3.6V input range
-
-
-typedef struct {
-    float voltage;
-    int percentage;
-} BatteryState;
-
-BatteryState battery_states[] = {
-    {4.16, 100}, {4.15, 99}, {4.14, 98}, {4.13, 97}, {4.12, 96}, {4.11, 95}, {4.10, 94}, {4.09, 92}, 
-    {4.08, 91}, {4.07, 90}, {4.06, 89}, {4.05, 88}, {4.04, 87}, {4.03, 86}, {4.02, 85}, {4.01, 84}, 
-    {4.00, 83}, {3.99, 82}, {3.98, 81}, {3.97, 80}, {3.96, 79}, {3.95, 78}, {3.94, 77}, {3.93, 76}, 
-    {3.92, 75}, {3.91, 74}, {3.9, 73}, {3.89, 72}, {3.88, 71}, {3.87, 70}, {3.86, 69}, {3.85, 68}, 
-    {3.84, 67}, {3.83, 66}, {3.82, 65}, {3.81, 64}, {3.8, 63}, {3.79, 62}, {3.78, 61}, {3.77, 60}, 
-    {3.76, 59}, {3.75, 58}, {3.74, 57}, {3.73, 56}, {3.72, 55}, {3.71, 54}, {3.7, 53}, {3.69, 52}, 
-    {3.68, 51}, {3.67, 50}, {3.66, 49}, {3.65, 48}, {3.64, 47}, {3.63, 46}, {3.62, 45}, {3.61, 44}, 
-    {3.6, 43}, {3.59, 42}, {3.58, 41}, {3.57, 40}, {3.56, 39}, {3.55, 38}, {3.54, 37}, {3.53, 36}, 
-    {3.52, 35}, {3.51, 34}, {3.5, 33}, {3.49, 32}, {3.48, 31}, {3.47, 30}, {3.46, 29}, {3.45, 28}, 
-    {3.44, 27}, {3.43, 26}, {3.42, 25}, {3.41, 24}, {3.4, 23}, {3.39, 22}, {3.38, 21}, {3.37, 20}, 
-    {3.36, 19}, {3.35, 18}, {3.34, 17}, {3.33, 16}, {3.32, 15}, {3.31, 14}, {3.3, 13}, {3.29, 12}, 
-    {3.28, 11}, {3.27, 10}, {3.26, 9}, {3.25, 8}, {3.24, 7}, {3.23, 6}, {3.22, 5}, {3.21, 4}, 
-    {3.19, 3}, {3.17, 2}, {3.15, 1}, {0.00, 0}
-}; 
-
-int getBatteryPercentage(float voltage) {
-  for (int i = 0; i < sizeof(battery_states)/sizeof(BatteryState) - 1; i++) {
-    if (voltage >= battery_states[i].voltage) {
-      return battery_states[i].percentage;
-    }
-  }
-  return 0; // Return 0% if the voltage is below the lowest defined voltage
-}
+// Divider and SAADC settings in src/BatteryEstimator.h
+const uint32_t batteryPeriodMs = 1000;  // One measurement per second
+uint32_t batteryMillivolts; // filtered open-circuit cell voltage
+int percentage; // state of charge from the filtered voltage
+
+// Radio events pull the cell down by tens of mV while they run, so
+// conversions are timed into the gap after one (radio notification on SWI1)
+// and only the steady load left then is corrected for, load current from the
+// model in src/PowerState.h times internal resistance.
+#define BATTERY_RINT_MOHM   250    // Cell, protection FETs and charger path
+#define BATTERY_RADIO_WAIT_MS 1100 // Longest gap between radio events, idle advertising is 1022.5 ms apart
+#define BATTERY_RADIO_GAP_US  2000 // Latest conversion start after a radio event ends, the next one
+                                   // is at least 7.5 ms minus the event length away
+#define BATTERY_RADIO_TRIES   4    // Radio events to wait for before converting regardless
+BatteryEstimator batteryEstimator(BATTERY_RINT_MOHM);
+volatile uint32_t radioIdleUs = 0; // Sample clock at the end of the last radio event
+volatile uint32_t radioStartUs = 0; // and at the start of the last one
+volatile bool radioActive = false;
+volatile bool batteryAwaitsRadio = false; // TaskBattery wants a notification at the next end
+// State of charge from the cell's discharge curve, see src/BatterySoc.h
 
 //************************ RTC ************************
-RTC_Millis rtc;
-// Initial date and time values
-volatile int year = 2023;
-volatile int month = 9;
-volatile int day = 30;
-volatile int hour = 15;
-volatile int minute = 0;
-volatile int second = 0;
-// Update date and time every second
-TickType_t Second_Time_Delay = 1024; 
+// Wall clock model against sampleClockMicros64(), see src/WallClock.h. Read
+// and written in a critical section.
+WallClockModel wallClock = {0, 0, 0};
+
+ClockSync clockSync;             // Sync points and the drift fitted across bursts
+MessageBufferHandle_t controlFrames;  // Command responses, ble_receive_task -> ble_uart_task
+CommandParser commandParser;
 
 //************************ BLE Service ************************
 BLEDfu  bledfu;  // OTA DFU service
@@ -78,228 +379,1610 @@ BLEDis  bledis;  // device information
 BLEUart bleuart; // uart over ble
 BLEBas  blebas;  // battery
 char central_name_global[32] = { 0 };
-String receivedString;         // Variable to store the received string
-String lastProcessedString;    // Variable to store the last processed string
+volatile uint16_t connHandle = BLE_CONN_HANDLE_INVALID;
+
+// Telemetry service, 128-bit UUIDs 5E1F000x-9A3C-4F6B-8D2E-7C4B1A2F6E30
+const uint8_t UUID_TELEMETRY_SERVICE[16] = {0x30, 0x6E, 0x2F, 0x1A, 0x4B, 0x7C, 0x2E, 0x8D, 0x6B, 0x4F, 0x3C, 0x9A, 0x01, 0x00, 0x1F, 0x5E};
+const uint8_t UUID_STATS_CHAR[16]        = {0x30, 0x6E, 0x2F, 0x1A, 0x4B, 0x7C, 0x2E, 0x8D, 0x6B, 0x4F, 0x3C, 0x9A, 0x02, 0x00, 0x1F, 0x5E};
+const uint8_t UUID_OFFLOAD_CHAR[16]      = {0x30, 0x6E, 0x2F, 0x1A, 0x4B, 0x7C, 0x2E, 0x8D, 0x6B, 0x4F, 0x3C, 0x9A, 0x03, 0x00, 0x1F, 0x5E};
+BLEService telemetryService(UUID_TELEMETRY_SERVICE);
+BLECharacteristic statsChar(UUID_STATS_CHAR);
+BLECharacteristic offloadChar(UUID_OFFLOAD_CHAR);  // Write 0x01 to offload the flash log, 0x02 to erase it
+const uint8_t UUID_LINK_CHAR[16]         = {0x30, 0x6E, 0x2F, 0x1A, 0x4B, 0x7C, 0x2E, 0x8D, 0x6B, 0x4F, 0x3C, 0x9A, 0x04, 0x00, 0x1F, 0x5E};
+BLECharacteristic linkChar(UUID_LINK_CHAR);
+LinkInfo linkInfo = {0};  // Last published
+uint16_t requestedInterval = 0;
+uint16_t requestedLatency = 0;     // Peripheral latency, raised while waiting for motion
+uint8_t intervalRetriesLeft = 0;
+MessageBufferHandle_t rxMessages;  // One message per write from the central
+
+
+extern "C" void RTC2_IRQHandler(void)
+{
+  if (NRF_RTC2->EVENTS_OVRFLW) {
+    NRF_RTC2->EVENTS_OVRFLW = 0;
+    sampleClockOverflows++;
+  }
+}
+
+// Start the sample clock, the LFCLK must already be running (Bluefruit.begin)
+void startSampleClock(void)
+{
+  NRF_RTC2->PRESCALER = 0;
+  NRF_RTC2->EVTENSET = RTC_EVTENSET_OVRFLW_Msk;
+  NRF_RTC2->INTENSET = RTC_INTENSET_OVRFLW_Msk;
+  NVIC_SetPriority(RTC2_IRQn, 2);
+  NVIC_EnableIRQ(RTC2_IRQn);
+  NRF_RTC2->TASKS_CLEAR = 1;
+  NRF_RTC2->TASKS_START = 1;
+}
+
+// Sample clock ticks since startSampleClock(), safe to call from any context
+uint64_t sampleClockTicks(void)
+{
+  uint32_t overflows, counter;
+  do {
+    overflows = sampleClockOverflows;
+    counter = NRF_RTC2->COUNTER;
+  } while (overflows != sampleClockOverflows);
+
+  // Overflow pending but not serviced yet because the caller outranks RTC2_IRQn
+  return extendRtcCounter(overflows, counter, NRF_RTC2->EVENTS_OVRFLW);
+}
+
+uint64_t sampleClockMicros64(void)
+{
+  return sampleClockTicksToMicros(sampleClockTicks());
+}
+
+uint32_t sampleClockMicros(void)
+{
+  return (uint32_t)sampleClockMicros64();
+}
+
+void setWallClockModel(const WallClockModel &model)
+{
+  taskENTER_CRITICAL();
+  wallClock = model;
+  taskEXIT_CRITICAL();
+}
+
+WallClockModel wallClockModel(void)
+{
+  taskENTER_CRITICAL();
+  WallClockModel model = wallClock;
+  taskEXIT_CRITICAL();
+  return model;
+}
+
+// Wall clock in us at a sample clock reading
+uint64_t wallClockAt(uint64_t localUs)
+{
+  return wallClockModelAt(wallClockModel(), localUs);
+}
+
+// Set the wall clock, the sample clock it rides on keeps running untouched and
+// the drift correction carries over
+void setWallClock(uint32_t unixSeconds)
+{
+  setWallClockModel(wallClockModelSet(wallClockModel(), sampleClockMicros64(), unixSeconds));
+}
+
+// Unix time in microseconds, the sample clock is 64-bit so it never wraps
+uint64_t wallClockMicros(void)
+{
+  return wallClockAt(sampleClockMicros64());
+}
+
+// Sample clock timestamp (recent, low 32 bits) in the shared wall clock timebase
+uint32_t sharedTimestamp(uint32_t localUs)
+{
+  return (uint32_t)wallClockAt(widenMicros(sampleClockMicros64(), localUs));
+}
+
+// A host sync point moves the wall clock model, see ClockSync
+void addSyncPoint(const SyncPoint &point)
+{
+  setWallClockModel(clockSync.add(point, wallClockModel().driftPpb));
+}
+
+// INT1 interrupt (data-ready or FIFO watermark): latch the instant and wake SensorTask
+void imuInt1ISR(void)
+{
+  sampleInstantUs = sampleClockMicros();
+  if (sensorTaskHandle != NULL) {
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    xTaskNotifyFromISR(sensorTaskHandle, SENSOR_TASK_INT1, eSetBits, &higherPriorityTaskWoken);
+    portYIELD_FROM_ISR(higherPriorityTaskWoken);
+  }
+}
+
+// SensorTask's notification bits, none on a timeout
+uint32_t waitSensorTask(TickType_t ticks)
+{
+  uint32_t bits = 0;
+  xTaskNotifyWait(0, UINT32_MAX, &bits, ticks);
+  return bits;
+}
+
+// Sample period at an ODR step, the 13 Hz step is really 12.5 Hz
+uint32_t imuPeriodUs(uint16_t hz)
+{
+  return hz == imuRates[0] ? IMU_LOWEST_PERIOD_US : 1000000UL / hz;
+}
+
+// LSM6DS3 ODR field value shared by CTRL1_XL, CTRL2_G and FIFO_CTRL5
+uint8_t imuOdrCode(uint16_t hz)
+{
+  uint8_t i = 0;
+  while (i < sizeof(imuRates) / sizeof(imuRates[0]) - 1 && imuRates[i] < hz) {
+    i++;
+  }
+  return i + 1;  // 0 is power-down
+}
+
+// Continuous-mode FIFO holding gyro and accel words (same order as the output
+// registers) with the watermark routed to INT1
+void configureFifo(uint16_t watermarkSamples)
+{
+  uint16_t words = watermarkSamples * (IMU_BURST_LEN / 2);
+
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_FIFO_CTRL5, 0x00);                  // Bypass, flushes the FIFO
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_FIFO_CTRL1, words & 0xFF);
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_FIFO_CTRL2, (words >> 8) & 0x0F);
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_FIFO_CTRL3, 0x09);                  // Gyro and accel, no decimation
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_FIFO_CTRL4, 0x00);
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_FIFO_CTRL5, (imuOdrCode(imuConfig.sampleRate) << 3) | 0x06); // Continuous
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_INT1_CTRL, 0x08);                   // INT1_FTH
+}
+
+// Route the acquisition interrupt to INT1. Data-ready is a short pulse so a late
+// read can never leave the line latched high and stall the sampling.
+void routeImuInterrupt(void)
+{
+  if (acquisitionMode == ACQ_FIFO) {
+    configureFifo(fifoWatermarkSamples);
+  } else {
+    myIMU.writeRegister(LSM6DS3_ACC_GYRO_FIFO_CTRL5, 0x00);       // FIFO bypass
+    myIMU.writeRegister(LSM6DS3_ACC_GYRO_DRDY_PULSE_CFG_G, 0x80); // DRDY_PULSED
+    myIMU.writeRegister(LSM6DS3_ACC_GYRO_INT1_CTRL, 0x01);        // INT1_DRDY_XL
+  }
+}
+
+void configureImuInterrupt(void)
+{
+  routeImuInterrupt();
+  pinMode(IMU_INT1_PIN, INPUT);
+  attachInterrupt(digitalPinToInterrupt(IMU_INT1_PIN), imuInt1ISR, RISING);
+}
 
+void countWakeup(void)
+{
+  __atomic_fetch_add(&appWakeups, 1, __ATOMIC_RELAXED);
+}
 
-// This function updates the software-based clock every second
-void updateClock() 
+// Motion as the wake-up detector would see it, to time the idle hand-over
+void noteMotion(const ImuSample &sample)
 {
-    DateTime now = rtc.now();
-    year = now.year();
-    month = now.month();
-    day = now.day();
-    hour = now.hour();
-    minute = now.minute();
-    second = now.second();
+  static int16_t previous[3];
+  if (motionSlopeExceeds(previous, sample.accel, motionConfig.threshold)) {
+    lastMotionUs = sample.timestamp;
+  }
+  memcpy(previous, sample.accel, sizeof(previous));
+}
 
+// Hand one sample to the transmit path, a full ring counts the drop. The
+// transmit task is only woken when it has a frame to fill, or for the first
+// sample when it has nothing pending to arm its latency deadline with.
+void publishSample(const ImuSample &sample)
+{
+  noteMotion(sample);
+  if (!streamEnabled || !sampleRing.push(sample) || bleTxTaskHandle == NULL) {
+    return;
+  }
+  uint16_t depth = sampleRing.size();
+  if (depth == txWakeThreshold || (depth == 1 && !txFramePending)) {
+    xTaskNotifyGive(bleTxTaskHandle);
+  }
+}
+
+// Drain the FIFO into the transmit ring, see readImuFifo(). After an overrun
+// the FIFO is flushed and starts over, losing what it held.
+uint16_t drainImuFifo(void)
+{
+  bool overrun;
+  uint16_t done = readImuFifo(myIMU, sampleClockMicros(), imuPeriodUs(imuConfig.sampleRate), overrun,
+                              [](const ImuSample &sample) {
+    // A pre-roll is more than the ring holds, the FIFO keeps the rest meanwhile
+    while (streamEnabled && sampleRing.size() == sampleRing.capacity()) {
+      xTaskNotifyGive(bleTxTaskHandle);
+      vTaskDelay(1);
+    }
+    publishSample(sample);
+  });
+  if (overrun) {
+    fifoOverruns++;
+    if (acquisitionMode == ACQ_FIFO && !motionWaiting) {
+      configureFifo(fifoWatermarkSamples);
+    }
+  }
+  return done;
+}
+
+void recordSamplePeriod(uint32_t period)
+{
+  recordPeriod(samplePeriodStats, period, imuPeriodUs(imuConfig.sampleRate));
+}
+
+bool validImuConfig(const ImuConfig &config)
+{
+  bool rateOk = false;
+  for (uint8_t i = 0; i < sizeof(imuRates) / sizeof(imuRates[0]); i++) {
+    rateOk |= imuRates[i] == config.sampleRate;
+  }
+  return rateOk &&
+         (config.accelRange == 2 || config.accelRange == 4 || config.accelRange == 8 || config.accelRange == 16) &&
+         (config.gyroRange == 125 || config.gyroRange == 245 || config.gyroRange == 500 ||
+          config.gyroRange == 1000 || config.gyroRange == 2000) &&
+         (config.accelBandwidth == 50 || config.accelBandwidth == 100 ||
+          config.accelBandwidth == 200 || config.accelBandwidth == 400);
+}
+
+// CTRL1_XL FS_XL field
+uint8_t accelRangeBits(uint16_t g)
+{
+  switch (g) {
+  case 2:  return 0x00;
+  case 4:  return 0x08;
+  case 8:  return 0x0C;
+  default: return 0x04;  // 16 g
+  }
+}
+
+// Widest filter whose cutoff does not exceed hz at the sample rate
+const AccelFilter &accelFilterFor(uint16_t hz, uint16_t sampleRate)
+{
+  const uint8_t last = sizeof(accelFilters) / sizeof(accelFilters[0]) - 1;
+  uint8_t i = 0;
+  while (i < last && (uint64_t)hz * accelFilters[i].divisor * imuPeriodUs(sampleRate) < 1000000UL) {
+    i++;
+  }
+  return accelFilters[i];
+}
+
+// CTRL2_G FS_G and FS_125 fields
+uint8_t gyroRangeBits(uint16_t dps)
+{
+  switch (dps) {
+  case 125:  return 0x02;
+  case 245:  return 0x00;
+  case 500:  return 0x04;
+  case 1000: return 0x08;
+  default:   return 0x0C;  // 2000 dps
+  }
+}
+
+// Program a validated configuration into both sensors and retune the FIFO
+// batch to the new rate, so a drain still fits the ring and the frame latency.
+// Only SensorTask touches the IMU bus once the tasks run.
+void applyImuConfig(const ImuConfig &config)
+{
+  uint8_t odr = imuOdrCode(config.sampleRate) << 4;
+  const AccelFilter &filter = accelFilterFor(config.accelBandwidth, config.sampleRate);
+  imuConfig = config;
+  myIMU.settings.accelSampleRate = config.sampleRate;
+  myIMU.settings.gyroSampleRate = config.sampleRate;
+  myIMU.settings.accelRange = config.accelRange;
+  myIMU.settings.gyroRange = config.gyroRange;
+  myIMU.settings.accelBandWidth = config.accelBandwidth;
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_CTRL1_XL, odr | accelRangeBits(config.accelRange) | filter.ctrl1);
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_CTRL8_XL, filter.ctrl8);
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_CTRL2_G, odr | gyroRangeBits(config.gyroRange));
+
+  fifoWatermarkSamples = constrain(maxBatchLatencyMs * 1000 / imuPeriodUs(config.sampleRate), (uint32_t)1, (uint32_t)sampleRing.capacity() / 2);
+  if (acquisitionMode == ACQ_FIFO && sensorTaskHandle != NULL) {
+    configureFifo(fifoWatermarkSamples);
+  }
+  resetPeriodStats(samplePeriodStats);
+}
+
+// Configuration saved by an earlier session, the defaults stay on any mismatch
+bool loadImuConfig(ImuConfig &config)
+{
+  File file(InternalFS);
+  if (!file.open(IMU_CONFIG_PATH, FILE_O_READ)) {
+    return false;
+  }
+  uint8_t version = 0;
+  ImuConfig stored;
+  bool ok = file.read(&version, 1) == 1 && version == IMU_CONFIG_VERSION &&
+            file.read(&stored, sizeof(stored)) == sizeof(stored) && validImuConfig(stored);
+  file.close();
+  if (ok) {
+    config = stored;
+  }
+  return ok;
+}
+
+bool saveImuConfig(const ImuConfig &config)
+{
+  InternalFS.remove(IMU_CONFIG_PATH);
+  File file(InternalFS);
+  if (!file.open(IMU_CONFIG_PATH, FILE_O_WRITE)) {
+    return false;
+  }
+  uint8_t version = IMU_CONFIG_VERSION;
+  bool ok = file.write(&version, 1) == 1 && file.write((const uint8_t *)&config, sizeof(config)) == sizeof(config);
+  file.close();
+  return ok;
+}
+
+// Both sensors to power-down, applyImuConfig brings them back
+void powerDownImu(void)
+{
+  uint8_t reg;
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_FIFO_CTRL5, 0x00);
+  myIMU.readRegister(&reg, LSM6DS3_ACC_GYRO_CTRL1_XL);
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_CTRL1_XL, reg & 0x0F);
+  myIMU.readRegister(&reg, LSM6DS3_ACC_GYRO_CTRL2_G);
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_CTRL2_G, reg & 0x0F);
+}
+
+// Still for long enough to hand over to the wake-up detector
+bool motionIdle(void)
+{
+  return motionConfig.enabled && streamEnabled &&
+         sampleClockMicros() - lastMotionUs > (uint32_t)motionConfig.idleSeconds * 1000000UL;
+}
+
+// Keep the newest pre-roll samples in a FIFO limited to that depth (STOP_ON_FTH)
+// and route only the wake-up event to INT1
+void armWakeOnMotion(void)
+{
+  armImuWakeUp(myIMU, imuOdrCode(imuConfig.sampleRate),
+               motionPreRollSamples(motionConfig.preRollMs, imuPeriodUs(imuConfig.sampleRate)), motionConfig.threshold);
+  motionWaiting = true;
+}
+
+// Back to normal acquisition, sending the pre-roll first when asked. The FIFO
+// depth limit goes first, so samples arriving during the drain are added
+// rather than overwriting unread ones. In FIFO mode they stay for the next
+// watermark. Data-ready mode cannot wait on a full ring, so it keeps the
+// FIFO buffering until the link has taken half the ring, then drains until a
+// pass finds at most one sample (at high ODRs reading one takes a sample
+// period, so it never finds none) and loses the one or two landing while it
+// switches over.
+void disarmWakeOnMotion(bool preRoll)
+{
+  releaseImuWakeUp(myIMU);
+  if (preRoll && acquisitionMode == ACQ_FIFO) {
+    drainImuFifo();
+    resumeImuFifo(myIMU, fifoWatermarkSamples);
+  } else {
+    while (preRoll && (drainImuFifo() > 1 || sampleRing.size() > sampleRing.capacity() / 4)) {
+      if (sampleRing.size() > sampleRing.capacity() / 4) {
+        xTaskNotifyGive(bleTxTaskHandle);
+        vTaskDelay(1);
+      }
+    }
+    routeImuInterrupt();
+  }
+  lastMotionUs = sampleClockMicros();
+  motionWaiting = false;
 }
 
 // Define a task function for the IMU reading
 void SensorTask(void *pvParameters) {
   (void) pvParameters;
+  uint32_t lastSampleUs = 0;
+  bool havePrevious = false;
 
   for (;;) { // A Task shall never return or exit.
-    bufferOverflow = false; // Set overflow flag
-    // Read accelerometer data
-    miliBuffer = millis();
-    sensorBuffer[0] = myIMU.readFloatAccelX();
-    sensorBuffer[1] = myIMU.readFloatAccelY();
-    sensorBuffer[2] = myIMU.readFloatAccelZ();
+    if (!sensorEnabled) {
+      if (motionWaiting) {
+        disarmWakeOnMotion(false);
+      }
+      powerDownImu();
+      while (!sensorEnabled) {
+        waitSensorTask(portMAX_DELAY);
+      }
+      applyImuConfig(imuConfig);
+      lastMotionUs = sampleClockMicros();
+      havePrevious = false;
+    }
 
-    // Read gyroscope data
-    sensorBuffer[3] = myIMU.readFloatGyroX();
-    sensorBuffer[4] = myIMU.readFloatGyroY();
-    sensorBuffer[5] = myIMU.readFloatGyroZ();
+    // Armed, INT1 only fires on motion. Power state changes notify us too.
+    // The event is latched (LIR) until WAKE_UP_SRC is read, so a short one is
+    // still there when the task gets to it.
+    if (motionWaiting) {
+      waitSensorTask(portMAX_DELAY);
+      countWakeup();
+      if (!sensorEnabled) {
+        continue;
+      }
+      if (takeImuWakeUp(myIMU) || !motionConfig.enabled || !streamEnabled) {
+        disarmWakeOnMotion(true);
+        updatePowerState();
+        havePrevious = false;
+      }
+      continue;
+    }
+    if (motionIdle()) {
+      armWakeOnMotion();
+      updatePowerState();
+      continue;
+    }
 
-    bufferOverflow = true; // Set overflow flag
+    ImuConfig config;
+    if (xMessageBufferReceive(imuConfigRequests, &config, sizeof(config), 0) == sizeof(config)) {
+      applyImuConfig(config);
+      havePrevious = false;
+    }
+
+    if (acquisitionMode == ACQ_FIFO) {
+      // INT1_FTH is level triggered, so drain on a timeout too in case the edge was missed
+      uint32_t watermarkMs = 2 * fifoWatermarkSamples * imuPeriodUs(imuConfig.sampleRate) / 1000;
+      if (waitSensorTask(pdMS_TO_TICKS(watermarkMs)) == 0) {
+        missedDataReady++;
+      }
+      countWakeup();
+      if (sensorEnabled) {
+        drainImuFifo();
+      }
+      continue;
+    }
+
+    // Block until the data-ready interrupt, the timeout only guards against a dead INT1 line
+    uint32_t notified = waitSensorTask(pdMS_TO_TICKS(imuTimeoutMs));
+    countWakeup();
+    if (!sensorEnabled) {
+      continue;
+    }
+    if (notified == 0) {
+      missedDataReady++;
+      havePrevious = false;
+      continue;
+    }
+    // Woken for a reconfiguration only, sampleInstantUs has not moved
+    if (!(notified & SENSOR_TASK_INT1)) {
+      continue;
+    }
+    uint32_t sampleUs = sampleInstantUs;
+    if (havePrevious) {
+      recordSamplePeriod(sampleUs - lastSampleUs);
+    }
+    lastSampleUs = sampleUs;
+    havePrevious = true;
 
-    vTaskDelay(pdMS_TO_TICKS(baseFrequency)); // Delay for a period of time
+    ImuSample sample;
+    sample.timestamp = sampleUs;
+    if (readImuBurst(myIMU, sample)) {
+      publishSample(sample);
+    }
   }
 }
 
 
-// Task for sampling the battery
-void TaskSampleBattery(void *pvParameters) {
-  (void) pvParameters;
+// VBAT_ENABLE is held low for good (see setup), so a measurement is just the
+// oversampled conversion
+uint16_t readBatteryRaw() {
+  return analogRead(PIN_VBAT);
+}
 
-  for (;;) {
-    // Sample the ADC value
-    batteryValues[currentSampleIndex] = analogRead(PIN_VBAT);
-    // Move to the next index, wrapping around if necessary
-    currentSampleIndex = (currentSampleIndex + 1) % batterySampleNum;
-    // Delay for next sample based on the defined sample rate
-    vTaskDelay(pdMS_TO_TICKS(baseFrequency * 8));
+// Draw while a conversion runs between radio events: MCU, regulators and the IMU
+uint32_t conversionLoadUa(void)
+{
+  return LOAD_IDLE_UA + (sensorEnabled ? LOAD_IMU_UA : 0);
+}
+
+// Radio notification as each radio event starts and ends, the two signals
+// alternate. The CPU is awake for the event anyway; the starts time sync
+// replies, and TaskBattery is woken at an end when it waits for a gap.
+extern "C" void SWI1_EGU1_IRQHandler(void)
+{
+  radioActive = !radioActive;
+  if (radioActive) {
+    radioStartUs = sampleClockMicros();
+    return;
+  }
+  radioIdleUs = sampleClockMicros();
+  if (batteryAwaitsRadio && batteryTaskHandle != NULL) {
+    batteryAwaitsRadio = false;
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(batteryTaskHandle, &woken);
+    portYIELD_FROM_ISR(woken);
   }
 }
 
-// Task for displaying the battery information
-void TaskDisplayBattery(void *pvParameters) {
+// Block until a radio event has just ended, so the conversion lands in the
+// quiet gap before the next one. Preempted past BATTERY_RADIO_GAP_US it
+// waits for the next event, and a radio silent for BATTERY_RADIO_WAIT_MS is
+// as quiet as it gets.
+void waitForRadioGap(void)
+{
+  for (uint8_t tries = 0; tries < BATTERY_RADIO_TRIES; tries++) {
+    ulTaskNotifyTake(pdTRUE, 0);
+    batteryAwaitsRadio = true;
+    if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BATTERY_RADIO_WAIT_MS)) == 0) {
+      batteryAwaitsRadio = false;
+      return;
+    }
+    if (sampleClockMicros() - radioIdleUs < BATTERY_RADIO_GAP_US) {
+      return;
+    }
+  }
+}
+
+// Advertising restarts with the new intervals, an idle device only needs to be findable
+void setAdvertisingIdle(bool idle)
+{
+  advertisingIdle = idle;
+  Bluefruit.Advertising.stop();
+  if (idle) {
+    Bluefruit.Advertising.setInterval(ADV_IDLE_INTERVAL, ADV_IDLE_INTERVAL);
+  } else {
+    Bluefruit.Advertising.setInterval(ADV_FAST_INTERVAL, ADV_SLOW_INTERVAL);
+  }
+  Bluefruit.Advertising.start(0);
+}
+
+void setPowerState(PowerState state)
+{
+  taskENTER_CRITICAL();
+  PowerState previous = powerState;
+  powerState = state;
+  sensorEnabled = powerStateImuOn(state);
+  batteryEnabled = powerStateMeasuresBattery(state);
+  taskEXIT_CRITICAL();
+  if (state == previous) {
+    return;
+  }
+  bool connected = connHandle != BLE_CONN_HANDLE_INVALID;
+
+  // Parked tasks look at their flag again, running ones just loop once more
+  if (sensorTaskHandle != NULL) {
+    xTaskNotify(sensorTaskHandle, SENSOR_TASK_RECONFIGURE, eSetBits);
+  }
+  if (batteryTaskHandle != NULL) {
+    xTaskNotifyGive(batteryTaskHandle);
+  }
+  // Advertising only runs while disconnected
+  bool idleAdvertising = powerStateAdvertisesIdle(state);
+  if (!connected && idleAdvertising != advertisingIdle) {
+    setAdvertisingIdle(idleAdvertising);
+  }
+  if (connected && (state == POWER_MOTION_WAIT) != (previous == POWER_MOTION_WAIT)) {
+    setMotionLatency(state == POWER_MOTION_WAIT);
+  }
+}
+
+// Called on connect, disconnect and stream start/stop
+void updatePowerState(void)
+{
+  setPowerState(powerStateFor(connHandle != BLE_CONN_HANDLE_INVALID, streamEnabled, motionWaiting));
+}
+
+// Task for measuring the battery, one oversampled conversion between radio
+// events, lifted to open circuit voltage and filtered by BatteryEstimator
+void TaskBattery(void *pvParameters) {
   (void) pvParameters;
 
   for (;;) {
-    // Calculate the average ADC value
-    int sum = 0;
-    for(int i = 0; i < batterySampleNum; i++) {
-      sum += batteryValues[i];
+    countWakeup();
+    waitForRadioGap();
+    uint32_t loadedMv = vbatMillivolts(readBatteryRaw());
+    batteryMillivolts = batteryEstimator.update(loadedMv, conversionLoadUa());
+    int level = batteryLevel(batterySocTenths(batteryMillivolts), percentage);
+    if (level != percentage) {
+      percentage = level;
+      // Also updates the stored value when nobody has subscribed
+      blebas.notify(level);
+    }
+
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(batteryPeriodMs));
+    while (!batteryEnabled) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+  }
+}
+
+
+// Legacy text line for one sample, formatted straight into a stack buffer
+void sendTextSample(const ImuSample &sample)
+{
+  char line[128];
+  TextWriter text(line, sizeof(line));
+  // Widened first, the 32-bit sample clock wraps every 71.6 minutes. The time
+  // of day is the sample's too, so it agrees with the ms field.
+  uint64_t sampleUs = wallClockAt(widenMicros(sampleClockMicros64(), sample.timestamp));
+  TimeOfDay at = timeOfDayAt(sampleUs);
+  TextTime time = {at.hour, at.minute, at.second, sampleUs / 1000};
+  formatTextSample(text, deviceName, percentage, time, sample, myIMU.settings.accelRange, myIMU.settings.gyroRange);
+
+  transmit((const uint8_t *)text.c_str(), text.length());
+}
+
+// Bytes one notification can carry on the current connection, ATT MTU minus
+// the 3-byte notification header. Read every frame, so a central-initiated
+// MTU exchange is picked up as soon as it completes.
+uint16_t notifyPayloadSize(void)
+{
+  BLEConnection* connection = Bluefruit.Connection(connHandle);
+  uint16_t mtu = connection ? connection->getMtu() : BLE_GATT_ATT_MTU_DEFAULT;
+  return mtu - 3;
+}
+
+// Offer queued frames to the stack in order, one notification at a time,
+// stopping at the first one it refuses. That one is retried on the next
+// TX-complete event. Without a TX FIFO BLEUart::write() is all or nothing,
+// it sends a longer write as several notifications but only reports whether
+// all of them went, so it is never handed more than one.
+void flushTxQueue(void)
+{
+  if (!bleuart.notifyEnabled()) {
+    return;
+  }
+  txQueue.flush(notifyPayloadSize(), [](const uint8_t *data, uint16_t length) {
+    return bleuart.write(data, length) == length;
+  }, txStats);
+}
+
+// Queue one frame behind any the stack has not taken yet and try to send
+void transmit(const uint8_t *data, uint16_t length)
+{
+  if (!txQueue.push(data, length)) {
+    txStats.framesDropped++;
+  }
+  if (txQueue.size() > txStats.queueHighWater) {
+    txStats.queueHighWater = txQueue.size();
+  }
+  flushTxQueue();
+}
+
+// Keep a frame in the flash log until the host comes back for it. Only the
+// RAM segment is touched here, TaskFlashLog writes it out once sealed. The
+// frame's 32-bit base timestamp is recent, the wall clock extends it.
+void logFrame(const uint8_t *data, uint16_t length)
+{
+  uint32_t base;
+  memcpy(&base, &data[6], 4);
+  uint64_t now = wallClockMicros();
+  uint64_t wallUs = now - (uint32_t)((uint32_t)now - base);
+
+  taskENTER_CRITICAL();
+  bool wasPending = flashLog.hasPending();
+  bool ok = flashLog.append(data, length, wallUs);
+  bool sealed = !wasPending && flashLog.hasPending();
+  taskEXIT_CRITICAL();
+
+  if (ok) {
+    framesLogged++;
+  } else {
+    logWriteErrors++;
+  }
+  if (sealed) {
+    xTaskNotify(flashLogTaskHandle, LOG_TASK_WRITE, eSetBits);
+  }
+}
+
+// Sample data, as opposed to text lines and command or sync responses
+bool isDataFrame(const uint8_t *data, uint16_t length)
+{
+  uint8_t type = data[0] & 0x0F;
+  return length >= FRAME_HEADER_LEN && data[0] >> 4 == FRAME_VERSION &&
+         (type == FRAME_TYPE_IMU || type == FRAME_TYPE_QUAT || type == FRAME_TYPE_GAIT || type == FRAME_TYPE_PACKED);
+}
+
+// The link went away, move whole data frames the stack never took into the log
+void spillTxQueue(void)
+{
+  while (txQueue.size() > 0) {
+    TxFrame &frame = txQueue.front();
+    if (frame.offset == 0 && !fullRateLog && isDataFrame(frame.data, frame.length)) {
+      logFrame(frame.data, frame.length);
     }
-    int avgBatValues = sum / batterySampleNum;
+    txQueue.pop();
+  }
+}
+
+// Seal the pending binary frame and send it, or log it while nobody listens
+// and the full-rate log is not already keeping the samples
+void sendFrame(void)
+{
+  if (frameEncoder.empty()) {
+    return;
+  }
+  frameEncoder.setBaseTimestamp(sharedTimestamp(frameEncoder.firstTimestamp()));
+  frameEncoder.finish();
+  if (bleuart.notifyEnabled()) {
+    transmit(frameEncoder.data(), frameEncoder.size());
+  } else if (!fullRateLog) {
+    logFrame(frameEncoder.data(), frameEncoder.size());
+  }
+  frameEncoder.clear();
+}
+
+static_assert(LINK_PHY_2MBPS == BLE_GAP_PHY_2MBPS, "link model PHY code");
+
+// Ask the central for the fastest link and an interval matched to the stream.
+// The central has the final say, publishLinkInfo reports what it agreed to.
+void optimizeLink(uint16_t conn_handle, uint16_t sampleRate)
+{
+  BLEConnection* connection = Bluefruit.Connection(conn_handle);
+  if (connection == NULL) {
+    return;
+  }
+  connection->requestPHY(BLE_GAP_PHY_2MBPS);
+  connection->requestDataLengthUpdate();
+  connection->requestMtuExchange(LINK_MTU);
+  requestedInterval = pickConnectionInterval(sampleRate, BLE_GAP_PHY_2MBPS, LINK_DATA_LENGTH, LINK_MTU, maxBatchLatencyMs);
+  intervalRetriesLeft = LINK_INTERVAL_RETRIES;
+  connection->requestConnectionParameter(requestedInterval, requestedLatency, LINK_SUP_TIMEOUT);
+}
+
+// Let the peripheral skip connection events while it has nothing to send, as
+// far as the supervision timeout allows: (1 + latency) * interval * 2 must stay below it
+void setMotionLatency(bool waiting)
+{
+  BLEConnection* connection = Bluefruit.Connection(connHandle);
+  if (connection == NULL || requestedInterval == 0) {
+    return;
+  }
+  uint32_t allowed = (uint32_t)LINK_SUP_TIMEOUT * 4 / requestedInterval;
+  requestedLatency = waiting ? min((uint32_t)MOTION_SLAVE_LATENCY, allowed > 2 ? allowed - 2 : 0) : 0;
+  connection->requestConnectionParameter(requestedInterval, requestedLatency, LINK_SUP_TIMEOUT);
+}
 
-    // Calculate the battery value based on the average ADC value
-    float batteryvalue = avgBatValues * mv_per_lsb * VBAT_DIVIDER_COMP / 1000;
-    percentage = getBatteryPercentage(batteryvalue);
-    
-    // Delay until it's time to display again
-    vTaskDelay(pdMS_TO_TICKS(baseFrequency * 64));
+// Publish the negotiated parameters when any of them changed. The interval
+// request is repeated a few times, it fails while a PHY or data length
+// procedure is still running.
+void publishLinkInfo(void)
+{
+  BLEConnection* connection = Bluefruit.Connection(connHandle);
+  if (connection == NULL) {
+    return;
+  }
+  if (connection->getConnectionInterval() != requestedInterval && intervalRetriesLeft > 0) {
+    intervalRetriesLeft--;
+    connection->requestConnectionParameter(requestedInterval, requestedLatency, LINK_SUP_TIMEOUT);
+  }
+  LinkInfo info;
+  info.mtu = connection->getMtu();
+  info.dataLength = connection->getDataLength();
+  info.phy = connection->getPHY();
+  info.interval = connection->getConnectionInterval();
+  info.requestedInterval = requestedInterval;
+  info.capacityBytesPerSec = linkCapacity(max(info.interval, (uint16_t)LINK_MIN_INTERVAL), info.phy,
+                                          max(info.dataLength, (uint16_t)27), info.mtu);
+  info.requiredBytesPerSec = streamRate(liveSampleRate(imuConfig.sampleRate), info.mtu);
+  if (memcmp(&info, &linkInfo, sizeof(info)) == 0) {
+    return;
   }
-} 
+  linkInfo = info;
+  if (linkChar.notifyEnabled()) {
+    linkChar.notify(&info, sizeof(info));
+  } else {
+    linkChar.write(&info, sizeof(info));
+  }
+}
+
+TxStats snapshotTxStats(void)
+{
+  TxStats snapshot = txStats;
+  snapshot.samplesDropped = sampleRing.overflowCount();
+  snapshot.txCompleted = txCompleted;
+  snapshot.wakeups = appWakeups;
+  snapshot.queueDepth = txQueue.size();
+  return snapshot;
+}
+
+AcqStats snapshotAcqStats(void)
+{
+  taskENTER_CRITICAL();
+  PeriodStats periods = samplePeriodStats;
+  taskEXIT_CRITICAL();
+  AcqStats snapshot;
+  snapshot.periods = periods.count;
+  snapshot.periodMinUs = periods.count ? periods.minPeriod : 0;
+  snapshot.periodMaxUs = periods.maxPeriod;
+  snapshot.periodMeanUs = periodMean(periods);
+  snapshot.jitterRmsUs = periodJitterRms(periods);
+  snapshot.missedDataReady = missedDataReady;
+  snapshot.fifoOverruns = fifoOverruns;
+  snapshot.framesLogged = framesLogged;
+  snapshot.logWriteErrors = logWriteErrors;
+  snapshot.commandErrors = commandParser.errorCount();
+  return snapshot;
+}
+
+// Runs on the timer task once a second while connected
+void publishStats(TimerHandle_t timer)
+{
+  (void) timer;
+  TxStats snapshot = snapshotTxStats();
 
+  if (statsChar.notifyEnabled()) {
+    statsChar.notify(&snapshot, sizeof(snapshot));
+  } else {
+    statsChar.write(&snapshot, sizeof(snapshot));
+  }
+  publishLinkInfo();
+}
 
-// The RTC thread
-void TaskDateTime(void *pvParameters) {
-    (void) pvParameters; // Silence unused parameter warning
+// SoftDevice events, used for TX-complete flow control
+void ble_event_callback(ble_evt_t* evt)
+{
+  if (evt->header.evt_id == BLE_GATTS_EVT_HVN_TX_COMPLETE) {
+    txCompleted += evt->evt.gatts_evt.params.hvn_tx_complete.count;
+    // Buffers freed up, let ble_uart_task push the rest of the queue
+    if (bleTxTaskHandle != NULL && txQueue.size() > 0) {
+      xTaskNotifyGive(bleTxTaskHandle);
+    }
+  }
+}
 
-    while (true) 
-    {
-      updateClock();
-      // Delay for 1 second to match our software clock update.
-      vTaskDelay(Second_Time_Delay);
+// Send command responses and sync replies handed over by ble_receive_task.
+// A sync reply gets its t3 right before it joins the TX queue, the start of
+// the connection event it will go out in (syncReplyStamp).
+void sendControlFrames(void)
+{
+  uint8_t frame[RESPONSE_HEADER_LEN + CMD_MAX_REPLY];
+  size_t len;
+  while ((len = xMessageBufferReceive(controlFrames, frame, sizeof(frame), 0)) > 0) {
+    if (!bleuart.notifyEnabled()) {
+      continue;
     }
+    if (frame[0] == ((FRAME_VERSION << 4) | FRAME_TYPE_SYNC) && len == SYNC_REPLY_LEN) {
+      BLEConnection* connection = Bluefruit.Connection(connHandle);
+      uint32_t intervalUs = connection ? connection->getConnectionInterval() * 1250UL : 0;
+      // The clock and the radio state from one instant
+      taskENTER_CRITICAL();
+      uint64_t now = sampleClockMicros64();
+      uint64_t radioStart = widenMicros(now, radioStartUs);
+      bool active = radioActive;
+      taskEXIT_CRITICAL();
+      uint64_t t3 = syncReplyStamp(now, radioStart, active, intervalUs);
+      memcpy(&frame[20], &t3, 8);
+    }
+    transmit(frame, len);
+  }
+}
+
+// Start a frame, flagging any samples the ring dropped since the last one
+void beginFrame(void)
+{
+  uint32_t overflows = sampleRing.overflowCount();
+  // Frames for the flash log are always packed full
+  uint16_t maxLen = bleuart.notifyEnabled() ? notifyPayloadSize() : FRAME_MAX_LEN;
+  frameEncoder.begin(overflows != reportedOverflows ? FRAME_FLAG_DROPPED : 0, maxLen, streamFrameType());
+  reportedOverflows = overflows;
+}
+
+uint8_t streamFrameType(void)
+{
+  switch (streamFormat) {
+  case STREAM_QUATERNION:
+    return FRAME_TYPE_QUAT;
+  case STREAM_GAIT:
+    return FRAME_TYPE_GAIT;
+  case STREAM_PACKED:
+    return FRAME_TYPE_PACKED;
+  default:
+    // Raw samples for the flash log are packed, text lines included
+    return bleuart.notifyEnabled() ? FRAME_TYPE_IMU : FRAME_TYPE_PACKED;
+  }
+}
+
+// Pack one record, sending the frame as soon as it fills a notification
+void queueRecord(uint32_t timestamp, const int16_t *values)
+{
+  if (frameEncoder.empty()) {
+    beginFrame();
+  }
+  if (!frameEncoder.add(timestamp, values)) {
+    sendFrame();
+    beginFrame();
+    frameEncoder.add(timestamp, values);
+  }
+  if (!frameEncoder.hasRoom()) {
+    sendFrame();
+  }
+}
+
+void queueSample(const ImuSample &sample)
+{
+  int16_t values[6] = {sample.accel[0], sample.accel[1], sample.accel[2],
+                       sample.gyro[0], sample.gyro[1], sample.gyro[2]};
+  queueRecord(sample.timestamp, values);
+}
+
+// Gyro sensitivity in dps per LSB at the configured range
+float gyroDpsPerLsb(void)
+{
+  return gyroDpsPerLsb(myIMU.settings.gyroRange);
+}
+
+// Run one sample through the orientation filter and queue every
+// fusionDivider-th result as a quaternion record
+void fuseSample(const ImuSample &sample)
+{
+  uint32_t gapUs = sample.timestamp - fusionLastUs;
+  fusionLastUs = sample.timestamp;
+  if (gapUs > FUSION_MAX_GAP_US) {
+    fusion.reset();
+  }
+  float scale = gyroDpsPerLsb() * (float)DEG_TO_RAD;
+
+  uint32_t start = DWT->CYCCNT;
+  fusion.update(sample.gyro[0] * scale, sample.gyro[1] * scale, sample.gyro[2] * scale,
+                sample.accel[0], sample.accel[1], sample.accel[2], gapUs * 1e-6f);
+  uint32_t cycles = DWT->CYCCNT - start;
+
+  fusionCycles += cycles;
+  fusionStats.updates++;
+  fusionStats.cyclesLast = cycles;
+  if (cycles > fusionStats.cyclesMax) {
+    fusionStats.cyclesMax = cycles;
+  }
+  if (!fusion.running() || ++fusionPhase < fusionDivider) {
+    return;
+  }
+  fusionPhase = 0;
+  int16_t quat[4];
+  fusion.toQ14(quat);
+  queueRecord(sample.timestamp, quat);
 }
 
-// This task checks for buffer overflow and prints the buffer if overflow occurs forward data from HW Serial to BLEUART
+// Run one sample through the gait detector and queue the events it finds
+void detectGait(const ImuSample &sample)
+{
+  uint8_t axis = gaitAxis;
+  float dps = sample.gyro[axis & 0x03] * gyroDpsPerLsb();
+  GaitRecord records[2];
+  uint8_t n = gaitDetector.update(sample.timestamp, axis & 0x80 ? -dps : dps, records);
+  for (uint8_t i = 0; i < n; i++) {
+    queueRecord(records[i].timestamp, records[i].values);
+  }
+}
+
+void flushLogFrame(void)
+{
+  if (logEncoder.empty()) {
+    return;
+  }
+  logEncoder.setBaseTimestamp(sharedTimestamp(logEncoder.firstTimestamp()));
+  logEncoder.finish();
+  logFrame(logEncoder.data(), logEncoder.size());
+  logEncoder.clear();
+}
+
+// Pack one full-rate sample for the flash log
+void logSample(const ImuSample &sample)
+{
+  int16_t values[6] = {sample.accel[0], sample.accel[1], sample.accel[2],
+                       sample.gyro[0], sample.gyro[1], sample.gyro[2]};
+  if (logEncoder.empty()) {
+    logEncoder.begin(0, FRAME_MAX_LEN, FRAME_TYPE_PACKED);
+  }
+  if (!logEncoder.add(sample.timestamp, values)) {
+    flushLogFrame();
+    logEncoder.begin(0, FRAME_MAX_LEN, FRAME_TYPE_PACKED);
+    logEncoder.add(sample.timestamp, values);
+  }
+}
+
+// Switch to the decimation asked for by CMD_SET_DECIMATION, between frames
+void applyDecimation(void)
+{
+  bool logRequested = requestedDecimationFlags & DECIMATION_LOG_FULL_RATE;
+  if (requestedDecimation == decimator.factor() && logRequested == fullRateLog) {
+    return;
+  }
+  sendFrame();
+  if (!logRequested) {
+    flushLogFrame();
+  }
+  decimator.configure(requestedDecimation);
+  fullRateLog = logRequested;
+}
+
+// Sample rate of the live stream after decimation
+uint16_t liveSampleRate(uint16_t sampleRate)
+{
+  return sampleRate / requestedDecimation;
+}
+
+// Switch to a format asked for by CMD_SET_STREAM, never mid-frame
+void applyStreamFormat(void)
+{
+  if (requestedFormat == streamFormat) {
+    return;
+  }
+  sendFrame();
+  streamFormat = requestedFormat;
+  fusion.reset();
+  fusionPhase = 0;
+  gaitDetector.reset();
+}
+
+// Samples that fill the next frame: what is left in a pending frame, or a
+// whole notification's worth. Gait events are too sparse to predict, so the
+// detector runs on half a ring at a time.
+uint16_t samplesToFillFrame(void)
+{
+  if (streamFormat == STREAM_TEXT && bleuart.notifyEnabled()) {
+    return 1;
+  }
+  if (streamFormat == STREAM_GAIT) {
+    return sampleRing.capacity() / 2;
+  }
+  uint16_t records;
+  if (!frameEncoder.empty()) {
+    records = max(frameEncoder.remaining(), (uint16_t)1);
+  } else {
+    uint16_t payload = notifyPayloadSize();
+    uint8_t recordLen = FrameEncoder::recordLength(streamFrameType());
+    records = payload > FRAME_HEADER_LEN ? (payload - FRAME_HEADER_LEN) / recordLen : 1;
+  }
+  uint32_t samples = streamFormat == STREAM_QUATERNION ? (uint32_t)records * fusionDivider : records;
+  samples *= decimator.factor();
+  return constrain(samples, (uint32_t)1, (uint32_t)(sampleRing.capacity() / 2));
+}
+
+// This task sleeps until SensorTask has a frame's worth of samples or the
+// pending frame's latency deadline expires, then forwards them to BLEUART
 void ble_uart_task(void *pvParameters)
 {
     (void) pvParameters; // Just to avoid compiler warnings
+  ImuSample batch[txBatchSamples];
+  TickType_t waitTicks = portMAX_DELAY;
 
   for (;;) {
-    // Wait for the overflow flag to be set
-    if (bufferOverflow) {
-      // Take the semaphore to ensure no conflict on buffer access
-      if (xSemaphoreTake(bufferSemaphore, (TickType_t)10) == pdTRUE) {
-        uint8_t buf[1000] = {0};
-
-        String timeString = deviceName;
-        timeString += ",";
-        timeString += String(percentage);
-        timeString += "%,";
-        timeString += String(myIMU.readTempC());
-        timeString += "^,";
-        // timeString += String(year);
-        // timeString += "/";
-        // timeString += String(month);
-        // timeString += "/";
-        // timeString += String(day);
-        // timeString += ",";
-        timeString += String(hour);
-        timeString += ":";
-        timeString += String(minute);
-        timeString += ":";
-        timeString += String(second);
-
-        timeString += ",";
-        timeString += String(miliBuffer);
-
-        for (int i = 0; i < 6; i++) {
-          timeString += ",";
-          timeString += String(sensorBuffer[i]);
+    ulTaskNotifyTake(pdTRUE, waitTicks);
+    countWakeup();
+    if (bleuart.notifyEnabled()) {
+      flushTxQueue();
+    } else {
+      spillTxQueue();
+    }
+    sendControlFrames();
+    applyStreamFormat();
+    applyDecimation();
+
+    uint16_t count;
+    while ((count = sampleRing.popBatch(batch, txBatchSamples)) > 0) {
+      for (uint16_t n = 0; n < count; n++) {
+        if (fullRateLog) {
+          logSample(batch[n]);
         }
-
-        timeString += "@";
-
-        int count1 = timeString.length();
-        //Serial.println(count1);
-        
-        for(int i = 0; i < count1; i++){
-          buf[i] = timeString[i];
-          //Serial.print((char)buf[i]);
+        ImuSample sample;
+        if (!decimator.push(batch[n], sample)) {
+          continue;
+        }
+        if (streamFormat == STREAM_TEXT && bleuart.notifyEnabled()) {
+          sendTextSample(sample);
+        } else if (streamFormat == STREAM_QUATERNION) {
+          fuseSample(sample);
+        } else if (streamFormat == STREAM_GAIT) {
+          detectGait(sample);
+        } else {
+          queueSample(sample);
         }
+      }
+    }
 
-        bleuart.write(buf, count1);
-      
-        // Reset the overflow flag
-        bufferOverflow = false;
-        
-        // Give the semaphore back
-        xSemaphoreGive(bufferSemaphore);
+    // Bound the latency of a frame that is filling slowly, logged frames have none
+    waitTicks = portMAX_DELAY;
+    if (!frameEncoder.empty() && !txQueue.congested() && bleuart.notifyEnabled()) {
+      uint32_t ageMs = (sampleClockMicros() - frameEncoder.firstTimestamp()) / 1000;
+      if (ageMs >= maxBatchLatencyMs) {
+        sendFrame();
+      } else {
+        waitTicks = pdMS_TO_TICKS(maxBatchLatencyMs - ageMs) + 1;
       }
     }
-    
-    // Slight delay to prevent this task from hogging the CPU
-    vTaskDelay(pdMS_TO_TICKS(baseFrequency));
+    if (txQueue.size() > 0) {
+      waitTicks = min(waitTicks, pdMS_TO_TICKS(txRetryMs));
+    }
+    txFramePending = !frameEncoder.empty();
+    txWakeThreshold = samplesToFillFrame();
+    // A sample pushed while the flags were stale may not have notified us
+    if (sampleRing.size() > 0) {
+      waitTicks = 0;
+    }
   }
 }
 
+// Runs on the Bluefruit callback task for every write to the UART RX characteristic.
+// Each message is prefixed with its arrival time, the t2 of a sync request.
+void ble_rx_callback(uint16_t conn_hdl)
+{
+  (void) conn_hdl;
+  uint8_t message[8 + 64];
+  uint64_t rxUs = sampleClockMicros64();
+  memcpy(message, &rxUs, 8);
+  int len;
+  while ((len = bleuart.read(&message[8], sizeof(message) - 8)) > 0) {
+    xMessageBufferSend(rxMessages, message, 8 + len, 0);
+  }
+}
+
+// Hand a frame to ble_uart_task, the only task that feeds the TX queue
+void queueControlFrame(const uint8_t *frame, size_t len)
+{
+  if (xMessageBufferSend(controlFrames, frame, len, 0) == len) {
+    xTaskNotifyGive(bleTxTaskHandle);
+  }
+}
+
+CommandStatus cmdSetTime(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) rxUs;
+  (void) reply;
+  (void) replyLen;
+  uint32_t seconds;
+  memcpy(&seconds, payload, 4);
+  setWallClock(seconds);
+  return CMD_OK;
+}
+
+// Save a new sensor configuration and hand it to SensorTask, which applies it
+// before its next wait
+CommandStatus requestImuConfig(const ImuConfig &config)
+{
+  if (!validImuConfig(config)) {
+    return CMD_BAD_VALUE;
+  }
+  saveImuConfig(config);
+  xMessageBufferSend(imuConfigRequests, &config, sizeof(config), 0);
+  // A new rate wants a new connection interval
+  optimizeLink(connHandle, liveSampleRate(config.sampleRate));
+  return CMD_OK;
+}
+
+CommandStatus cmdSetOdr(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) rxUs;
+  (void) reply;
+  (void) replyLen;
+  ImuConfig config = imuConfig;
+  config.sampleRate = payload[0] | (payload[1] << 8);
+  return requestImuConfig(config);
+}
+
+CommandStatus cmdSetConfig(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) rxUs;
+  (void) reply;
+  (void) replyLen;
+  ImuConfig config;
+  memcpy(&config, payload, sizeof(config));
+  return requestImuConfig(config);
+}
+
+CommandStatus cmdGetConfig(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) payload;
+  (void) rxUs;
+  ImuConfig config = imuConfig;
+  memcpy(reply, &config, sizeof(config));
+  *replyLen = sizeof(config);
+  return CMD_OK;
+}
+
+CommandStatus cmdStartStream(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) payload;
+  (void) rxUs;
+  (void) reply;
+  (void) replyLen;
+  streamEnabled = true;
+  updatePowerState();
+  return CMD_OK;
+}
+
+// Also keeps the device idle rather than recording once the host disconnects
+CommandStatus cmdStopStream(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) payload;
+  (void) rxUs;
+  (void) reply;
+  (void) replyLen;
+  streamEnabled = false;
+  updatePowerState();
+  return CMD_OK;
+}
+
+CommandStatus cmdGetStats(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) payload;
+  (void) rxUs;
+  TxStats transmit = snapshotTxStats();
+  AcqStats acquisition = snapshotAcqStats();
+  memcpy(reply, &transmit, sizeof(transmit));
+  memcpy(reply + sizeof(transmit), &acquisition, sizeof(acquisition));
+  *replyLen = sizeof(transmit) + sizeof(acquisition);
+  return CMD_OK;
+}
+
+// t2 is when the command's first byte reached the RX callback
+CommandStatus cmdSyncRequest(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) reply;
+  (void) replyLen;
+  uint8_t frame[SYNC_REPLY_LEN] = {0};
+  frame[0] = (FRAME_VERSION << 4) | FRAME_TYPE_SYNC;
+  frame[2] = deviceId;
+  frame[3] = payload[0];
+  memcpy(&frame[4], &payload[1], 8);
+  memcpy(&frame[12], &rxUs, 8);
+  queueControlFrame(frame, sizeof(frame));
+  return CMD_NO_REPLY;
+}
+
+CommandStatus cmdSyncResult(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) reply;
+  (void) replyLen;
+  SyncPoint point;
+  point.localUs = rxUs;
+  memcpy(&point.offsetUs, &payload[1], 8);
+  memcpy(&point.delayUs, &payload[9], 4);
+  addSyncPoint(point);
+  return CMD_OK;
+}
+
+CommandStatus cmdSetStream(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) rxUs;
+  (void) reply;
+  (void) replyLen;
+  if (payload[0] >= STREAM_FORMATS) {
+    return CMD_BAD_VALUE;
+  }
+  if (payload[0] == STREAM_GAIT) {
+    if ((payload[1] & 0x7F) > 2) {
+      return CMD_BAD_VALUE;
+    }
+    gaitAxis = payload[1];
+  } else if (payload[0] == STREAM_QUATERNION) {
+    if (payload[1] == 0) {
+      return CMD_BAD_VALUE;
+    }
+    fusionDivider = payload[1];
+  }
+  requestedFormat = (StreamFormat)payload[0];
+  xTaskNotifyGive(bleTxTaskHandle);
+  return CMD_OK;
+}
+
+CommandStatus cmdSetDecimation(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) rxUs;
+  (void) reply;
+  (void) replyLen;
+  uint8_t factor = payload[0];
+  if (factor == 0 || factor > DECIMATION_MAX_FACTOR || (factor & (factor - 1)) != 0) {
+    return CMD_BAD_VALUE;
+  }
+  requestedDecimation = factor;
+  requestedDecimationFlags = payload[1];
+  xTaskNotifyGive(bleTxTaskHandle);
+  // The live stream rate changed
+  optimizeLink(connHandle, liveSampleRate(imuConfig.sampleRate));
+  return CMD_OK;
+}
+
+CommandStatus cmdSetMotion(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) rxUs;
+  (void) reply;
+  (void) replyLen;
+  MotionConfig config;
+  memcpy(&config, payload, sizeof(config));
+  if (config.threshold == 0 || config.threshold > 63 || config.idleSeconds == 0 ||
+      config.idleSeconds > MOTION_MAX_IDLE_S) {
+    return CMD_BAD_VALUE;
+  }
+  lastMotionUs = sampleClockMicros();  // The idle time counts from now
+  motionConfig = config;
+  // Disabling wakes an armed SensorTask
+  xTaskNotify(sensorTaskHandle, SENSOR_TASK_RECONFIGURE, eSetBits);
+  return CMD_OK;
+}
+
+CommandStatus cmdGetFusion(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) payload;
+  (void) rxUs;
+  FusionStats snapshot = fusionStats;
+  snapshot.cyclesAvg = snapshot.updates ? fusionCycles / snapshot.updates : 0;
+  memcpy(reply, &snapshot, sizeof(snapshot));
+  *replyLen = sizeof(snapshot);
+  return CMD_OK;
+}
+
+CommandStatus cmdOffload(const uint8_t *payload, uint64_t rxUs, uint8_t *reply, uint8_t *replyLen)
+{
+  (void) rxUs;
+  (void) reply;
+  (void) replyLen;
+  if (payload[0] != LOG_TASK_OFFLOAD && payload[0] != LOG_TASK_ERASE) {
+    return CMD_BAD_VALUE;
+  }
+  if (offloadActive) {
+    return CMD_BUSY;
+  }
+  if (payload[0] == LOG_TASK_OFFLOAD && !offloadChar.notifyEnabled()) {
+    return CMD_UNAVAILABLE;
+  }
+  xTaskNotify(flashLogTaskHandle, payload[0], eSetBits);
+  return CMD_OK;
+}
+
+static_assert(sizeof(TxStats) + sizeof(AcqStats) <= CMD_MAX_REPLY, "CMD_GET_STATS reply too long");
+
+const CommandEntry commandTable[] = {
+  {CMD_SET_TIME,     4,  cmdSetTime},
+  {CMD_SET_ODR,      2,  cmdSetOdr},
+  {CMD_START_STREAM, 0,  cmdStartStream},
+  {CMD_STOP_STREAM,  0,  cmdStopStream},
+  {CMD_GET_STATS,    0,  cmdGetStats},
+  {CMD_SYNC_REQUEST, 9,  cmdSyncRequest},
+  {CMD_SYNC_RESULT,  13, cmdSyncResult},
+  {CMD_OFFLOAD,      1,  cmdOffload},
+  {CMD_SET_CONFIG,   sizeof(ImuConfig), cmdSetConfig},
+  {CMD_GET_CONFIG,   0,  cmdGetConfig},
+  {CMD_SET_STREAM,   2,  cmdSetStream},
+  {CMD_GET_FUSION,   0,  cmdGetFusion},
+  {CMD_SET_DECIMATION, 2, cmdSetDecimation},
+  {CMD_SET_MOTION,   sizeof(MotionConfig), cmdSetMotion},
+};
+
+// Run a parsed command from the table and queue its response
+void dispatchCommand(const CommandParser &parser)
+{
+  uint8_t response[RESPONSE_HEADER_LEN + CMD_MAX_REPLY];
+  uint8_t replyLen = 0;
+  CommandStatus status = CMD_UNKNOWN;
+
+  for (size_t i = 0; i < sizeof(commandTable) / sizeof(commandTable[0]); i++) {
+    if (commandTable[i].opcode == parser.opcode()) {
+      status = parser.length() != commandTable[i].length ? CMD_BAD_LENGTH
+             : commandTable[i].handler(parser.payload(), parser.arrivalUs(), &response[RESPONSE_HEADER_LEN], &replyLen);
+      break;
+    }
+  }
+  if (status == CMD_NO_REPLY) {
+    return;
+  }
+  response[0] = (FRAME_VERSION << 4) | FRAME_TYPE_RESPONSE;
+  response[1] = status;
+  response[2] = deviceId;
+  response[3] = parser.opcode();
+  response[4] = replyLen;
+  queueControlFrame(response, RESPONSE_HEADER_LEN + replyLen);
+}
+
+// Response frame nobody asked for, reports how a command running in the
+// background ended
+void queueStatus(uint8_t opcode, CommandStatus status)
+{
+  uint8_t response[RESPONSE_HEADER_LEN] = {(FRAME_VERSION << 4) | FRAME_TYPE_RESPONSE, (uint8_t)status, deviceId, opcode, 0};
+  queueControlFrame(response, sizeof(response));
+}
+
+// Blocks until the RX callback hands over a message, no polling. Messages are
+// fed to the command parser byte by byte, commands may span several of them.
 void ble_receive_task(void *pvParameters)
 {
-  while(true) 
-  {
-    // Check if there's data available
-    if (bleuart.available()) 
-    {
-      receivedString = bleuart.readString();
-      // TODO: Handle or process the receivedString if needed
-    }
-    vTaskDelay(pdMS_TO_TICKS(10)); // Short delay to prevent busy-waiting
-  }
-} 
-
-void processReceivedStringTask(void *pvParameters) {
-    while(1) {
-        if (receivedString != lastProcessedString) {
-            if (isInCorrectFormat(receivedString)) {
-                int year   = receivedString.substring(0, 4).toInt();
-                int month  = receivedString.substring(5, 7).toInt();
-                int day    = receivedString.substring(8, 10).toInt();
-                int hour   = receivedString.substring(11, 13).toInt();
-                int minute = receivedString.substring(14, 16).toInt();
-                int second = receivedString.substring(17, 19).toInt();
-
-                DateTime newTime(year, month, day, hour, minute, second);
-                rtc.adjust(newTime);
-            }
-            
-            lastProcessedString = receivedString;
-        }
-        vTaskDelay(pdMS_TO_TICKS(10));
+  (void) pvParameters;
+  uint8_t received[8 + 64];
+
+  for (;;) {
+    size_t len = xMessageBufferReceive(rxMessages, received, sizeof(received), portMAX_DELAY);
+    countWakeup();
+    if (len < 8) {
+      continue;
+    }
+    uint64_t rxUs;
+    memcpy(&rxUs, received, 8);
+    for (size_t i = 8; i < len; i++) {
+      if (commandParser.feed(received[i], rxUs)) {
+        dispatchCommand(commandParser);
+      }
+    }
+  }
+}
+
+// Offload control, runs on the Bluefruit callback task
+void offload_write_callback(uint16_t conn_hdl, BLECharacteristic* chr, uint8_t* data, uint16_t len)
+{
+  (void) conn_hdl;
+  (void) chr;
+  if (len > 0 && !offloadActive) {
+    xTaskNotify(flashLogTaskHandle, data[0] & (LOG_TASK_OFFLOAD | LOG_TASK_ERASE), eSetBits);
+  }
+}
+
+// Write out the sealed segment, if any
+void writeLog(void)
+{
+  uint16_t frames = flashLog.pendingFrames();
+  if (!flashLog.writePending()) {
+    logWriteErrors += frames;
+  }
+}
+
+// Everything logged so far to flash, the segment still filling included
+void flushLog(void)
+{
+  writeLog();
+  taskENTER_CRITICAL();
+  flashLog.seal();
+  taskEXIT_CRITICAL();
+  writeLog();
+}
+
+// Frame opening a segment in an offload, carries its full start time
+void segmentFrame(uint8_t *frame, uint32_t sequence, uint64_t startUs)
+{
+  frame[0] = (FRAME_VERSION << 4) | FRAME_TYPE_SEGMENT;
+  frame[1] = FRAME_FLAG_LOGGED;
+  frame[2] = deviceId;
+  frame[3] = 0;
+  uint16_t seq = sequence;
+  uint32_t base = startUs;
+  memcpy(&frame[4], &seq, 2);
+  memcpy(&frame[6], &base, 4);
+  memcpy(&frame[FRAME_HEADER_LEN], &startUs, 8);
+}
+
+// Offloads the flash log in bulk: each segment opens with a segment frame,
+// its frames follow back to back, all packed into full notifications on the
+// offload characteristic, and an empty FRAME_FLAG_LOG_END frame closes the
+// log. The log is only erased once all of it went out. A host that stops
+// taking the notifications, or never subscribed, gets CMD_ABORTED or
+// CMD_UNAVAILABLE in a response frame.
+void offloadLog(void)
+{
+  if (!offloadChar.notifyEnabled()) {
+    queueStatus(CMD_OFFLOAD, CMD_UNAVAILABLE);
+    return;
+  }
+  offloadActive = true;
+  flushLog();
+
+  uint8_t chunk[FRAME_MAX_LEN];
+  uint16_t payload = min(notifyPayloadSize(), (uint16_t)FRAME_MAX_LEN);
+  uint16_t used = 0;
+  // Push out one notification, waiting a bounded time for TX buffers
+  auto flushChunk = [&]() -> bool {
+    for (uint32_t refused = 0; used > 0 && !offloadChar.notify(chunk, used); refused++) {
+      if (!offloadChar.notifyEnabled() || refused == OFFLOAD_MAX_RETRIES) {
+        return false;
+      }
+      vTaskDelay(pdMS_TO_TICKS(txRetryMs));
+    }
+    used = 0;
+    return true;
+  };
+  auto put = [&](const uint8_t *data, uint8_t length) -> bool {
+    for (uint8_t sent = 0; sent < length; ) {
+      uint16_t n = min((uint16_t)(length - sent), (uint16_t)(payload - used));
+      memcpy(&chunk[used], &data[sent], n);
+      used += n;
+      sent += n;
+      if (used == payload && !flushChunk()) {
+        return false;
+      }
     }
+    return true;
+  };
+
+  bool complete = flashLog.replay(
+    [&](uint32_t sequence, uint64_t startUs) -> bool {
+      uint8_t frame[FRAME_SEGMENT_LEN];
+      segmentFrame(frame, sequence, startUs);
+      return put(frame, sizeof(frame));
+    },
+    [&](uint8_t *frame, uint8_t length) -> bool {
+      frame[1] |= FRAME_FLAG_LOGGED;
+      return put(frame, length);
+    });
+
+  if (complete) {
+    FrameEncoder end(deviceId);
+    end.begin(FRAME_FLAG_LOGGED | FRAME_FLAG_LOG_END, FRAME_HEADER_LEN);
+    end.finish();
+    complete = put(end.data(), end.size()) && flushChunk();
+  }
+  if (complete) {
+    flashLog.erase();
+  } else {
+    queueStatus(CMD_OFFLOAD, CMD_ABORTED);
+  }
+  offloadActive = false;
+}
+
+// Owns the QSPI flash: writes sealed segments, seals a slowly filling one
+// after LOG_FLUSH_MS, and offloads or erases the log on request
+void TaskFlashLog(void *pvParameters)
+{
+  (void) pvParameters;
+
+  for (;;) {
+    uint32_t bits = 0;
+    TickType_t wait = flashLog.buffered() ? pdMS_TO_TICKS(LOG_FLUSH_MS) : portMAX_DELAY;
+    bool timedOut = xTaskNotifyWait(0, UINT32_MAX, &bits, wait) == pdFALSE;
+    countWakeup();
+    if (bits & LOG_TASK_ERASE) {
+      taskENTER_CRITICAL();
+      flashLog.discard();
+      taskEXIT_CRITICAL();
+      flashLog.erase();
+    }
+    if (timedOut) {
+      flushLog();
+    } else {
+      writeLog();
+    }
+    if (bits & LOG_TASK_OFFLOAD) {
+      offloadLog();
+    }
+  }
 }
 
 void setup() {
-  // Initialize digital pins as outputs
+  // Keep the VBAT divider switched on. Released, its low side FET turns off
+  // and PIN_VBAT is pulled up to the cell through 1M, above VDD on an ADC pin,
+  // so it is not gated between measurements; that would save about 3 uA.
   pinMode(VBAT_ENABLE, OUTPUT);
-
-  // Initialize pin phases
   digitalWrite(VBAT_ENABLE, LOW);
+  analogReadResolution(BATTERY_ADC_BITS);
+  analogOversampling(BATTERY_OVERSAMPLE);
   
-  //Configure IMU
+  //Configure IMU with the configuration saved by the last session, if any
+  InternalFS.begin();
+  loadImuConfig(imuConfig);
   myIMU.begin();
+  myIMU.writeRegister(LSM6DS3_ACC_GYRO_CTRL3_C, 0x44); // BDU | IF_INC for burst reads
+  applyImuConfig(imuConfig);
+  imuConfigRequests = xMessageBufferCreate(2 * (sizeof(ImuConfig) + sizeof(size_t)));
 
   // initialize BLE
   setupBLE();
 
-  delay(1000);
+  // The sample clock runs from the LFCLK started by the SoftDevice
+  startSampleClock();
+
+  // DWT cycle counter, times the fusion updates
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 
-  // initialize RTC
-  rtc.begin(DateTime(F(__DATE__), F(__TIME__)));
-  // This line sets the RTC with an explicit date & time, for example to set
-  rtc.adjust(DateTime(year, month, day, hour, minute, second));
+  // Pick up the flash log where it was before the reset. Without the QSPI
+  // flash the log has no sectors and counts every frame as a write error.
+  qspiFlash.begin();
+  flashLog.begin();
 
-  // Initialize the semaphore
-  bufferSemaphore = xSemaphoreCreateMutex();
+  delay(1000);
 
+  // Start the wall clock at the build time until the host sets it
+  setWallClock(DateTime(F(__DATE__), F(__TIME__)).unixtime());
+
+  // Create the BLE send task first so SensorTask can notify it
+  xTaskCreate(ble_uart_task, "BLE UART Task", 1000, NULL, 5, &bleTxTaskHandle);
   // Create the IMU reading task
-  xTaskCreate(SensorTask,    "Sensor Read", 1000,  NULL, 7, NULL);
-  // Create the BLE send task
-  xTaskCreate(ble_uart_task, "BLE UART Task", 1000, NULL, 5, NULL);
-  // Create RTC task
-  xTaskCreate(TaskDateTime, "RTC Task", 256, NULL, 7, NULL); 
-  // Create battery voltage tasks
-  xTaskCreate(TaskSampleBattery, "SampleBattery", 100, NULL, 6, NULL);
-  xTaskCreate(TaskDisplayBattery, "DisplayBattery", 256, NULL, 4, NULL);
-  // Create BLE receive tasks
-  xTaskCreate(ble_receive_task, "BLE RE Task", 1000, NULL, 3, NULL);
-  xTaskCreate(processReceivedStringTask, "Process Received String Task", 256, NULL, 1, NULL);
+  xTaskCreate(SensorTask,    "Sensor Read", 1000,  NULL, 7, &sensorTaskHandle);
+  // INT1 interrupts only once the task exists to receive them
+  configureImuInterrupt();
+  // Create battery voltage task
+  xTaskCreate(TaskBattery, "Battery", 256, NULL, 4, &batteryTaskHandle);
+  // Create the flash log task
+  xTaskCreate(TaskFlashLog, "Flash Log", 768, NULL, 2, &flashLogTaskHandle);
+  // Create BLE receive task, fed by the BLEUart RX callback
+  xTaskCreate(ble_receive_task, "BLE RE Task", 512, NULL, 3, NULL);
 }
 
 
@@ -331,7 +2014,7 @@ void startAdv(void)
    * https://developer.apple.com/library/content/qa/qa1931/_index.html   
    */
   Bluefruit.Advertising.restartOnDisconnect(true);
-  Bluefruit.Advertising.setInterval(32, 244);    // in unit of 0.625 ms
+  Bluefruit.Advertising.setInterval(ADV_FAST_INTERVAL, ADV_SLOW_INTERVAL);    // in unit of 0.625 ms
   Bluefruit.Advertising.setFastTimeout(30);      // number of seconds in fast mode
   Bluefruit.Advertising.start(0);                // 0 = Don't stop advertising after n seconds  
 }
@@ -351,9 +2034,15 @@ void setupBLE(void)
 
   Bluefruit.begin();
   Bluefruit.setTxPower(4);    // Check bluefruit.h for supported values
-  Bluefruit.setName(deviceName.c_str()); // useful testing with multiple central connections getMcuUniqueID()
+  // Radio notification at the start and end of every radio event, for sync
+  // reply stamps and TaskBattery's conversions in the gaps
+  sd_radio_notification_cfg_set(NRF_RADIO_NOTIFICATION_TYPE_INT_ON_BOTH, NRF_RADIO_NOTIFICATION_DISTANCE_NONE);
+  NVIC_SetPriority(SWI1_EGU1_IRQn, 6);
+  NVIC_EnableIRQ(SWI1_EGU1_IRQn);
+  Bluefruit.setName(deviceName); // useful testing with multiple central connections getMcuUniqueID()
   Bluefruit.Periph.setConnectCallback(connect_callback);
   Bluefruit.Periph.setDisconnectCallback(disconnect_callback);
+  Bluefruit.setEventCallback(ble_event_callback);
 
   // To be consistent OTA DFU should be added first if it exists
   bledfu.begin();
@@ -364,11 +2053,30 @@ void setupBLE(void)
   bledis.begin();
 
   // Configure and Start BLE Uart Service
+  rxMessages = xMessageBufferCreate(256);
+  controlFrames = xMessageBufferCreate(256);
+  bleuart.setRxCallback(ble_rx_callback);
   bleuart.begin();
 
-  // Start BLE Battery Service
+  // Configure and Start the telemetry service with its stats characteristic
+  telemetryService.begin();
+  statsChar.setProperties(CHR_PROPS_READ | CHR_PROPS_NOTIFY);
+  statsChar.setPermission(SECMODE_OPEN, SECMODE_NO_ACCESS);
+  statsChar.setFixedLen(sizeof(TxStats));
+  statsChar.begin();
+  offloadChar.setProperties(CHR_PROPS_WRITE | CHR_PROPS_NOTIFY);
+  offloadChar.setPermission(SECMODE_OPEN, SECMODE_OPEN);
+  offloadChar.setMaxLen(FRAME_MAX_LEN);
+  offloadChar.setWriteCallback(offload_write_callback);
+  offloadChar.begin();
+  linkChar.setProperties(CHR_PROPS_READ | CHR_PROPS_NOTIFY);
+  linkChar.setPermission(SECMODE_OPEN, SECMODE_NO_ACCESS);
+  linkChar.setFixedLen(sizeof(LinkInfo));
+  linkChar.begin();
+  statsTimer = xTimerCreate("Stats", pdMS_TO_TICKS(1000), pdTRUE, NULL, publishStats);
+
+  // Start BLE Battery Service, TaskBattery publishes the level
   blebas.begin();
-  blebas.write(100);
 
   // Set up and start advertising
   startAdv();
@@ -387,6 +2095,10 @@ void connect_callback(uint16_t conn_handle)
   Serial.println(central_name);
 
   strncpy(central_name_global, central_name, 32);
+  connHandle = conn_handle;
+  xTimerStart(statsTimer, 0);
+  updatePowerState();
+  optimizeLink(conn_handle, liveSampleRate(imuConfig.sampleRate));
 }
 
 /**
@@ -398,21 +2110,13 @@ void disconnect_callback(uint16_t conn_handle, uint8_t reason)
 {
   (void) conn_handle;
   (void) reason;
+  connHandle = BLE_CONN_HANDLE_INVALID;
+  xTimerStop(statsTimer, 0);
+  updatePowerState();
 
 /*   Serial.println();
   Serial.print("Disconnected from ");
   Serial.print(central_name_global);
   Serial.print(", reason = 0x");
   Serial.println(reason, HEX); */
-}
-
-bool isInCorrectFormat(const String &str) {
-    // Simple check for the format "YYYY/MM/DD HH:MM:SS"
-    if (str.length() != 19) return false;
-    if (str.charAt(4) != '/' || str.charAt(7) != '/' || 
-        str.charAt(10) != ' ' || str.charAt(13) != ':' || str.charAt(16) != ':') return false;
-
-    // Additional checks like valid month, day, hour, etc., can be added if needed.
-
-    return true;
 }
\ No newline at end of file
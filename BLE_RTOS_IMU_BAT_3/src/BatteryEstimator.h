@@ -0,0 +1,51 @@
+#ifndef BATTERY_ESTIMATOR_H
+#define BATTERY_ESTIMATOR_H
+
+#include <stdint.h>
+
+// VBAT through the board's divider into the SAADC, 3.6 V full scale
+#define VBAT_DIVIDER      (0.332888F)   // 1M + 0.499M voltage divider on VBAT
+#define VBAT_DIVIDER_COMP (3.004008F)   // Compensation factor for the VBAT divider
+#define BATTERY_ADC_BITS   12           // SAADC resolution for VBAT
+#define BATTERY_OVERSAMPLE 16           // SAADC hardware oversampling, averaged in one conversion
+
+// Cell voltage in mV from a conversion of the given resolution
+inline uint32_t vbatMillivolts(uint32_t raw, uint8_t bits = BATTERY_ADC_BITS)
+{
+  return (uint32_t)(raw * (3600.0F / (1 << bits)) * VBAT_DIVIDER_COMP);
+}
+
+// Open circuit cell voltage from single conversions. Each is lifted by the
+// current drawn while it ran times the internal resistance, then smoothed by
+// a first order IIR in Q8 updated in place. The correction only holds for a
+// steady load: a conversion that catches a radio event reads tens of mV low,
+// so the caller times conversions into the gaps between radio events.
+#define BATTERY_IIR_SHIFT  3            // IIR weight 1/8 per measurement
+
+class BatteryEstimator {
+public:
+  explicit BatteryEstimator(uint16_t rintMilliohm) : rint(rintMilliohm), filteredQ8(-1) {}
+
+  void reset() { filteredQ8 = -1; }
+
+  // Feed one conversion in mV and the load in uA while it ran, returns the
+  // filtered open circuit voltage in mV. The first conversion starts the filter.
+  uint32_t update(uint32_t loadedMv, uint32_t loadUa) {
+    int32_t openCircuitQ8 = (int32_t)((loadedMv << 8) + ((uint64_t)loadUa * rint << 8) / 1000000);
+    if (filteredQ8 < 0) {
+      filteredQ8 = openCircuitQ8;
+    } else {
+      filteredQ8 += (openCircuitQ8 - filteredQ8) >> BATTERY_IIR_SHIFT;
+    }
+    return millivolts();
+  }
+
+  uint32_t millivolts() const { return filteredQ8 < 0 ? 0 : (uint32_t)filteredQ8 >> 8; }
+  bool valid() const { return filteredQ8 >= 0; }
+
+private:
+  uint16_t rint;       // Cell, protection FETs and charger path, mOhm
+  int32_t filteredQ8;  // Negative until the first conversion
+};
+
+#endif
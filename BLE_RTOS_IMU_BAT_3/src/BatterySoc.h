@@ -0,0 +1,84 @@
+#ifndef BATTERY_SOC_H
+#define BATTERY_SOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Discharge curve of a cell chemistry, rest voltage in mV against state of
+// charge in tenths of a percent, ordered by rising voltage
+typedef struct {
+    uint16_t millivolts;
+    uint16_t tenths;
+} DischargePoint;
+
+// Single cell LiPo, fitted to the 1%/10 mV reference table this firmware used to scan
+constexpr DischargePoint lipoCurve[] = {
+    {3100, 0}, {3150, 10}, {3190, 30}, {3210, 40}, {4090, 920}, {4100, 940}, {4160, 1000}
+};
+
+// Single cell LiFePO4, flat plateau between 3.25 V and 3.35 V
+constexpr DischargePoint lifepo4Curve[] = {
+    {2500, 0}, {2900, 50}, {3100, 100}, {3200, 200}, {3250, 400}, {3300, 700}, {3350, 900}, {3400, 990}, {3600, 1000}
+};
+
+// Curve of the fitted cell, point this at another table to change chemistry
+#define BATTERY_CURVE lipoCurve
+
+#define SOC_TABLE_STEP_MV 10
+constexpr uint16_t socTableMinMv = BATTERY_CURVE[0].millivolts;
+constexpr uint16_t socTableMaxMv = BATTERY_CURVE[sizeof(BATTERY_CURVE) / sizeof(DischargePoint) - 1].millivolts;
+constexpr size_t socTableLen = (socTableMaxMv - socTableMinMv) / SOC_TABLE_STEP_MV + 1;
+static_assert((socTableMaxMv - socTableMinMv) % SOC_TABLE_STEP_MV == 0, "discharge curve must span whole table steps");
+
+// Piecewise-linear state of charge on the curve, evaluated at compile time
+constexpr uint16_t curveTenths(const DischargePoint *curve, size_t points, uint16_t millivolts)
+{
+  return points < 2 || millivolts <= curve[0].millivolts ? curve[0].tenths
+       : millivolts >= curve[1].millivolts ? curveTenths(curve + 1, points - 1, millivolts)
+       : curve[0].tenths + (uint32_t)(curve[1].tenths - curve[0].tenths) * (millivolts - curve[0].millivolts)
+                           / (curve[1].millivolts - curve[0].millivolts);
+}
+
+template<size_t... I> struct IndexSequence {};
+template<size_t N, size_t... I> struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...> {};
+template<size_t... I> struct MakeIndexSequence<0, I...> { typedef IndexSequence<I...> type; };
+
+template<size_t N> struct SocTable { uint16_t tenths[N]; };
+
+template<size_t... I>
+constexpr SocTable<sizeof...(I)> makeSocTable(IndexSequence<I...>)
+{
+  return {{ curveTenths(BATTERY_CURVE, sizeof(BATTERY_CURVE) / sizeof(DischargePoint),
+                        socTableMinMv + I * SOC_TABLE_STEP_MV)... }};
+}
+
+// State of charge every SOC_TABLE_STEP_MV across the curve, lives in flash
+constexpr SocTable<socTableLen> socTable = makeSocTable(MakeIndexSequence<socTableLen>::type());
+
+// Battery state of charge in tenths of a percent, interpolated between table steps
+inline uint16_t batterySocTenths(uint32_t millivolts) {
+  if (millivolts <= socTableMinMv) return socTable.tenths[0];
+  if (millivolts >= socTableMaxMv) return socTable.tenths[socTableLen - 1];
+  uint32_t offset = millivolts - socTableMinMv;
+  uint32_t index = offset / SOC_TABLE_STEP_MV;
+  uint32_t fraction = offset % SOC_TABLE_STEP_MV;
+  return socTable.tenths[index] + (socTable.tenths[index + 1] - socTable.tenths[index]) * (int32_t)fraction / SOC_TABLE_STEP_MV;
+}
+
+// Whole percent to report, moving from the previous level only once the state
+// of charge is BATTERY_LEVEL_HYSTERESIS tenths past the rounding point, so
+// noise on a step boundary does not flip it back and forth
+#define BATTERY_LEVEL_HYSTERESIS 3
+
+inline int batteryLevel(uint16_t tenths, int previous) {
+  int rounded = (tenths + 5) / 10;
+  if (rounded > previous && tenths < previous * 10 + 5 + BATTERY_LEVEL_HYSTERESIS) {
+    return previous;
+  }
+  if (rounded < previous && tenths + 5 + BATTERY_LEVEL_HYSTERESIS > previous * 10) {
+    return previous;
+  }
+  return rounded;
+}
+
+#endif
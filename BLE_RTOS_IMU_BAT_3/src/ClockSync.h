@@ -0,0 +1,150 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <stdint.h>
+#include <math.h>
+#include "WallClock.h"
+
+// Two-way time sync, all times in us. The host clock is the shared timebase
+// and the device clock is the raw sample clock, so each exchange measures
+// host minus device; the host works out offset and delay from
+//   t1 host send, t2 device receive, t3 device send, t4 host receive
+// and sends them back as a sync point.
+//
+// The two legs are not alike. The request waits in the host for the next
+// connection event, an unknown part of an interval, so t1 - t2 says little.
+// The reply's t3 is stamped with the connection event that carries it, so
+// t4 - t3 is only the host's receive latency: the device follows the
+// smallest t4 - t3 of a burst, the least latency it has seen.
+#define SYNC_BURST_GAP_US  5000000ULL   // A quieter gap starts a new sync burst
+#define DRIFT_ANCHORS      8              // Best points of recent bursts the drift is fitted to
+#define DRIFT_MIN_SPAN_US  60000000ULL    // Anchors must span this long before drift is fitted
+#define DRIFT_MAX_PPB      200000         // Reject fits beyond 200 ppm, no LF crystal is that far off
+
+// One host sync point, host minus device clock measured over a round trip
+typedef struct {
+  uint64_t localUs;   // Device clock when the result arrived
+  int64_t offsetUs;
+  uint32_t delayUs;   // Round trip less device turnaround, bounds the offset error
+} SyncPoint;
+
+// The host's side of an exchange, as bleimu102.py works it out
+inline SyncPoint syncPointFrom(uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4, uint64_t localUs)
+{
+  SyncPoint point;
+  point.localUs = localUs;
+  int64_t twice = (int64_t)(t1 - t2) + (int64_t)(t4 - t3);
+  point.offsetUs = twice >= 0 ? twice / 2 : -((1 - twice) / 2);  // Python's floor division
+  int64_t delay = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+  point.delayUs = delay > 0 ? (uint32_t)delay : 0;
+  return point;
+}
+
+// t4 - t3 of an exchange, the host minus device offset plus the reply's
+// latency, from the host's offset and delay
+inline int64_t syncReplyOffset(const SyncPoint &point)
+{
+  return point.offsetUs + point.delayUs / 2;
+}
+
+// t3 of a sync reply, the start of the connection event that carries it.
+// Between events the reply waits for the next one, which starts a whole
+// number of intervals after the last (radioStartUs); during one it may yet
+// go in it, so it is stamped nowUs. Either way the stamp is never after the
+// reply goes out, a reply held up only looks slower.
+inline uint64_t syncReplyStamp(uint64_t nowUs, uint64_t radioStartUs, bool radioActive, uint32_t intervalUs)
+{
+  if (radioActive || intervalUs == 0 || radioStartUs > nowUs) {
+    return nowUs;
+  }
+  return radioStartUs + ((nowUs - radioStartUs) / intervalUs + 1) * intervalUs;
+}
+
+// Host sync points arrive in bursts. Within a burst follow the point with the
+// smallest reply offset, the one the least delayed, and fit the clock rate
+// under the best points of recent bursts.
+class ClockSync {
+public:
+  ClockSync() : count(0), last(0), lastPointUs(0) {}
+
+  // The wall clock model after this point: the burst's best point, or once
+  // the drift can be fitted the line under the best points of recent
+  // bursts, the least latency any of them saw; else the drift stays driftPpb
+  WallClockModel add(const SyncPoint &point, int32_t driftPpb) {
+    SyncPoint reply = point;
+    reply.offsetUs = syncReplyOffset(point);
+    if (count == 0 || point.localUs - lastPointUs > SYNC_BURST_GAP_US) {
+      last = count == 0 ? 0 : (last + 1) % DRIFT_ANCHORS;
+      if (count < DRIFT_ANCHORS) {
+        count++;
+      }
+      anchors[last] = reply;
+    } else if (reply.offsetUs < anchors[last].offsetUs) {
+      anchors[last] = reply;
+    }
+    lastPointUs = point.localUs;
+
+    const SyncPoint &best = anchors[last];
+    WallClockModel model = {best.localUs, best.offsetUs, driftPpb};
+    fitDrift(&model.driftPpb, &model.offsetUs);
+    return model;
+  }
+
+  // Line under the anchor offsets against the sample clock, its slope in ppb
+  // and its offset at the latest anchor. Latency only ever adds to an
+  // offset, so the line is the one that lies on or below every anchor and
+  // closest to them overall, through two of them. Returns false until the
+  // anchors span long enough to tell drift from jitter.
+  bool fitDrift(int32_t *driftPpb, int64_t *offsetUs) const {
+    const SyncPoint &ref = anchors[last];
+    double x[DRIFT_ANCHORS], y[DRIFT_ANCHORS];
+    double sumX = 0, sumY = 0;
+    uint64_t oldest = ref.localUs;
+    for (uint8_t i = 0; i < count; i++) {
+      x[i] = (double)(int64_t)(anchors[i].localUs - ref.localUs);
+      y[i] = (double)(anchors[i].offsetUs - ref.offsetUs);
+      sumX += x[i];
+      sumY += y[i];
+      oldest = anchors[i].localUs < oldest ? anchors[i].localUs : oldest;
+    }
+    if (count < 2 || ref.localUs - oldest < DRIFT_MIN_SPAN_US) {
+      return false;
+    }
+    bool found = false;
+    double bestSlope = 0, bestIntercept = 0, bestExcess = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      for (uint8_t j = i + 1; j < count; j++) {
+        if (x[i] == x[j]) {
+          continue;
+        }
+        double slope = (y[j] - y[i]) / (x[j] - x[i]);
+        double intercept = y[i] - slope * x[i];
+        bool under = true;
+        for (uint8_t k = 0; k < count && under; k++) {
+          under = y[k] >= intercept + slope * x[k] - 0.5;
+        }
+        double excess = sumY - count * intercept - slope * sumX;
+        if (under && (!found || excess < bestExcess)) {
+          found = true;
+          bestSlope = slope;
+          bestIntercept = intercept;
+          bestExcess = excess;
+        }
+      }
+    }
+    if (!found || bestSlope * 1e9 > DRIFT_MAX_PPB || bestSlope * 1e9 < -DRIFT_MAX_PPB) {
+      return false;
+    }
+    *driftPpb = (int32_t)(bestSlope * 1e9);
+    *offsetUs = ref.offsetUs + (int64_t)llround(bestIntercept);
+    return true;
+  }
+
+private:
+  SyncPoint anchors[DRIFT_ANCHORS];
+  uint8_t count;
+  uint8_t last;          // Anchor of the burst in progress
+  uint64_t lastPointUs;
+};
+
+#endif
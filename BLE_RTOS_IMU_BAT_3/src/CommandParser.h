@@ -0,0 +1,93 @@
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#include <stdint.h>
+
+// Binary commands from the host, written to the UART RX characteristic and
+// parsed byte by byte, so a command may span several writes:
+//   [CMD_SOF][opcode][payload length][payload][CRC-16/CCITT-FALSE over opcode..payload, u16]
+#define CMD_SOF             0xA5
+#define CMD_MAX_PAYLOAD     32
+
+// Byte-wise command frame parser, resynchronises on the next CMD_SOF after a
+// bad length or CRC
+class CommandParser {
+public:
+  CommandParser() : state(WAIT_SOF), op(0), len(0), received(0), crc(0), rxCrc(0), startUs(0), errors(0) {}
+
+  // True when this byte completed a frame with a good CRC
+  bool feed(uint8_t byte, uint64_t rxUs) {
+    switch (state) {
+    case WAIT_SOF:
+      if (byte == CMD_SOF) {
+        startUs = rxUs;
+        state = OPCODE;
+      }
+      return false;
+    case OPCODE:
+      op = byte;
+      crc = crc16(0xFFFF, byte);
+      state = LENGTH;
+      return false;
+    case LENGTH:
+      if (byte > CMD_MAX_PAYLOAD) {
+        errors++;
+        state = WAIT_SOF;
+        return false;
+      }
+      len = byte;
+      received = 0;
+      crc = crc16(crc, byte);
+      state = len > 0 ? PAYLOAD : CRC_LOW;
+      return false;
+    case PAYLOAD:
+      buf[received++] = byte;
+      crc = crc16(crc, byte);
+      if (received == len) {
+        state = CRC_LOW;
+      }
+      return false;
+    case CRC_LOW:
+      rxCrc = byte;
+      state = CRC_HIGH;
+      return false;
+    case CRC_HIGH:
+      rxCrc |= (uint16_t)byte << 8;
+      state = WAIT_SOF;
+      if (rxCrc != crc) {
+        errors++;
+        return false;
+      }
+      return true;
+    }
+    return false;
+  }
+
+  // CRC-16/CCITT-FALSE, polynomial 0x1021, one byte at a time
+  static uint16_t crc16(uint16_t crc, uint8_t byte) {
+    crc ^= (uint16_t)byte << 8;
+    for (int i = 0; i < 8; i++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+  }
+
+  uint8_t opcode() const { return op; }
+  uint8_t length() const { return len; }
+  const uint8_t *payload() const { return buf; }
+  uint64_t arrivalUs() const { return startUs; }  // When the CMD_SOF arrived
+  uint32_t errorCount() const { return errors; }
+
+private:
+  enum { WAIT_SOF, OPCODE, LENGTH, PAYLOAD, CRC_LOW, CRC_HIGH } state;
+  uint8_t buf[CMD_MAX_PAYLOAD];
+  uint8_t op;
+  uint8_t len;
+  uint8_t received;
+  uint16_t crc;
+  uint16_t rxCrc;
+  uint64_t startUs;
+  uint32_t errors;
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef DECIMATOR_H
+#define DECIMATOR_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "ImuSample.h"
+#ifdef ARDUINO
+#include <Arduino.h>  // CMSIS __SMLAD and __SSAT
+#endif
+
+// The IMU can run at a high ODR while the live stream goes out at a fraction
+// of it. Samples are low-pass filtered by a linear phase FIR in Q15 and every
+// factor-th output kept; the MAC loop takes two taps per __SMLAD.
+#define DECIMATION_MAX_FACTOR      8
+#define DECIMATION_TAPS_PER_FACTOR 20     // Filter length in input samples per unit of factor
+#define DECIMATION_MAX_TAPS        (DECIMATION_MAX_FACTOR * DECIMATION_TAPS_PER_FACTOR)
+#define DECIMATION_CUTOFF          0.4f   // -6 dB point as a fraction of the output rate
+#define DECIMATION_STOPBAND_DB     50     // Rejection from half the output rate up, measured by test_decimator
+
+class Decimator {
+public:
+  Decimator() : decimation(1), taps(0), pos(0), phase(0), filled(0) {}
+
+  // Hamming windowed sinc for decimation by factor, 1 passes samples through.
+  // Taps are rounded to Q15 with the rounding error put on the centre taps,
+  // so the DC gain is exactly one.
+  void configure(uint8_t factor) {
+    const float pi = 3.14159265358979f;
+    decimation = factor;
+    pos = phase = filled = 0;
+    taps = factor > 1 ? factor * DECIMATION_TAPS_PER_FACTOR : 0;
+    if (taps == 0) {
+      return;
+    }
+    float h[DECIMATION_MAX_TAPS];
+    float cutoff = DECIMATION_CUTOFF / factor;  // Cycles per input sample
+    float sum = 0.0f;
+    for (uint16_t i = 0; i < taps; i++) {
+      float m = i - (taps - 1) * 0.5f;
+      float window = 0.54f - 0.46f * cosf(2.0f * pi * i / (taps - 1));
+      h[i] = window * sinf(2.0f * pi * cutoff * m) / (pi * m);
+      sum += h[i];
+    }
+    int16_t q[DECIMATION_MAX_TAPS];
+    int32_t total = 0;
+    for (uint16_t i = 0; i < taps; i++) {
+      q[i] = (int16_t)lrintf(h[i] / sum * 32768.0f);
+      total += q[i];
+    }
+    int32_t error = 32768 - total;
+    q[taps / 2 - 1] += error / 2;
+    q[taps / 2] += error - error / 2;
+    for (uint16_t i = 0; i < taps / 2; i++) {
+      coeffPairs[i] = (uint16_t)q[2 * i] | ((uint32_t)(uint16_t)q[2 * i + 1] << 16);
+    }
+  }
+
+  // Feed one sample, true when out holds the next output. The output is
+  // stamped with the centre of the filter window, its group delay.
+  bool push(const ImuSample &in, ImuSample &out) {
+    out.temperature = in.temperature;
+    if (taps == 0) {
+      out = in;
+      return true;
+    }
+    // Each sample is stored twice, so the newest taps samples are always one
+    // contiguous run starting at pos
+    for (int c = 0; c < 3; c++) {
+      history[c][pos] = history[c][pos + taps] = in.accel[c];
+      history[c + 3][pos] = history[c + 3][pos + taps] = in.gyro[c];
+    }
+    stamps[pos] = in.timestamp;
+    pos = pos + 1 == taps ? 0 : pos + 1;
+    if (filled < taps) {
+      filled++;
+    }
+    if (++phase < decimation) {
+      return false;
+    }
+    phase = 0;
+    if (filled < taps) {
+      return false;
+    }
+    for (int c = 0; c < 6; c++) {
+      int16_t value = fir(&history[c][pos]);
+      if (c < 3) {
+        out.accel[c] = value;
+      } else {
+        out.gyro[c - 3] = value;
+      }
+    }
+    uint32_t early = stamps[(pos + taps / 2 - 1) % taps];
+    uint32_t late = stamps[(pos + taps / 2) % taps];
+    out.timestamp = early + (late - early) / 2;
+    return true;
+  }
+
+  uint8_t factor() const { return decimation; }
+
+private:
+  int16_t fir(const int16_t *x) const {
+    int32_t acc = 0;
+    for (uint16_t i = 0; i < taps / 2; i++) {
+      uint32_t pair;
+      memcpy(&pair, &x[2 * i], 4);  // Unaligned word loads are fine on the M4
+      acc = mac(pair, coeffPairs[i], acc);
+    }
+    return saturate((acc + (1 << 14)) >> 15);
+  }
+
+  // Dual 16-bit multiply-accumulate, a single SMLAD on cores with the DSP extension
+  static int32_t mac(uint32_t x, uint32_t y, int32_t acc) {
+#if defined(__ARM_FEATURE_DSP)
+    return (int32_t)__SMLAD(x, y, (uint32_t)acc);
+#else
+    return acc + (int16_t)(x & 0xFFFF) * (int16_t)(y & 0xFFFF) + (int16_t)(x >> 16) * (int16_t)(y >> 16);
+#endif
+  }
+
+  static int16_t saturate(int32_t value) {
+#if defined(__ARM_FEATURE_DSP)
+    return (int16_t)__SSAT(value, 16);
+#else
+    return (int16_t)(value < INT16_MIN ? INT16_MIN : value > INT16_MAX ? INT16_MAX : value);
+#endif
+  }
+
+  uint8_t decimation;
+  uint16_t taps;
+  uint16_t pos;
+  uint8_t phase;
+  uint16_t filled;
+  uint32_t coeffPairs[DECIMATION_MAX_TAPS / 2];
+  int16_t history[6][2 * DECIMATION_MAX_TAPS];
+  uint32_t stamps[DECIMATION_MAX_TAPS];
+};
+
+#endif
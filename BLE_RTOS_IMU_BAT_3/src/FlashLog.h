@@ -0,0 +1,266 @@
+#ifndef FLASH_LOG_H
+#define FLASH_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Frame log on NOR flash for the time nobody listens to the stream. Frames
+// are collected in RAM until a whole segment is full, then the segment goes
+// to flash in one erase and one program, so the flash sees one erase per
+// 4 kbyte of frames rather than one per frame. Segments fill the sectors as
+// a ring, which spreads the erases evenly; when the log is full the oldest
+// segment is overwritten.
+//
+// A segment is a header followed by records, a length byte and one binary
+// frame each. The header is programmed after the records and its magic word
+// last, so a segment cut short by power loss has no magic and is skipped;
+// CRCs catch a sector whose erase was cut short. Sequence numbers count up
+// across the log, the newest tells where to go on after a reset. Erasing
+// the log only writes a marker segment, everything older than it is gone.
+//
+// Storage is any flash with 4 kbyte erase sectors:
+//   uint32_t sectors();
+//   bool eraseSector(uint32_t sector);
+//   bool program(uint32_t address, const uint8_t *data, uint32_t length);
+//   bool read(uint32_t address, uint8_t *data, uint32_t length);
+#define LOG_SEGMENT_BYTES 4096
+#define LOG_MAGIC         0x474F4C49u     // "ILOG"
+#define LOG_SEGMENT_ERASED 0x0001         // Header flag of an erase marker
+#define LOG_MAX_SPAN_US   1800000000ull   // 30 min, frames keep 32-bit timestamps near the segment start
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;      // LOG_MAGIC, programmed last
+    uint32_t sequence;
+    uint64_t startUs;    // Wall clock of the first frame, full 64 bits
+    uint16_t length;     // Record bytes after the header
+    uint16_t flags;
+    uint32_t dataCrc;    // CRC-32 of the records
+    uint32_t headerCrc;  // CRC-32 of sequence to dataCrc
+} LogSegmentHeader;
+
+#define LOG_RECORD_BYTES (LOG_SEGMENT_BYTES - sizeof(LogSegmentHeader))
+
+template <typename Storage>
+class FlashLog {
+public:
+  explicit FlashLog(Storage &flash)
+    : storage(flash), sectorCount(0), head(0), nextSequence(0), firstValid(0), filling(0), sealed(0), pending(0) {
+    buffers[0].length = buffers[1].length = 0;
+    buffers[0].frames = buffers[1].frames = 0;
+  }
+
+  // Find where the log stood before the reset: the newest segment and the
+  // newest erase marker
+  void begin() {
+    sectorCount = storage.sectors();
+    head = 0;
+    nextSequence = 0;
+    firstValid = 0;
+    bool found = false;
+    for (uint32_t sector = 0; sector < sectorCount; sector++) {
+      LogSegmentHeader header;
+      if (!readHeader(sector, header)) {
+        continue;
+      }
+      if (!found || header.sequence >= nextSequence) {
+        nextSequence = header.sequence + 1;
+        head = sector + 1 == sectorCount ? 0 : sector + 1;
+        found = true;
+      }
+      if ((header.flags & LOG_SEGMENT_ERASED) && header.sequence + 1 > firstValid) {
+        firstValid = header.sequence + 1;
+      }
+    }
+  }
+
+  // Producer side. append(), seal() and discard() touch the segment being
+  // filled, callers keep them from running concurrently.
+
+  // Add one frame stamped with the 64-bit wall clock of its base timestamp.
+  // False when both RAM segments are full, the writer has fallen behind.
+  bool append(const uint8_t *frame, uint8_t length, uint64_t wallUs) {
+    Buffer *buf = &buffers[filling];
+    if (buf->length > 0 && (buf->length + 1u + length > LOG_RECORD_BYTES || wallUs - buf->startUs > LOG_MAX_SPAN_US)) {
+      if (!seal()) {
+        return false;
+      }
+      buf = &buffers[filling];
+    }
+    if (buf->length == 0) {
+      buf->startUs = wallUs;
+    }
+    buf->records[buf->length] = length;
+    memcpy(&buf->records[buf->length + 1], frame, length);
+    buf->length += 1 + length;
+    buf->frames++;
+    return true;
+  }
+
+  // Hand the segment being filled to the writer, false while the previous
+  // one has not been written yet
+  bool seal() {
+    if (buffers[filling].length == 0) {
+      return true;
+    }
+    if (__atomic_load_n(&pending, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    sealed = filling;
+    filling ^= 1;
+    buffers[filling].length = 0;
+    buffers[filling].frames = 0;
+    __atomic_store_n(&pending, 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Drop whatever is still in RAM
+  void discard() {
+    buffers[filling].length = 0;
+    buffers[filling].frames = 0;
+    __atomic_store_n(&pending, 0, __ATOMIC_RELEASE);
+  }
+
+  bool hasPending() const { return __atomic_load_n(&pending, __ATOMIC_ACQUIRE) != 0; }
+  bool buffered() const { return buffers[filling].length > 0 || hasPending(); }
+
+  // Writer side, one task does all the flash access
+
+  // Frames in the sealed segment, lost if writing it fails
+  uint16_t pendingFrames() const { return hasPending() ? buffers[sealed].frames : 0; }
+
+  // Write the sealed segment out, if there is one
+  bool writePending() {
+    if (!hasPending()) {
+      return true;
+    }
+    const Buffer &buf = buffers[sealed];
+    bool ok = writeSegment(buf.records, buf.length, buf.startUs, 0);
+    __atomic_store_n(&pending, 0, __ATOMIC_RELEASE);
+    return ok;
+  }
+
+  // Forget every segment in flash. RAM segments are kept, they are newer.
+  bool erase() {
+    if (!writeSegment(NULL, 0, 0, LOG_SEGMENT_ERASED)) {
+      return false;
+    }
+    firstValid = nextSequence;
+    return true;
+  }
+
+  // Walk the segments in flash oldest first: onSegment(sequence, startUs)
+  // for each, then onFrame(frame, length) for each of its frames. Either
+  // returning false stops the replay, which then returns false.
+  template <typename SegmentSink, typename FrameSink>
+  bool replay(SegmentSink onSegment, FrameSink onFrame) {
+    uint8_t frame[255];
+    for (uint32_t i = 0; i < sectorCount; i++) {
+      uint32_t sector = (head + i) % sectorCount;
+      LogSegmentHeader header;
+      if (!readHeader(sector, header) || (header.flags & LOG_SEGMENT_ERASED) || header.sequence < firstValid) {
+        continue;
+      }
+      uint32_t address = sector * LOG_SEGMENT_BYTES + sizeof(header);
+      if (!dataIntact(address, header)) {
+        continue;
+      }
+      if (!onSegment(header.sequence, header.startUs)) {
+        return false;
+      }
+      for (uint32_t pos = 0; pos < header.length; ) {
+        uint8_t length;
+        if (!storage.read(address + pos, &length, 1) || pos + 1 + length > header.length ||
+            !storage.read(address + pos + 1, frame, length)) {
+          break;
+        }
+        if (!onFrame(frame, length)) {
+          return false;
+        }
+        pos += 1 + length;
+      }
+    }
+    return true;
+  }
+
+  uint32_t capacity() const { return sectorCount * LOG_RECORD_BYTES; }
+
+  // CRC-32 (IEEE 802.3) continued from crc, a nibble at a time
+  static uint32_t crc32(uint32_t crc, const uint8_t *data, uint32_t length) {
+    static const uint32_t table[16] = {
+      0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+      0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    crc = ~crc;
+    for (uint32_t i = 0; i < length; i++) {
+      crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+      crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+  }
+
+private:
+  typedef struct {
+    uint64_t startUs;
+    uint16_t length;
+    uint16_t frames;
+    uint8_t records[LOG_RECORD_BYTES];
+  } Buffer;
+
+  static uint32_t headerCrc(const LogSegmentHeader &header) {
+    return crc32(0, (const uint8_t *)&header.sequence, offsetof(LogSegmentHeader, headerCrc) - offsetof(LogSegmentHeader, sequence));
+  }
+
+  // Records first, then the header, then its magic word
+  bool writeSegment(const uint8_t *records, uint16_t length, uint64_t startUs, uint16_t flags) {
+    if (sectorCount == 0) {
+      return false;
+    }
+    LogSegmentHeader header;
+    header.magic = LOG_MAGIC;
+    header.sequence = nextSequence++;
+    header.startUs = startUs;
+    header.length = length;
+    header.flags = flags;
+    header.dataCrc = crc32(0, records, length);
+    header.headerCrc = headerCrc(header);
+    uint32_t address = head * LOG_SEGMENT_BYTES;
+    // A sector that fails is not retried, the next segment goes to the next one
+    head = head + 1 == sectorCount ? 0 : head + 1;
+    const uint8_t *raw = (const uint8_t *)&header;
+    return storage.eraseSector(address / LOG_SEGMENT_BYTES) &&
+           (length == 0 || storage.program(address + sizeof(header), records, length)) &&
+           storage.program(address + 4, raw + 4, sizeof(header) - 4) &&
+           storage.program(address, raw, 4);
+  }
+
+  bool readHeader(uint32_t sector, LogSegmentHeader &header) {
+    return storage.read(sector * LOG_SEGMENT_BYTES, (uint8_t *)&header, sizeof(header)) &&
+           header.magic == LOG_MAGIC && header.headerCrc == headerCrc(header) && header.length <= LOG_RECORD_BYTES;
+  }
+
+  bool dataIntact(uint32_t address, const LogSegmentHeader &header) {
+    uint8_t block[64];
+    uint32_t crc = 0;
+    for (uint32_t pos = 0; pos < header.length; pos += sizeof(block)) {
+      uint32_t n = header.length - pos < sizeof(block) ? header.length - pos : sizeof(block);
+      if (!storage.read(address + pos, block, n)) {
+        return false;
+      }
+      crc = crc32(crc, block, n);
+    }
+    return crc == header.dataCrc;
+  }
+
+  Storage &storage;
+  uint32_t sectorCount;
+  uint32_t head;          // Sector the next segment goes to, the oldest one
+  uint32_t nextSequence;
+  uint32_t firstValid;    // Segments below this sequence were erased
+  Buffer buffers[2];
+  uint8_t filling;        // Buffer being appended to
+  uint8_t sealed;         // Buffer waiting for the writer while pending
+  uint8_t pending;
+};
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef FRAME_DECODER_H
+#define FRAME_DECODER_H
+
+#include <stdint.h>
+#include "FrameEncoder.h"
+
+// Decoder for the frames FrameEncoder builds, the C++ counterpart of the one
+// in bleimu102.py. The firmware never decodes its own stream; this is for
+// host tools and tests.
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t deviceId;
+    uint8_t count;
+    uint16_t sequence;
+    uint32_t baseTimestamp;
+} FrameHeader;
+
+inline uint16_t frameGet16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+inline uint32_t frameGet32(const uint8_t *p)
+{
+  return frameGet16(p) | ((uint32_t)frameGet16(p + 2) << 16);
+}
+
+// False for a short header or another frame version
+inline bool decodeFrameHeader(const uint8_t *frame, uint16_t length, FrameHeader &header)
+{
+  if (length < FRAME_HEADER_LEN || frame[0] >> 4 != FRAME_VERSION) {
+    return false;
+  }
+  header.type = frame[0] & 0x0F;
+  header.flags = frame[1];
+  header.deviceId = frame[2];
+  header.count = frame[3];
+  header.sequence = frameGet16(&frame[4]);
+  header.baseTimestamp = frameGet32(&frame[6]);
+  return true;
+}
+
+// Length of the sample frame starting at data, 0 while more bytes are needed
+// to tell or for a frame type this decoder does not know
+inline uint16_t frameLength(const uint8_t *data, uint16_t available)
+{
+  FrameHeader header;
+  if (!decodeFrameHeader(data, available, header)) {
+    return 0;
+  }
+  switch (header.type) {
+  case FRAME_TYPE_IMU:
+  case FRAME_TYPE_QUAT:
+  case FRAME_TYPE_GAIT:
+    return FRAME_HEADER_LEN + header.count * FrameEncoder::recordLength(header.type);
+  case FRAME_TYPE_SEGMENT:
+    return FRAME_SEGMENT_LEN;
+  case FRAME_TYPE_PACKED:
+    return available > FRAME_HEADER_LEN ? data[FRAME_HEADER_LEN] : 0;
+  default:
+    return 0;
+  }
+}
+
+// Walk the records of an IMU, quaternion or gait frame, calling
+// onRecord(uint32_t timestamp, const int16_t *values, uint8_t fields) for
+// each with its timestamp rebuilt from the base and the deltas. False when
+// the frame is malformed or of another type.
+template <typename Sink>
+bool decodeFrame(const uint8_t *frame, uint16_t length, FrameHeader &header, Sink onRecord)
+{
+  if (!decodeFrameHeader(frame, length, header) ||
+      (header.type != FRAME_TYPE_IMU && header.type != FRAME_TYPE_QUAT && header.type != FRAME_TYPE_GAIT)) {
+    return false;
+  }
+  const uint8_t recordLen = FrameEncoder::recordLength(header.type);
+  const uint8_t shift = header.type == FRAME_TYPE_GAIT ? FRAME_GAIT_SHIFT : 0;
+  if (length != FRAME_HEADER_LEN + header.count * recordLen) {
+    return false;
+  }
+  uint32_t timestamp = header.baseTimestamp;
+  const uint8_t *p = &frame[FRAME_HEADER_LEN];
+  for (uint8_t n = 0; n < header.count; n++, p += recordLen) {
+    int16_t values[(FRAME_SAMPLE_LEN - 2) / 2];
+    timestamp += (uint32_t)frameGet16(p) << shift;
+    for (uint8_t i = 0; i < (recordLen - 2) / 2; i++) {
+      values[i] = (int16_t)frameGet16(p + 2 + 2 * i);
+    }
+    onRecord(timestamp, (const int16_t *)values, (uint8_t)((recordLen - 2) / 2));
+  }
+  return true;
+}
+
+// Bit reader over a packed frame's stream, LSB first, bounded by its length
+class FrameBitReader {
+public:
+  FrameBitReader(const uint8_t *frame, uint16_t length) : data(frame), pos(FRAME_PACKED_START * 8), end(length * 8) {}
+
+  // The next n bits (n <= 24), false past the end of the frame
+  bool get(uint8_t n, uint32_t &value) {
+    if (pos + n > end) {
+      return false;
+    }
+    value = 0;
+    for (uint8_t done = 0; done < n;) {
+      uint8_t offset = pos & 7;
+      uint8_t take = 8 - offset < n - done ? 8 - offset : n - done;
+      value |= (uint32_t)((data[pos >> 3] >> offset) & ((1U << take) - 1)) << done;
+      done += take;
+      pos += take;
+    }
+    return true;
+  }
+
+  // One Rice coded residual with parameter k, escapes included
+  bool rice(uint8_t k, uint32_t &u) {
+    uint32_t q = 0, bit = 1;
+    while (q < RICE_ESCAPE && get(1, bit) && bit) {
+      q++;
+    }
+    if (q == RICE_ESCAPE) {
+      return get(RICE_RAW_BITS, u);
+    }
+    uint32_t low = 0;
+    if (bit || !get(k, low)) {
+      return false;
+    }
+    u = (q << k) | low;
+    return true;
+  }
+
+private:
+  const uint8_t *data;
+  uint32_t pos;
+  uint32_t end;
+};
+
+// Walk the samples of a packed IMU frame like decodeFrame, each rebuilt from
+// the previous one and its residuals, with the encoder's Rice parameters
+// tracked alongside. False when the frame is malformed or of another type.
+template <typename Sink>
+bool decodePackedFrame(const uint8_t *frame, uint16_t length, FrameHeader &header, Sink onRecord)
+{
+  if (!decodeFrameHeader(frame, length, header) || header.type != FRAME_TYPE_PACKED ||
+      length < FRAME_PACKED_START || frame[FRAME_HEADER_LEN] != length || header.count == 0) {
+    return false;
+  }
+  uint32_t timestamp = header.baseTimestamp, delta = 0;
+  int16_t values[6];
+  for (int i = 0; i < 6; i++) {
+    values[i] = (int16_t)frameGet16(&frame[FRAME_HEADER_LEN + 1 + 2 * i]);
+  }
+  onRecord(timestamp, (const int16_t *)values, (uint8_t)6);
+  uint32_t means[PACKED_CHANNELS];
+  for (int c = 0; c < PACKED_CHANNELS; c++) {
+    means[c] = RICE_INITIAL_MEAN << RICE_MEAN_SHIFT;
+  }
+  FrameBitReader reader(frame, length);
+  for (uint8_t n = 1; n < header.count; n++) {
+    int32_t residuals[PACKED_CHANNELS];
+    for (int c = 0; c < PACKED_CHANNELS; c++) {
+      uint32_t mean = means[c] >> RICE_MEAN_SHIFT, u;
+      if (!reader.rice(mean ? 31 - __builtin_clz(mean) : 0, u)) {
+        return false;
+      }
+      means[c] += u - (means[c] >> RICE_MEAN_SHIFT);
+      residuals[c] = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+    }
+    delta += residuals[0];
+    timestamp += delta;
+    for (int i = 0; i < 6; i++) {
+      values[i] = (int16_t)(values[i] + residuals[i + 1]);
+    }
+    onRecord(timestamp, (const int16_t *)values, (uint8_t)6);
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef FRAME_ENCODER_H
+#define FRAME_ENCODER_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Binary IMU frame, all fields little-endian:
+//   header  version << 4 | type (u8), flags (u8), device id (u8), sample count (u8),
+//           sequence (u16), base timestamp in synchronised wall clock us (low u32)
+//   sample  delta from the previous timestamp in us (u16), accel XYZ, gyro XYZ (int16)
+// The first sample's delta is 0, so its timestamp is the base timestamp.
+// Quaternion frames share the header and carry records of
+//   delta (u16), orientation w, x, y, z in Q14 (int16, 1.0 = 16384)
+// Gait frames carry sparse events, so their deltas count 32 us ticks:
+//   delta in ticks (u16), GaitEvent (int16), four int16 fields, see GaitDetector
+// Packed IMU frames hold the same samples losslessly in fewer bytes, the
+// slower the motion the fewer. The header is followed by the frame length
+// (u8), the first sample's accel XYZ, gyro XYZ (int16), then a bit stream,
+// LSB first. For each further sample it holds seven residuals: the change
+// of the timestamp delta, then the change of each axis from the previous
+// sample. Each residual is zig-zag mapped to unsigned and Rice coded: u >> k
+// as that many 1 bits and a 0, then the low k bits of u. When u >> k reaches
+// RICE_ESCAPE, RICE_ESCAPE 1 bits are followed by u in 17 bits. k follows a
+// running mean per residual, reset at every frame so frames decode on their
+// own (see FrameEncoder::riceParam).
+// A flash log offload opens each log segment with a segment frame: the header
+// with a sample count of 0, the segment sequence (low u16) and start time
+// (low u32), followed by the full start time in wall clock us (u64). Frames
+// in the segment are within 30 minutes of it, so their 32-bit timestamps
+// unwrap against it however old the log is.
+#define FRAME_VERSION      1
+#define FRAME_TYPE_IMU     1
+#define FRAME_TYPE_QUAT    4
+#define FRAME_TYPE_GAIT    5
+#define FRAME_TYPE_PACKED  6
+#define FRAME_TYPE_SEGMENT 7
+#define FRAME_HEADER_LEN   10
+#define FRAME_SAMPLE_LEN   14
+#define FRAME_QUAT_LEN     10
+#define FRAME_GAIT_LEN     12
+#define FRAME_SEGMENT_LEN  18   // Header and u64 start time
+#define FRAME_GAIT_SHIFT   5    // Gait deltas are in units of 1 << 5 us, up to ~2.1 s
+#define FRAME_PACKED_START 23   // Header, length and the first sample
+#define FRAME_PACKED_EST   6    // Typical bytes per packed sample, for planning only
+#define PACKED_CHANNELS    7    // Timestamp delta, accel XYZ, gyro XYZ
+#define RICE_ESCAPE        20
+#define RICE_RAW_BITS      17   // Zig-zag of a difference of two 16-bit values
+#define RICE_MEAN_SHIFT    4    // Running mean over roughly 16 samples
+#define RICE_INITIAL_MEAN  8
+#define FRAME_MAX_LEN      244  // One notification payload at the largest ATT MTU (247)
+#define FRAME_FLAG_DROPPED 0x01 // Samples were lost between the previous frame and this one
+#define FRAME_FLAG_LOGGED  0x02 // Replayed from the flash log rather than live
+#define FRAME_FLAG_LOG_END 0x04 // Empty frame closing a flash log offload
+
+class FrameEncoder {
+public:
+  explicit FrameEncoder(uint8_t device = 0)
+    : length(0), capacity(FRAME_MAX_LEN), recordLen(FRAME_SAMPLE_LEN), deltaShift(0), packed(false), count(0), sequence(0),
+      deviceId(device), firstLocal(0), lastTimestamp(0), bitPos(0), lastDelta(0) {}
+
+  // Bytes per record, an estimate for packed frames
+  static uint8_t recordLength(uint8_t type) {
+    switch (type) {
+    case FRAME_TYPE_QUAT:
+      return FRAME_QUAT_LEN;
+    case FRAME_TYPE_GAIT:
+      return FRAME_GAIT_LEN;
+    case FRAME_TYPE_PACKED:
+      return FRAME_PACKED_EST;
+    default:
+      return FRAME_SAMPLE_LEN;
+    }
+  }
+
+  // Start a frame sized for maxLen bytes, normally one notification payload.
+  // The first sample is always accepted, so a tiny MTU still makes progress
+  // with the frame split over two notifications.
+  void begin(uint8_t flags, uint16_t maxLen, uint8_t type = FRAME_TYPE_IMU) {
+    capacity = maxLen < FRAME_MAX_LEN ? maxLen : FRAME_MAX_LEN;
+    recordLen = recordLength(type);
+    deltaShift = type == FRAME_TYPE_GAIT ? FRAME_GAIT_SHIFT : 0;
+    packed = type == FRAME_TYPE_PACKED;
+    buf[0] = (FRAME_VERSION << 4) | type;
+    buf[1] = flags;
+    buf[2] = deviceId;
+    buf[3] = 0;
+    put16(&buf[4], sequence);
+    put32(&buf[6], 0);
+    length = FRAME_HEADER_LEN;
+    count = 0;
+  }
+
+  // False when the frame is full or the gap to the previous sample does not fit
+  // the 16-bit delta, the caller then sends this frame and starts a new one.
+  // Coarse deltas are rounded down and the remainder carried to the next one.
+  // values holds the record's int16 fields in order, accel XYZ then gyro XYZ
+  // for IMU frames.
+  bool add(uint32_t timestamp, const int16_t *values) {
+    if (count > 0 && !hasRoom()) {
+      return false;
+    }
+    if (packed) {
+      return addPacked(timestamp, values);
+    }
+    uint32_t delta = 0;
+    if (count == 0) {
+      put32(&buf[6], timestamp);
+      firstLocal = timestamp;
+    } else {
+      delta = (timestamp - lastTimestamp) >> deltaShift;
+      if (delta > UINT16_MAX) {
+        return false;
+      }
+    }
+    uint8_t *p = &buf[length];
+    put16(p, (uint16_t)delta);
+    for (int i = 0; i < (recordLen - 2) / 2; i++) {
+      put16(p + 2 + 2 * i, (uint16_t)values[i]);
+    }
+    length += recordLen;
+    count++;
+    lastTimestamp = count == 1 ? timestamp : lastTimestamp + (delta << deltaShift);
+    return true;
+  }
+
+  // Seal the frame for sending and advance the sequence number
+  void finish() {
+    buf[3] = count;
+    if (packed) {
+      buf[FRAME_HEADER_LEN] = length;
+    }
+    sequence++;
+  }
+
+  // Move the base timestamp to another timebase, deltas are kept as sampled
+  void setBaseTimestamp(uint32_t timestamp) { put32(&buf[6], timestamp); }
+
+  void clear() { count = 0; }
+
+  bool empty() const { return count == 0; }
+  bool hasRoom() const { return length + recordLen <= capacity && count < UINT8_MAX; }
+  uint32_t firstTimestamp() const { return firstLocal; }  // Sample clock, for the latency deadline
+  uint16_t size() const { return length; }
+  uint16_t remaining() const { return (capacity - length) / recordLen; }
+  const uint8_t *data() const { return buf; }
+
+private:
+  static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+  }
+  static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+  }
+
+  // The first sample is stored as is, later ones as coded residuals. A sample
+  // that does not fit is rolled back, leaving the frame as it was.
+  bool addPacked(uint32_t timestamp, const int16_t *values) {
+    if (count == 0) {
+      put32(&buf[6], timestamp);
+      for (int i = 0; i < 6; i++) {
+        put16(&buf[FRAME_HEADER_LEN + 1 + 2 * i], (uint16_t)values[i]);
+      }
+      bitPos = FRAME_PACKED_START * 8;
+      length = FRAME_PACKED_START;
+      lastDelta = 0;
+      for (int c = 0; c < PACKED_CHANNELS; c++) {
+        riceMean[c] = RICE_INITIAL_MEAN << RICE_MEAN_SHIFT;
+      }
+    } else {
+      uint32_t delta = timestamp - lastTimestamp;
+      if (delta > UINT16_MAX) {
+        return false;
+      }
+      uint16_t startPos = bitPos;
+      uint32_t startMean[PACKED_CHANNELS];
+      memcpy(startMean, riceMean, sizeof(riceMean));
+      bool fits = putRice(0, (int32_t)delta - (int32_t)lastDelta);
+      for (int c = 0; c < 6 && fits; c++) {
+        fits = putRice(c + 1, (int32_t)values[c] - prevValues[c]);
+      }
+      if (!fits) {
+        bitPos = startPos;
+        if (bitPos & 7) {
+          buf[bitPos >> 3] &= (1 << (bitPos & 7)) - 1;
+        }
+        memcpy(riceMean, startMean, sizeof(riceMean));
+        return false;
+      }
+      lastDelta = delta;
+      length = (bitPos + 7) >> 3;
+    }
+    memcpy(prevValues, values, sizeof(prevValues));
+    if (count == 0) {
+      firstLocal = timestamp;
+    }
+    count++;
+    lastTimestamp = timestamp;
+    return true;
+  }
+
+  // Rice parameter from the channel's running mean, floor(log2(mean))
+  uint8_t riceParam(uint8_t channel) const {
+    uint32_t mean = riceMean[channel] >> RICE_MEAN_SHIFT;
+    return mean ? 31 - __builtin_clz(mean) : 0;
+  }
+
+  bool putRice(uint8_t channel, int32_t residual) {
+    uint32_t u = ((uint32_t)residual << 1) ^ (uint32_t)(residual >> 31);  // Zig-zag
+    uint8_t k = riceParam(channel);
+    uint32_t q = u >> k;
+    bool fits = q < RICE_ESCAPE ? putBits((1UL << q) - 1, q + 1) && putBits(u, k)
+                                : putBits((1UL << RICE_ESCAPE) - 1, RICE_ESCAPE) && putBits(u, RICE_RAW_BITS);
+    riceMean[channel] += u - (riceMean[channel] >> RICE_MEAN_SHIFT);
+    return fits;
+  }
+
+  // Append the low n bits of value (n <= 24), false past the frame capacity
+  bool putBits(uint32_t value, uint8_t n) {
+    if (bitPos + n > capacity * 8) {
+      return false;
+    }
+    while (n > 0) {
+      uint8_t offset = bitPos & 7;
+      uint8_t take = 8 - offset < n ? 8 - offset : n;
+      uint8_t &byte = buf[bitPos >> 3];
+      if (offset == 0) {
+        byte = 0;
+      }
+      byte |= (value & ((1U << take) - 1)) << offset;
+      value >>= take;
+      n -= take;
+      bitPos += take;
+    }
+    return true;
+  }
+
+  uint8_t buf[FRAME_MAX_LEN];
+  uint16_t length;
+  uint16_t capacity;
+  uint8_t recordLen;
+  uint8_t deltaShift;
+  bool packed;
+  uint8_t count;
+  uint16_t sequence;
+  uint8_t deviceId;
+  uint32_t firstLocal;
+  uint32_t lastTimestamp;
+  // Packed frame state
+  uint16_t bitPos;
+  uint32_t lastDelta;
+  int16_t prevValues[6];
+  uint32_t riceMean[PACKED_CHANNELS];  // Running mean of each residual << RICE_MEAN_SHIFT
+};
+
+#endif
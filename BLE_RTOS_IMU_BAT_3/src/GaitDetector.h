@@ -0,0 +1,150 @@
+#ifndef GAIT_DETECTOR_H
+#define GAIT_DETECTOR_H
+
+#include <stdint.h>
+#include <math.h>
+
+// Incremental gait event detector on the sagittal angular velocity of a shank
+// or foot worn sensor. Each stride shows one large positive mid-swing peak;
+// heel strike is the negative minimum that follows it and toe off the
+// push-off minimum just before it.
+#define GAIT_LPF_ALPHA      0.3f      // Smoothing of the angular velocity, roughly 8 Hz at 104 Hz
+#define GAIT_SWING_DPS      100.0f    // Mid-swing peak must exceed this
+#define GAIT_HS_RISE_DPS    40.0f     // Rise above the post-swing minimum that confirms heel strike
+#define GAIT_TO_WINDOW_US   400000    // Toe off minimum is searched within this long before swing
+#define GAIT_MAX_SWING_US   1500000   // Longer without a heel strike abandons the stride
+#define GAIT_MAX_STRIDE_US  3000000   // Longer strides are pauses and get no stride record
+
+typedef enum {
+    GAIT_HEEL_STRIKE = 1,  // angular velocity (0.1 dps), 0, 0, 0
+    GAIT_TOE_OFF     = 2,  // angular velocity (0.1 dps), 0, 0, 0
+    GAIT_STRIDE      = 3   // stride, stance, swing (ms), mid-swing peak (0.1 dps); at the closing heel strike
+} GaitEvent;
+
+typedef struct {
+    uint32_t timestamp;  // Sample clock microseconds
+    int16_t values[5];   // GaitEvent then its four fields
+} GaitRecord;
+
+class GaitDetector {
+public:
+  GaitDetector() { reset(); }
+
+  void reset() {
+    phase = STANCE;
+    primed = false;
+    filtered = 0.0f;
+    extremeDps = 0.0f;
+    extremeUs = 0;
+    peakDps = 0.0f;
+    swingUs = 0;
+    heelStrikeUs = 0;
+    toeOffUs = 0;
+    haveHeelStrike = false;
+    haveToeOff = false;
+  }
+
+  // Feed one sample of angular velocity in dps, up to two records land in out
+  uint8_t update(uint32_t timestamp, float dps, GaitRecord *out) {
+    filtered = primed ? filtered + GAIT_LPF_ALPHA * (dps - filtered) : dps;
+    primed = true;
+    uint8_t n = 0;
+
+    switch (phase) {
+    case STANCE:
+      if (filtered < extremeDps || timestamp - extremeUs > GAIT_TO_WINDOW_US) {
+        extremeDps = filtered;
+        extremeUs = timestamp;
+      }
+      if (filtered > GAIT_SWING_DPS) {
+        if (extremeDps < 0.0f) {
+          event(out[n++], GAIT_TOE_OFF, extremeUs, extremeDps);
+          toeOffUs = extremeUs;
+          haveToeOff = true;
+        }
+        phase = SWING;
+        peakDps = filtered;
+        swingUs = timestamp;
+      }
+      break;
+
+    case SWING:
+      if (filtered > peakDps) {
+        peakDps = filtered;
+      }
+      if (filtered < 0.0f) {
+        phase = HEEL;
+        extremeDps = filtered;
+        extremeUs = timestamp;
+      } else if (timestamp - swingUs > GAIT_MAX_SWING_US) {
+        abandonStride(timestamp);
+      }
+      break;
+
+    case HEEL:
+      if (filtered < extremeDps) {
+        extremeDps = filtered;
+        extremeUs = timestamp;
+      }
+      if (filtered > extremeDps + GAIT_HS_RISE_DPS) {
+        event(out[n++], GAIT_HEEL_STRIKE, extremeUs, extremeDps);
+        uint32_t strideUs = extremeUs - heelStrikeUs;
+        if (haveHeelStrike && haveToeOff && strideUs <= GAIT_MAX_STRIDE_US && toeOffUs - heelStrikeUs < strideUs) {
+          GaitRecord &stride = out[n++];
+          stride.timestamp = extremeUs;
+          stride.values[0] = GAIT_STRIDE;
+          stride.values[1] = (int16_t)(strideUs / 1000);
+          stride.values[2] = (int16_t)((toeOffUs - heelStrikeUs) / 1000);
+          stride.values[3] = (int16_t)((extremeUs - toeOffUs) / 1000);
+          stride.values[4] = deciDps(peakDps);
+        }
+        heelStrikeUs = extremeUs;
+        haveHeelStrike = true;
+        haveToeOff = false;
+        phase = STANCE;
+        extremeDps = filtered;
+        extremeUs = timestamp;
+      } else if (timestamp - swingUs > GAIT_MAX_SWING_US) {
+        abandonStride(timestamp);
+      }
+      break;
+    }
+    return n;
+  }
+
+private:
+  static int16_t deciDps(float dps) {
+    long deci = lrintf(dps * 10.0f);
+    return (int16_t)(deci < INT16_MIN ? INT16_MIN : deci > INT16_MAX ? INT16_MAX : deci);
+  }
+
+  static void event(GaitRecord &record, GaitEvent type, uint32_t timestamp, float dps) {
+    record.timestamp = timestamp;
+    record.values[0] = type;
+    record.values[1] = deciDps(dps);
+    record.values[2] = record.values[3] = record.values[4] = 0;
+  }
+
+  // No heel strike in time, the next stride starts from scratch
+  void abandonStride(uint32_t timestamp) {
+    phase = STANCE;
+    haveHeelStrike = false;
+    haveToeOff = false;
+    extremeDps = filtered;
+    extremeUs = timestamp;
+  }
+
+  enum { STANCE, SWING, HEEL } phase;
+  bool primed;
+  float filtered;
+  float extremeDps;     // Minimum searched for toe off or heel strike
+  uint32_t extremeUs;
+  float peakDps;        // Mid-swing peak of the current stride
+  uint32_t swingUs;     // Swing onset, bounds the heel strike search
+  uint32_t heelStrikeUs;
+  uint32_t toeOffUs;
+  bool haveHeelStrike;
+  bool haveToeOff;
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef IMU_BUS_H
+#define IMU_BUS_H
+
+#include <stdint.h>
+#include "ImuSample.h"
+
+// LSM6DS3TR-C register reads over any bus with the LSM6DS3 library's
+//   status_t readRegisterRegion(uint8_t *out, uint8_t reg, uint8_t length);
+// which auto-increments the register address and returns 0 (IMU_SUCCESS) on
+// success. On the board that is the LSM6DS3 instance, on the host a mock.
+#define IMU_REG_OUT_TEMP_L      0x20
+#define IMU_REG_FIFO_STATUS1    0x3A
+#define IMU_REG_FIFO_DATA_OUT_L 0x3E
+
+#define IMU_FIFO_BURST_SAMPLES 5  // Samples per I2C read, 60 bytes fits the Wire buffer
+
+// Read the temperature and all six axes in one auto-increment I2C transaction
+template <typename Bus>
+bool readImuBurst(Bus &bus, ImuSample &sample)
+{
+  uint8_t raw[IMU_TEMP_LEN + IMU_BURST_LEN];
+  if (bus.readRegisterRegion(raw, IMU_REG_OUT_TEMP_L, sizeof(raw)) != 0) {
+    return false;
+  }
+  sample.temperature = (int16_t)(raw[0] | (raw[1] << 8));
+  decodeImuBurst(&raw[IMU_TEMP_LEN], sample);
+  return true;
+}
+
+// Drain every complete sample from a FIFO holding gyro and accel words (the
+// output register order) in multi-sample bursts, handing each to
+// publish(const ImuSample &) oldest first. The FIFO carries no timestamps,
+// so samples are stamped back from drainUs, the instant before the status
+// read, at the nominal period; nor temperatures, so they share the current
+// one. Samples arriving meanwhile stay for the next drain. Returns the
+// samples drained.
+//
+// A FIFO that overran is left alone and reported through overrun: while it
+// is full each new sample overwrites the oldest words, so reads race the
+// writes and the words stop lining up with samples. The caller flushes it.
+template <typename Bus, typename Sink>
+uint16_t readImuFifo(Bus &bus, uint32_t drainUs, uint32_t periodUs, bool &overrun, Sink publish)
+{
+  uint8_t status[4];
+  uint8_t temp[IMU_TEMP_LEN];
+  overrun = false;
+  if (bus.readRegisterRegion(status, IMU_REG_FIFO_STATUS1, 4) != 0 ||
+      bus.readRegisterRegion(temp, IMU_REG_OUT_TEMP_L, IMU_TEMP_LEN) != 0) {
+    return 0;
+  }
+  uint16_t words = status[0] | ((status[1] & 0x0F) << 8);
+  uint16_t pattern = status[2] | ((status[3] & 0x03) << 8);
+  overrun = (status[1] & 0x40) != 0;
+  if (overrun) {
+    return 0;
+  }
+
+  // Skip to the next gyro X word if an earlier read stopped mid-sample
+  while (pattern != 0 && words > 0) {
+    uint8_t discard[2];
+    bus.readRegisterRegion(discard, IMU_REG_FIFO_DATA_OUT_L, 2);
+    pattern = (pattern + 1) % (IMU_BURST_LEN / 2);
+    words--;
+  }
+
+  const uint16_t count = words / (IMU_BURST_LEN / 2);
+  uint8_t raw[IMU_FIFO_BURST_SAMPLES * IMU_BURST_LEN];
+  uint16_t done = 0;
+  while (done < count) {
+    uint16_t n = count - done < IMU_FIFO_BURST_SAMPLES ? count - done : IMU_FIFO_BURST_SAMPLES;
+    // FIFO_DATA_OUT rolls back on itself, so one region read returns n whole samples
+    if (bus.readRegisterRegion(raw, IMU_REG_FIFO_DATA_OUT_L, n * IMU_BURST_LEN) != 0) {
+      break;
+    }
+    for (uint16_t k = 0; k < n; k++) {
+      ImuSample sample;
+      decodeImuBurst(&raw[k * IMU_BURST_LEN], sample);
+      sample.temperature = (int16_t)(temp[0] | (temp[1] << 8));
+      sample.timestamp = drainUs - (uint32_t)(count - 1 - (done + k)) * periodUs;
+      publish(sample);
+    }
+    done += n;
+  }
+  return done;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef IMU_SAMPLE_H
+#define IMU_SAMPLE_H
+
+#include <stdint.h>
+
+// One IMU sample as read from the LSM6DS3 output registers
+#define IMU_BURST_LEN 12  // OUTX_L_G .. OUTZ_H_XL, gyro XYZ then accel XYZ
+#define IMU_TEMP_LEN  2   // OUT_TEMP_L .. OUT_TEMP_H, just before OUTX_L_G
+#define IMU_TEMP_LSB_PER_C 256  // LSM6DS3TR-C, zero at 25 degrees C
+
+typedef struct {
+    uint32_t timestamp;  // Sample clock microseconds
+    int16_t accel[3];
+    int16_t gyro[3];
+    int16_t temperature; // Raw OUT_TEMP
+} ImuSample;
+
+// Unpack a 12-byte output register burst, little-endian, gyro first
+inline void decodeImuBurst(const uint8_t *raw, ImuSample &sample)
+{
+  for (int i = 0; i < 3; i++) {
+    sample.gyro[i]  = (int16_t)(raw[2 * i]     | (raw[2 * i + 1] << 8));
+    sample.accel[i] = (int16_t)(raw[6 + 2 * i] | (raw[7 + 2 * i] << 8));
+  }
+}
+
+// Gyro sensitivity in dps per LSB at a full scale of rangeDps, 4.375 mdps/LSB
+// at 125 dps like LSM6DS3::calcGyro
+inline float gyroDpsPerLsb(uint16_t rangeDps)
+{
+  int32_t divisor = rangeDps == 245 ? 2 : rangeDps / 125;
+  return divisor * 4.375e-3f;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef LINK_MODEL_H
+#define LINK_MODEL_H
+
+#include <stdint.h>
+#include "FrameEncoder.h"
+
+// Throughput model of the BLE link, which the link optimizer picks the
+// connection interval from. Intervals are in units of 1.25 ms.
+#define LINK_MTU              247    // Largest ATT MTU the stack is configured for
+#define LINK_DATA_LENGTH      251    // Largest LL payload with data length extension
+#define LINK_MIN_INTERVAL     6      // 7.5 ms
+#define LINK_HEADROOM         2      // Capacity over the stream rate, leaves room for retransmissions
+#define LINK_PHY_2MBPS        0x02   // BLE_GAP_PHY_2MBPS
+#define LINK_HVN_QUEUE        3      // SoftDevice notification buffers, hvn_qsize of BANDWIDTH_MAX
+
+// Notification payload bytes per second the link can carry. Every packet is
+// followed by an empty one from the central, with connection event length
+// extension the exchange may run for the whole interval. The SoftDevice only
+// holds LINK_HVN_QUEUE notifications and frees them after the event, which
+// bounds an event first on any but the shortest intervals.
+inline uint32_t linkCapacity(uint16_t interval, uint8_t phy, uint16_t dataLength, uint16_t mtu)
+{
+  const uint32_t ifsUs = 150;
+  uint32_t usPerByte = phy == LINK_PHY_2MBPS ? 4 : 8;
+  uint32_t packetUs = (dataLength + 14) * usPerByte + ifsUs + 10 * usPerByte + ifsUs;  // 14 = preamble, AA, header, MIC, CRC
+  uint32_t packetsPerNotification = (mtu + 4 + dataLength - 1) / dataLength;  // L2CAP header
+  uint32_t notificationsPerEvent = (uint32_t)interval * 1250 / (packetsPerNotification * packetUs);
+  notificationsPerEvent = notificationsPerEvent < LINK_HVN_QUEUE ? notificationsPerEvent : LINK_HVN_QUEUE;
+  notificationsPerEvent = notificationsPerEvent > 1 ? notificationsPerEvent : 1;
+  return notificationsPerEvent * (mtu - 3) * 800 / interval;  // 800 intervals of 1.25 ms per second
+}
+
+// Binary stream payload at an ODR, one frame header per notification
+inline uint32_t streamRate(uint16_t sampleRate, uint16_t mtu)
+{
+  int32_t samplesPerFrame = (mtu - 3 - FRAME_HEADER_LEN) / FRAME_SAMPLE_LEN;
+  samplesPerFrame = samplesPerFrame > 1 ? samplesPerFrame : 1;
+  return (uint32_t)sampleRate * FRAME_SAMPLE_LEN + (uint32_t)sampleRate * FRAME_HEADER_LEN / samplesPerFrame;
+}
+
+// Longest interval, so the fewest radio events, whose modelled capacity still
+// has headroom over the stream and which does not hold a frame longer than
+// half the batch latency budget
+inline uint16_t pickConnectionInterval(uint16_t sampleRate, uint8_t phy, uint16_t dataLength, uint16_t mtu,
+                                       uint32_t maxBatchLatencyMs)
+{
+  uint32_t longest = maxBatchLatencyMs * 4 / 5 / 2;
+  longest = longest > LINK_MIN_INTERVAL ? longest : LINK_MIN_INTERVAL;
+  uint32_t required = streamRate(sampleRate, mtu) * LINK_HEADROOM;
+  for (uint16_t interval = (uint16_t)longest; interval > LINK_MIN_INTERVAL; interval--) {
+    if (linkCapacity(interval, phy, dataLength, mtu) >= required) {
+      return interval;
+    }
+  }
+  return LINK_MIN_INTERVAL;
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef MADGWICK_FILTER_H
+#define MADGWICK_FILTER_H
+
+#include <stdint.h>
+#include <math.h>
+
+// Madgwick orientation filter on gyro and accel (no magnetometer, so yaw
+// drifts). Single precision keeps it on the M4F FPU, which has hardware sqrt
+// and divide.
+#define QUAT_ONE          16384.0f // Q14 output scale
+
+class MadgwickFilter {
+public:
+  MadgwickFilter(float gain) : beta(gain) { reset(); }
+
+  void reset() {
+    q[0] = 1.0f;
+    q[1] = q[2] = q[3] = 0.0f;
+    started = false;
+  }
+
+  // Gyro in rad/s, accel in any unit (only its direction is used), dt in s.
+  // The first update only levels the filter on the accel tilt.
+  void update(float gx, float gy, float gz, float ax, float ay, float az, float dt) {
+    if (!started) {
+      level(ax, ay, az);
+      return;
+    }
+    float q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+
+    // Rate of change of the quaternion from the gyro
+    float qDot0 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
+    float qDot1 = 0.5f * (q0 * gx + q2 * gz - q3 * gy);
+    float qDot2 = 0.5f * (q0 * gy - q1 * gz + q3 * gx);
+    float qDot3 = 0.5f * (q0 * gz + q1 * gy - q2 * gx);
+
+    // Gradient descent step towards the measured gravity direction
+    float norm = ax * ax + ay * ay + az * az;
+    if (norm > 0.0f) {
+      float recipNorm = 1.0f / sqrtf(norm);
+      ax *= recipNorm;
+      ay *= recipNorm;
+      az *= recipNorm;
+
+      float _2q0 = 2.0f * q0, _2q1 = 2.0f * q1, _2q2 = 2.0f * q2, _2q3 = 2.0f * q3;
+      float _4q0 = 4.0f * q0, _4q1 = 4.0f * q1, _4q2 = 4.0f * q2;
+      float _8q1 = 8.0f * q1, _8q2 = 8.0f * q2;
+      float q0q0 = q0 * q0, q1q1 = q1 * q1, q2q2 = q2 * q2, q3q3 = q3 * q3;
+
+      float s0 = _4q0 * q2q2 + _2q2 * ax + _4q0 * q1q1 - _2q1 * ay;
+      float s1 = _4q1 * q3q3 - _2q3 * ax + 4.0f * q0q0 * q1 - _2q0 * ay - _4q1 + _8q1 * q1q1 + _8q1 * q2q2 + _4q1 * az;
+      float s2 = 4.0f * q0q0 * q2 + _2q0 * ax + _4q2 * q3q3 - _2q3 * ay - _4q2 + _8q2 * q1q1 + _8q2 * q2q2 + _4q2 * az;
+      float s3 = 4.0f * q1q1 * q3 - _2q1 * ax + 4.0f * q2q2 * q3 - _2q2 * ay;
+      norm = s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3;
+      if (norm > 0.0f) {
+        recipNorm = beta / sqrtf(norm);
+        qDot0 -= recipNorm * s0;
+        qDot1 -= recipNorm * s1;
+        qDot2 -= recipNorm * s2;
+        qDot3 -= recipNorm * s3;
+      }
+    }
+
+    q0 += qDot0 * dt;
+    q1 += qDot1 * dt;
+    q2 += qDot2 * dt;
+    q3 += qDot3 * dt;
+    float recipNorm = 1.0f / sqrtf(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+    q[0] = q0 * recipNorm;
+    q[1] = q1 * recipNorm;
+    q[2] = q2 * recipNorm;
+    q[3] = q3 * recipNorm;
+  }
+
+  // Orientation as w, x, y, z in Q14
+  void toQ14(int16_t *out) const {
+    for (int i = 0; i < 4; i++) {
+      out[i] = (int16_t)lrintf(q[i] * QUAT_ONE);
+    }
+  }
+
+  bool running() const { return started; }
+
+private:
+  // Roll and pitch from gravity, yaw zero, so the filter starts converged
+  void level(float ax, float ay, float az) {
+    if (ax == 0.0f && ay == 0.0f && az == 0.0f) {
+      return;
+    }
+    float halfRoll = 0.5f * atan2f(ay, az);
+    float halfPitch = 0.5f * atan2f(-ax, sqrtf(ay * ay + az * az));
+    float cr = cosf(halfRoll), sr = sinf(halfRoll);
+    float cp = cosf(halfPitch), sp = sinf(halfPitch);
+    q[0] = cr * cp;
+    q[1] = sr * cp;
+    q[2] = cr * sp;
+    q[3] = -sr * sp;
+    started = true;
+  }
+
+  float beta;
+  float q[4];
+  bool started;
+};
+
+#endif
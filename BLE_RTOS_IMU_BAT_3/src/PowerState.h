@@ -0,0 +1,76 @@
+#ifndef POWER_STATE_H
+#define POWER_STATE_H
+
+#include <stdint.h>
+
+// Connection and stream state decide which parts of the device stay awake.
+typedef enum {
+    POWER_STREAMING,       // Connected, sampling and notifying
+    POWER_CONNECTED_IDLE,  // Connected, stream stopped by the host: IMU powered down
+    POWER_RECORDING,       // Disconnected, sampling into the flash log
+    POWER_IDLE,            // Disconnected and stopped: IMU powered down, battery parked, slow advertising
+    POWER_MOTION_WAIT,     // Streaming but still: IMU filling its FIFO, SensorTask blocked until
+                           // the wake-up interrupt, slow advertising or a lazy connection
+    POWER_STATE_COUNT
+} PowerState;
+
+// Load model, average draw of each part of the device
+#define LOAD_IDLE_UA        500    // MCU, regulators and SoftDevice housekeeping
+#define LOAD_ADVERTISING_UA 250    // Advertising events
+#define LOAD_ADV_IDLE_UA    40     // Advertising events at ADV_IDLE_INTERVAL
+#define LOAD_CONNECTED_UA   150    // Empty connection events
+#define LOAD_IMU_UA         900    // LSM6DS3 accel and gyro in high performance mode
+#define LOAD_SAMPLE_NC      4000   // MCU wakeup and I2C read per IMU sample, nC
+
+// The whole power policy, everything else follows from the state
+inline PowerState powerStateFor(bool connected, bool streaming, bool still)
+{
+  if (streaming && still) {
+    return POWER_MOTION_WAIT;
+  }
+  if (connected) {
+    return streaming ? POWER_STREAMING : POWER_CONNECTED_IDLE;
+  }
+  return streaming ? POWER_RECORDING : POWER_IDLE;
+}
+
+// The IMU is powered, whether SensorTask reads it or its wake-up detector watches
+inline bool powerStateImuOn(PowerState state)
+{
+  return state == POWER_STREAMING || state == POWER_RECORDING || state == POWER_MOTION_WAIT;
+}
+
+inline bool powerStateMeasuresBattery(PowerState state)
+{
+  return state != POWER_IDLE;
+}
+
+// Advertising, while disconnected, at ADV_IDLE_INTERVAL
+inline bool powerStateAdvertisesIdle(PowerState state)
+{
+  return state == POWER_IDLE || state == POWER_MOTION_WAIT;
+}
+
+// Average draw of a power state before notification traffic. A connection
+// waiting for motion skips all but one in latency + 1 connection events.
+inline uint32_t powerStateCurrentUa(PowerState state, uint16_t sampleRateHz, bool connected, uint16_t latency)
+{
+  uint32_t ua = LOAD_IDLE_UA;
+  if (state == POWER_STREAMING || state == POWER_RECORDING) {
+    ua += LOAD_IMU_UA + (uint32_t)sampleRateHz * LOAD_SAMPLE_NC / 1000;
+  }
+  switch (state) {
+  case POWER_MOTION_WAIT:
+    ua += LOAD_IMU_UA;
+    return ua + (connected ? LOAD_CONNECTED_UA / (1 + latency) : LOAD_ADV_IDLE_UA);
+  case POWER_STREAMING:
+  case POWER_CONNECTED_IDLE:
+    return ua + LOAD_CONNECTED_UA;
+  case POWER_RECORDING:
+    return ua + LOAD_ADVERTISING_UA;
+  default:
+    return ua + LOAD_ADV_IDLE_UA;
+  }
+}
+
+#endif
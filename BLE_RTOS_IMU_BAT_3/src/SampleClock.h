@@ -0,0 +1,67 @@
+#ifndef SAMPLE_CLOCK_H
+#define SAMPLE_CLOCK_H
+
+#include <stdint.h>
+#include <math.h>
+
+// Sample clock arithmetic and the sample period statistics. The clock is a
+// 32.768 kHz RTC counter extended to 64 bits, so timestamps resolve to
+// ~30.5 us; a sample is stamped with it in the data-ready interrupt.
+#define SAMPLE_CLOCK_HZ 32768UL
+
+inline uint64_t sampleClockTicksToMicros(uint64_t ticks)
+{
+  return (ticks * 15625ULL) >> 9;  // 1e6 / 32768 = 15625 / 512
+}
+
+// The 24-bit RTC counter extended by the overflows counted so far. An
+// overflow event still pending, because the reader outranks the overflow
+// interrupt, counts only if the counter was read after it wrapped.
+inline uint64_t extendRtcCounter(uint32_t overflows, uint32_t counter, bool overflowPending)
+{
+  if (overflowPending && counter < (1UL << 23)) {
+    overflows++;
+  }
+  return ((uint64_t)overflows << 24) | counter;
+}
+
+// Sample period statistics, all values in microseconds
+typedef struct {
+    uint32_t count;
+    uint32_t minPeriod;
+    uint32_t maxPeriod;
+    uint64_t sumPeriod;
+    uint64_t sumSquaredJitter;  // Squared deviation from the nominal period
+} PeriodStats;
+
+inline void resetPeriodStats(PeriodStats &stats)
+{
+  stats.count = 0;
+  stats.minPeriod = UINT32_MAX;
+  stats.maxPeriod = 0;
+  stats.sumPeriod = 0;
+  stats.sumSquaredJitter = 0;
+}
+
+inline void recordPeriod(PeriodStats &stats, uint32_t period, uint32_t nominal)
+{
+  int32_t jitter = (int32_t)(period - nominal);
+  stats.count++;
+  stats.sumPeriod += period;
+  stats.sumSquaredJitter += (uint64_t)((int64_t)jitter * jitter);
+  if (period < stats.minPeriod) stats.minPeriod = period;
+  if (period > stats.maxPeriod) stats.maxPeriod = period;
+}
+
+inline uint32_t periodMean(const PeriodStats &stats)
+{
+  return stats.count ? (uint32_t)(stats.sumPeriod / stats.count) : 0;
+}
+
+// RMS deviation from the nominal period
+inline uint32_t periodJitterRms(const PeriodStats &stats)
+{
+  return stats.count ? (uint32_t)lrintf(sqrtf((float)stats.sumSquaredJitter / stats.count)) : 0;
+}
+
+#endif
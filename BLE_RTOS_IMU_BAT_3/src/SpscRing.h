@@ -0,0 +1,54 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdint.h>
+
+// Lock-free single-producer/single-consumer ring. Only the producer moves head
+// and only the consumer moves tail. Each index is published with a release
+// store and read with an acquire load, so slot accesses stay ordered against
+// the index update that publishes or releases them (a DMB on the M4).
+template <typename T, uint16_t N>
+class SpscRing {
+  static_assert((N & (N - 1)) == 0, "SpscRing capacity must be a power of two");
+
+public:
+  SpscRing() : head(0), tail(0), overflows(0) {}
+
+  // Producer side, drops the new item and counts it when full
+  bool push(const T &item) {
+    uint32_t h = head;
+    if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= N) {
+      __atomic_store_n(&overflows, overflows + 1, __ATOMIC_RELAXED);
+      return false;
+    }
+    slots[h & (N - 1)] = item;
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Consumer side, copies out up to maxCount items in FIFO order
+  uint16_t popBatch(T *out, uint16_t maxCount) {
+    uint32_t t = tail;
+    uint32_t available = __atomic_load_n(&head, __ATOMIC_ACQUIRE) - t;
+    uint16_t n = available < maxCount ? available : maxCount;
+    for (uint16_t i = 0; i < n; i++) {
+      out[i] = slots[(t + i) & (N - 1)];
+    }
+    __atomic_store_n(&tail, t + n, __ATOMIC_RELEASE);
+    return n;
+  }
+
+  uint16_t size() const {
+    return __atomic_load_n(&head, __ATOMIC_ACQUIRE) - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+  }
+  uint16_t capacity() const { return N; }
+  uint32_t overflowCount() const { return __atomic_load_n(&overflows, __ATOMIC_RELAXED); }
+
+private:
+  T slots[N];
+  uint32_t head;
+  uint32_t tail;
+  uint32_t overflows;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef TEXT_SAMPLE_H
+#define TEXT_SAMPLE_H
+
+#include <stdint.h>
+#include "ImuSample.h"
+#include "TextWriter.h"
+
+// Legacy text line for one sample,
+//   IMU1,87%,25.30^,15:0:3,123456,0.01,-0.02,0.98,1.23,0.00,-4.56@
+// name, battery percent, temperature in C, wall clock time, timestamp in ms,
+// accel XYZ in g and gyro XYZ in dps, all in integer and fixed-point
+// arithmetic so no String or float formatting is involved.
+
+inline int32_t roundDiv(int32_t n, int32_t d)
+{
+  return n >= 0 ? (n + d / 2) / d : (n - d / 2) / d;
+}
+
+// Raw accel to hundredths of a g, integer version of LSM6DS3::calcAccel
+inline int32_t accelCentiG(int16_t raw, uint16_t rangeG)
+{
+  return roundDiv((int32_t)raw * 61 * (rangeG >> 1), 10000);
+}
+
+// Raw gyro to hundredths of a dps, integer version of LSM6DS3::calcGyro
+// (4.375 mdps/LSB is exactly 7/16 centi-dps)
+inline int32_t gyroCentiDps(int16_t raw, uint16_t rangeDps)
+{
+  int32_t divisor = rangeDps == 245 ? 2 : rangeDps / 125;
+  return roundDiv((int32_t)raw * 7 * divisor, 16);
+}
+
+// Raw OUT_TEMP to hundredths of a degree C
+inline int32_t tempCentiC(int16_t raw)
+{
+  return 2500 + roundDiv((int32_t)raw * 100, IMU_TEMP_LSB_PER_C);
+}
+
+// Wall clock time of day and the sample's timestamp for the line
+typedef struct {
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+    uint64_t millis;
+} TextTime;
+
+inline void formatTextSample(TextWriter &text, const char *name, int battery, const TextTime &time,
+                             const ImuSample &sample, uint16_t accelRange, uint16_t gyroRange)
+{
+  text.str(name).chr(',');
+  text.i32(battery).str("%,");
+  text.fixed(tempCentiC(sample.temperature), 2).str("^,");
+  text.i32(time.hour).chr(':').i32(time.minute).chr(':').i32(time.second);
+  text.chr(',').u64(time.millis);
+  for (int i = 0; i < 3; i++) {
+    text.chr(',').fixed(accelCentiG(sample.accel[i], accelRange), 2);
+  }
+  for (int i = 0; i < 3; i++) {
+    text.chr(',').fixed(gyroCentiDps(sample.gyro[i], gyroRange), 2);
+  }
+  text.chr('@');
+}
+
+#endif
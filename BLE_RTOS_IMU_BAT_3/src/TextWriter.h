@@ -0,0 +1,94 @@
+#ifndef TEXT_WRITER_H
+#define TEXT_WRITER_H
+
+#include <stdint.h>
+
+// Appends text to a caller-provided buffer without touching the heap. Output is
+// truncated rather than overrun when the buffer is too small.
+class TextWriter {
+public:
+  TextWriter(char *buffer, uint16_t capacity) : buf(buffer), cap(capacity), len(0) {
+    buf[0] = '\0';
+  }
+
+  TextWriter &chr(char c) {
+    if (len + 1 < cap) {
+      buf[len++] = c;
+      buf[len] = '\0';
+    }
+    return *this;
+  }
+
+  TextWriter &str(const char *s) {
+    while (*s) {
+      chr(*s++);
+    }
+    return *this;
+  }
+
+  TextWriter &u32(uint32_t v) {
+    char digits[10];
+    uint8_t n = 0;
+    do {
+      digits[n++] = '0' + (v % 10);
+      v /= 10;
+    } while (v);
+    while (n) {
+      chr(digits[--n]);
+    }
+    return *this;
+  }
+
+  // For wide values only, a 64-bit division is a library call on the Cortex-M4
+  TextWriter &u64(uint64_t v) {
+    char digits[20];
+    uint8_t n = 0;
+    do {
+      digits[n++] = '0' + (v % 10);
+      v /= 10;
+    } while (v);
+    while (n) {
+      chr(digits[--n]);
+    }
+    return *this;
+  }
+
+  TextWriter &i32(int32_t v) {
+    if (v < 0) {
+      chr('-');
+      return u32(0U - (uint32_t)v);
+    }
+    return u32((uint32_t)v);
+  }
+
+  // Fixed-point number, value is scaled by 10^decimals
+  TextWriter &fixed(int32_t value, uint8_t decimals) {
+    uint32_t scale = 1;
+    for (uint8_t i = 0; i < decimals; i++) {
+      scale *= 10;
+    }
+    uint32_t magnitude = value < 0 ? 0U - (uint32_t)value : (uint32_t)value;
+    if (value < 0) {
+      chr('-');
+    }
+    u32(magnitude / scale);
+    if (decimals) {
+      chr('.');
+      uint32_t fraction = magnitude % scale;
+      for (uint32_t d = scale / 10; d > 0; d /= 10) {
+        chr('0' + (fraction / d) % 10);
+      }
+    }
+    return *this;
+  }
+
+  uint16_t length() const { return len; }
+  const char *c_str() const { return buf; }
+
+private:
+  char *buf;
+  uint16_t cap;
+  uint16_t len;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef TX_QUEUE_H
+#define TX_QUEUE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "FrameEncoder.h"
+
+// Frames waiting for the SoftDevice to accept them. A frame longer than one
+// notification goes out as several, and the stack may refuse any of them when
+// its TX buffers are full; the rest stays here (offset) so the byte stream is
+// never reordered or repeated. When full, the oldest frame nobody has started
+// sending is dropped to make room for fresh data.
+#define TX_QUEUE_FRAMES 4
+
+typedef struct {
+    uint16_t length;
+    uint16_t offset;  // Bytes already accepted by the stack, whole notifications
+    uint8_t data[FRAME_MAX_LEN];
+} TxFrame;
+
+class TxQueue {
+public:
+  TxQueue() : count(0) {}
+
+  // False when a queued frame had to be dropped to make room
+  bool push(const uint8_t *data, uint16_t length) {
+    bool dropped = false;
+    if (count == TX_QUEUE_FRAMES) {
+      remove(frames[0].offset == 0 ? 0 : 1);
+      dropped = true;
+    }
+    TxFrame &frame = frames[count++];
+    frame.length = length < FRAME_MAX_LEN ? length : FRAME_MAX_LEN;
+    frame.offset = 0;
+    memcpy(frame.data, data, frame.length);
+    return !dropped;
+  }
+
+  // Offer the frames in order, one notification of up to payload bytes at a
+  // time, stopping at the first one notify(data, length) refuses; that one is
+  // offered again on the next call. Counts into stats' framesSent,
+  // framesRetried, bytesAccepted and bytesRejected, a refusal counting only
+  // the bytes of the notification refused.
+  template <typename Notify, typename Stats>
+  void flush(uint16_t payload, Notify notify, Stats &stats) {
+    while (count > 0) {
+      TxFrame &frame = frames[0];
+      while (frame.offset < frame.length) {
+        uint16_t chunk = frame.length - frame.offset < payload ? frame.length - frame.offset : payload;
+        if (!notify(frame.data + frame.offset, chunk)) {
+          stats.bytesRejected += chunk;
+          stats.framesRetried++;
+          return;
+        }
+        stats.bytesAccepted += chunk;
+        frame.offset += chunk;
+      }
+      remove(0);
+      stats.framesSent++;
+    }
+  }
+
+  TxFrame &front() { return frames[0]; }
+  void pop() { remove(0); }
+  uint16_t size() const { return count; }
+
+  // Backed up, the link is the bottleneck: the sender stops flushing partial
+  // frames on their deadline and only sends full ones
+  bool congested() const { return count >= TX_QUEUE_FRAMES / 2; }
+
+private:
+  void remove(uint16_t index) {
+    for (uint16_t i = index; i + 1 < count; i++) {
+      frames[i] = frames[i + 1];
+    }
+    count--;
+  }
+
+  TxFrame frames[TX_QUEUE_FRAMES];
+  volatile uint16_t count;
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef WAKE_ON_MOTION_H
+#define WAKE_ON_MOTION_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "ImuSample.h"
+
+// LSM6DS3TR-C wake-up detector and FIFO pre-roll over any bus with the
+// LSM6DS3 library's
+//   status_t writeRegister(uint8_t offset, uint8_t data);
+//   status_t readRegister(uint8_t *out, uint8_t offset);
+// While armed the FIFO runs continuous with its depth limited to the
+// pre-roll (STOP_ON_FTH), so it holds the newest samples, and only the
+// wake-up event reaches INT1. The samples are read with readImuFifo().
+#define IMU_REG_FIFO_CTRL1   0x06
+#define IMU_REG_FIFO_CTRL2   0x07
+#define IMU_REG_FIFO_CTRL3   0x08
+#define IMU_REG_FIFO_CTRL4   0x09
+#define IMU_REG_FIFO_CTRL5   0x0A
+#define IMU_REG_INT1_CTRL    0x0D
+#define IMU_REG_WAKE_UP_SRC  0x1B
+#define IMU_REG_TAP_CFG      0x58
+#define IMU_REG_WAKE_UP_THS  0x5B
+#define IMU_REG_WAKE_UP_DUR  0x5C
+#define IMU_REG_MD1_CFG      0x5E
+
+#define MOTION_FIFO_SAMPLES  256   // Pre-roll limit, the 4 kbyte FIFO holds 341 samples and
+                                   // the rest is room for new ones while it is drained
+#define WAKE_UP_SRC_WU_IA    0x08
+
+// Samples of pre-roll at a sample period, at least one
+inline uint16_t motionPreRollSamples(uint16_t preRollMs, uint32_t periodUs)
+{
+  uint32_t samples = (uint32_t)preRollMs * 1000 / periodUs;
+  return samples < 1 ? 1 : samples > MOTION_FIFO_SAMPLES ? MOTION_FIFO_SAMPLES : (uint16_t)samples;
+}
+
+// Accel slope over the wake-up threshold, the test the LSM6DS3 applies while
+// armed: half the change between samples against threshold * FS / 64
+inline bool motionSlopeExceeds(const int16_t *previous, const int16_t *accel, uint8_t threshold)
+{
+  int32_t limit = (int32_t)threshold * 2 * (32768 / 64);
+  bool moved = false;
+  for (int i = 0; i < 3; i++) {
+    moved |= abs(accel[i] - previous[i]) > limit;
+  }
+  return moved;
+}
+
+// Keep the newest samples in the FIFO and route only the wake-up event to
+// INT1, latched until WAKE_UP_SRC is read. odrCode is the FIFO_CTRL5 ODR.
+template <typename Bus>
+void armImuWakeUp(Bus &bus, uint8_t odrCode, uint16_t preRollSamples, uint8_t threshold)
+{
+  uint16_t words = preRollSamples * (IMU_BURST_LEN / 2);
+  uint8_t src;
+
+  bus.writeRegister(IMU_REG_INT1_CTRL, 0x00);
+  bus.writeRegister(IMU_REG_FIFO_CTRL5, 0x00);
+  bus.writeRegister(IMU_REG_FIFO_CTRL1, words & 0xFF);
+  bus.writeRegister(IMU_REG_FIFO_CTRL2, (words >> 8) & 0x0F);
+  bus.writeRegister(IMU_REG_FIFO_CTRL3, 0x09);
+  bus.writeRegister(IMU_REG_FIFO_CTRL4, 0x80);                  // STOP_ON_FTH
+  bus.writeRegister(IMU_REG_FIFO_CTRL5, (odrCode << 3) | 0x06);
+  bus.writeRegister(IMU_REG_WAKE_UP_THS, threshold & 0x3F);
+  bus.writeRegister(IMU_REG_WAKE_UP_DUR, 0x00);                 // One sample over the threshold
+  bus.writeRegister(IMU_REG_TAP_CFG, 0x81);                     // INTERRUPTS_ENABLE, slope filter, LIR
+  bus.readRegister(&src, IMU_REG_WAKE_UP_SRC);                  // Clear a stale event
+  bus.writeRegister(IMU_REG_MD1_CFG, 0x20);                     // INT1_WU
+}
+
+// Reads and so releases the latched wake-up event, true when there was one
+template <typename Bus>
+bool takeImuWakeUp(Bus &bus)
+{
+  uint8_t src = 0;
+  bus.readRegister(&src, IMU_REG_WAKE_UP_SRC);
+  return (src & WAKE_UP_SRC_WU_IA) != 0;
+}
+
+// Detector off and the FIFO depth limit lifted, so samples arriving while
+// the pre-roll is drained are added rather than overwriting unread ones
+template <typename Bus>
+void releaseImuWakeUp(Bus &bus)
+{
+  uint8_t src;
+  bus.writeRegister(IMU_REG_MD1_CFG, 0x00);
+  bus.writeRegister(IMU_REG_TAP_CFG, 0x00);
+  bus.readRegister(&src, IMU_REG_WAKE_UP_SRC);  // Release a latched event
+  bus.writeRegister(IMU_REG_FIFO_CTRL4, 0x00);
+}
+
+// Back to watermark acquisition without flushing the FIFO, what it holds goes
+// out with the next batch
+template <typename Bus>
+void resumeImuFifo(Bus &bus, uint16_t watermarkSamples)
+{
+  uint16_t words = watermarkSamples * (IMU_BURST_LEN / 2);
+  bus.writeRegister(IMU_REG_FIFO_CTRL1, words & 0xFF);
+  bus.writeRegister(IMU_REG_FIFO_CTRL2, (words >> 8) & 0x0F);
+  bus.writeRegister(IMU_REG_INT1_CTRL, 0x08);  // INT1_FTH
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef WALL_CLOCK_H
+#define WALL_CLOCK_H
+
+#include <stdint.h>
+
+// Wall clock kept as an offset and rate correction against the 64-bit sample
+// clock and computed on demand, so it needs no task of its own. The firmware
+// copies the model out in one critical section, so a reader never sees half
+// an update.
+//   wall = local + offset + (local - reference) * drift / 1e9
+typedef struct {
+    uint64_t refUs;     // Sample clock the offset was measured at
+    int64_t offsetUs;   // Unix time in us minus the sample clock at the reference
+    int32_t driftPpb;   // Host clock rate relative to the sample clock, minus one
+} WallClockModel;
+
+// Unix time in us at a sample clock reading
+inline uint64_t wallClockModelAt(const WallClockModel &model, uint64_t localUs)
+{
+  return localUs + model.offsetUs + ((int64_t)(localUs - model.refUs) * model.driftPpb) / 1000000000;
+}
+
+// The model set to unixSeconds at nowUs, the drift correction carries over
+inline WallClockModel wallClockModelSet(const WallClockModel &model, uint64_t nowUs, uint32_t unixSeconds)
+{
+  WallClockModel set = {nowUs, (int64_t)unixSeconds * 1000000 - (int64_t)nowUs, model.driftPpb};
+  return set;
+}
+
+// Full sample clock reading of a recent 32-bit timestamp, at most 71 minutes
+// before nowUs
+inline uint64_t widenMicros(uint64_t nowUs, uint32_t recentUs)
+{
+  return nowUs - (uint32_t)((uint32_t)nowUs - recentUs);
+}
+
+// Time of day from one wall clock reading, so the fields never tear at a rollover
+typedef struct {
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+    uint16_t millis;
+} TimeOfDay;
+
+inline TimeOfDay timeOfDayAt(uint64_t wallUs)
+{
+  uint32_t ms = (uint32_t)((wallUs / 1000) % 86400000UL);
+  TimeOfDay time = {(uint8_t)(ms / 3600000), (uint8_t)(ms / 60000 % 60), (uint8_t)(ms / 1000 % 60), (uint16_t)(ms % 1000)};
+  return time;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+// Minimal assertions for the host tests. A failed check is reported and
+// counted, the test carries on, and testResult() is the process exit code.
+#include <stdio.h>
+#include <math.h>
+
+static int testFailures = 0;
+
+#define CHECK(cond)                                                             \
+  do {                                                                          \
+    if (!(cond)) {                                                              \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);  \
+      testFailures++;                                                           \
+    }                                                                           \
+  } while (0)
+
+#define CHECK_NEAR(actual, expected, tolerance)                                 \
+  do {                                                                          \
+    double a_ = (actual), e_ = (expected);                                      \
+    if (!(fabs(a_ - e_) <= (tolerance))) {                                      \
+      fprintf(stderr, "%s:%d: %s = %g, expected %g +- %g\n", __FILE__, __LINE__, \
+              #actual, a_, e_, (double)(tolerance));                            \
+      testFailures++;                                                           \
+    }                                                                           \
+  } while (0)
+
+static inline int testResult(const char *name)
+{
+  printf("%s: %s\n", name, testFailures ? "FAILED" : "passed");
+  return testFailures ? 1 : 0;
+}
+
+#endif
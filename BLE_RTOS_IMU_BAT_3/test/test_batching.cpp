@@ -0,0 +1,261 @@
+// Notification batching across ATT MTUs 23 to 247: samples at the ODR are
+// packed by FrameEncoder into frames sized to one notification payload, sent
+// when full or when the oldest sample reaches the latency bound, and offered
+// through TxQueue to a model of the SoftDevice. The link model sends the
+// queued notifications in connection events, as many as fit the interval on
+// the 1M PHY. Reports throughput and per-sample latency. TxQueue's counts
+// of a stalled frame are checked on their own.
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include "TestCheck.h"
+#include "FrameEncoder.h"
+#include "TxQueue.h"
+
+#define BATCH_LATENCY_MS 100   // maxBatchLatencyMs
+#define HVN_QUEUE        3     // SoftDevice notification buffers with BANDWIDTH_MAX
+#define INTERVAL_US      15000 // A typical central's connection interval
+#define SIM_SECONDS      10
+
+// Indices of the first and last sample in a frame
+struct SampleRange {
+  int32_t first;
+  int32_t last;
+};
+
+// One notification handed to the SoftDevice, with the samples of the frame it
+// ends, if any
+struct Notification {
+  uint16_t bytes;
+  SampleRange samples;  // first > last when it ends no frame
+};
+
+class SimLink {
+public:
+  SimLink(uint16_t mtu) : dataLength(mtu > 23 ? 251 : 27), payloadBytes(0) {}
+
+  bool notify(uint16_t bytes, SampleRange samples) {
+    if (buffers.size() == HVN_QUEUE) {
+      return false;
+    }
+    buffers.push_back(Notification{bytes, samples});
+    return true;
+  }
+
+  // One connection event at time t: notifications go out while the event
+  // has time for their LL packets, each completed frame's samples arrive
+  template <typename Delivered>
+  void connectionEvent(double t, Delivered delivered) {
+    const double ifsUs = 150;
+    double packetUs = (dataLength + 14) * 8 + ifsUs + 10 * 8 + ifsUs;
+    double used = 0;
+    while (!buffers.empty()) {
+      // ATT and L2CAP headers, fragmented into LL packets
+      uint32_t packets = (buffers.front().bytes + 3 + 4 + dataLength - 1) / dataLength;
+      if (used + packets * packetUs > INTERVAL_US) {
+        break;
+      }
+      used += packets * packetUs;
+      payloadBytes += buffers.front().bytes;
+      delivered(buffers.front().samples, t + used);
+      buffers.pop_front();
+    }
+  }
+
+  uint16_t dataLength;
+  uint64_t payloadBytes;
+  std::deque<Notification> buffers;
+};
+
+// The TxStats fields TxQueue::flush() counts into
+struct FlushStats {
+  uint32_t framesSent;
+  uint32_t framesRetried;
+  uint32_t bytesAccepted;
+  uint32_t bytesRejected;
+};
+
+struct Result {
+  double samplesPerSec;
+  double bytesPerSec;
+  double meanLatencyMs;
+  double maxLatencyMs;
+  uint32_t framesDropped;
+  double bytesPerNotification;
+};
+
+static uint16_t payload(uint16_t mtu)
+{
+  return mtu - 3;  // ATT notification header
+}
+
+static Result simulate(uint16_t mtu, uint16_t odr)
+{
+  const uint16_t payload = ::payload(mtu);
+  const double period = 1e6 / odr;
+  SimLink link(mtu);
+  FrameEncoder encoder(1);
+  TxQueue queue;
+  // Samples of each queued frame, in queue order
+  std::deque<SampleRange> queued;
+  std::vector<double> sampleTime;
+  SampleRange frame = {0, -1};
+  uint32_t framesDropped = 0, notifications = 0;
+  double sumLatency = 0, maxLatency = 0;
+  uint32_t delivered = 0;
+  FlushStats stats = {0, 0, 0, 0};
+
+  auto flush = [&]() {
+    queue.flush(payload, [&](const uint8_t *data, uint16_t length) {
+      TxFrame &front = queue.front();
+      bool last = data + length == front.data + front.length;
+      if (!link.notify(length, last ? queued.front() : SampleRange{0, -1})) {
+        return false;
+      }
+      notifications++;
+      if (last) {
+        queued.pop_front();
+      }
+      return true;
+    }, stats);
+  };
+  auto send = [&]() {
+    encoder.finish();
+    // TxQueue drops the oldest frame not yet started
+    bool started = queue.size() > 0 && queue.front().offset != 0;
+    if (!queue.push(encoder.data(), encoder.size())) {
+      framesDropped++;
+      queued.erase(started ? queued.begin() + 1 : queued.begin());
+    }
+    queued.push_back(frame);
+    encoder.clear();
+    flush();
+  };
+
+  double nextEvent = INTERVAL_US / 2;
+  int32_t n = 0;
+  int16_t values[6] = {0};
+  for (double t = 0; t < SIM_SECONDS * 1e6; ) {
+    double nextSample = n * period;
+    // ble_uart_task sleeps until the frame's deadline, unless backed up
+    double deadline = 1e18;
+    if (!encoder.empty() && !queue.congested()) {
+      deadline = encoder.firstTimestamp() + BATCH_LATENCY_MS * 1000.0;
+    }
+    if (deadline <= nextEvent && deadline <= nextSample) {
+      t = deadline;
+      send();
+    } else if (nextEvent <= nextSample) {
+      t = nextEvent;
+      link.connectionEvent(t, [&](SampleRange samples, double at) {
+        for (int32_t i = samples.first; i <= samples.last; i++) {
+          double latency = (at - sampleTime[i]) / 1000;
+          sumLatency += latency;
+          maxLatency = latency > maxLatency ? latency : maxLatency;
+          delivered++;
+        }
+      });
+      flush();  // TX-complete
+      nextEvent += INTERVAL_US;
+    } else {
+      t = nextSample;
+      sampleTime.push_back(t);
+      if (encoder.empty()) {
+        encoder.begin(0, payload);
+        frame.first = n;
+      }
+      if (!encoder.add((uint32_t)t, values)) {
+        send();
+        encoder.begin(0, payload);
+        encoder.add((uint32_t)t, values);
+        frame.first = n;
+      }
+      frame.last = n;
+      if (!encoder.hasRoom()) {
+        send();
+      }
+      n++;
+    }
+  }
+  Result r;
+  r.samplesPerSec = delivered / (double)SIM_SECONDS;
+  r.bytesPerSec = link.payloadBytes / (double)SIM_SECONDS;
+  r.meanLatencyMs = delivered ? sumLatency / delivered : 0;
+  r.maxLatencyMs = maxLatency;
+  r.framesDropped = framesDropped;
+  r.bytesPerNotification = notifications ? link.payloadBytes / (double)notifications : 0;
+  return r;
+}
+
+// A frame the stack keeps refusing counts each refused notification once,
+// not the rest of the frame on every retry
+static void stalledFrame()
+{
+  TxQueue queue;
+  FlushStats stats = {0, 0, 0, 0};
+  uint8_t data[FRAME_MAX_LEN];
+  memset(data, 0x5A, sizeof(data));
+  queue.push(data, 100);
+  queue.push(data, 30);
+  // The second 20-byte notification of the first frame is refused 5 times
+  uint32_t accepted = 0;
+  int refusals = 0;
+  auto link = [&](const uint8_t *, uint16_t length) {
+    if (accepted == 20 && refusals < 5) {
+      refusals++;
+      return false;
+    }
+    accepted += length;
+    return true;
+  };
+  for (int retry = 0; retry < 6; retry++) {
+    queue.flush(20, link, stats);
+  }
+  CHECK(queue.size() == 0);
+  CHECK(stats.framesSent == 2 && stats.framesRetried == 5);
+  CHECK(stats.bytesAccepted == 130);
+  CHECK(stats.bytesRejected == 5 * 20);
+
+  // A refused short last notification counts its own length
+  FlushStats tail = {0, 0, 0, 0};
+  queue.push(data, 45);
+  queue.flush(20, [](const uint8_t *, uint16_t length) { return length == 20; }, tail);
+  CHECK(queue.size() == 1 && tail.framesRetried == 1);
+  CHECK(tail.bytesAccepted == 40 && tail.bytesRejected == 5);
+}
+
+int main()
+{
+  stalledFrame();
+  const uint16_t mtus[] = {23, 27, 65, 104, 185, 247};
+  const uint16_t odrs[] = {52, 104, 416, 833};
+  printf(" MTU   ODR  samples/s  bytes/s  bytes/notif  latency mean/max ms  frames dropped\n");
+  for (uint16_t mtu : mtus) {
+    for (uint16_t odr : odrs) {
+      Result r = simulate(mtu, odr);
+      printf("%4u  %4u  %9.0f  %7.0f  %11.1f  %8.1f / %6.1f  %u\n", mtu, odr, r.samplesPerSec, r.bytesPerSec,
+             r.bytesPerNotification, r.meanLatencyMs, r.maxLatencyMs, r.framesDropped);
+      // Notifications the stream needs against what the SoftDevice queue
+      // passes, one queue's worth per connection event
+      uint16_t perFrame = (payload(mtu) - FRAME_HEADER_LEN) / FRAME_SAMPLE_LEN;
+      double needed = perFrame > 0 ? (double)odr / perFrame : odr * 2.0;
+      bool fits = needed < HVN_QUEUE * 1e6 / INTERVAL_US * 0.95;
+      if (fits) {
+        // Everything arrives, within the latency bound, the wait for the
+        // next connection event and that event
+        CHECK(r.framesDropped == 0);
+        CHECK(r.samplesPerSec > odr * 0.98);
+        CHECK(r.maxLatencyMs < BATCH_LATENCY_MS + 2 * INTERVAL_US / 1000.0);
+      } else {
+        // More than the link carries: whole frames are dropped at the queue,
+        // what does arrive is no older than the queue is deep
+        CHECK(r.framesDropped > 0);
+        CHECK(r.maxLatencyMs < (TX_QUEUE_FRAMES + HVN_QUEUE + 1) * INTERVAL_US / 1000.0);
+      }
+      if (mtu == 247 && odr >= 416) {
+        CHECK(r.bytesPerNotification > 200);
+      }
+    }
+  }
+  return testResult("test_batching");
+}
@@ -0,0 +1,174 @@
+// BatteryEstimator and the reported level on synthetic VBAT traces: a cell
+// discharging under a steady load, with radio events pulling the reading
+// down while they run. Conversions timed like TaskBattery, into the gap after
+// a radio event, against conversions at whatever moment the period ends.
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include "TestCheck.h"
+#include "BatteryEstimator.h"
+#include "BatterySoc.h"
+
+#define RINT_MOHM        250
+#define STEADY_LOAD_UA   1400     // MCU, regulators and IMU between radio events
+#define ADC_MV_PER_LSB   (3600.0 / 4096 * 3.004008)  // 12-bit SAADC behind the VBAT divider
+#define CONVERSION_US    700      // 16x oversampled conversion
+#define RADIO_GAP_US     2000     // BATTERY_RADIO_GAP_US
+#define RADIO_TRIES      4        // BATTERY_RADIO_TRIES
+
+// Radio events of eventUs every intervalUs, each pulling the reading down by
+// sagMv: TX current through the cell and supply noise into the SAADC
+struct RadioTrace {
+  const char *name;
+  uint32_t intervalUs;
+  uint32_t eventUs;
+  double sagMv;
+};
+
+static const RadioTrace traces[] = {
+  {"streaming at 7.5 ms", 7500, 1250, 40},
+  {"streaming at 50 ms", 50000, 3000, 40},
+  {"advertising", 152500, 3500, 30},
+  {"idle advertising", 1022500, 3500, 30},
+};
+
+// Open circuit voltage falling 40 mV an hour, across a few percent
+static double openCircuitMv(double tUs)
+{
+  return 3950.0 - 40.0 * tUs / 3600e6;
+}
+
+static bool radioActive(const RadioTrace &radio, double tUs)
+{
+  return fmod(tUs, radio.intervalUs) < radio.eventUs;
+}
+
+// One conversion starting at tUs: the oversampled average over its duration,
+// quantised by the ADC, with a little noise
+static uint32_t convert(const RadioTrace &radio, double tUs)
+{
+  double sum = 0;
+  for (int i = 0; i < 16; i++) {
+    double t = tUs + i * CONVERSION_US / 16.0;
+    double mv = openCircuitMv(t) - STEADY_LOAD_UA * RINT_MOHM / 1e6;
+    if (radioActive(radio, t)) {
+      mv -= radio.sagMv;
+    }
+    sum += mv + (rand() % 2001 - 1000) / 1000.0 * 3.0;
+  }
+  return (uint32_t)(lround(sum / 16 / ADC_MV_PER_LSB) * ADC_MV_PER_LSB);
+}
+
+// When TaskBattery converts after asking at tUs: at the end of the next
+// radio event plus a scheduling delay, waiting for another event when the
+// delay ran past the gap
+static double gatedStart(const RadioTrace &radio, double tUs)
+{
+  double eventEnd = floor(tUs / radio.intervalUs) * radio.intervalUs + radio.eventUs;
+  for (int tries = 0; tries < RADIO_TRIES; tries++) {
+    if (eventEnd < tUs) {
+      eventEnd += radio.intervalUs;
+    }
+    double delay = rand() % 3000;  // Higher priority tasks running first
+    if (delay < RADIO_GAP_US) {
+      return eventEnd + delay;
+    }
+    tUs = eventEnd + delay;
+  }
+  return tUs;
+}
+
+struct Result {
+  double maxErrorMv;   // Filtered estimate against open circuit, once settled
+  uint32_t reversals;  // Reported level rising while the cell only discharges
+  uint32_t changes;
+  uint32_t steps;      // Whole percent steps the open circuit voltage crossed
+};
+
+static Result run(const RadioTrace &radio, bool gated)
+{
+  BatteryEstimator estimator(RINT_MOHM);
+  Result result = {0, 0, 0, 0};
+  uint16_t firstTenths = 0;
+  int level = 0;
+  double tUs = 0;
+  for (int n = 0; n < 3600; n++) {
+    tUs += 1e6 + rand() % 1000;  // batteryPeriodMs plus tick granularity
+    double start = gated ? gatedStart(radio, tUs) : tUs;
+    uint32_t mv = estimator.update(convert(radio, start), STEADY_LOAD_UA);
+    int next = batteryLevel(batterySocTenths(mv), level);
+    if (n == 40) {
+      firstTenths = batterySocTenths((uint32_t)openCircuitMv(start));
+    }
+    if (n >= 40) {
+      double error = fabs(mv - openCircuitMv(start));
+      result.maxErrorMv = error > result.maxErrorMv ? error : result.maxErrorMv;
+      result.reversals += next > level;
+      result.changes += next != level;
+    }
+    level = next;
+    tUs = start;
+  }
+  result.steps = (firstTenths - batterySocTenths((uint32_t)openCircuitMv(tUs)) + 9) / 10;
+  return result;
+}
+
+static void traceComparison()
+{
+  for (const RadioTrace &radio : traces) {
+    srand(1);
+    Result gated = run(radio, true);
+    srand(1);
+    Result ungated = run(radio, false);
+    printf("%-20s %u percent steps; gated: error %.1f mV, %u level changes, %u reversals; "
+           "ungated: error %.1f mV, %u changes, %u reversals\n",
+           radio.name, gated.steps, gated.maxErrorMv, gated.changes, gated.reversals,
+           ungated.maxErrorMv, ungated.changes, ungated.reversals);
+    // Integer mV and the ADC step bound what the filter can do
+    CHECK(gated.maxErrorMv < 3.0);
+    CHECK(gated.reversals == 0);
+    CHECK(gated.changes <= gated.steps + 1);
+  }
+  // At the shortest interval ungated conversions catch every sixth event
+  srand(1);
+  Result ungated = run(traces[0], false);
+  CHECK(ungated.maxErrorMv > 5.0 && ungated.reversals > 0);
+}
+
+// Steady load correction and the filter step response
+static void estimator()
+{
+  BatteryEstimator estimator(RINT_MOHM);
+  CHECK(!estimator.valid());
+  // 20 mA through 250 mOhm is 5 mV
+  CHECK(estimator.update(3800, 20000) == 3805);
+  CHECK(estimator.valid());
+  // A 100 mV step settles to within 1 mV in about ln(100) * 8 measurements
+  uint32_t steps = 0;
+  while (estimator.update(3900, 20000) < 3904 && steps < 100) {
+    steps++;
+  }
+  CHECK(steps > 25 && steps < 45);
+  estimator.reset();
+  CHECK(estimator.update(3700, 0) == 3700);
+}
+
+// The level holds on a step boundary and follows real changes
+static void hysteresis()
+{
+  CHECK(batteryLevel(854, 0) == 85);
+  CHECK(batteryLevel(855, 85) == 85);
+  CHECK(batteryLevel(857, 85) == 85);
+  CHECK(batteryLevel(858, 85) == 86);
+  CHECK(batteryLevel(843, 85) == 85);
+  CHECK(batteryLevel(842, 85) == 84);
+  CHECK(batteryLevel(500, 85) == 50);
+}
+
+int main()
+{
+  estimator();
+  hysteresis();
+  traceComparison();
+  return testResult("test_battery");
+}
@@ -0,0 +1,175 @@
+// The VBAT measurement path on a model of the divider and SAADC: the old
+// single 10-bit conversions averaged over the last eight, re-summed on every
+// read, against one 12-bit 16x oversampled conversion a second into
+// BatteryEstimator's IIR. Compares noise, bias and step response, and what
+// the divider draws being switched on for good.
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include "TestCheck.h"
+#include "BatteryEstimator.h"
+
+#define ADC_NOISE_LSB12   1.5    // SAADC input noise, RMS in 12-bit LSBs
+#define SUPPLY_RIPPLE_MV  4.0    // Cell voltage ripple from the load, RMS
+#define LEGACY_AVERAGE    8      // batterySampleNum
+#define DIVIDER_OHM       1499000.0  // 1M + 499k from the cell to ground
+
+static double gaussian()
+{
+  double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+// One conversion of the cell voltage at the given resolution, averaging
+// oversample samples the way the SAADC does before rounding the result
+static uint32_t convert(double cellMv, uint8_t bits, uint8_t oversample)
+{
+  const double lsb12 = 3600.0 / 4096;
+  double sum = 0;
+  for (uint8_t i = 0; i < oversample; i++) {
+    double pinMv = (cellMv + gaussian() * SUPPLY_RIPPLE_MV) / VBAT_DIVIDER_COMP;
+    sum += pinMv / lsb12 + gaussian() * ADC_NOISE_LSB12;
+  }
+  double raw = sum / oversample / (1 << (12 - bits));
+  raw = raw < 0 ? 0 : raw;
+  return (uint32_t)lround(raw);
+}
+
+// TaskSampleBattery and TaskDisplayBattery: the last eight raw values summed
+// over again and divided, truncating, on every display
+class LegacyAverage {
+public:
+  LegacyAverage() : index(0) {
+    for (int i = 0; i < LEGACY_AVERAGE; i++) {
+      values[i] = 0;
+    }
+  }
+  void sample(uint32_t raw) {
+    values[index] = raw;
+    index = (index + 1) % LEGACY_AVERAGE;
+  }
+  uint32_t millivolts() const {
+    int sum = 0;
+    for (int i = 0; i < LEGACY_AVERAGE; i++) {
+      sum += values[i];
+    }
+    return vbatMillivolts(sum / LEGACY_AVERAGE, 10);
+  }
+
+private:
+  uint32_t values[LEGACY_AVERAGE];
+  int index;
+};
+
+struct Stats {
+  double biasMv;
+  double rmsMv;
+};
+
+// Steady cell voltage, after the filters have settled
+static Stats steady(double cellMv, bool legacy)
+{
+  LegacyAverage average;
+  BatteryEstimator estimator(0);
+  double sum = 0, sumSquares = 0;
+  const int warmup = 50, measurements = 2000;
+  for (int n = 0; n < warmup + measurements; n++) {
+    double mv;
+    if (legacy) {
+      average.sample(convert(cellMv, 10, 1));
+      mv = average.millivolts();
+    } else {
+      mv = estimator.update(vbatMillivolts(convert(cellMv, BATTERY_ADC_BITS, BATTERY_OVERSAMPLE)), 0);
+    }
+    if (n >= warmup) {
+      sum += mv - cellMv;
+      sumSquares += (mv - cellMv) * (mv - cellMv);
+    }
+  }
+  Stats stats;
+  stats.biasMv = sum / measurements;
+  stats.rmsMv = sqrt(sumSquares / measurements - stats.biasMv * stats.biasMv);
+  return stats;
+}
+
+static void noise()
+{
+  srand(12);
+  double worstLegacyBias = 0, worstBias = 0, legacyRms = 0, rms = 0;
+  const int voltages = 12;
+  for (int i = 0; i < voltages; i++) {
+    double cellMv = 3300 + i * 73.3;
+    Stats legacy = steady(cellMv, true);
+    Stats filtered = steady(cellMv, false);
+    worstLegacyBias = fabs(legacy.biasMv) > worstLegacyBias ? fabs(legacy.biasMv) : worstLegacyBias;
+    worstBias = fabs(filtered.biasMv) > worstBias ? fabs(filtered.biasMv) : worstBias;
+    legacyRms += legacy.rmsMv / voltages;
+    rms += filtered.rmsMv / voltages;
+  }
+  printf("10-bit, average of 8: bias up to %.1f mV, noise %.2f mV RMS; "
+         "12-bit 16x and IIR: bias up to %.1f mV, noise %.2f mV RMS\n",
+         worstLegacyBias, legacyRms, worstBias, rms);
+  // Truncating the average of whole 10.5 mV steps reads low
+  CHECK(worstLegacyBias > 4);
+  CHECK(worstBias < 3);
+  CHECK(rms < 1.5);
+  CHECK(rms < legacyRms);
+}
+
+// Measurements until a 50 mV step, the charger coming off, is 90% through
+static void stepResponse()
+{
+  srand(13);
+  BatteryEstimator estimator(0);
+  LegacyAverage average;
+  for (int n = 0; n < 100; n++) {
+    estimator.update(vbatMillivolts(convert(4000, BATTERY_ADC_BITS, BATTERY_OVERSAMPLE)), 0);
+    average.sample(convert(4000, 10, 1));
+  }
+  int filteredSteps = -1, legacySteps = -1;
+  for (int n = 1; n <= 100 && (filteredSteps < 0 || legacySteps < 0); n++) {
+    uint32_t mv = estimator.update(vbatMillivolts(convert(3950, BATTERY_ADC_BITS, BATTERY_OVERSAMPLE)), 0);
+    average.sample(convert(3950, 10, 1));
+    if (filteredSteps < 0 && mv <= 3955) {
+      filteredSteps = n;
+    }
+    if (legacySteps < 0 && average.millivolts() <= 3955) {
+      legacySteps = n;
+    }
+  }
+  printf("50 mV step, 90%% after: average of 8 %d conversions, IIR %d measurements\n", legacySteps, filteredSteps);
+  // ln(10) * 8 for the IIR, the average needs its whole window
+  CHECK(filteredSteps >= 14 && filteredSteps <= 24);
+  CHECK(legacySteps > 0 && legacySteps <= LEGACY_AVERAGE);
+}
+
+// VBAT_ENABLE stays low, the divider is never gated. Its continuous draw
+// across the cell's range, through the low leg at the pin voltage the
+// firmware's ratio gives, against what gating it around one conversion a
+// second would leave. A known VBAT comes back through vbatMillivolts().
+static void dividerDuty()
+{
+  const double conversionUs = BATTERY_OVERSAMPLE * (40 + 2);  // 40 us acquisition, 2 us conversion
+  const double periodUs = 1e6;
+  const double lowLegOhm = 499000;
+  double fullUa = 4200 * VBAT_DIVIDER / lowLegOhm * 1000;
+  double emptyUa = 3000 * VBAT_DIVIDER / lowLegOhm * 1000;
+  double gatedUa = fullUa * conversionUs / periodUs;
+  printf("Divider on for good: %.2f to %.2f uA; gated around each conversion: %.4f uA (duty %.3f%%)\n",
+         emptyUa, fullUa, gatedUa, conversionUs / periodUs * 100);
+  // The ratio the firmware uses is the board's 1M + 499k
+  CHECK_NEAR(fullUa, 4200 / DIVIDER_OHM * 1000, 0.001);
+  CHECK_NEAR(VBAT_DIVIDER * VBAT_DIVIDER_COMP, 1.0, 1e-5);
+  // 4.2 V at the pin's 12-bit code reads back to within an LSB, 2.6 mV at the cell
+  uint32_t raw = (uint32_t)lround(4200 * VBAT_DIVIDER / (3600.0 / 4096));
+  CHECK_NEAR(vbatMillivolts(raw), 4200, 3600.0 / 4096 * VBAT_DIVIDER_COMP);
+  CHECK_NEAR(vbatMillivolts(raw >> 2, 10), 4200, 4 * 3600.0 / 4096 * VBAT_DIVIDER_COMP);
+}
+
+int main()
+{
+  noise();
+  stepResponse();
+  dividerDuty();
+  return testResult("test_battery_adc");
+}
@@ -0,0 +1,127 @@
+// The compile-time state of charge table against the 1%/10 mV reference table
+// getBatteryPercentage used to scan: within its 10 mV steps at every mV, never
+// falling as the voltage rises, exact on the curve's points, and what each
+// lookup costs.
+#include <stdint.h>
+#include <stdlib.h>
+#include <chrono>
+#include "TestCheck.h"
+#include "BatterySoc.h"
+
+// Built at compile time, nothing computed at startup
+static_assert(socTable.tenths[0] == 0 && socTable.tenths[socTableLen - 1] == 1000, "table spans the curve");
+
+// The reference table and linear scan this replaced
+typedef struct {
+    float voltage;
+    int percentage;
+} BatteryState;
+
+static const BatteryState battery_states[] = {
+    {4.16, 100}, {4.15, 99}, {4.14, 98}, {4.13, 97}, {4.12, 96}, {4.11, 95}, {4.10, 94}, {4.09, 92},
+    {4.08, 91}, {4.07, 90}, {4.06, 89}, {4.05, 88}, {4.04, 87}, {4.03, 86}, {4.02, 85}, {4.01, 84},
+    {4.00, 83}, {3.99, 82}, {3.98, 81}, {3.97, 80}, {3.96, 79}, {3.95, 78}, {3.94, 77}, {3.93, 76},
+    {3.92, 75}, {3.91, 74}, {3.9, 73}, {3.89, 72}, {3.88, 71}, {3.87, 70}, {3.86, 69}, {3.85, 68},
+    {3.84, 67}, {3.83, 66}, {3.82, 65}, {3.81, 64}, {3.8, 63}, {3.79, 62}, {3.78, 61}, {3.77, 60},
+    {3.76, 59}, {3.75, 58}, {3.74, 57}, {3.73, 56}, {3.72, 55}, {3.71, 54}, {3.7, 53}, {3.69, 52},
+    {3.68, 51}, {3.67, 50}, {3.66, 49}, {3.65, 48}, {3.64, 47}, {3.63, 46}, {3.62, 45}, {3.61, 44},
+    {3.6, 43}, {3.59, 42}, {3.58, 41}, {3.57, 40}, {3.56, 39}, {3.55, 38}, {3.54, 37}, {3.53, 36},
+    {3.52, 35}, {3.51, 34}, {3.5, 33}, {3.49, 32}, {3.48, 31}, {3.47, 30}, {3.46, 29}, {3.45, 28},
+    {3.44, 27}, {3.43, 26}, {3.42, 25}, {3.41, 24}, {3.4, 23}, {3.39, 22}, {3.38, 21}, {3.37, 20},
+    {3.36, 19}, {3.35, 18}, {3.34, 17}, {3.33, 16}, {3.32, 15}, {3.31, 14}, {3.3, 13}, {3.29, 12},
+    {3.28, 11}, {3.27, 10}, {3.26, 9}, {3.25, 8}, {3.24, 7}, {3.23, 6}, {3.22, 5}, {3.21, 4},
+    {3.19, 3}, {3.17, 2}, {3.15, 1}, {0.00, 0}
+};
+
+static int getBatteryPercentage(float voltage)
+{
+  for (size_t i = 0; i < sizeof(battery_states) / sizeof(BatteryState) - 1; i++) {
+    if (voltage >= battery_states[i].voltage) {
+      return battery_states[i].percentage;
+    }
+  }
+  return 0;
+}
+
+// Every mV from flat to over full: the reference steps every 10 mV, mostly by
+// a whole percent, the interpolated value stays between the step it is on and
+// the next one up
+static void againstReference()
+{
+  double worst = 0, sum = 0;
+  uint32_t points = 0;
+  uint16_t previous = 0;
+  bool rising = true, withinStep = true;
+  for (uint32_t mv = 3000; mv <= 4300; mv++) {
+    uint16_t tenths = batterySocTenths(mv);
+    // A hair over so float rounding does not drop the reference a step
+    int reference = getBatteryPercentage(mv / 1000.0f + 1e-5f);
+    // Below 3.15 V the reference has no steps, it drops straight to 0
+    int next = getBatteryPercentage((mv + SOC_TABLE_STEP_MV) / 1000.0f + 1e-5f);
+    next = next > reference ? next : reference + 1;
+    withinStep &= tenths >= reference * 10 && tenths <= next * 10;
+    double error = fabs(tenths / 10.0 - reference);
+    worst = error > worst ? error : worst;
+    sum += error;
+    points++;
+    rising &= tenths >= previous;
+    previous = tenths;
+  }
+  printf("Against the reference table: mean %.2f%%, worst %.2f%%\n", sum / points, worst);
+  CHECK(rising);
+  CHECK(withinStep);
+  CHECK(sum / points < 0.5);
+  CHECK(batterySocTenths(0) == 0 && batterySocTenths(5000) == 1000);
+}
+
+// The table reproduces each chemistry's curve at its points and between them
+static void curves()
+{
+  const size_t lipoPoints = sizeof(lipoCurve) / sizeof(DischargePoint);
+  for (size_t i = 0; i < lipoPoints; i++) {
+    CHECK(batterySocTenths(lipoCurve[i].millivolts) == lipoCurve[i].tenths);
+  }
+  const size_t lifepo4Points = sizeof(lifepo4Curve) / sizeof(DischargePoint);
+  for (size_t i = 0; i < lifepo4Points; i++) {
+    CHECK(curveTenths(lifepo4Curve, lifepo4Points, lifepo4Curve[i].millivolts) == lifepo4Curve[i].tenths);
+  }
+  CHECK(curveTenths(lifepo4Curve, lifepo4Points, 3275) == 550);
+  CHECK(curveTenths(lifepo4Curve, lifepo4Points, 2000) == 0);
+  CHECK(curveTenths(lifepo4Curve, lifepo4Points, 3700) == 1000);
+}
+
+static void benchmark()
+{
+  srand(11);
+  const int lookups = 1000000;
+  static uint16_t input[lookups];
+  for (int n = 0; n < lookups; n++) {
+    input[n] = 3000 + rand() % 1300;
+  }
+  // volatile so neither loop is folded away
+  volatile uint32_t checksum = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int n = 0; n < lookups; n++) {
+    checksum = checksum + getBatteryPercentage(input[n] / 1000.0f);
+  }
+  double scanNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lookups;
+
+  start = std::chrono::steady_clock::now();
+  for (int n = 0; n < lookups; n++) {
+    checksum = checksum + batterySocTenths(input[n]);
+  }
+  double tableNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lookups;
+
+  printf("Linear scan: %.1f ns per lookup; table: %.1f ns (%zu entries, %zu bytes; checksum %u)\n",
+         scanNs, tableNs, socTableLen, sizeof(socTable), (uint32_t)checksum);
+  CHECK(tableNs < scanNs);
+}
+
+int main()
+{
+  againstReference();
+  curves();
+  benchmark();
+  return testResult("test_battery_soc");
+}
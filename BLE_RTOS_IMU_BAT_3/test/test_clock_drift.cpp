@@ -0,0 +1,144 @@
+// ClockSync's drift fit on synthetic crystal profiles: constant errors, a
+// slow temperature ramp and a step. A burst of sync points a minute, each
+// host minus device offset late by a host latency, over a four hour capture;
+// the corrected timestamps must stay within 1 ms of the host clock, and
+// within 2 ms when the host stops syncing for ten minutes. The step is a
+// crystal at room temperature put on skin, the 5 ppm its parabola drops.
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include "TestCheck.h"
+#include "ClockSync.h"
+
+#define CAPTURE_S      14400     // Four hours
+#define BURST_PERIOD_S 60        // bleimu102.py SYNC_PERIOD
+#define BURST_POINTS   24        // bleimu102.py SYNC_ROUNDS
+#define SETTLE_BURSTS  5         // Bursts before the drift is trusted
+#define HOLDOVER_S     600       // Host gone quiet at the end of the capture
+
+static double exponential(double mean)
+{
+  return -mean * log((rand() + 1.0) / (RAND_MAX + 2.0));
+}
+
+// Device clock error in ppm, positive runs fast, at device seconds s
+typedef double (*DriftProfile)(double s);
+static double fastCrystal(double) { return 20; }
+static double slowCrystal(double) { return -40; }
+static double warmingUp(double s) { return 15 - 20 * s / CAPTURE_S; }
+static double steppedDown(double s) { return s < CAPTURE_S / 2 ? 10 : 5; }
+
+struct Profile {
+  const char *name;
+  DriftProfile ppm;
+};
+
+static const Profile profiles[] = {
+  {"constant +20 ppm", fastCrystal},
+  {"constant -40 ppm", slowCrystal},
+  {"ramp +15 to -5 ppm", warmingUp},
+  {"step +10 to +5 ppm", steppedDown},
+};
+
+// Host minus device clock, us, at each device second: a device running fast
+// by ppm loses ppm us a second against the host
+static double trueOffset[CAPTURE_S + HOLDOVER_S + 1];
+
+static void integrate(DriftProfile ppm)
+{
+  trueOffset[0] = 1696118398000000.0;
+  for (int s = 1; s <= CAPTURE_S + HOLDOVER_S; s++) {
+    trueOffset[s] = trueOffset[s - 1] - ppm(s - 0.5);
+  }
+}
+
+static double trueOffsetAt(double s)
+{
+  int i = (int)s;
+  return trueOffset[i] + (trueOffset[i + 1] - trueOffset[i]) * (s - i);
+}
+
+static double errorAt(const WallClockModel &model, double s)
+{
+  uint64_t local = (uint64_t)(s * 1e6);
+  return (double)(int64_t)(wallClockModelAt(model, local) - local) - trueOffsetAt(s);
+}
+
+struct Result {
+  double maxUs;          // Corrected, once settled
+  double uncorrectedUs;  // The burst's offset alone, drift left at 0
+  double holdoverUs;
+  double uncorrectedHoldoverUs;
+  double maxPpbError;
+};
+
+static Result run(const Profile &profile)
+{
+  integrate(profile.ppm);
+  ClockSync sync;
+  WallClockModel model = {0, 0, 0};
+  Result result = {0, 0, 0, 0, 0};
+  for (int burst = 0; burst * BURST_PERIOD_S < CAPTURE_S; burst++) {
+    double start = burst * BURST_PERIOD_S + 1.0;
+    for (int i = 0; i < BURST_POINTS; i++) {
+      double s = start + i * 0.05;
+      SyncPoint point = {(uint64_t)(s * 1e6), (int64_t)llround(trueOffsetAt(s) + 300 + exponential(2000)), 0};
+      model = sync.add(point, model.driftPpb);
+    }
+    if (burst < SETTLE_BURSTS) {
+      continue;
+    }
+    WallClockModel offsetOnly = {model.refUs, model.offsetUs, 0};
+    double truePpb = -profile.ppm(start) * 1000;
+    double ppbError = fabs(model.driftPpb - truePpb);
+    result.maxPpbError = ppbError > result.maxPpbError ? ppbError : result.maxPpbError;
+    for (double s = start + 2; s < start + BURST_PERIOD_S && s < CAPTURE_S; s += 0.5) {
+      double e = fabs(errorAt(model, s));
+      result.maxUs = e > result.maxUs ? e : result.maxUs;
+      e = fabs(errorAt(offsetOnly, s));
+      result.uncorrectedUs = e > result.uncorrectedUs ? e : result.uncorrectedUs;
+    }
+  }
+  WallClockModel offsetOnly = {model.refUs, model.offsetUs, 0};
+  for (double s = CAPTURE_S; s < CAPTURE_S + HOLDOVER_S; s += 0.5) {
+    double e = fabs(errorAt(model, s));
+    result.holdoverUs = e > result.holdoverUs ? e : result.holdoverUs;
+    e = fabs(errorAt(offsetOnly, s));
+    result.uncorrectedHoldoverUs = e > result.uncorrectedHoldoverUs ? e : result.uncorrectedHoldoverUs;
+  }
+  return result;
+}
+
+// No fit from bursts less than a minute apart, nor one beyond 200 ppm
+static void limits()
+{
+  ClockSync sync;
+  SyncPoint a = {1000000, 5000, 0};
+  SyncPoint b = {40000000, 4000, 0};
+  WallClockModel model = sync.add(a, 7);
+  model = sync.add(b, model.driftPpb);
+  CHECK(model.driftPpb == 7 && model.offsetUs == 4000 && model.refUs == 40000000);
+  // 300 ppm off the first
+  SyncPoint c = {100000000, 5000 - 29700, 0};
+  model = sync.add(c, model.driftPpb);
+  CHECK(model.driftPpb == 7);
+  int32_t drift;
+  int64_t offset;
+  CHECK(!sync.fitDrift(&drift, &offset));
+}
+
+int main()
+{
+  limits();
+  srand(16);
+  for (const Profile &profile : profiles) {
+    Result r = run(profile);
+    printf("%-20s  corrected %3.0f us max (offset only %4.0f us), %4.0f ppb off; "
+           "%d min without sync %3.0f us (offset only %5.0f us)\n",
+           profile.name, r.maxUs, r.uncorrectedUs, r.maxPpbError, HOLDOVER_S / 60, r.holdoverUs,
+           r.uncorrectedHoldoverUs);
+    CHECK(r.maxUs < 1000);
+    CHECK(r.holdoverUs < 2000);
+  }
+  return testResult("test_clock_drift");
+}
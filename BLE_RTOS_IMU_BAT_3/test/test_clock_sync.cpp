@@ -0,0 +1,180 @@
+// Two-way time sync of two devices, left and right, to one host through a
+// model of the BLE link: the host's request waits for the device's next
+// connection event; the reply goes in the event running when it is queued if
+// that one is still open, else in the next; host stack latency is drawn from
+// a configurable distribution both ways, and lost packets are retransmitted
+// an interval later. Each device has its own offset and crystal error, and
+// runs ClockSync on a burst of exchanges a minute, as bleimu102.py sends
+// them. Once the drift is fitted over a few bursts, the two must agree on the
+// time of any instant to within 1 ms.
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include "TestCheck.h"
+#include "ClockSync.h"
+
+#define SYNC_ROUNDS    24         // bleimu102.py
+#define SYNC_PERIOD_US 60000000.0 // bleimu102.py SYNC_PERIOD
+#define SIM_MINUTES    10
+#define SETTLE_MINUTES 4          // Bursts before the drift is trusted
+#define AIR_US         300        // Packet on air and its ack, 1M PHY
+#define EVENT_MIN_US   400        // Connection event length, an empty exchange
+#define EVENT_MAX_US   3000       // up to a few full packets of streamed data
+#define HOST_START_US  1696118398000000.0
+
+static double uniform(double lo, double hi)
+{
+  return lo + (hi - lo) * rand() / (double)RAND_MAX;
+}
+
+static double exponential(double mean)
+{
+  return -mean * log((rand() + 1.0) / (RAND_MAX + 2.0));
+}
+
+// Host stack latency between the application and the controller, us: a
+// floor and a tail of scheduling and D-Bus hops
+typedef double (*Latency)();
+static double fixedLatency() { return 1000; }
+static double shortTailLatency() { return 500 + exponential(2000); }
+static double longTailLatency() { return 700 + exponential(3000); }
+
+struct LinkProfile {
+  const char *name;
+  double intervalUs;
+  Latency hostTx;
+  Latency hostRx;
+  double lossRate;  // Chance a packet misses its event and goes an interval later
+};
+
+static const LinkProfile profiles[] = {
+  {"7.5 ms, fixed 1 ms host", 7500, fixedLatency, fixedLatency, 0.0},
+  {"15 ms, 2 ms tail host", 15000, shortTailLatency, shortTailLatency, 0.05},
+  {"30 ms, 3 ms tail host", 30000, longTailLatency, longTailLatency, 0.1},
+  {"50 ms, asymmetric host", 50000, fixedLatency, longTailLatency, 0.2},
+};
+
+struct Device {
+  double phaseUs;   // First connection event, host time
+  double ppm;       // Crystal error, the device clock runs this much fast
+  double bootUs;    // Host time when its clock read 0
+  ClockSync sync;
+  WallClockModel model;
+
+  uint64_t local(double hostUs) const {
+    return (uint64_t)llround((hostUs - bootUs) * (1 + ppm * 1e-6));
+  }
+  // Connection event n starts at eventStart(n) and runs eventLength(n)
+  double eventStart(int64_t n, const LinkProfile &link) const {
+    return phaseUs + n * link.intervalUs;
+  }
+  double eventLength(int64_t n) const {
+    return EVENT_MIN_US + (EVENT_MAX_US - EVENT_MIN_US) * ((n * 2654435761u) % 1000) / 1000.0;
+  }
+  int64_t eventAt(double hostUs, const LinkProfile &link) const {
+    return (int64_t)floor((hostUs - phaseUs) / link.intervalUs);
+  }
+  // Whether an event runs at hostUs, as SWI1 records it
+  bool radioActive(double hostUs, const LinkProfile &link) const {
+    int64_t n = eventAt(hostUs, link);
+    return hostUs < eventStart(n, link) + eventLength(n);
+  }
+  // A packet queued at hostUs goes in the running event if that is still
+  // open, else the next; one lost goes an interval later
+  double send(double hostUs, const LinkProfile &link) const {
+    int64_t n = eventAt(hostUs, link);
+    double event = hostUs < eventStart(n, link) + eventLength(n) ? hostUs : eventStart(n + 1, link);
+    while (uniform(0, 1) < link.lossRate) {
+      event += link.intervalUs;
+    }
+    return event;
+  }
+  // Host to device: handed to the controller, sent at the next event,
+  // stamped by the RX callback
+  double deliver(double hostUs, const LinkProfile &link) const {
+    return send(hostUs + link.hostTx(), link) + AIR_US + uniform(50, 300);
+  }
+};
+
+// One burst of exchanges starting at host time t, returns when it ends
+static double syncBurst(Device &device, const LinkProfile &link, double t)
+{
+  for (int seq = 0; seq < SYNC_ROUNDS; seq++) {
+    uint64_t t1 = (uint64_t)t;
+    double received = device.deliver(t, link);
+    uint64_t t2 = device.local(received);
+    // ble_receive_task hands the reply to ble_uart_task, which stamps t3
+    double sent = received + uniform(300, 3000);
+    double radioStart = device.eventStart(device.eventAt(sent, link), link);
+    uint64_t t3 = syncReplyStamp(device.local(sent), device.local(radioStart), device.radioActive(sent, link),
+                                 (uint32_t)link.intervalUs);
+    double replied = device.send(sent, link) + AIR_US + link.hostRx();
+    uint64_t t4 = (uint64_t)replied;
+    // The result goes back as a command of its own
+    double resultAt = device.deliver(replied + 200, link);
+    SyncPoint point = syncPointFrom(t1, t2, t3, t4, device.local(resultAt));
+    device.model = device.sync.add(point, device.model.driftPpb);
+    t = resultAt + uniform(1000, 5000);
+  }
+  return t;
+}
+
+struct Result {
+  double maxCrossUs;
+  double rmsCrossUs;
+  double maxAbsoluteUs;
+};
+
+static Result simulate(const LinkProfile &link)
+{
+  Device left = {uniform(0, link.intervalUs), 23.0, HOST_START_US - 4e9, ClockSync(), {0, 0, 0}};
+  Device right = {uniform(0, link.intervalUs), -31.0, HOST_START_US - 9e8, ClockSync(), {0, 0, 0}};
+  Result result = {0, 0, 0};
+  double sumSquares = 0;
+  uint32_t points = 0;
+  for (int minute = 0; minute < SIM_MINUTES; minute++) {
+    double burst = HOST_START_US + minute * SYNC_PERIOD_US;
+    syncBurst(left, link, burst);
+    syncBurst(right, link, burst + 20000);
+    // Drift needs two bursts a minute apart and a few more to settle
+    if (minute < SETTLE_MINUTES) {
+      continue;
+    }
+    for (double t = burst + 1e6; t < burst + SYNC_PERIOD_US; t += 97000) {
+      double l = (double)wallClockModelAt(left.model, left.local(t)) - t;
+      double r = (double)wallClockModelAt(right.model, right.local(t)) - t;
+      double cross = fabs(l - r);
+      result.maxCrossUs = cross > result.maxCrossUs ? cross : result.maxCrossUs;
+      result.maxAbsoluteUs = fabs(l) > result.maxAbsoluteUs ? fabs(l) : result.maxAbsoluteUs;
+      result.maxAbsoluteUs = fabs(r) > result.maxAbsoluteUs ? fabs(r) : result.maxAbsoluteUs;
+      sumSquares += cross * cross;
+      points++;
+    }
+  }
+  result.rmsCrossUs = sqrt(sumSquares / points);
+  return result;
+}
+
+// The host's arithmetic matches bleimu102.py's, floor division and all
+static void hostMath()
+{
+  SyncPoint p = syncPointFrom(1000, 5000, 6000, 3000, 7000);
+  CHECK(p.offsetUs == -3500 && p.delayUs == 1000 && p.localUs == 7000);
+  p = syncPointFrom(1000, 5000, 6001, 3000, 7000);
+  CHECK(p.offsetUs == -3501 && p.delayUs == 999);
+  p = syncPointFrom(1000, 500, 600, 1050, 0);
+  CHECK(p.offsetUs == 475 && p.delayUs == 0);
+}
+
+int main()
+{
+  hostMath();
+  srand(15);
+  for (const LinkProfile &link : profiles) {
+    Result r = simulate(link);
+    printf("%-30s  left/right %4.0f us max, %4.0f us RMS; against the host %5.0f us max\n",
+           link.name, r.maxCrossUs, r.rmsCrossUs, r.maxAbsoluteUs);
+    CHECK(r.maxCrossUs < 1000);
+  }
+  return testResult("test_clock_sync");
+}
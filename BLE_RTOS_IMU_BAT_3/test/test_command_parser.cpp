@@ -0,0 +1,160 @@
+// CommandParser against frames built as bleimu102.py's encode_command builds
+// them: every command round trips whole however the writes split it, and
+// fed noise it never overruns its buffer, accepts a frame that was not sent
+// only at the rate a 16-bit CRC allows, and loses less than a frame to each
+// burst of noise.
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "TestCheck.h"
+#include "CommandParser.h"
+
+static std::vector<uint8_t> encodeCommand(uint8_t opcode, const uint8_t *payload, uint8_t len)
+{
+  std::vector<uint8_t> frame = {CMD_SOF, opcode, len};
+  for (uint8_t i = 0; i < len; i++) {
+    frame.push_back(payload[i]);
+  }
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 1; i < frame.size(); i++) {
+    crc = CommandParser::crc16(crc, frame[i]);
+  }
+  frame.push_back(crc & 0xFF);
+  frame.push_back(crc >> 8);
+  return frame;
+}
+
+// binascii.crc_hqx(b'123456789', 0xFFFF), the CRC-16/CCITT-FALSE check value
+static void crc()
+{
+  uint16_t crc = 0xFFFF;
+  for (const char *c = "123456789"; *c; c++) {
+    crc = CommandParser::crc16(crc, (uint8_t)*c);
+  }
+  CHECK(crc == 0x29B1);
+}
+
+// Commands of every length split across writes at random, each write
+// stamped with its own arrival time
+static void roundTrip()
+{
+  srand(17);
+  uint32_t frames = 0, good = 0;
+  CommandParser parser;
+  for (int n = 0; n < 20000; n++) {
+    uint8_t payload[CMD_MAX_PAYLOAD];
+    uint8_t len = rand() % (CMD_MAX_PAYLOAD + 1);
+    for (uint8_t i = 0; i < len; i++) {
+      payload[i] = rand() % 4 ? rand() : CMD_SOF;
+    }
+    uint8_t opcode = rand();
+    std::vector<uint8_t> frame = encodeCommand(opcode, payload, len);
+    size_t split = 1 + rand() % frame.size();  // The SOF is in the first write
+    uint64_t firstWriteUs = 1000 * (uint64_t)n;
+    bool done = false;
+    for (size_t i = 0; i < frame.size(); i++) {
+      done = parser.feed(frame[i], i < split ? firstWriteUs : firstWriteUs + 7500);
+      CHECK(!done || i == frame.size() - 1);
+    }
+    frames++;
+    good += done && parser.opcode() == opcode && parser.length() == len &&
+            memcmp(parser.payload(), payload, len) == 0 && parser.arrivalUs() == firstWriteUs;
+  }
+  CHECK(good == frames);
+  CHECK(parser.errorCount() == 0);
+}
+
+// A length beyond the buffer or a bad CRC is counted and dropped, and the
+// next frame gets through
+static void rejects()
+{
+  CommandParser parser;
+  uint8_t payload[4] = {1, 2, 3, 4};
+  std::vector<uint8_t> stream = {CMD_SOF, 0x01, CMD_MAX_PAYLOAD + 1};
+  std::vector<uint8_t> bad = encodeCommand(0x01, payload, 4);
+  bad[4] ^= 0x10;
+  stream.insert(stream.end(), bad.begin(), bad.end());
+  std::vector<uint8_t> good = encodeCommand(0x03, payload, 0);
+  stream.insert(stream.end(), good.begin(), good.end());
+  uint32_t accepted = 0;
+  for (uint8_t byte : stream) {
+    accepted += parser.feed(byte, 0);
+  }
+  CHECK(accepted == 1 && parser.opcode() == 0x03 && parser.length() == 0);
+  CHECK(parser.errorCount() == 2);
+}
+
+// Bursts of noise between runs of good frames, as a host that lost part of a
+// write or a peer writing something else would leave
+static void fuzz()
+{
+  srand(170);
+  CommandParser parser;
+  std::vector<uint8_t> stream;
+  std::vector<size_t> frameEnds;  // Index of the last byte of each good frame
+  uint32_t bursts = 0, noiseBytes = 0;
+  while (stream.size() < 20000000) {
+    size_t noise = rand() % 64;
+    for (size_t i = 0; i < noise; i++) {
+      stream.push_back(rand() % 8 ? rand() : CMD_SOF);
+    }
+    bursts++;
+    noiseBytes += noise;
+    for (int f = 0; f < 4; f++) {
+      uint8_t payload[CMD_MAX_PAYLOAD];
+      uint8_t len = rand() % 14;
+      for (uint8_t i = 0; i < len; i++) {
+        payload[i] = rand();
+      }
+      std::vector<uint8_t> frame = encodeCommand(rand() % 10, payload, len);
+      stream.insert(stream.end(), frame.begin(), frame.end());
+      frameEnds.push_back(stream.size() - 1);
+    }
+  }
+  uint32_t received = 0, spurious = 0, overruns = 0;
+  uint32_t lostInRow = 0, maxLostInRow = 0;
+  size_t next = 0;
+  for (size_t i = 0; i < stream.size(); i++) {
+    bool done = parser.feed(stream[i], i);
+    overruns += parser.length() > CMD_MAX_PAYLOAD;
+    while (next < frameEnds.size() && frameEnds[next] < i) {
+      next++;
+      lostInRow++;
+      maxLostInRow = lostInRow > maxLostInRow ? lostInRow : maxLostInRow;
+    }
+    if (done) {
+      if (next < frameEnds.size() && frameEnds[next] == i) {
+        received++;
+        lostInRow = 0;
+        next++;
+      } else {
+        spurious++;
+      }
+    }
+  }
+  uint32_t lost = frameEnds.size() - received;
+  double lostPerBurst = (double)lost / bursts;
+  double spuriousPerMByte = spurious / (noiseBytes / 1e6);
+  printf("%u noise bursts, %u frames: %u lost (%.2f a burst, at most %u in a row), "
+         "%u spurious (%.1f per MB of noise)\n",
+         bursts, (unsigned)frameEnds.size(), lost, lostPerBurst, maxLostInRow, spurious, spuriousPerMByte);
+  CHECK(overruns == 0);
+  // Noise leaves the parser inside a frame of up to CMD_MAX_PAYLOAD, which
+  // runs on over the next good frames until its CRC fails, and may hunt for
+  // the next SOF in their payloads; it always gets back in step
+  CHECK(lostPerBurst < 1.0);
+  CHECK(maxLostInRow < 16);
+  // A noise SOF starts a frame one time in eight, and its CRC matches one
+  // time in 65536
+  CHECK(spuriousPerMByte < 1e6 / 8 / 65536 * 4);
+}
+
+int main()
+{
+  crc();
+  roundTrip();
+  rejects();
+  fuzz();
+  return testResult("test_command_parser");
+}
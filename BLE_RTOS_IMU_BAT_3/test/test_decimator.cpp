@@ -0,0 +1,141 @@
+// Decimator frequency response measured through push(): tones swept across
+// the band at each factor, the output amplitude against the input's. Also the
+// group delay stamped on the output, and what push() costs per sample.
+#include <stdint.h>
+#include <chrono>
+#include "TestCheck.h"
+#include "Decimator.h"
+
+static const double pi = 3.14159265358979;
+
+// Gain in dB of a tone at freq cycles per input sample, on every channel
+static double toneGain(Decimator &decimator, uint8_t factor, double freq)
+{
+  const double amplitude = 16000;
+  decimator.configure(factor);
+  uint32_t settle = 2 * DECIMATION_MAX_TAPS;
+  uint32_t total = settle + 4096 * factor;
+  double sumIn = 0, sumOut[6] = {0};
+  uint32_t outputs = 0;
+  for (uint32_t n = 0; n < total; n++) {
+    ImuSample in, out;
+    int16_t value = (int16_t)lrint(amplitude * sin(2 * pi * freq * n + 0.3));
+    in.timestamp = n * 1000;
+    in.temperature = 0;
+    for (int c = 0; c < 3; c++) {
+      in.accel[c] = value;
+      in.gyro[c] = value;
+    }
+    if (n >= settle) {
+      sumIn += (double)value * value;
+    }
+    if (decimator.push(in, out) && n >= settle) {
+      for (int c = 0; c < 3; c++) {
+        sumOut[c] += (double)out.accel[c] * out.accel[c];
+        sumOut[c + 3] += (double)out.gyro[c] * out.gyro[c];
+      }
+      outputs++;
+    }
+  }
+  for (int c = 1; c < 6; c++) {
+    CHECK(sumOut[c] == sumOut[0]);
+  }
+  double rmsIn = sqrt(sumIn / (total - settle));
+  double rmsOut = sqrt(sumOut[0] / outputs);
+  return 20 * log10((rmsOut + 1e-9) / rmsIn);
+}
+
+// Passband flat, -6 dB at the cutoff, and everything above half the output
+// rate, which would alias, rejected by DECIMATION_STOPBAND_DB
+static void response()
+{
+  static Decimator decimator;
+  for (uint8_t factor = 2; factor <= DECIMATION_MAX_FACTOR; factor *= 2) {
+    double outRate = 1.0 / factor;  // Output rate in cycles per input sample
+    double passband = 0;
+    for (double f = 0.02; f <= 0.2; f += 0.02) {
+      double gain = toneGain(decimator, factor, f * outRate);
+      passband = gain < passband ? gain : passband;
+    }
+    double cutoff = toneGain(decimator, factor, DECIMATION_CUTOFF * outRate);
+    double stopband = -200, worst = 0;
+    for (double f = 0.5 * outRate; f < 0.5; f += 0.002) {
+      double gain = toneGain(decimator, factor, f);
+      if (gain > stopband) {
+        stopband = gain;
+        worst = f;
+      }
+    }
+    printf("factor %u: passband to 0.2 of the output rate %.2f dB, cutoff %.1f dB, stopband %.1f dB (at %.3f of the input rate)\n",
+           factor, passband, cutoff, stopband, worst);
+    CHECK(passband > -0.5);
+    CHECK_NEAR(cutoff, -6.0, 0.5);
+    CHECK(stopband <= -DECIMATION_STOPBAND_DB);
+  }
+}
+
+// Exact DC gain, factor 1 passes samples through, and outputs are stamped
+// with the centre of the window
+static void passThroughAndDelay()
+{
+  static Decimator decimator;
+  decimator.configure(1);
+  ImuSample in = {1234, {1, -2, 3}, {-4, 5, -32768}, 99}, out = {0, {0, 0, 0}, {0, 0, 0}, 0};
+  CHECK(decimator.push(in, out));
+  CHECK(out.timestamp == 1234 && out.accel[1] == -2 && out.gyro[2] == -32768 && out.temperature == 99);
+
+  for (uint8_t factor = 2; factor <= DECIMATION_MAX_FACTOR; factor *= 2) {
+    decimator.configure(factor);
+    uint32_t outputs = 0;
+    for (uint32_t n = 0; n < 2000; n++) {
+      ImuSample sample = {n * 1000, {32767, -32768, 1000}, {-1, 0, 12345}, 0};
+      if (!decimator.push(sample, out)) {
+        continue;
+      }
+      outputs++;
+      CHECK(out.accel[0] == 32767 && out.accel[1] == -32768 && out.accel[2] == 1000);
+      CHECK(out.gyro[0] == -1 && out.gyro[1] == 0 && out.gyro[2] == 12345);
+      // Newest sample n, the window spans taps samples before it
+      uint32_t taps = factor * DECIMATION_TAPS_PER_FACTOR;
+      CHECK(out.timestamp * 2 == (2 * n - (taps - 1)) * 1000);
+    }
+    CHECK(outputs + DECIMATION_TAPS_PER_FACTOR + 1 > 2000u / factor);
+  }
+}
+
+// Host time per input sample. On the M4 each output costs taps / 2 SMLAD per
+// channel, printed alongside.
+static void benchmark()
+{
+  static Decimator decimator;
+  for (uint8_t factor = 2; factor <= DECIMATION_MAX_FACTOR; factor *= 2) {
+    decimator.configure(factor);
+    const uint32_t total = 400000;
+    ImuSample in = {0, {0, 0, 0}, {0, 0, 0}, 0}, out;
+    uint32_t outputs = 0;
+    int32_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t n = 0; n < total; n++) {
+      in.timestamp = n * 1000;
+      in.accel[0] = (int16_t)(n * 7);
+      in.gyro[2] = (int16_t)(n * 13);
+      if (decimator.push(in, out)) {
+        outputs++;
+        checksum += out.accel[0] + out.gyro[2];
+      }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / total;
+    uint32_t macs = 6 * factor * DECIMATION_TAPS_PER_FACTOR / 2;
+    printf("factor %u: %.1f ns per input sample on the host, %u dual MACs per output (%u per input sample) on the M4, checksum %d\n",
+           factor, ns, macs, macs / factor, checksum);
+    CHECK(outputs > 0);
+  }
+}
+
+int main()
+{
+  response();
+  passThroughAndDelay();
+  benchmark();
+  return testResult("test_decimator");
+}
@@ -0,0 +1,422 @@
+// FlashLog on a simulated NOR flash: frames come back in order after resets,
+// erases are spread evenly over the sectors, power cut at any point while a
+// segment is written loses at most that segment, and replay reads little
+// more than it hands out.
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "TestCheck.h"
+#include "FlashLog.h"
+
+// Erased bytes read 0xFF and programming can only clear bits. With a power
+// budget set, every byte erased or programmed spends one unit and the flash
+// goes dead when it runs out, leaving the operation half done. An erase
+// clears a sector from its end, so a cut one keeps its header.
+class SimFlash {
+public:
+  explicit SimFlash(uint32_t sectorCount)
+    : mem(sectorCount * LOG_SEGMENT_BYTES, 0xFF), erases(sectorCount, 0), budget(-1), bytesRead(0) {}
+
+  uint32_t sectors() { return erases.size(); }
+
+  bool eraseSector(uint32_t sector) {
+    if (sector >= sectors()) {
+      return false;
+    }
+    erases[sector]++;
+    for (int32_t i = LOG_SEGMENT_BYTES - 1; i >= 0; i--) {
+      if (!spend()) {
+        return false;
+      }
+      mem[sector * LOG_SEGMENT_BYTES + i] = 0xFF;
+    }
+    return true;
+  }
+
+  bool program(uint32_t address, const uint8_t *data, uint32_t length) {
+    if (address + length > mem.size()) {
+      return false;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+      if (!spend()) {
+        return false;
+      }
+      mem[address + i] &= data[i];
+    }
+    return true;
+  }
+
+  bool read(uint32_t address, uint8_t *data, uint32_t length) {
+    if (budget == 0 || address + length > mem.size()) {
+      return false;
+    }
+    memcpy(data, &mem[address], length);
+    bytesRead += length;
+    return true;
+  }
+
+  void cutPowerAfter(int64_t bytes) { budget = bytes; }
+  void restorePower() { budget = -1; }
+
+  std::vector<uint8_t> mem;
+  std::vector<uint32_t> erases;
+  int64_t budget;
+  uint64_t bytesRead;
+
+private:
+  bool spend() {
+    if (budget < 0) {
+      return true;
+    }
+    if (budget == 0) {
+      return false;
+    }
+    budget--;
+    return true;
+  }
+};
+
+typedef FlashLog<SimFlash> Log;
+
+// Frames of varying length whose bytes all follow from their number
+static uint8_t makeFrame(uint32_t n, uint8_t *frame)
+{
+  uint8_t length = 10 + n % 235;
+  memcpy(frame, &n, 4);
+  for (uint8_t i = 4; i < length; i++) {
+    frame[i] = (uint8_t)(n * 31 + i);
+  }
+  return length;
+}
+
+static bool frameIntact(const uint8_t *frame, uint8_t length, uint32_t &n)
+{
+  memcpy(&n, frame, 4);
+  uint8_t expected[255];
+  return makeFrame(n, expected) == length && memcmp(frame, expected, length) == 0;
+}
+
+// What a replay handed out
+struct Replayed {
+  std::vector<uint32_t> frames;
+  std::vector<uint32_t> sequences;
+  std::vector<uint64_t> starts;
+  uint32_t corrupt;
+};
+
+static Replayed replayAll(Log &log)
+{
+  Replayed out;
+  out.corrupt = 0;
+  bool complete = log.replay(
+    [&](uint32_t sequence, uint64_t startUs) -> bool {
+      out.sequences.push_back(sequence);
+      out.starts.push_back(startUs);
+      return true;
+    },
+    [&](const uint8_t *frame, uint8_t length) -> bool {
+      uint32_t n;
+      out.corrupt += !frameIntact(frame, length, n);
+      out.frames.push_back(n);
+      return true;
+    });
+  CHECK(complete);
+  return out;
+}
+
+// Log frames first to first + count, 20 ms apart from wallUs, writing each
+// segment as soon as it is sealed like the flash task does
+static void logFrames(Log &log, uint32_t first, uint32_t count, uint64_t &wallUs)
+{
+  uint8_t frame[255];
+  for (uint32_t n = first; n < first + count; n++) {
+    uint8_t length = makeFrame(n, frame);
+    CHECK(log.append(frame, length, wallUs));
+    log.writePending();
+    wallUs += 20000;
+  }
+}
+
+static void flush(Log &log)
+{
+  log.writePending();
+  log.seal();
+  log.writePending();
+}
+
+static bool consecutive(const std::vector<uint32_t> &frames, uint32_t first, uint32_t last)
+{
+  if (frames.empty() || frames.front() != first || frames.back() != last) {
+    return false;
+  }
+  for (size_t i = 1; i < frames.size(); i++) {
+    if (frames[i] != frames[i - 1] + 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void crc()
+{
+  CHECK(Log::crc32(0, (const uint8_t *)"123456789", 9) == 0xCBF43926u);
+  CHECK(Log::crc32(Log::crc32(0, (const uint8_t *)"1234", 4), (const uint8_t *)"56789", 5) == 0xCBF43926u);
+}
+
+// One erase per segment, not per frame, and everything survives a reset
+static void roundTrip()
+{
+  SimFlash flash(64);
+  Log log(flash);
+  log.begin();
+  uint64_t wallUs = 1700000000000000ull;
+  logFrames(log, 0, 500, wallUs);
+  flush(log);
+
+  Replayed out = replayAll(log);
+  CHECK(out.corrupt == 0);
+  CHECK(consecutive(out.frames, 0, 499));
+  uint32_t erases = 0;
+  for (uint32_t e : flash.erases) {
+    erases += e;
+  }
+  CHECK(erases == out.sequences.size());
+  CHECK(out.starts.front() == 1700000000000000ull);
+  printf("roundTrip: 500 frames in %u segments\n", (unsigned)out.sequences.size());
+
+  // The next boot carries on behind the newest segment
+  Log rebooted(flash);
+  rebooted.begin();
+  logFrames(rebooted, 500, 300, wallUs);
+  flush(rebooted);
+  out = replayAll(rebooted);
+  CHECK(out.corrupt == 0);
+  CHECK(consecutive(out.frames, 0, 799));
+  for (size_t i = 1; i < out.sequences.size(); i++) {
+    CHECK(out.sequences[i] == out.sequences[i - 1] + 1);
+    CHECK(out.starts[i] > out.starts[i - 1]);
+  }
+}
+
+// Long recording wraps the ring many times: erases stay even and the log
+// holds the newest frames
+static void wear()
+{
+  const uint32_t sectors = 32;
+  SimFlash flash(sectors);
+  Log log(flash);
+  log.begin();
+  uint64_t wallUs = 0;
+  const uint32_t total = 60000;
+  logFrames(log, 0, total, wallUs);
+  flush(log);
+
+  uint32_t low = UINT32_MAX, high = 0;
+  for (uint32_t e : flash.erases) {
+    low = e < low ? e : low;
+    high = e > high ? e : high;
+  }
+  CHECK(high - low <= 1);
+  Replayed out = replayAll(log);
+  CHECK(out.corrupt == 0);
+  CHECK(out.sequences.size() == sectors);
+  CHECK(consecutive(out.frames, out.frames.front(), total - 1));
+
+  // 52 Hz packed into full frames on the 2 Mbyte QSPI flash
+  double bytesPerDay = 52.0 * 86400 * 6 * (1 + 1.0 / 36);  // FRAME_PACKED_EST, plus header and length byte per frame
+  double erasesPerDay = bytesPerDay / LOG_RECORD_BYTES / 512;
+  printf("wear: erases per sector %u-%u; 52 Hz packed on 2 Mbyte is %.1f erases per sector per day, "
+         "%.0f days to 10k cycles\n", low, high, erasesPerDay, 10000 / erasesPerDay);
+  CHECK(10000 / erasesPerDay > 365);
+}
+
+// Cut power at points all through writing a segment, into a sector that held an
+// older one. After the reset the log has lost at most that one segment and
+// goes on writing.
+static void powerLoss()
+{
+  const uint32_t sectors = 4;
+  uint32_t cuts = 0, kept = 0;
+  for (int64_t budget = 0; budget < LOG_SEGMENT_BYTES + LOG_SEGMENT_BYTES; budget += 37) {
+    SimFlash flash(sectors);
+    Log log(flash);
+    log.begin();
+    uint64_t wallUs = 0;
+    uint32_t n = 0;
+    // Fill the ring, then seal one more segment and cut its write short
+    while (flash.erases[0] == 0 || flash.erases[sectors - 1] == 0) {
+      logFrames(log, n++, 1, wallUs);
+    }
+    logFrames(log, n, 40, wallUs);
+    n += 40;
+    Replayed before = replayAll(log);
+    log.seal();
+    flash.cutPowerAfter(budget);
+    bool written = log.writePending();
+    flash.restorePower();
+    cuts += !written;
+
+    Log rebooted(flash);
+    rebooted.begin();
+    Replayed out = replayAll(rebooted);
+    CHECK(out.corrupt == 0);
+    CHECK(consecutive(out.frames, out.frames.front(), written ? n - 1 : before.frames.back()));
+    // Only the sector being written lost its segment
+    CHECK(out.sequences.size() >= before.sequences.size() - 1);
+    kept += out.frames.back() == n - 1;
+
+    logFrames(rebooted, n, 40, wallUs);
+    flush(rebooted);
+    out = replayAll(rebooted);
+    CHECK(out.corrupt == 0);
+    CHECK(out.frames.back() == n + 39);
+    for (size_t i = 1; i < out.frames.size(); i++) {
+      CHECK(out.frames[i] > out.frames[i - 1]);
+    }
+  }
+  printf("powerLoss: %u cut writes recovered, %u writes completed\n", cuts, kept);
+  CHECK(cuts > 100);
+}
+
+// Erasing hides every older segment, also after a reset, and keeps the
+// frames still in RAM
+static void eraseMarker()
+{
+  SimFlash flash(16);
+  Log log(flash);
+  log.begin();
+  uint64_t wallUs = 0;
+  logFrames(log, 0, 200, wallUs);
+  flush(log);
+  logFrames(log, 200, 5, wallUs);
+  CHECK(log.erase());
+  CHECK(replayAll(log).frames.empty());
+  flush(log);
+  CHECK(consecutive(replayAll(log).frames, 200, 204));
+
+  Log rebooted(flash);
+  rebooted.begin();
+  CHECK(consecutive(replayAll(rebooted).frames, 200, 204));
+
+  // discard() drops RAM as well
+  logFrames(rebooted, 205, 5, wallUs);
+  rebooted.discard();
+  CHECK(rebooted.erase());
+  flush(rebooted);
+  CHECK(replayAll(rebooted).frames.empty());
+}
+
+// A writer that falls behind costs frames, never a blocked producer
+static void backpressure()
+{
+  SimFlash flash(16);
+  Log log(flash);
+  log.begin();
+  uint8_t frame[255];
+  uint32_t accepted = 0;
+  for (uint32_t n = 0; n < 300; n++) {
+    uint8_t length = makeFrame(n, frame);
+    accepted += log.append(frame, length, n);
+  }
+  CHECK(accepted > 2 * LOG_RECORD_BYTES / 255 && accepted < 300);
+  CHECK(log.hasPending());
+  CHECK(log.pendingFrames() > 0);
+  CHECK(log.writePending());
+  uint8_t length = makeFrame(300, frame);
+  CHECK(log.append(frame, length, 300));
+}
+
+// Segments are closed before their frames' 32-bit timestamps could wrap
+// against the start time
+static void span()
+{
+  SimFlash flash(16);
+  Log log(flash);
+  log.begin();
+  uint64_t wallUs = 5000000000ull;
+  uint8_t frame[255];
+  std::vector<uint64_t> stamps;
+  for (uint32_t n = 0; n < 20; n++) {
+    CHECK(log.append(frame, makeFrame(n, frame), wallUs));
+    stamps.push_back(wallUs);
+    log.writePending();
+    wallUs += 11 * 60 * 1000000ull;
+  }
+  flush(log);
+  Replayed out = replayAll(log);
+  CHECK(out.frames.size() == 20);
+  size_t frame0 = 0;
+  for (size_t s = 0; s < out.starts.size(); s++) {
+    CHECK(out.starts[s] == stamps[frame0]);
+    frame0 += 3;  // 0, 11 and 22 min fit in 30 min
+  }
+  CHECK(out.starts.size() == 7);
+}
+
+// A full 2 Mbyte log through the offload path, packed into notifications
+static void offload()
+{
+  SimFlash flash(512);
+  Log log(flash);
+  log.begin();
+  uint64_t wallUs = 0;
+  uint32_t total = 0;
+  while (flash.erases[511] == 0) {
+    logFrames(log, total++, 1, wallUs);
+  }
+  flush(log);
+  CHECK(log.capacity() == 512 * LOG_RECORD_BYTES);
+
+  flash.bytesRead = 0;
+  uint8_t chunk[244];
+  uint16_t used = 0;
+  uint32_t notifications = 0, frames = 0;
+  uint64_t payloadBytes = 0;
+  auto put = [&](const uint8_t *data, uint8_t length) {
+    for (uint8_t sent = 0; sent < length; ) {
+      uint16_t n = length - sent < (int)sizeof(chunk) - used ? length - sent : sizeof(chunk) - used;
+      memcpy(&chunk[used], &data[sent], n);
+      used += n;
+      sent += n;
+      if (used == sizeof(chunk)) {
+        notifications++;
+        used = 0;
+      }
+    }
+    payloadBytes += length;
+  };
+  uint8_t segmentFrame[18] = {0};
+  auto start = std::chrono::steady_clock::now();
+  bool complete = log.replay(
+    [&](uint32_t, uint64_t) -> bool {
+      put(segmentFrame, sizeof(segmentFrame));
+      return true;
+    },
+    [&](const uint8_t *frame, uint8_t length) -> bool {
+      put(frame, length);
+      frames++;
+      return true;
+    });
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  CHECK(complete);
+  CHECK(frames > 0 && frames < total);
+  double readPerByte = (double)flash.bytesRead / payloadBytes;
+  printf("offload: %u frames, %llu bytes in %u notifications, %.2f bytes read per byte sent, %.0f Mbyte/s on the host\n",
+         frames, (unsigned long long)payloadBytes, notifications, readPerByte, payloadBytes / seconds / 1e6);
+  // Headers and the CRC pass, nothing more
+  CHECK(readPerByte < 2.1);
+}
+
+int main()
+{
+  crc();
+  roundTrip();
+  wear();
+  powerLoss();
+  eraseMarker();
+  backpressure();
+  span();
+  offload();
+  return testResult("test_flash_log");
+}
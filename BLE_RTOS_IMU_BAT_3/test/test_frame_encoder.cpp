@@ -0,0 +1,196 @@
+// FrameEncoder against FrameDecoder: IMU, quaternion and gait frames round
+// trip sample for sample at every payload size, a byte stream of frames
+// splits back into frames, and malformed ones are refused. Also bytes and
+// notifications per sample against the legacy text line.
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include "TestCheck.h"
+#include "FrameEncoder.h"
+#include "FrameDecoder.h"
+#include "TextSample.h"
+
+struct Record {
+  uint32_t timestamp;
+  int16_t values[6];
+};
+
+static std::vector<Record> makeRecords(uint32_t count, uint32_t minGapUs, uint32_t maxGapUs)
+{
+  std::vector<Record> records;
+  uint32_t t = 0xFFFF0000u;  // Wraps the 32-bit timestamp along the way
+  for (uint32_t n = 0; n < count; n++) {
+    Record r;
+    t += minGapUs + rand() % (maxGapUs - minGapUs + 1);
+    r.timestamp = t;
+    for (int i = 0; i < 6; i++) {
+      r.values[i] = (int16_t)(rand() % 65536 - 32768);
+    }
+    if (n % 50 == 0) {
+      r.values[0] = INT16_MIN;
+      r.values[5] = INT16_MAX;
+    }
+    records.push_back(r);
+  }
+  return records;
+}
+
+// Encode records into frames of at most maxLen bytes, returns the frames
+static std::vector<std::vector<uint8_t>> encode(FrameEncoder &encoder, const std::vector<Record> &records,
+                                                uint8_t type, uint16_t maxLen, uint8_t flags = 0)
+{
+  std::vector<std::vector<uint8_t>> frames;
+  encoder.begin(flags, maxLen, type);
+  for (const Record &r : records) {
+    if (!encoder.add(r.timestamp, r.values)) {
+      encoder.finish();
+      frames.push_back(std::vector<uint8_t>(encoder.data(), encoder.data() + encoder.size()));
+      encoder.begin(flags, maxLen, type);
+      CHECK(encoder.add(r.timestamp, r.values));
+    }
+  }
+  encoder.finish();
+  frames.push_back(std::vector<uint8_t>(encoder.data(), encoder.data() + encoder.size()));
+  return frames;
+}
+
+static void roundTrip(uint8_t type, uint32_t minGapUs, uint32_t maxGapUs)
+{
+  const uint16_t payloads[] = {20, 64, 100, 182, 244};
+  const uint8_t fields = (FrameEncoder::recordLength(type) - 2) / 2;
+  const uint32_t resolution = type == FRAME_TYPE_GAIT ? 1u << FRAME_GAIT_SHIFT : 1;
+  for (uint16_t payload : payloads) {
+    srand(payload);
+    FrameEncoder encoder(7);
+    std::vector<Record> records = makeRecords(2000, minGapUs, maxGapUs);
+    std::vector<std::vector<uint8_t>> frames = encode(encoder, records, type, payload, FRAME_FLAG_LOGGED);
+    size_t next = 0;
+    uint16_t sequence = 0;
+    bool intact = true;
+    for (const std::vector<uint8_t> &frame : frames) {
+      FrameHeader header = FrameHeader();
+      bool ok = decodeFrame(frame.data(), frame.size(), header, [&](uint32_t timestamp, const int16_t *values, uint8_t n) {
+        const Record &r = records[next++];
+        // Coarse deltas round down and carry, so the error never builds up
+        intact &= n == fields && r.timestamp - timestamp < resolution;
+        for (uint8_t i = 0; i < n; i++) {
+          intact &= values[i] == r.values[i];
+        }
+      });
+      CHECK(ok);
+      CHECK(header.type == type && header.deviceId == 7 && header.flags == FRAME_FLAG_LOGGED);
+      CHECK(header.sequence == sequence++);
+      // The first record always goes in, even when it does not fit
+      CHECK(frame.size() <= payload || header.count == 1);
+      CHECK(frameLength(frame.data(), frame.size()) == frame.size());
+    }
+    CHECK(intact);
+    CHECK(next == records.size());
+  }
+}
+
+// A gap over the 16-bit delta closes the frame and leaves it as it was
+static void deltaLimit()
+{
+  FrameEncoder encoder;
+  int16_t values[6] = {1, 2, 3, 4, 5, 6};
+  encoder.begin(0, FRAME_MAX_LEN);
+  CHECK(encoder.add(1000, values));
+  CHECK(encoder.add(1000 + UINT16_MAX, values));
+  uint16_t size = encoder.size();
+  CHECK(!encoder.add(1000 + 2 * UINT16_MAX + 1, values));
+  CHECK(encoder.size() == size);
+  encoder.finish();
+  FrameHeader header;
+  std::vector<uint32_t> stamps;
+  CHECK(decodeFrame(encoder.data(), encoder.size(), header, [&](uint32_t t, const int16_t *, uint8_t) { stamps.push_back(t); }));
+  CHECK(stamps.size() == 2 && stamps[1] == 1000 + UINT16_MAX);
+}
+
+// Frames back to back in one byte stream, as notifications deliver them
+static void stream()
+{
+  srand(5);
+  FrameEncoder encoder(1);
+  std::vector<Record> records = makeRecords(500, 1000, 1000);
+  std::vector<uint8_t> bytes;
+  for (const std::vector<uint8_t> &frame : encode(encoder, records, FRAME_TYPE_IMU, 100)) {
+    bytes.insert(bytes.end(), frame.begin(), frame.end());
+  }
+  size_t pos = 0, samples = 0;
+  while (pos < bytes.size()) {
+    uint16_t available = bytes.size() - pos > UINT16_MAX ? UINT16_MAX : (uint16_t)(bytes.size() - pos);
+    uint16_t length = frameLength(&bytes[pos], available);
+    CHECK(length >= FRAME_HEADER_LEN && length <= available);
+    if (length < FRAME_HEADER_LEN || length > available) {
+      break;
+    }
+    FrameHeader header;
+    CHECK(decodeFrame(&bytes[pos], length, header, [&](uint32_t, const int16_t *, uint8_t) { samples++; }));
+    pos += length;
+  }
+  CHECK(samples == records.size());
+}
+
+static void malformed()
+{
+  FrameEncoder encoder;
+  int16_t values[6] = {0};
+  encoder.begin(0, FRAME_MAX_LEN);
+  encoder.add(0, values);
+  encoder.add(100, values);
+  encoder.finish();
+  std::vector<uint8_t> frame(encoder.data(), encoder.data() + encoder.size());
+  FrameHeader header;
+  auto ignore = [](uint32_t, const int16_t *, uint8_t) {};
+  CHECK(decodeFrame(frame.data(), frame.size(), header, ignore));
+  CHECK(!decodeFrame(frame.data(), frame.size() - 1, header, ignore));
+  CHECK(!decodeFrame(frame.data(), FRAME_HEADER_LEN - 1, header, ignore));
+  frame[0] = (2 << 4) | FRAME_TYPE_IMU;
+  CHECK(!decodeFrame(frame.data(), frame.size(), header, ignore));
+  CHECK(frameLength(frame.data(), frame.size()) == 0);
+}
+
+// Bytes and notifications per sample at 52 Hz for a few ATT MTUs, binary
+// frames against the text line, one line per sample
+static void bytesPerSample()
+{
+  srand(9);
+  std::vector<Record> records = makeRecords(5200, 19230, 19230);
+  double textBytes = 0;
+  for (const Record &r : records) {
+    char line[128];
+    TextWriter text(line, sizeof(line));
+    ImuSample sample = {r.timestamp, {r.values[0], r.values[1], r.values[2]}, {r.values[3], r.values[4], r.values[5]}, 300};
+    TextTime time = {15, 4, 33, r.timestamp / 1000};
+    formatTextSample(text, "IMU1", 87, time, sample, 16, 2000);
+    textBytes += text.length();
+  }
+  textBytes /= records.size();
+  const uint16_t mtus[] = {23, 185, 247};
+  for (uint16_t mtu : mtus) {
+    uint16_t payload = mtu - 3;
+    FrameEncoder encoder;
+    double bytes = 0, notifications = 0;
+    for (const std::vector<uint8_t> &frame : encode(encoder, records, FRAME_TYPE_IMU, payload)) {
+      bytes += frame.size();
+      notifications += (frame.size() + payload - 1) / payload;
+    }
+    double textNotifications = ceil(textBytes / payload);
+    printf("MTU %3u: binary %.1f bytes, %.3f notifications per sample; text %.1f bytes, %.0f notifications\n",
+           mtu, bytes / records.size(), notifications / records.size(), textBytes, textNotifications);
+    CHECK(bytes / records.size() * 3 < textBytes || mtu == 23);
+  }
+}
+
+int main()
+{
+  roundTrip(FRAME_TYPE_IMU, 1, 20000);
+  roundTrip(FRAME_TYPE_QUAT, 1000, 60000);
+  roundTrip(FRAME_TYPE_GAIT, 100000, 2000000);
+  deltaLimit();
+  stream();
+  malformed();
+  bytesPerSample();
+  return testResult("test_frame_encoder");
+}
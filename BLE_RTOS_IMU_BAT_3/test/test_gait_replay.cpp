@@ -0,0 +1,306 @@
+// GaitDetector replaying recordings in the loggers' CSV format the way
+// detectGait runs it on the sample stream, one detector per device:
+//   test_gait_replay recording.csv [gyro axis 0-2] [inv] [gyro range dps]
+// prints the events as the _gait.csv rows bleimu102.py writes. Without a
+// recording it writes a synthetic walk of the shank's sagittal angular
+// velocity with known heel strikes and toe offs, in bouts of changing cadence
+// and speed between pauses, with sensor noise, replays it and scores the
+// events against the truth.
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "TestCheck.h"
+#include "ImuSample.h"
+#include "GaitDetector.h"
+
+#define GYRO_RANGE_DPS  2000    // imuConfig default
+#define ACCEL_LSB_PER_G 2049    // 16 g, imuConfig default
+#define GAIT_AXIS       1       // Gyro Y, the sagittal axis of the synthetic shank
+#define FRAME_SAMPLES   17      // Samples to a 247 byte MTU frame, the sequence column
+#define MATCH_US        150000  // A detection further than this from the truth is a miss
+#define START_US        4284967296ull  // Ten seconds before the sample clock wraps
+
+struct GaitRow {
+  std::string device;
+  uint32_t sequence;
+  uint64_t timestamp;  // Unwrapped like the loggers write it
+  GaitRecord record;
+};
+
+static const char *eventName(int16_t event)
+{
+  return event == GAIT_HEEL_STRIKE ? "heel strike" : event == GAIT_TOE_OFF ? "toe off" : "stride";
+}
+
+// Runs each device's samples through its own detector. The detector sees
+// the 32-bit sample clock, events get the unwrapped time back.
+static bool replay(const char *path, uint8_t axis, uint16_t rangeDps, std::vector<GaitRow> &rows)
+{
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    perror(path);
+    return false;
+  }
+  std::map<std::string, GaitDetector> detectors;
+  float scale = gyroDpsPerLsb(rangeDps);
+  char line[256];
+  while (fgets(line, sizeof(line), in)) {
+    char *comma = strchr(line, ',');
+    if (!comma || strncmp(line, "Device Name,", 12) == 0) {
+      continue;
+    }
+    std::string device(line, comma - line);
+    char *end;
+    uint32_t sequence = strtoul(comma + 1, &end, 10);
+    uint64_t timestamp = strtoull(end + 1, &end, 10);
+    int16_t values[6];  // accel XYZ, gyro XYZ
+    for (int i = 0; i < 6; i++) {
+      values[i] = (int16_t)strtol(end + 1, &end, 10);
+    }
+    float dps = values[3 + (axis & 0x03)] * scale;
+    GaitRecord records[2];
+    uint8_t n = detectors[device].update((uint32_t)timestamp, axis & 0x80 ? -dps : dps, records);
+    for (uint8_t i = 0; i < n; i++) {
+      rows.push_back({device, sequence, timestamp - (uint32_t)((uint32_t)timestamp - records[i].timestamp), records[i]});
+    }
+  }
+  fclose(in);
+  return true;
+}
+
+static void printRows(const std::vector<GaitRow> &rows)
+{
+  printf("Device Name,sequence,timestamp_us,event,gyro_dps,stride_ms,stance_ms,swing_ms,swing_peak_dps\n");
+  for (const GaitRow &row : rows) {
+    const int16_t *v = row.record.values;
+    printf("%s,%u,%llu,%s,", row.device.c_str(), row.sequence, (unsigned long long)row.timestamp, eventName(v[0]));
+    if (v[0] == GAIT_STRIDE) {
+      printf(",%d,%d,%d,%.1f\n", v[1], v[2], v[3], v[4] / 10.0);
+    } else {
+      printf("%.1f,,,,\n", v[1] / 10.0);
+    }
+  }
+}
+
+static double gaussian(double sigma)
+{
+  double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static double uniform(double lo, double hi)
+{
+  return lo + (hi - lo) * rand() / RAND_MAX;
+}
+
+// A Gaussian lobe of the angular velocity, dps
+struct Lobe {
+  double centreS, widthS, dps;
+};
+
+struct Walk {
+  std::vector<Lobe> lobes;           // In time order of their centres
+  std::vector<double> heelStrikes;   // Seconds
+  std::vector<double> toeOffs;
+  struct Stride { double heelStrike, toeOff, next; };
+  std::vector<Stride> strides;       // Between heel strikes of one bout
+  double seconds;
+};
+
+// Shank angular velocity through a stride of period T from heel strike: a
+// sharp negative dip at heel strike, a slow forward roll through stance, the
+// push-off dip at toe off at 60% and the mid-swing peak at 80%. A bout starts
+// with a toe off and ends with a heel strike. Faster walking has shorter
+// strides and larger swings.
+static Walk walk(double seconds)
+{
+  Walk w;
+  double t = 3;
+  while (t < seconds - 20) {
+    double speed = uniform(0, 1);
+    double period = 1.3 - 0.35 * speed, swing = 280 + 200 * speed;
+    int strides = 5 + rand() % 30;
+    double T = period * uniform(0.95, 1.05);
+    w.lobes.push_back({t + 0.2 * T, 0.035 * T, -0.4 * swing});
+    w.toeOffs.push_back(t + 0.2 * T);
+    w.lobes.push_back({t + 0.4 * T, 0.07 * T, swing});
+    t += 0.6 * T;
+    for (int k = 0; k <= strides; k++) {
+      w.lobes.push_back({t, 0.025 * T, -0.5 * swing});
+      w.heelStrikes.push_back(t);
+      if (k == strides) {
+        break;
+      }
+      T = period * uniform(0.95, 1.05);
+      w.lobes.push_back({t + 0.3 * T, 0.1 * T, 40});
+      w.lobes.push_back({t + 0.6 * T, 0.035 * T, -0.4 * swing});
+      w.toeOffs.push_back(t + 0.6 * T);
+      w.lobes.push_back({t + 0.8 * T, 0.07 * T, swing});
+      w.strides.push_back({t, t + 0.6 * T, t + T});
+      t += T;
+    }
+    t += uniform(4, 10);  // Standing, longer than GAIT_MAX_STRIDE_US
+  }
+  w.seconds = seconds;
+  return w;
+}
+
+// Samples of a walk as the loggers write them, gyro noise and bias included
+static void record(FILE *out, const char *device, const Walk &w, uint16_t rateHz, bool inverted)
+{
+  double noise = 5, bias = uniform(-2, 2);  // dps, the noise counting strap vibration
+  float scale = gyroDpsPerLsb(GYRO_RANGE_DPS);
+  size_t first = 0;
+  uint32_t samples = (uint32_t)(w.seconds * rateHz);
+  for (uint32_t n = 0; n < samples; n++) {
+    double t = (double)n / rateHz;
+    while (first < w.lobes.size() && w.lobes[first].centreS + 0.5 < t) {
+      first++;
+    }
+    double dps = bias + gaussian(noise);
+    for (size_t i = first; i < w.lobes.size() && w.lobes[i].centreS - 0.5 < t; i++) {
+      double x = (t - w.lobes[i].centreS) / w.lobes[i].widthS;
+      dps += w.lobes[i].dps * exp(-0.5 * x * x);
+    }
+    int16_t gyro = (int16_t)lrint((inverted ? -dps : dps) / scale);
+    fprintf(out, "%s,%u,%llu,%d,%d,%d,%d,%d,%d\n", device, n / FRAME_SAMPLES,
+            (unsigned long long)(START_US + (uint64_t)llrint(t * 1e6)), (int)lrint(gaussian(40)),
+            (int)lrint(gaussian(40)), ACCEL_LSB_PER_G + (int)lrint(gaussian(40)), (int)lrint(gaussian(20)), gyro,
+            (int)lrint(gaussian(20)));
+  }
+}
+
+struct Score {
+  uint32_t truths, found, spurious;
+  double meanMs, maxMs;  // Detection minus truth
+};
+
+// Pairs each true event with the nearest detection within MATCH_US
+static Score score(const std::vector<double> &truths, const std::vector<GaitRow> &rows, const char *device,
+                   int16_t event)
+{
+  std::vector<double> detected;
+  for (const GaitRow &row : rows) {
+    if (row.device == device && row.record.values[0] == event) {
+      detected.push_back((row.timestamp - START_US) / 1e6);
+    }
+  }
+  Score s = {(uint32_t)truths.size(), 0, 0, 0, 0};
+  std::vector<bool> used(detected.size(), false);
+  double sum = 0;
+  for (double truth : truths) {
+    size_t best = detected.size();
+    for (size_t i = 0; i < detected.size(); i++) {
+      if (!used[i] && fabs(detected[i] - truth) * 1e6 <= MATCH_US &&
+          (best == detected.size() || fabs(detected[i] - truth) < fabs(detected[best] - truth))) {
+        best = i;
+      }
+    }
+    if (best < detected.size()) {
+      used[best] = true;
+      double errorMs = (detected[best] - truth) * 1000;
+      s.found++;
+      sum += errorMs;
+      s.maxMs = fabs(errorMs) > s.maxMs ? fabs(errorMs) : s.maxMs;
+    }
+  }
+  s.spurious = detected.size() - s.found;
+  s.meanMs = s.found ? sum / s.found : 0;
+  return s;
+}
+
+// Every stride between heel strikes of a bout gets its record, with stride,
+// stance and swing times near the truth
+static void strides(const Walk &w, const std::vector<GaitRow> &rows, const char *device, double *maxErrorMs,
+                    uint32_t *count)
+{
+  *count = 0;
+  *maxErrorMs = 0;
+  for (const GaitRow &row : rows) {
+    if (row.device != device || row.record.values[0] != GAIT_STRIDE) {
+      continue;
+    }
+    (*count)++;
+    double end = (row.timestamp - START_US) / 1e6;
+    for (const Walk::Stride &stride : w.strides) {
+      if (fabs(stride.next - end) * 1e6 <= MATCH_US) {
+        const int16_t *v = row.record.values;
+        double errors[3] = {v[1] - (stride.next - stride.heelStrike) * 1000,
+                            v[2] - (stride.toeOff - stride.heelStrike) * 1000, v[3] - (stride.next - stride.toeOff) * 1000};
+        for (double e : errors) {
+          *maxErrorMs = fabs(e) > *maxErrorMs ? fabs(e) : *maxErrorMs;
+        }
+      }
+    }
+  }
+}
+
+// Two feet half a stride apart would share a file; each device here walks
+// its own synthetic course
+static void synthetic(uint16_t rateHz, bool inverted)
+{
+  const char *path = "gait_replay.csv";
+  FILE *out = fopen(path, "w");
+  CHECK(out != NULL);
+  if (!out) {
+    return;
+  }
+  fprintf(out, "Device Name,sequence,timestamp_us,sensorBuffer_1,sensorBuffer_2,sensorBuffer_3,"
+               "sensorBuffer_4,sensorBuffer_5,sensorBuffer_6\n");
+  Walk left = walk(900), right = walk(900);
+  record(out, "L", left, rateHz, inverted);
+  record(out, "R", right, rateHz, inverted);
+  fclose(out);
+
+  std::vector<GaitRow> rows;
+  CHECK(replay(path, GAIT_AXIS | (inverted ? 0x80 : 0), GYRO_RANGE_DPS, rows));
+  remove(path);
+  const Walk *walks[2] = {&left, &right};
+  const char *devices[2] = {"L", "R"};
+  for (int d = 0; d < 2; d++) {
+    Score hs = score(walks[d]->heelStrikes, rows, devices[d], GAIT_HEEL_STRIKE);
+    Score to = score(walks[d]->toeOffs, rows, devices[d], GAIT_TOE_OFF);
+    double strideErrorMs;
+    uint32_t strideCount;
+    strides(*walks[d], rows, devices[d], &strideErrorMs, &strideCount);
+    printf("%4u Hz%s %s: heel strike %u/%u, %u spurious, %+5.1f ms mean, %5.1f max; "
+           "toe off %u/%u, %u spurious, %+5.1f ms mean, %5.1f max; strides %u/%u, %4.1f ms max error\n",
+           rateHz, inverted ? " inv" : "", devices[d], hs.found, hs.truths, hs.spurious, hs.meanMs, hs.maxMs,
+           to.found, to.truths, to.spurious, to.meanMs, to.maxMs, strideCount, (unsigned)walks[d]->strides.size(),
+           strideErrorMs);
+    CHECK(hs.found == hs.truths && hs.spurious == 0);
+    CHECK(to.found == to.truths && to.spurious == 0);
+    CHECK(strideCount == walks[d]->strides.size());
+    CHECK(fabs(hs.meanMs) < 40 && hs.maxMs < 80);
+    CHECK(fabs(to.meanMs) < 40 && to.maxMs < 80);
+    CHECK(strideErrorMs < 80);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1) {
+    uint8_t axis = argc > 2 ? atoi(argv[2]) & 0x03 : GAIT_AXIS;
+    int next = 3;
+    if (argc > next && strcmp(argv[next], "inv") == 0) {
+      axis |= 0x80;
+      next++;
+    }
+    uint16_t range = argc > next ? atoi(argv[next]) : GYRO_RANGE_DPS;
+    std::vector<GaitRow> rows;
+    if (!replay(argv[1], axis, range, rows)) {
+      return 1;
+    }
+    printRows(rows);
+    return 0;
+  }
+  srand(22);
+  synthetic(104, false);
+  synthetic(52, false);
+  synthetic(104, true);
+  return testResult("test_gait_replay");
+}
@@ -0,0 +1,117 @@
+// readImuBurst on a mock I2C bus: the LSM6DS3TR-C register file with address
+// auto-increment, so the burst decoder, the axis order and the transaction
+// count can be checked without the sensor.
+#include <stdint.h>
+#include <string.h>
+#include "TestCheck.h"
+#include "ImuBus.h"
+
+// Output registers of the LSM6DS3TR-C
+#define REG_OUT_TEMP_L 0x20
+#define REG_OUTX_L_G   0x22
+#define REG_OUTX_L_XL  0x28
+
+class MockImuBus {
+public:
+  MockImuBus() : transactions(0), bytes(0), fail(false) { memset(regs, 0, sizeof(regs)); }
+
+  int readRegisterRegion(uint8_t *out, uint8_t reg, uint8_t length) {
+    transactions++;
+    if (fail) {
+      return 1;  // IMU_HW_ERROR
+    }
+    for (uint8_t i = 0; i < length; i++) {
+      out[i] = regs[(uint8_t)(reg + i)];
+    }
+    bytes += length;
+    return 0;
+  }
+
+  void setWord(uint8_t reg, int16_t value) {
+    regs[reg] = (uint8_t)value;
+    regs[reg + 1] = (uint8_t)((uint16_t)value >> 8);
+  }
+
+  uint8_t regs[256];
+  uint32_t transactions;
+  uint32_t bytes;
+  bool fail;
+};
+
+// Bus time of one register read at 400 kHz: address, register, repeated
+// start, address and the data bytes, 9 clocks each, plus start and stop
+static double busMicros(uint32_t transactions, uint32_t bytes)
+{
+  return (transactions * (3 * 9 + 3) + bytes * 9) / 0.4;
+}
+
+static void axisOrder()
+{
+  MockImuBus bus;
+  const int16_t gyro[3] = {0x0102, -2, INT16_MIN};
+  const int16_t accel[3] = {INT16_MAX, -16384, 0x7F80};
+  for (int i = 0; i < 3; i++) {
+    bus.setWord(REG_OUTX_L_G + 2 * i, gyro[i]);
+    bus.setWord(REG_OUTX_L_XL + 2 * i, accel[i]);
+  }
+  bus.setWord(REG_OUT_TEMP_L, -512);  // 23 degrees C
+  ImuSample sample = {1234, {0, 0, 0}, {0, 0, 0}, 0};
+  CHECK(readImuBurst(bus, sample));
+  for (int i = 0; i < 3; i++) {
+    CHECK(sample.gyro[i] == gyro[i]);
+    CHECK(sample.accel[i] == accel[i]);
+  }
+  CHECK(sample.temperature == -512);
+  CHECK(sample.timestamp == 1234);
+  CHECK(bus.transactions == 1 && bus.bytes == IMU_TEMP_LEN + IMU_BURST_LEN);
+}
+
+// A failed transfer reports it and leaves the sample alone
+static void failure()
+{
+  MockImuBus bus;
+  bus.setWord(REG_OUTX_L_G, 100);
+  bus.fail = true;
+  ImuSample sample = {0, {7, 7, 7}, {7, 7, 7}, 7};
+  CHECK(!readImuBurst(bus, sample));
+  CHECK(sample.gyro[0] == 7 && sample.accel[2] == 7 && sample.temperature == 7);
+}
+
+// Every word of the burst lands in its own field, whatever its position
+static void everyByte()
+{
+  for (int word = 0; word < (IMU_TEMP_LEN + IMU_BURST_LEN) / 2; word++) {
+    MockImuBus bus;
+    bus.setWord(REG_OUT_TEMP_L + 2 * word, -1 - word);
+    ImuSample sample;
+    CHECK(readImuBurst(bus, sample));
+    const int16_t *fields[7] = {&sample.temperature, &sample.gyro[0], &sample.gyro[1], &sample.gyro[2],
+                                &sample.accel[0], &sample.accel[1], &sample.accel[2]};
+    for (int f = 0; f < 7; f++) {
+      CHECK(*fields[f] == (f == word ? -1 - word : 0));
+    }
+  }
+}
+
+// Against the library's readFloat* path: six 16-bit register reads and a
+// seventh for the temperature
+static void busCost()
+{
+  MockImuBus bus;
+  ImuSample sample;
+  readImuBurst(bus, sample);
+  double burst = busMicros(bus.transactions, bus.bytes);
+  double perAxis = busMicros(7, 14);
+  printf("burst: %u transaction, %.0f us at 400 kHz; per axis: 7 transactions, %.0f us\n",
+         bus.transactions, burst, perAxis);
+  CHECK(burst * 2 < perAxis);
+}
+
+int main()
+{
+  axisOrder();
+  failure();
+  everyByte();
+  busCost();
+  return testResult("test_imu_bus");
+}
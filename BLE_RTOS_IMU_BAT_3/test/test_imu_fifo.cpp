@@ -0,0 +1,216 @@
+// readImuFifo against a model of the LSM6DS3TR-C FIFO in continuous mode:
+// samples arrive at the ODR while the drain runs over a 400 kHz bus, SensorTask
+// wakes late on the watermark and the transmit ring sometimes makes it wait.
+// Every sample must come out once and in order across watermark and burst
+// boundaries, and an overrun must be reported rather than tear or reorder
+// anything.
+#include <stdint.h>
+#include <stdlib.h>
+#include <deque>
+#include <vector>
+#include "TestCheck.h"
+#include "ImuBus.h"
+
+#define FIFO_WORDS   2048  // 4 kbyte
+#define SAMPLE_WORDS (IMU_BURST_LEN / 2)
+#define SEQ_MODULO   4000  // Sample number carried in every word, fits int16 times 8
+
+class SimFifo {
+public:
+  explicit SimFifo(double periodUs)
+    : now(0), period(periodUs), nextSampleUs(periodUs), produced(0), headPattern(0), overrun(false),
+      transactions(0) {}
+
+  // Let time pass, samples land in the FIFO at the ODR
+  void advance(double us) {
+    now += us;
+    while (nextSampleUs <= now) {
+      for (int w = 0; w < SAMPLE_WORDS; w++) {
+        if (words.size() == FIFO_WORDS) {
+          words.pop_front();  // Continuous mode, the oldest word goes
+          headPattern = (headPattern + 1) % SAMPLE_WORDS;
+          overrun = true;
+        }
+        words.push_back((uint16_t)(((produced % SEQ_MODULO) * 8) + w));
+      }
+      produced++;
+      nextSampleUs += period;
+    }
+  }
+
+  int readRegisterRegion(uint8_t *out, uint8_t reg, uint8_t length) {
+    transactions++;
+    advance((3 * 9 + 3 + 9 * length) / 0.4);  // Address, register, restart, address, data
+    if (reg == IMU_REG_FIFO_STATUS1) {
+      uint16_t n = (uint16_t)words.size();
+      out[0] = n & 0xFF;
+      out[1] = ((n >> 8) & 0x0F) | (overrun ? 0x40 : 0);
+      out[2] = headPattern;
+      out[3] = 0;
+      overrun = false;
+    } else if (reg == IMU_REG_OUT_TEMP_L) {
+      out[0] = 0x00;
+      out[1] = 0xFE;
+    } else if (reg == IMU_REG_FIFO_DATA_OUT_L) {
+      for (uint8_t i = 0; i + 1 < length; i += 2) {
+        uint16_t word = 0;
+        if (!words.empty()) {
+          word = words.front();
+          words.pop_front();
+          headPattern = (headPattern + 1) % SAMPLE_WORDS;
+        }
+        out[i] = word & 0xFF;
+        out[i + 1] = word >> 8;
+      }
+    }
+    return 0;
+  }
+
+  // Bypass and back to continuous, what configureFifo() does
+  void flush() {
+    words.clear();
+    headPattern = 0;
+    overrun = false;
+  }
+
+  // Sample clock at the current time, what sampleClockMicros() returns
+  uint32_t clock() const { return (uint32_t)now; }
+  double sampleTime(uint32_t seq) const { return (seq + 1) * period; }
+
+  double now;
+  double period;
+  double nextSampleUs;
+  uint32_t produced;
+  std::deque<uint16_t> words;
+  uint8_t headPattern;
+  bool overrun;
+  uint32_t transactions;
+};
+
+struct Drained {
+  std::vector<uint32_t> seqs;  // Unwrapped sample numbers in arrival order
+  double worstStampErrorUs;
+  uint32_t torn;               // Samples whose words came from different samples
+  uint32_t overruns;
+  uint32_t drains;
+};
+
+// Run SensorTask's FIFO loop: wake on the watermark a little late, drain
+static Drained run(double periodUs, uint16_t watermark, double lateUs, uint32_t samples, double stallAtUs = -1)
+{
+  SimFifo fifo(periodUs);
+  Drained result = {std::vector<uint32_t>(), 0, 0, 0, 0};
+  uint32_t lastSeq = 0;
+  while (fifo.produced < samples) {
+    // Wait for the watermark, then for the task to get going
+    while (fifo.words.size() < (size_t)watermark * SAMPLE_WORDS) {
+      fifo.advance(periodUs / 4);
+    }
+    fifo.advance(rand() % 1000 * lateUs / 1000);
+    if (stallAtUs >= 0 && fifo.now >= stallAtUs) {
+      fifo.advance(FIFO_WORDS / SAMPLE_WORDS * periodUs * 1.5);  // Held off long enough to overflow
+      stallAtUs = -1;
+    }
+    bool overrun = false;
+    result.drains++;
+    readImuFifo(fifo, fifo.clock(), (uint32_t)periodUs, overrun, [&](const ImuSample &sample) {
+      int seq = (uint16_t)sample.gyro[0] / 8;
+      for (int i = 0; i < 3; i++) {
+        result.torn += (uint16_t)sample.gyro[i] != seq * 8 + i || (uint16_t)sample.accel[i] != seq * 8 + 3 + i;
+      }
+      // Unwrap against the previous sample, always later
+      uint32_t full = lastSeq + (uint32_t)((seq - (int)(lastSeq % SEQ_MODULO) + SEQ_MODULO) % SEQ_MODULO);
+      if (result.seqs.empty()) {
+        full = (uint32_t)seq;
+      }
+      lastSeq = full;
+      result.seqs.push_back(full);
+      double error = fabs((double)sample.timestamp - fifo.sampleTime(full));
+      result.worstStampErrorUs = error > result.worstStampErrorUs ? error : result.worstStampErrorUs;
+      if (rand() % 100 == 0) {
+        fifo.advance(2000);  // Ring full, waits for ble_uart_task
+      }
+    });
+    if (overrun) {
+      result.overruns++;
+      fifo.flush();
+    }
+  }
+  return result;
+}
+
+static void noLossNoReorder()
+{
+  const double rates[] = {416, 833, 1660};
+  const uint16_t watermarks[] = {1, 4, 7, 16, 50};
+  for (double hz : rates) {
+    for (uint16_t watermark : watermarks) {
+      srand(watermark);
+      double period = 1e6 / hz;
+      Drained drained = run(period, watermark, 3000, 20000);
+      bool inOrder = true;
+      for (size_t i = 0; i < drained.seqs.size(); i++) {
+        inOrder &= drained.seqs[i] == i;
+      }
+      if (watermark == 16) {
+        printf("%4.0f Hz, watermark %2u: %zu samples in %u drains, stamps within %.0f us\n",
+               hz, watermark, drained.seqs.size(), drained.drains, drained.worstStampErrorUs);
+      }
+      CHECK(inOrder);
+      CHECK(drained.torn == 0);
+      CHECK(drained.overruns == 0);
+      CHECK(drained.seqs.size() + 2 * watermark + 400 >= 20000);
+      // Stamped back from the drain instant, samples that land during the
+      // status read make up the rest
+      CHECK(drained.worstStampErrorUs < period + 300);
+    }
+  }
+}
+
+// Held off past the FIFO depth: the overrun is reported and the FIFO
+// flushed, and what comes after is still whole and in order
+static void overrun()
+{
+  srand(3);
+  Drained drained = run(1e6 / 833, 16, 1000, 20000, 5e6);
+  uint32_t gaps = 0;
+  bool increasing = true;
+  for (size_t i = 1; i < drained.seqs.size(); i++) {
+    increasing &= drained.seqs[i] > drained.seqs[i - 1];
+    gaps += drained.seqs[i] != drained.seqs[i - 1] + 1;
+  }
+  printf("overrun: %u reported, %u gap, %zu samples kept\n", drained.overruns, gaps, drained.seqs.size());
+  CHECK(drained.overruns == 1);
+  CHECK(gaps == 1);
+  CHECK(increasing);
+  CHECK(drained.torn == 0);
+}
+
+// An earlier read that stopped mid-sample: the drain skips to the next gyro
+// X word and loses only the sample it was in
+static void resync()
+{
+  SimFifo fifo(1e6 / 416);
+  fifo.advance(10 * fifo.period + 1);
+  uint8_t partial[4];
+  fifo.readRegisterRegion(partial, IMU_REG_FIFO_DATA_OUT_L, 4);
+  std::vector<int> seqs;
+  bool overrun;
+  uint16_t n = readImuFifo(fifo, fifo.clock(), (uint32_t)fifo.period, overrun, [&](const ImuSample &sample) {
+    seqs.push_back((uint16_t)sample.gyro[0] / 8);
+    CHECK((uint16_t)sample.accel[2] == (uint16_t)sample.gyro[0] + 5);
+  });
+  CHECK(n >= 9 && seqs.size() == n);
+  CHECK(!seqs.empty() && seqs[0] == 1);
+  for (size_t i = 1; i < seqs.size(); i++) {
+    CHECK(seqs[i] == seqs[i - 1] + 1);
+  }
+}
+
+int main()
+{
+  noLossNoReorder();
+  overrun();
+  resync();
+  return testResult("test_imu_fifo");
+}
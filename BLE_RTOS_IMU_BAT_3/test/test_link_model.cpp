@@ -0,0 +1,93 @@
+// The link optimizer's throughput model and the interval it picks for every
+// ODR, on the link it asks for and on the ones a central may settle for
+// instead: the capacity on air and through the SoftDevice's notification
+// queue, headroom over the stream at the picked interval and not at the next
+// longer one.
+#include <stdint.h>
+#include "TestCheck.h"
+#include "LinkModel.h"
+
+#define MAX_BATCH_LATENCY_MS 100  // maxBatchLatencyMs
+#define LONGEST_INTERVAL     40   // Half the batch latency budget less 20%, 50 ms
+
+static const uint16_t imuRates[] = {13, 26, 52, 104, 208, 416, 833, 1660};
+
+struct Link {
+  const char *name;
+  uint8_t phy;
+  uint16_t dataLength;
+  uint16_t mtu;
+};
+
+static const Link links[] = {
+  {"2M, DLE 251, MTU 247", LINK_PHY_2MBPS, LINK_DATA_LENGTH, LINK_MTU},
+  {"1M, DLE 251, MTU 247", 0x01, LINK_DATA_LENGTH, LINK_MTU},
+  {"1M, 27, MTU 23", 0x01, 27, 23},
+};
+
+// Notification payload at 7.5 ms. On air five 251 byte packets fit the
+// interval on 2M, 1.3 Mbit/s, and three on 1M; the SoftDevice's queue of three
+// notifications caps both at 781 kbit/s and the legacy link at 64. Beyond
+// 7.5 ms the queue is what counts, capacity falls with the interval.
+static void capacity()
+{
+  double kbps[3];
+  for (int i = 0; i < 3; i++) {
+    kbps[i] = linkCapacity(LINK_MIN_INTERVAL, links[i].phy, links[i].dataLength, links[i].mtu) * 8 / 1000.0;
+    printf("%-22s %5.0f kbit/s at 7.5 ms\n", links[i].name, kbps[i]);
+  }
+  CHECK(linkCapacity(LINK_MIN_INTERVAL, LINK_PHY_2MBPS, LINK_DATA_LENGTH, LINK_MTU) == LINK_HVN_QUEUE * 244 * 800 / 6);
+  CHECK(kbps[1] == kbps[0]);
+  CHECK(linkCapacity(LINK_MIN_INTERVAL, 0x01, 27, 23) == LINK_HVN_QUEUE * 20 * 800 / 6);
+  for (uint16_t interval = LINK_MIN_INTERVAL; interval < LONGEST_INTERVAL; interval++) {
+    CHECK(linkCapacity(interval + 1, LINK_PHY_2MBPS, LINK_DATA_LENGTH, LINK_MTU) <=
+          linkCapacity(interval, LINK_PHY_2MBPS, LINK_DATA_LENGTH, LINK_MTU));
+  }
+  // A notification over 27 byte packets takes ten of them
+  CHECK(linkCapacity(LINK_MIN_INTERVAL, 0x01, 27, LINK_MTU) == 244 * 800 / 6);
+}
+
+// The stream a full MTU frame carries: 17 samples to a 247 byte MTU, one to 23
+static void stream()
+{
+  CHECK(streamRate(100, 247) == 100 * FRAME_SAMPLE_LEN + 100 * FRAME_HEADER_LEN / 16);
+  CHECK(streamRate(100, 23) == 100 * (FRAME_SAMPLE_LEN + FRAME_HEADER_LEN));
+}
+
+static void intervals()
+{
+  for (const Link &link : links) {
+    printf("%s\n", link.name);
+    for (uint16_t rate : imuRates) {
+      uint16_t interval = pickConnectionInterval(rate, link.phy, link.dataLength, link.mtu, MAX_BATCH_LATENCY_MS);
+      uint32_t required = streamRate(rate, link.mtu);
+      uint32_t capacity = linkCapacity(interval, link.phy, link.dataLength, link.mtu);
+      bool fits = capacity >= required * LINK_HEADROOM;
+      printf("  %4u Hz  %5.2f ms  %6u B/s of %6u B/s%s\n", rate, interval * 1.25, required, capacity,
+             fits ? "" : ", short of headroom");
+      CHECK(interval >= LINK_MIN_INTERVAL && interval <= LONGEST_INTERVAL);
+      // Headroom at the pick, or the shortest interval when nothing has it
+      CHECK(fits || interval == LINK_MIN_INTERVAL);
+      // The longest that has it
+      if (fits && interval < LONGEST_INTERVAL) {
+        CHECK(linkCapacity(interval + 1, link.phy, link.dataLength, link.mtu) < required * LINK_HEADROOM);
+      }
+    }
+  }
+  // The requested link streams every ODR with headroom, at 15 ms for the
+  // fastest; the legacy one only up to 104 Hz, and not at all from 416 Hz
+  CHECK(pickConnectionInterval(416, LINK_PHY_2MBPS, LINK_DATA_LENGTH, LINK_MTU, MAX_BATCH_LATENCY_MS) == LONGEST_INTERVAL);
+  CHECK(pickConnectionInterval(833, LINK_PHY_2MBPS, LINK_DATA_LENGTH, LINK_MTU, MAX_BATCH_LATENCY_MS) == 24);
+  CHECK(pickConnectionInterval(1660, LINK_PHY_2MBPS, LINK_DATA_LENGTH, LINK_MTU, MAX_BATCH_LATENCY_MS) == 12);
+  CHECK(linkCapacity(LINK_MIN_INTERVAL, 0x01, 27, 23) >= streamRate(104, 23) * LINK_HEADROOM);
+  CHECK(linkCapacity(LINK_MIN_INTERVAL, 0x01, 27, 23) < streamRate(208, 23) * LINK_HEADROOM);
+  CHECK(linkCapacity(LINK_MIN_INTERVAL, 0x01, 27, 23) < streamRate(416, 23));
+}
+
+int main()
+{
+  capacity();
+  stream();
+  intervals();
+  return testResult("test_link_model");
+}
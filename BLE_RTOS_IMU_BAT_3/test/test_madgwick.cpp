@@ -0,0 +1,211 @@
+// MadgwickFilter against reference motion with a known orientation: the
+// true quaternion is integrated from a body rate in double precision, and
+// the IMU readings derived from it with the noise, gyro bias and linear
+// acceleration of a worn sensor. Yaw has no reference without a
+// magnetometer, so the filter is judged on tilt, the angle between the true
+// and the estimated gravity direction. Reports the cost of an update.
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include "TestCheck.h"
+#include "MadgwickFilter.h"
+
+#define FUSION_BETA   0.1f    // FUSION_BETA
+#define RATE_HZ       52      // imuConfig default
+#define SUBSTEPS      16      // Integration steps of the reference per sample
+#define DEG           (M_PI / 180)
+
+static double gaussian(double sigma)
+{
+  double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+struct Quat {
+  double w, x, y, z;
+};
+
+static Quat multiply(const Quat &a, const Quat &b)
+{
+  return {a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z,
+          a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+          a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+          a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w};
+}
+
+static Quat normalize(const Quat &q)
+{
+  double n = sqrt(q.w * q.w + q.x * q.x + q.y * q.y + q.z * q.z);
+  return {q.w / n, q.x / n, q.y / n, q.z / n};
+}
+
+// Earth up in the sensor frame of orientation q, what a still accelerometer reads
+static void gravityIn(const Quat &q, double *v)
+{
+  v[0] = 2 * (q.x * q.z - q.w * q.y);
+  v[1] = 2 * (q.w * q.x + q.y * q.z);
+  v[2] = q.w * q.w - q.x * q.x - q.y * q.y + q.z * q.z;
+}
+
+static double tiltError(const Quat &truth, const MadgwickFilter &filter)
+{
+  int16_t q14[4];
+  filter.toQ14(q14);
+  Quat estimate = normalize({q14[0] / QUAT_ONE, q14[1] / QUAT_ONE, q14[2] / QUAT_ONE, q14[3] / QUAT_ONE});
+  double a[3], b[3];
+  gravityIn(truth, a);
+  gravityIn(estimate, b);
+  double dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+  return acos(dot > 1 ? 1 : dot) / DEG;
+}
+
+// Body rate in rad/s at time t
+typedef void (*Motion)(double t, double *w);
+
+static void still(double, double *w) { w[0] = w[1] = w[2] = 0; }
+
+// Nodding and swaying, 30 degrees at 0.5 and 0.3 Hz, and turning
+static void swaying(double t, double *w)
+{
+  w[0] = 30 * DEG * 2 * M_PI * 0.5 * cos(2 * M_PI * 0.5 * t);
+  w[1] = 30 * DEG * 2 * M_PI * 0.3 * cos(2 * M_PI * 0.3 * t);
+  w[2] = 0.5;
+}
+
+// Fast limb swing, a shank while running: 60 degrees at 1.5 Hz
+static void swinging(double t, double *w)
+{
+  w[0] = 0.2 * sin(2 * M_PI * 0.7 * t);
+  w[1] = 60 * DEG * 2 * M_PI * 1.5 * cos(2 * M_PI * 1.5 * t);
+  w[2] = 0;
+}
+
+struct Sensor {
+  double gyroNoise;  // rad/s RMS
+  double gyroBias;   // rad/s on each axis
+  double accelNoise; // g RMS, linear acceleration included
+};
+
+struct Result {
+  double settleS;    // Until the tilt error stays below SETTLED_DEG
+  double rmsDeg;     // Over the second half of the run
+  double maxDeg;
+};
+
+#define SETTLED_DEG 5
+// The normalised gradient step leaves a still filter cycling around the truth
+// by beta * dt, 0.11 degrees at 52 Hz
+#define STEP_DEG    (FUSION_BETA / RATE_HZ / DEG)
+
+// Starts from `start`, the filter levelled on an upright reading
+static Result run(Motion motion, const Sensor &sensor, const Quat &start, double seconds)
+{
+  MadgwickFilter filter(FUSION_BETA);
+  filter.update(0, 0, 0, 0, 0, 1, 0);
+  Quat truth = start;
+  double dt = 1.0 / RATE_HZ;
+  uint32_t samples = (uint32_t)(seconds * RATE_HZ);
+  Result result = {0, 0, 0};
+  double sumSquares = 0;
+  for (uint32_t n = 0; n < samples; n++) {
+    double t = n * dt, w[3];
+    for (int s = 0; s < SUBSTEPS; s++) {
+      motion(t + (s + 0.5) * dt / SUBSTEPS, w);
+      Quat dq = {0, 0.5 * w[0] * dt / SUBSTEPS, 0.5 * w[1] * dt / SUBSTEPS, 0.5 * w[2] * dt / SUBSTEPS};
+      Quat step = multiply(truth, dq);
+      truth = normalize({truth.w + step.w, truth.x + step.x, truth.y + step.y, truth.z + step.z});
+    }
+    // The gyro's filtered output, the mean rate over the sample period
+    motion(t + dt / 2, w);
+    double g[3];
+    gravityIn(truth, g);
+    filter.update(w[0] + sensor.gyroBias + gaussian(sensor.gyroNoise), w[1] + sensor.gyroBias + gaussian(sensor.gyroNoise),
+                  w[2] + sensor.gyroBias + gaussian(sensor.gyroNoise), g[0] + gaussian(sensor.accelNoise),
+                  g[1] + gaussian(sensor.accelNoise), g[2] + gaussian(sensor.accelNoise), dt);
+    double error = tiltError(truth, filter);
+    if (error > SETTLED_DEG) {
+      result.settleS = t + dt;
+    }
+    if (n >= samples / 2) {
+      sumSquares += error * error;
+      result.maxDeg = error > result.maxDeg ? error : result.maxDeg;
+    }
+  }
+  result.rmsDeg = sqrt(sumSquares / (samples - samples / 2));
+  return result;
+}
+
+static Quat axisAngle(double x, double y, double z, double degrees)
+{
+  double s = sin(degrees * DEG / 2);
+  return {cos(degrees * DEG / 2), x * s, y * s, z * s};
+}
+
+static void convergence()
+{
+  srand(21);
+  Sensor clean = {0, 0, 0};
+  // Gyro noise of 0.23 dps RMS and 0.5 dps of bias on every axis, and
+  // 0.05 g of a worn sensor's linear acceleration on the accelerometer
+  Sensor worn = {0.004, 0.5 * DEG, 0.05};
+  struct {
+    const char *name;
+    Motion motion;
+    Sensor sensor;
+    Quat start;
+    double seconds;
+    double settleS, rmsDeg;  // Bounds
+  } cases[] = {
+    {"still, 60 degree tilt", still, clean, axisAngle(1, 0, 0, 60), 30, 15, 1.5 * STEP_DEG},
+    {"still, upside down", still, clean, axisAngle(0, 1, 0, 179), 60, 30, 1.5 * STEP_DEG},
+    {"still, worn sensor", still, worn, axisAngle(0.6, 0.8, 0, 45), 60, 15, 1.0},
+    {"swaying, worn sensor", swaying, worn, axisAngle(1, 0, 0, 20), 120, 20, 2.0},
+    {"swinging, worn sensor", swinging, worn, axisAngle(0, 1, 0, 10), 120, 20, 2.0},
+  };
+  for (const auto &c : cases) {
+    Result r = run(c.motion, c.sensor, c.start, c.seconds);
+    printf("%-24s settled in %5.2f s, tilt %4.2f deg RMS, %4.2f max\n", c.name, r.settleS, r.rmsDeg, r.maxDeg);
+    CHECK(r.settleS < c.settleS);
+    CHECK(r.rmsDeg < c.rmsDeg);
+  }
+}
+
+// Q14 holds a unit quaternion to within a count
+static void q14()
+{
+  MadgwickFilter filter(FUSION_BETA);
+  filter.update(0, 0, 0, 0.3f, -0.5f, 0.8f, 0);
+  int16_t q[4];
+  filter.toQ14(q);
+  double norm = sqrt((double)q[0] * q[0] + (double)q[1] * q[1] + (double)q[2] * q[2] + (double)q[3] * q[3]);
+  CHECK_NEAR(norm, QUAT_ONE, 2);
+  CHECK(filter.running());
+}
+
+static void cost()
+{
+  MadgwickFilter filter(FUSION_BETA);
+  filter.update(0, 0, 0, 0, 0, 1, 0);
+  const int updates = 2000000;
+  volatile float sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < updates; i++) {
+    float phase = (i & 1023) * 0.006f;
+    filter.update(0.1f * phase, 0.02f, -0.05f, 0.1f, 0.2f * phase, 0.97f, 1.0f / RATE_HZ);
+  }
+  int16_t q[4];
+  filter.toQ14(q);
+  sink = q[0];
+  (void)sink;
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / updates;
+  printf("%.1f ns per update on the host\n", ns);
+}
+
+int main()
+{
+  q14();
+  convergence();
+  cost();
+  return testResult("test_madgwick");
+}
@@ -0,0 +1,271 @@
+// Packed IMU frames against the plain ones: samples round trip losslessly at
+// every payload size however wild the data, a truncated or corrupt frame is
+// refused, and on sensor-like motion the compression ratio and the encoder's
+// cost per sample. A logger CSV given as
+//   test_packed_frame recording.csv
+// is benchmarked in place of the synthetic recordings.
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include "TestCheck.h"
+#include "FrameEncoder.h"
+#include "FrameDecoder.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HOST_CYCLES() __rdtsc()
+#endif
+
+#define RATE_HZ         52      // imuConfig default
+#define ACCEL_LSB_PER_G 2049    // 16 g, imuConfig default
+#define GYRO_LSB_PER_DPS 14.29  // 2000 dps, imuConfig default
+
+struct Record {
+  uint32_t timestamp;
+  int16_t values[6];  // accel XYZ, gyro XYZ
+};
+
+static std::vector<std::vector<uint8_t>> encode(const std::vector<Record> &records, uint8_t type, uint16_t maxLen)
+{
+  std::vector<std::vector<uint8_t>> frames;
+  FrameEncoder encoder(3);
+  encoder.begin(0, maxLen, type);
+  for (const Record &r : records) {
+    if (!encoder.add(r.timestamp, r.values)) {
+      encoder.finish();
+      frames.push_back(std::vector<uint8_t>(encoder.data(), encoder.data() + encoder.size()));
+      encoder.begin(0, maxLen, type);
+      CHECK(encoder.add(r.timestamp, r.values));
+    }
+  }
+  encoder.finish();
+  frames.push_back(std::vector<uint8_t>(encoder.data(), encoder.data() + encoder.size()));
+  return frames;
+}
+
+static bool decodesTo(const std::vector<std::vector<uint8_t>> &frames, const std::vector<Record> &records)
+{
+  size_t next = 0;
+  bool intact = true;
+  for (const std::vector<uint8_t> &frame : frames) {
+    FrameHeader header;
+    intact &= frameLength(frame.data(), frame.size()) == frame.size();
+    intact &= decodePackedFrame(frame.data(), frame.size(), header, [&](uint32_t timestamp, const int16_t *values, uint8_t n) {
+      if (next >= records.size()) {
+        intact = false;
+        return;
+      }
+      const Record &r = records[next++];
+      intact &= n == 6 && timestamp == r.timestamp && memcmp(values, r.values, sizeof(r.values)) == 0;
+    });
+  }
+  return intact && next == records.size();
+}
+
+static double gaussian(double sigma)
+{
+  double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static int16_t clamp16(double v)
+{
+  return (int16_t)(v < INT16_MIN ? INT16_MIN : v > INT16_MAX ? INT16_MAX : lrint(v));
+}
+
+// Worn sensor motion at the sample rate: a periodic limb swing of the given
+// cadence and size, in g and dps, on sensor noise and the sample clock's
+// jitter. Zero swing is a sensor on the desk.
+static std::vector<Record> motion(uint32_t count, uint16_t rateHz, double strideHz, double swingG, double swingDps)
+{
+  std::vector<Record> records;
+  uint32_t t = 0xFFFF0000u;  // Wraps the 32-bit timestamp along the way
+  double tilt = gaussian(0.3);
+  for (uint32_t n = 0; n < count; n++) {
+    double s = (double)n / rateHz, phase = 2 * M_PI * strideHz * s;
+    double shape = sin(phase) + 0.5 * sin(2 * phase + 1) + 0.25 * sin(3 * phase + 2);
+    Record r;
+    r.timestamp = t + (uint32_t)llrint(s * 1e6) + rand() % 31 - 15;
+    double accel[3] = {sin(tilt) + swingG * shape, 0.3 * swingG * cos(phase), cos(tilt) + 0.6 * swingG * shape * shape};
+    double gyro[3] = {0.2 * swingDps * cos(phase), swingDps * shape, 0.1 * swingDps * sin(2 * phase)};
+    for (int i = 0; i < 3; i++) {
+      r.values[i] = clamp16(accel[i] * ACCEL_LSB_PER_G + gaussian(4));       // 2 mg RMS
+      r.values[3 + i] = clamp16(gyro[i] * GYRO_LSB_PER_DPS + gaussian(1.5)); // 0.1 dps RMS
+    }
+    records.push_back(r);
+  }
+  return records;
+}
+
+// Full scale noise and gaps, every residual escapes
+static std::vector<Record> noise(uint32_t count)
+{
+  std::vector<Record> records;
+  uint32_t t = 0;
+  for (uint32_t n = 0; n < count; n++) {
+    Record r;
+    t += rand() % 65536;
+    r.timestamp = t;
+    for (int i = 0; i < 6; i++) {
+      r.values[i] = (int16_t)(rand() % 65536 - 32768);
+    }
+    if (n % 7 == 0) {
+      r.values[n % 6] = n % 2 ? INT16_MIN : INT16_MAX;
+    }
+    records.push_back(r);
+  }
+  return records;
+}
+
+static void roundTrip()
+{
+  const uint16_t payloads[] = {20, 64, 100, 182, 244};
+  srand(23);
+  std::vector<std::vector<Record>> sets = {motion(3000, RATE_HZ, 0, 0, 0), motion(3000, 1660, 1.5, 2, 600),
+                                           motion(3000, 13, 0.9, 1, 300), noise(3000)};
+  for (const std::vector<Record> &records : sets) {
+    for (uint16_t payload : payloads) {
+      std::vector<std::vector<uint8_t>> frames = encode(records, FRAME_TYPE_PACKED, payload);
+      CHECK(decodesTo(frames, records));
+      for (const std::vector<uint8_t> &frame : frames) {
+        // Only a lone first sample overruns a payload smaller than it
+        CHECK(frame.size() <= payload || (frame.size() == FRAME_PACKED_START && frame[3] == 1));
+      }
+    }
+  }
+}
+
+// A gap over the 16-bit delta closes the frame and leaves it intact
+static void deltaLimit()
+{
+  FrameEncoder encoder;
+  int16_t values[6] = {1, 2, 3, 4, 5, 6};
+  encoder.begin(0, FRAME_MAX_LEN, FRAME_TYPE_PACKED);
+  CHECK(encoder.add(1000, values));
+  CHECK(encoder.add(1000 + UINT16_MAX, values));
+  uint16_t size = encoder.size();
+  CHECK(!encoder.add(1000 + 2 * UINT16_MAX + 1, values));
+  CHECK(encoder.size() == size);
+  encoder.finish();
+  std::vector<std::vector<uint8_t>> frames = {std::vector<uint8_t>(encoder.data(), encoder.data() + encoder.size())};
+  CHECK(decodesTo(frames, {{1000, {1, 2, 3, 4, 5, 6}}, {1000 + UINT16_MAX, {1, 2, 3, 4, 5, 6}}}));
+}
+
+static void malformed()
+{
+  srand(4);
+  std::vector<Record> records = motion(200, RATE_HZ, 1, 1, 300);
+  std::vector<uint8_t> frame = encode(records, FRAME_TYPE_PACKED, FRAME_MAX_LEN)[0];
+  FrameHeader header;
+  auto ignore = [](uint32_t, const int16_t *, uint8_t) {};
+  CHECK(decodePackedFrame(frame.data(), frame.size(), header, ignore));
+  CHECK(!decodePackedFrame(frame.data(), frame.size() - 1, header, ignore));
+  CHECK(!decodeFrame(frame.data(), frame.size(), header, ignore));
+  // More samples claimed than the bits hold
+  frame[3] += 10;
+  CHECK(!decodePackedFrame(frame.data(), frame.size(), header, ignore));
+  // A stream of 1 bits runs into escapes and out of the frame
+  frame[3] -= 10;
+  memset(&frame[FRAME_PACKED_START], 0xFF, frame.size() - FRAME_PACKED_START);
+  CHECK(!decodePackedFrame(frame.data(), frame.size(), header, ignore));
+}
+
+static bool readCsv(const char *path, std::vector<Record> &records)
+{
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    perror(path);
+    return false;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), in)) {
+    char *comma = strchr(line, ',');
+    if (!comma || strncmp(line, "Device Name,", 12) == 0) {
+      continue;
+    }
+    char *end;
+    strtoul(comma + 1, &end, 10);  // Sequence
+    Record r;
+    r.timestamp = (uint32_t)strtoull(end + 1, &end, 10);
+    for (int i = 0; i < 6; i++) {
+      r.values[i] = (int16_t)strtol(end + 1, &end, 10);
+    }
+    records.push_back(r);
+  }
+  fclose(in);
+  return true;
+}
+
+// Compression at a 247 byte MTU against plain frames, and the encoder's time
+// per sample on the host, frame handling included
+static double benchmark(const char *name, const std::vector<Record> &records)
+{
+  size_t plainBytes = 0, packedBytes = 0;
+  for (const std::vector<uint8_t> &frame : encode(records, FRAME_TYPE_IMU, FRAME_MAX_LEN)) {
+    plainBytes += frame.size();
+  }
+  std::vector<std::vector<uint8_t>> packed = encode(records, FRAME_TYPE_PACKED, FRAME_MAX_LEN);
+  for (const std::vector<uint8_t> &frame : packed) {
+    packedBytes += frame.size();
+  }
+  CHECK(decodesTo(packed, records));
+
+  const int passes = 20;
+  FrameEncoder encoder;
+  uint32_t frames = 0;
+  auto start = std::chrono::steady_clock::now();
+#ifdef HOST_CYCLES
+  uint64_t startCycles = HOST_CYCLES();
+#endif
+  for (int pass = 0; pass < passes; pass++) {
+    encoder.begin(0, FRAME_MAX_LEN, FRAME_TYPE_PACKED);
+    for (const Record &r : records) {
+      if (!encoder.add(r.timestamp, r.values)) {
+        encoder.finish();
+        frames++;
+        encoder.begin(0, FRAME_MAX_LEN, FRAME_TYPE_PACKED);
+        encoder.add(r.timestamp, r.values);
+      }
+    }
+  }
+  double samples = (double)passes * records.size();
+#ifdef HOST_CYCLES
+  double cycles = (HOST_CYCLES() - startCycles) / samples;
+#endif
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / samples;
+  volatile uint32_t sink = frames + encoder.size();
+  (void)sink;
+
+  double ratio = (double)plainBytes / packedBytes;
+  printf("%-22s %6.2f bytes a sample packed, %5.2f plain, ratio %.2f; %5.1f ns", name,
+         (double)packedBytes / records.size(), (double)plainBytes / records.size(), ratio, ns);
+#ifdef HOST_CYCLES
+  printf(", %4.0f TSC cycles", cycles);
+#endif
+  printf(" a sample on the host\n");
+  return ratio;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1) {
+    std::vector<Record> records;
+    if (!readCsv(argv[1], records) || records.empty()) {
+      return 1;
+    }
+    benchmark(argv[1], records);
+    return testResult("test_packed_frame");
+  }
+  roundTrip();
+  deltaLimit();
+  malformed();
+  srand(230);
+  CHECK(benchmark("on the desk, 52 Hz", motion(20000, RATE_HZ, 0, 0, 0)) > 3);
+  CHECK(benchmark("walking, 104 Hz", motion(20000, 104, 0.9, 0.5, 250)) > 1.5);
+  CHECK(benchmark("walking, 52 Hz", motion(20000, RATE_HZ, 0.9, 0.5, 250)) > 1.3);
+  CHECK(benchmark("running, 416 Hz", motion(20000, 416, 1.4, 2, 600)) > 1.5);
+  CHECK(benchmark("full scale noise", noise(20000)) > 0.6);
+  return testResult("test_packed_frame");
+}
@@ -0,0 +1,90 @@
+// The power state machine as the connect, disconnect and stream callbacks
+// drive it: the state each combination leads to, what runs in it, and its
+// draw from the load model, over a day of use against a device that keeps
+// sampling whatever the connection does.
+#include <stdint.h>
+#include "TestCheck.h"
+#include "PowerState.h"
+
+#define SAMPLE_RATE_HZ 52    // imuConfig default
+
+static const char *stateNames[POWER_STATE_COUNT] = {
+  "streaming", "connected idle", "recording", "idle", "motion wait",
+};
+
+static void transitions()
+{
+  // Stillness only counts while streaming, the IMU is off otherwise
+  CHECK(powerStateFor(true, true, false) == POWER_STREAMING);
+  CHECK(powerStateFor(true, false, false) == POWER_CONNECTED_IDLE);
+  CHECK(powerStateFor(true, false, true) == POWER_CONNECTED_IDLE);
+  CHECK(powerStateFor(false, true, false) == POWER_RECORDING);
+  CHECK(powerStateFor(false, false, false) == POWER_IDLE);
+  CHECK(powerStateFor(false, false, true) == POWER_IDLE);
+  CHECK(powerStateFor(true, true, true) == POWER_MOTION_WAIT);
+  CHECK(powerStateFor(false, true, true) == POWER_MOTION_WAIT);
+
+  // A session: connect, start, sit still, move, walk out of range and back,
+  // stop, disconnect
+  struct { bool connected, streaming, still; PowerState expected; } session[] = {
+    {false, false, false, POWER_IDLE},
+    {true, false, false, POWER_CONNECTED_IDLE},
+    {true, true, false, POWER_STREAMING},
+    {true, true, true, POWER_MOTION_WAIT},
+    {true, true, false, POWER_STREAMING},
+    {false, true, false, POWER_RECORDING},
+    {true, true, false, POWER_STREAMING},
+    {true, false, false, POWER_CONNECTED_IDLE},
+    {false, false, false, POWER_IDLE},
+  };
+  for (const auto &step : session) {
+    CHECK(powerStateFor(step.connected, step.streaming, step.still) == step.expected);
+  }
+}
+
+// What runs in each state
+static void parts()
+{
+  CHECK(powerStateImuOn(POWER_STREAMING) && powerStateImuOn(POWER_RECORDING) && powerStateImuOn(POWER_MOTION_WAIT));
+  CHECK(!powerStateImuOn(POWER_CONNECTED_IDLE) && !powerStateImuOn(POWER_IDLE));
+  for (int s = 0; s < POWER_STATE_COUNT; s++) {
+    CHECK(powerStateMeasuresBattery((PowerState)s) == (s != POWER_IDLE));
+  }
+  CHECK(powerStateAdvertisesIdle(POWER_IDLE) && powerStateAdvertisesIdle(POWER_MOTION_WAIT));
+  CHECK(!powerStateAdvertisesIdle(POWER_RECORDING));
+}
+
+// Draw of each state, and of a day: two hours streaming, of which half still,
+// an hour connected with the stream stopped, 21 hours on the desk
+static void current()
+{
+  uint32_t ua[POWER_STATE_COUNT];
+  for (int s = 0; s < POWER_STATE_COUNT; s++) {
+    ua[s] = powerStateCurrentUa((PowerState)s, SAMPLE_RATE_HZ, s != POWER_RECORDING && s != POWER_IDLE, 9);
+    printf("%-15s %5u uA\n", stateNames[s], ua[s]);
+  }
+  CHECK(ua[POWER_STREAMING] == LOAD_IDLE_UA + LOAD_IMU_UA + SAMPLE_RATE_HZ * LOAD_SAMPLE_NC / 1000 + LOAD_CONNECTED_UA);
+  CHECK(ua[POWER_RECORDING] == LOAD_IDLE_UA + LOAD_IMU_UA + SAMPLE_RATE_HZ * LOAD_SAMPLE_NC / 1000 + LOAD_ADVERTISING_UA);
+  CHECK(ua[POWER_CONNECTED_IDLE] == LOAD_IDLE_UA + LOAD_CONNECTED_UA);
+  CHECK(ua[POWER_IDLE] == LOAD_IDLE_UA + LOAD_ADV_IDLE_UA);
+  // Latency 9: one connection event in ten
+  CHECK(ua[POWER_MOTION_WAIT] == LOAD_IDLE_UA + LOAD_IMU_UA + LOAD_CONNECTED_UA / 10);
+  CHECK(powerStateCurrentUa(POWER_MOTION_WAIT, SAMPLE_RATE_HZ, false, 0) == LOAD_IDLE_UA + LOAD_IMU_UA + LOAD_ADV_IDLE_UA);
+  CHECK(ua[POWER_IDLE] < ua[POWER_CONNECTED_IDLE] && ua[POWER_CONNECTED_IDLE] < ua[POWER_MOTION_WAIT]);
+  CHECK(ua[POWER_MOTION_WAIT] < ua[POWER_STREAMING] && ua[POWER_STREAMING] < ua[POWER_RECORDING]);
+
+  double managed = (1.0 * ua[POWER_STREAMING] + 1.0 * ua[POWER_MOTION_WAIT] + 1.0 * ua[POWER_CONNECTED_IDLE] +
+                    21.0 * ua[POWER_IDLE]) / 24;
+  // Always sampling, connected or advertising
+  double unmanaged = (3.0 * ua[POWER_STREAMING] + 21.0 * ua[POWER_RECORDING]) / 24;
+  printf("a day: %.0f uA average, %.0f uA sampling throughout\n", managed, unmanaged);
+  CHECK(managed < unmanaged / 2);
+}
+
+int main()
+{
+  transitions();
+  parts();
+  current();
+  return testResult("test_power_state");
+}
@@ -0,0 +1,125 @@
+// Sample timestamps against a simulated clock: the IMU's data-ready edges at
+// the ODR of its own oscillator, stamped with the 32.768 kHz sample clock in
+// an interrupt that is sometimes held off by the SoftDevice. PeriodStats as
+// SensorTask fills it reports the jitter, next to the old vTaskDelay loop
+// that stamped millis() before six separate reads.
+#include <stdint.h>
+#include <stdlib.h>
+#include "TestCheck.h"
+#include "SampleClock.h"
+
+#define ODR_ERROR_PPM     100   // IMU oscillator against nominal
+#define ISR_LATENCY_US    15    // GPIOTE interrupt entry, spread evenly
+#define RADIO_HOLDOFF_US  250   // Longest the SoftDevice keeps the interrupt waiting
+#define RADIO_HOLDOFF_PCT 2     // Data-ready edges that land in a radio event
+
+// ODR steps and the nominal periods imuPeriodUs() gives them
+static const struct {
+  uint16_t hz;
+  uint32_t nominalUs;
+} rates[] = {{13, 80000}, {52, 19230}, {104, 9615}, {416, 2403}, {1660, 602}};
+
+static double uniform(double max)
+{
+  return max * rand() / RAND_MAX;
+}
+
+// Sample clock reading at time t in us, as imuInt1ISR latches it
+static uint32_t sampleClockAt(double tUs)
+{
+  return (uint32_t)sampleClockTicksToMicros((uint64_t)(tUs * SAMPLE_CLOCK_HZ / 1e6));
+}
+
+static PeriodStats dataReady(uint32_t nominalUs, uint32_t samples)
+{
+  PeriodStats stats;
+  resetPeriodStats(stats);
+  double period = nominalUs * (1 + ODR_ERROR_PPM / 1e6);
+  uint32_t last = 0;
+  for (uint32_t n = 0; n < samples; n++) {
+    double latency = uniform(ISR_LATENCY_US);
+    if (rand() % 100 < RADIO_HOLDOFF_PCT) {
+      latency += uniform(RADIO_HOLDOFF_US);
+    }
+    uint32_t stamp = sampleClockAt(1000 + n * period + latency);
+    if (n > 0) {
+      recordPeriod(stats, stamp - last, nominalUs);
+    }
+    last = stamp;
+  }
+  return stats;
+}
+
+// The loop this replaced at 32 Hz: stamp millis() on the 1024 Hz tick, six
+// register reads of about 200 us each, then vTaskDelay(32) from wherever the
+// reads ended
+static PeriodStats delayLoop(uint32_t samples)
+{
+  const double tickUs = 1e6 / 1024;
+  PeriodStats stats;
+  resetPeriodStats(stats);
+  uint64_t tick = 0;
+  uint32_t last = 0;
+  for (uint32_t n = 0; n < samples; n++) {
+    uint32_t stamp = (uint32_t)(tick * 1000 / 1024) * 1000;
+    if (n > 0) {
+      recordPeriod(stats, stamp - last, 31250);
+    }
+    last = stamp;
+    double reads = 6 * 200 + uniform(300);
+    tick = (uint64_t)((tick * tickUs + reads) / tickUs) + 32;
+  }
+  return stats;
+}
+
+static void arithmetic()
+{
+  CHECK(sampleClockTicksToMicros(0) == 0);
+  CHECK(sampleClockTicksToMicros(SAMPLE_CLOCK_HZ) == 1000000);
+  CHECK(sampleClockTicksToMicros(1) == 30);
+  // A year of ticks, still exact to the microsecond
+  uint64_t year = 365ULL * 86400 * SAMPLE_CLOCK_HZ;
+  CHECK(sampleClockTicksToMicros(year) == 365ULL * 86400 * 1000000);
+
+  PeriodStats stats;
+  resetPeriodStats(stats);
+  CHECK(periodMean(stats) == 0 && periodJitterRms(stats) == 0);
+  recordPeriod(stats, 1030, 1000);
+  recordPeriod(stats, 960, 1000);
+  recordPeriod(stats, 1010, 1000);
+  CHECK(stats.count == 3 && stats.minPeriod == 960 && stats.maxPeriod == 1030);
+  CHECK(periodMean(stats) == 1000);
+  CHECK(periodJitterRms(stats) == 29);  // sqrt((900 + 1600 + 100) / 3)
+}
+
+static void jitter()
+{
+  for (const auto &rate : rates) {
+    srand(rate.hz);
+    PeriodStats stats = dataReady(rate.nominalUs, 20000);
+    double expectedMean = rate.nominalUs * (1 + ODR_ERROR_PPM / 1e6);
+    uint32_t bound = ISR_LATENCY_US + RADIO_HOLDOFF_US + 31 + (uint32_t)(expectedMean - rate.nominalUs) + 1;
+    printf("%4u Hz data-ready: period %u..%u us, mean %u us, jitter rms %u us\n", rate.hz,
+           stats.minPeriod, stats.maxPeriod, periodMean(stats), periodJitterRms(stats));
+    // The stamps never drift from the data-ready edges, only the interrupt entry shows
+    CHECK_NEAR((double)stats.sumPeriod / stats.count, expectedMean, 1.0);
+    CHECK(stats.maxPeriod <= rate.nominalUs + bound && stats.minPeriod + bound >= rate.nominalUs);
+    CHECK(periodJitterRms(stats) < 40);
+  }
+
+  srand(1);
+  PeriodStats old = delayLoop(20000);
+  PeriodStats now = dataReady(31250, 20000);
+  printf("  32 Hz vTaskDelay: period %u..%u us, mean %u us, jitter rms %u us; data-ready: rms %u us\n",
+         old.minPeriod, old.maxPeriod, periodMean(old), periodJitterRms(old), periodJitterRms(now));
+  // The old loop falls behind by the read time every period, over 2 %
+  CHECK(periodMean(old) > 31250 * 102 / 100);
+  CHECK(periodJitterRms(now) * 20 < periodJitterRms(old));
+}
+
+int main()
+{
+  arithmetic();
+  jitter();
+  return testResult("test_sample_clock");
+}
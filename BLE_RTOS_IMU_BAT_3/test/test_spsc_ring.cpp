@@ -0,0 +1,147 @@
+// SpscRing under a real producer and consumer thread: every item arrives
+// exactly once, in order and untorn, and drops are counted rather than lost.
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include "TestCheck.h"
+#include "SpscRing.h"
+
+// Larger than one machine word, so a slot read racing its write shows up as a
+// mismatch between the fields
+struct Item {
+  uint32_t seq;
+  uint32_t check[7];
+};
+
+static Item makeItem(uint32_t seq)
+{
+  Item item;
+  item.seq = seq;
+  for (int i = 0; i < 7; i++) {
+    item.check[i] = seq * (2 * i + 3) ^ 0xA5A5A5A5u;
+  }
+  return item;
+}
+
+static bool intact(const Item &item)
+{
+  for (int i = 0; i < 7; i++) {
+    if (item.check[i] != (item.seq * (2 * i + 3) ^ 0xA5A5A5A5u)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void basics()
+{
+  SpscRing<Item, 8> ring;
+  Item out[8];
+  CHECK(ring.capacity() == 8);
+  CHECK(ring.size() == 0);
+  CHECK(ring.popBatch(out, 8) == 0);
+  for (uint32_t i = 0; i < 8; i++) {
+    CHECK(ring.push(makeItem(i)));
+  }
+  CHECK(!ring.push(makeItem(8)));
+  CHECK(ring.overflowCount() == 1);
+  CHECK(ring.popBatch(out, 3) == 3);
+  CHECK(out[0].seq == 0 && out[2].seq == 2);
+  // Wrap the slot index a few times
+  for (uint32_t i = 9; i < 40; i++) {
+    CHECK(ring.push(makeItem(i)));
+    CHECK(ring.popBatch(out, 1) == 1);
+  }
+  CHECK(ring.size() == 5);
+  CHECK(ring.popBatch(out, 8) == 5);
+  CHECK(out[4].seq == 39);
+}
+
+// The producer waits for room, so nothing may be dropped
+static void lossless(uint32_t total)
+{
+  static SpscRing<Item, 64> ring;
+  std::atomic<bool> done(false);
+  std::thread producer([&]() {
+    for (uint32_t seq = 0; seq < total; seq++) {
+      while (ring.size() == ring.capacity()) {
+        std::this_thread::yield();
+      }
+      ring.push(makeItem(seq));
+    }
+    done = true;
+  });
+
+  Item batch[16];
+  uint32_t expected = 0;
+  uint32_t torn = 0, misordered = 0;
+  while (expected < total) {
+    uint16_t n = ring.popBatch(batch, 16);
+    for (uint16_t i = 0; i < n; i++) {
+      torn += !intact(batch[i]);
+      misordered += batch[i].seq != expected;
+      expected = batch[i].seq + 1;
+    }
+    if (n == 0) {
+      if (done && ring.size() == 0) {
+        break;
+      }
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  CHECK(expected == total);
+  CHECK(torn == 0);
+  CHECK(misordered == 0);
+  CHECK(ring.overflowCount() == 0);
+}
+
+// Like SensorTask against a slow ble_uart_task: the producer never waits, a
+// full ring drops the new item. What arrives is in order and intact, and
+// arrivals plus counted overflows add up to everything pushed.
+static void lossy(uint32_t total)
+{
+  static SpscRing<Item, 64> ring;
+  std::atomic<bool> done(false);
+  std::thread producer([&]() {
+    for (uint32_t seq = 0; seq < total; seq++) {
+      ring.push(makeItem(seq));
+      if ((seq & 0x3FF) == 0) {
+        std::this_thread::yield();
+      }
+    }
+    done = true;
+  });
+
+  Item batch[16];
+  uint32_t received = 0, torn = 0, misordered = 0;
+  int64_t last = -1;
+  for (uint32_t round = 0;; round++) {
+    uint16_t n = ring.popBatch(batch, 16);
+    for (uint16_t i = 0; i < n; i++) {
+      torn += !intact(batch[i]);
+      misordered += (int64_t)batch[i].seq <= last;
+      last = batch[i].seq;
+    }
+    received += n;
+    if (n == 0 && done && ring.size() == 0) {
+      break;
+    }
+    if ((round & 0xFF) == 0) {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  printf("lossy: %u of %u received, %u dropped\n", received, total, ring.overflowCount());
+  CHECK(torn == 0);
+  CHECK(misordered == 0);
+  CHECK(received + ring.overflowCount() == total);
+}
+
+int main()
+{
+  basics();
+  lossless(300000);
+  lossy(300000);
+  return testResult("test_spsc_ring");
+}
@@ -0,0 +1,216 @@
+// The text line through TextWriter against the String path it replaced: the
+// same fields to within the last digit, no heap use at all, and what each
+// costs per line. The String path is modelled on Arduino's WString, which has
+// no small-string buffer, so every temporary and every growing += goes
+// through malloc/realloc; on the board each of those suspends the scheduler
+// in the heap_3 wrapper. malloc is interposed here to count them.
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "TestCheck.h"
+#include "TextSample.h"
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+static uint32_t heapCalls = 0;
+
+extern "C" void *malloc(size_t size)
+{
+  heapCalls++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+  heapCalls++;
+  return __libc_realloc(ptr, size);
+}
+
+// WString's allocation pattern: exact-size buffers grown with realloc
+class LegacyString {
+public:
+  LegacyString(const char *s) : buffer(NULL), len(0), capacity(0) { concat(s, strlen(s)); }
+  explicit LegacyString(int v) : buffer(NULL), len(0), capacity(0) {
+    char buf[12];
+    snprintf(buf, sizeof(buf), "%d", v);
+    concat(buf, strlen(buf));
+  }
+  explicit LegacyString(unsigned long long v) : buffer(NULL), len(0), capacity(0) {
+    char buf[21];
+    snprintf(buf, sizeof(buf), "%llu", v);
+    concat(buf, strlen(buf));
+  }
+  explicit LegacyString(float v) : buffer(NULL), len(0), capacity(0) {  // dtostrf, two decimals
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%.2f", v);
+    concat(buf, strlen(buf));
+  }
+  ~LegacyString() { free(buffer); }
+
+  LegacyString &operator+=(const LegacyString &s) { concat(s.buffer, s.len); return *this; }
+  LegacyString &operator+=(const char *s) { concat(s, strlen(s)); return *this; }
+  const char *c_str() const { return buffer; }
+  uint16_t length() const { return len; }
+
+private:
+  void concat(const char *s, uint16_t n) {
+    if (len + n > capacity || buffer == NULL) {
+      buffer = (char *)realloc(buffer, len + n + 1);
+      capacity = len + n;
+    }
+    memcpy(buffer + len, s, n);
+    len += n;
+    buffer[len] = '\0';
+  }
+
+  char *buffer;
+  uint16_t len;
+  uint16_t capacity;
+};
+
+struct Line {
+  int battery;
+  TextTime time;
+  ImuSample sample;
+};
+
+// The ble_uart_task body this replaced, floats from LSM6DS3::calcAccel/calcGyro
+static uint16_t legacyLine(const Line &l, char *out)
+{
+  LegacyString timeString = "IMU1";
+  timeString += ",";
+  timeString += LegacyString(l.battery);
+  timeString += "%,";
+  timeString += LegacyString((float)l.sample.temperature / IMU_TEMP_LSB_PER_C + 25);
+  timeString += "^,";
+  timeString += LegacyString((int)l.time.hour);
+  timeString += ":";
+  timeString += LegacyString((int)l.time.minute);
+  timeString += ":";
+  timeString += LegacyString((int)l.time.second);
+  timeString += ",";
+  timeString += LegacyString((unsigned long long)l.time.millis);
+  for (int i = 0; i < 3; i++) {
+    timeString += ",";
+    timeString += LegacyString((float)l.sample.accel[i] * 0.061f * (16 >> 1) / 1000);
+  }
+  for (int i = 0; i < 3; i++) {
+    timeString += ",";
+    timeString += LegacyString((float)l.sample.gyro[i] * 4.375f * (2000 / 125) / 1000);
+  }
+  timeString += "@";
+  memcpy(out, timeString.c_str(), timeString.length() + 1);
+  return timeString.length();
+}
+
+static uint16_t writerLine(const Line &l, char *out, uint16_t capacity)
+{
+  TextWriter text(out, capacity);
+  formatTextSample(text, "IMU1", l.battery, l.time, l.sample, 16, 2000);
+  return text.length();
+}
+
+static Line randomLine()
+{
+  Line l;
+  l.battery = rand() % 101;
+  l.time.hour = rand() % 24;
+  l.time.minute = rand() % 60;
+  l.time.second = rand() % 60;
+  l.time.millis = (uint64_t)rand() * 1000003u;  // Past 32 bits, wall clock ms are
+  l.sample.timestamp = 0;
+  for (int i = 0; i < 3; i++) {
+    l.sample.accel[i] = (int16_t)(rand() % 65536 - 32768);
+    l.sample.gyro[i] = (int16_t)(rand() % 65536 - 32768);
+  }
+  l.sample.temperature = (int16_t)(rand() % 8000 - 4000);
+  return l;
+}
+
+// Field by field, numbers agree to the last printed digit
+static void sameFields()
+{
+  srand(2);
+  uint32_t mismatches = 0;
+  for (int n = 0; n < 20000; n++) {
+    Line l = randomLine();
+    char a[128], b[128];
+    legacyLine(l, a);
+    writerLine(l, b, sizeof(b));
+    char *pa = a, *pb = b;
+    for (int field = 0; field < 12; field++) {
+      char *ea, *eb;
+      double va = strtod(pa, &ea), vb = strtod(pb, &eb);
+      // Integer and float rounding may part at the last digit
+      if (fabs(va - vb) > 0.0101) {
+        mismatches++;
+      }
+      pa = ea + strcspn(ea, "0123456789-");
+      pb = eb + strcspn(eb, "0123456789-");
+    }
+  }
+  CHECK(mismatches == 0);
+}
+
+// Too small a buffer truncates, never overruns
+static void truncation()
+{
+  char buf[24];
+  memset(buf, 'x', sizeof(buf));
+  TextWriter text(buf, 16);
+  text.str("0123456789").i32(INT32_MIN).fixed(-5, 2);
+  CHECK(text.length() == 15 && buf[15] == '\0' && buf[16] == 'x');
+
+  char small[32];
+  TextWriter fixed(small, sizeof(small));
+  fixed.fixed(-5, 2).chr(' ').fixed(100, 2).chr(' ').i32(INT32_MIN).chr(' ').fixed(7, 0);
+  CHECK(strcmp(small, "-0.05 1.00 -2147483648 7") == 0);
+
+  char wide[48];
+  TextWriter u64(wide, sizeof(wide));
+  u64.u64(UINT64_MAX).chr(' ').u64(0).chr(' ').u64(1760000000123ULL);
+  CHECK(strcmp(wide, "18446744073709551615 0 1760000000123") == 0);
+}
+
+static void benchmark()
+{
+  srand(3);
+  const int lines = 20000;
+  static Line input[lines];
+  for (int n = 0; n < lines; n++) {
+    input[n] = randomLine();
+  }
+  char out[128];
+  uint32_t checksum = 0;
+
+  uint32_t before = heapCalls;
+  auto start = std::chrono::steady_clock::now();
+  for (int n = 0; n < lines; n++) {
+    checksum += legacyLine(input[n], out);
+  }
+  double legacyNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lines;
+  double legacyAllocs = (double)(heapCalls - before) / lines;
+
+  before = heapCalls;
+  start = std::chrono::steady_clock::now();
+  for (int n = 0; n < lines; n++) {
+    checksum += writerLine(input[n], out, sizeof(out));
+  }
+  double writerNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / lines;
+  uint32_t writerAllocs = heapCalls - before;
+
+  printf("String path: %.0f ns and %.1f heap calls per line; TextWriter: %.0f ns and %u heap calls (checksum %u)\n",
+         legacyNs, legacyAllocs, writerNs, writerAllocs, checksum);
+  CHECK(writerAllocs == 0);
+  CHECK(legacyAllocs >= 20);
+  CHECK(writerNs < legacyNs);
+}
+
+int main()
+{
+  sameFields();
+  truncation();
+  benchmark();
+  return testResult("test_text_writer");
+}
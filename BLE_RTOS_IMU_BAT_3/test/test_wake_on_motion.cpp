@@ -0,0 +1,408 @@
+// Wake on motion against a model of the LSM6DS3TR-C: its FIFO with the
+// STOP_ON_FTH depth limit, the wake-up slope detector latched on INT1, a
+// 400 kHz bus, and behind the sample ring a link draining it a connection
+// event at a time. A stream goes still, SensorTask arms the detector, and
+// synthetic motion wakes it: a jerk, and a lean whose first sharp step comes
+// well after the motion began. Everything the pre-roll held must come out
+// once, in order and whole, and join the samples that follow without a gap in
+// FIFO acquisition, and the motion onset must be in it whenever it is within
+// the pre-roll.
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <deque>
+#include <vector>
+#include "TestCheck.h"
+#include "ImuBus.h"
+#include "SpscRing.h"
+#include "LinkModel.h"
+#include "WakeOnMotion.h"
+
+#define FIFO_WORDS      2048    // 4 kbyte
+#define SAMPLE_WORDS    (IMU_BURST_LEN / 2)
+#define ACCEL_LSB_PER_G 2048    // 16 g, imuConfig default
+#define THRESHOLD       1       // motionConfig default, 0.25 g of slope at 16 g
+#define MAX_BATCH_MS    100     // maxBatchLatencyMs
+#define FRAME_SAMPLES   16      // Plain samples to a 244 byte frame
+#define LOST_EVENTS     10      // Percent of connection events that carry nothing
+
+// Accel in g at t us, the motion the sensor goes through
+typedef void (*Trace)(double t, double onsetUs, double *g);
+
+static double gaussian(double sigma)
+{
+  double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return sigma * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+// Picked up with a jerk, 1.5 g for 100 ms
+static void jerk(double t, double onsetUs, double *g)
+{
+  g[0] = t >= onsetUs && t < onsetUs + 100000 ? 1.5 : 0;
+  g[1] = 0;
+  g[2] = 1;
+}
+
+// Leaning over 600 ms, too smooth for the detector, then steps landing
+// 1.5 g for 100 ms every half second
+static void lean(double t, double onsetUs, double *g)
+{
+  double s = (t - onsetUs) / 600000;
+  s = s < 0 ? 0 : s > 1 ? 1 : s;
+  double step = fmod(t - onsetUs - 600000, 500000);
+  g[0] = 0.3 * s * s * (3 - 2 * s);
+  g[1] = 0;
+  g[2] = 1 + (t >= onsetUs + 600000 && step < 100000 ? 1.5 : 0);
+}
+
+struct Link {
+  double intervalUs;
+  double nextEventUs;
+};
+
+// The IMU and everything that runs while SensorTask waits on it
+class World {
+public:
+  World(double periodUs, Trace motion, double onsetUs)
+    : now(0), period(periodUs), wakeSeq(UINT32_MAX), nextSampleUs(periodUs), produced(0), headPattern(0),
+      trace(motion), onset(onsetUs), wakeLatched(false) {
+    memset(regs, 0, sizeof(regs));
+    uint16_t rate = (uint16_t)lrint(1e6 / periodUs);
+    link.intervalUs = pickConnectionInterval(rate, LINK_PHY_2MBPS, LINK_DATA_LENGTH, LINK_MTU, MAX_BATCH_MS) * 1250.0;
+    link.nextEventUs = link.intervalUs;
+  }
+
+  // Samples land at the ODR, the link empties the ring at its events
+  void advance(double us) {
+    now += us;
+    while (nextSampleUs <= now || link.nextEventUs <= now) {
+      if (nextSampleUs <= link.nextEventUs) {
+        sample();
+        nextSampleUs += period;
+      } else {
+        if (rand() % 100 >= LOST_EVENTS) {
+          ImuSample batch[LINK_HVN_QUEUE * FRAME_SAMPLES];
+          ring.popBatch(batch, LINK_HVN_QUEUE * FRAME_SAMPLES);
+        }
+        link.nextEventUs += link.intervalUs;
+      }
+    }
+  }
+
+  void writeRegister(uint8_t reg, uint8_t value) {
+    bus(1);
+    regs[reg] = value;
+    if (reg == IMU_REG_FIFO_CTRL5 && (value & 0x07) == 0) {
+      words.clear();  // Bypass flushes
+      headPattern = 0;
+    }
+  }
+
+  void readRegister(uint8_t *out, uint8_t reg) {
+    bus(1);
+    *out = regs[reg];
+    if (reg == IMU_REG_WAKE_UP_SRC) {
+      *out = wakeLatched ? WAKE_UP_SRC_WU_IA : 0;
+      wakeLatched = false;
+    }
+  }
+
+  int readRegisterRegion(uint8_t *out, uint8_t reg, uint8_t length) {
+    bus(length);
+    if (reg == IMU_REG_FIFO_STATUS1) {
+      uint16_t n = (uint16_t)words.size();
+      out[0] = n & 0xFF;
+      out[1] = ((n >> 8) & 0x0F) | (n >= depth() ? 0x40 : 0);  // Completely filled
+      out[2] = headPattern;
+      out[3] = 0;
+    } else if (reg == IMU_REG_OUT_TEMP_L) {
+      out[0] = 0x00;
+      out[1] = 0xFE;
+      for (uint8_t i = 2; i + 1 < length; i += 2) {
+        out[i] = latest[i / 2 - 1] & 0xFF;  // The output registers, gyro then accel
+        out[i + 1] = latest[i / 2 - 1] >> 8;
+      }
+    } else if (reg == IMU_REG_FIFO_DATA_OUT_L) {
+      for (uint8_t i = 0; i + 1 < length; i += 2) {
+        uint16_t word = 0;
+        if (!words.empty()) {
+          word = words.front();
+          words.pop_front();
+          headPattern = (headPattern + 1) % SAMPLE_WORDS;
+        }
+        out[i] = word & 0xFF;
+        out[i + 1] = word >> 8;
+      }
+    }
+    return 0;
+  }
+
+  bool int1() const { return wakeLatched && (regs[IMU_REG_MD1_CFG] & 0x20); }
+
+  // The sample number and the accel the model produced for it
+  static uint32_t seqOf(const ImuSample &s) { return (uint16_t)s.gyro[0] | ((uint32_t)(uint16_t)s.gyro[1] << 16); }
+  bool whole(const ImuSample &s) const {
+    uint32_t seq = seqOf(s);
+    return seq < accel.size() && (uint16_t)s.gyro[2] == (uint16_t)~s.gyro[0] &&
+           memcmp(s.accel, accel[seq].v, sizeof(s.accel)) == 0;
+  }
+  double sampleTime(uint32_t seq) const { return (seq + 1) * period; }
+  uint32_t samples() const { return produced; }
+  uint32_t clock() const { return (uint32_t)now; }
+
+  double now;
+  double period;
+  SpscRing<ImuSample, 64> ring;
+  uint32_t wakeSeq;  // First sample over the threshold while armed
+
+private:
+  struct Accel { int16_t v[3]; };
+
+  // Address, register, restart, address, data
+  void bus(uint8_t length) { advance((3 * 9 + 3 + 9 * length) / 0.4); }
+
+  uint16_t depth() const {
+    uint16_t limit = regs[IMU_REG_FIFO_CTRL1] | ((regs[IMU_REG_FIFO_CTRL2] & 0x0F) << 8);
+    return regs[IMU_REG_FIFO_CTRL4] & 0x80 ? limit : FIFO_WORDS;
+  }
+
+  void sample() {
+    double g[3];
+    trace(nextSampleUs, onset, g);
+    Accel a;
+    for (int i = 0; i < 3; i++) {
+      a.v[i] = (int16_t)lrint((g[i] + gaussian(0.002)) * ACCEL_LSB_PER_G);
+    }
+    bool armed = (regs[IMU_REG_TAP_CFG] & 0x80) && !accel.empty();
+    if (armed && motionSlopeExceeds(accel.back().v, a.v, regs[IMU_REG_WAKE_UP_THS] & 0x3F)) {
+      wakeLatched = true;  // LIR
+      wakeSeq = wakeSeq == UINT32_MAX ? produced : wakeSeq;
+    }
+    accel.push_back(a);
+    uint16_t seqWords[SAMPLE_WORDS] = {(uint16_t)produced, (uint16_t)(produced >> 16), (uint16_t)~produced,
+                                       (uint16_t)a.v[0], (uint16_t)a.v[1], (uint16_t)a.v[2]};
+    memcpy(latest, seqWords, sizeof(latest));
+    if ((regs[IMU_REG_FIFO_CTRL5] & 0x07) == 0) {
+      produced++;
+      return;
+    }
+    for (int w = 0; w < SAMPLE_WORDS; w++) {
+      if (words.size() >= depth()) {
+        words.pop_front();  // Continuous, the oldest word goes
+        headPattern = (headPattern + 1) % SAMPLE_WORDS;
+      }
+      words.push_back(seqWords[w]);
+    }
+    produced++;
+  }
+
+  double nextSampleUs;
+  uint32_t produced;
+  std::deque<uint16_t> words;
+  uint8_t headPattern;
+  uint8_t regs[128];
+  uint16_t latest[SAMPLE_WORDS];  // Output registers
+  std::vector<Accel> accel;
+  Trace trace;
+  double onset;
+  bool wakeLatched;
+  Link link;
+};
+
+struct Outcome {
+  uint32_t preRoll;      // Samples asked for
+  uint32_t history;      // Samples before the wake sample sent
+  uint32_t joinGap;      // Samples lost at the hand-over
+  uint32_t missing, torn, repeats;
+  double onsetLeadMs;    // Onset before the wake sample
+  bool onsetSent;
+  double worstStampUs;   // Pre-roll timestamps against the true sample times
+};
+
+static Outcome run(uint16_t rateHz, uint16_t preRollMs, Trace trace, double stillS, bool fifoMode)
+{
+  double period = rateHz == 13 ? 80000 : 1e6 / rateHz;  // imuPeriodUs
+  double armUs = 2e6, onsetUs = armUs + stillS * 1e6;
+  World imu(period, trace, onsetUs);
+  uint16_t watermark = MAX_BATCH_MS * 1000 / (uint32_t)period;
+  watermark = watermark < 1 ? 1 : watermark > 32 ? 32 : watermark;
+  std::vector<ImuSample> sent;
+
+  // publishSample(), a full ring drops the sample
+  auto publish = [&](const ImuSample &sample) {
+    if (imu.ring.push(sample)) {
+      sent.push_back(sample);
+    }
+  };
+  // drainImuFifo(), waiting on the link while the ring is full
+  auto drain = [&]() {
+    bool overrun;
+    uint16_t n = readImuFifo(imu, imu.clock(), (uint32_t)period, overrun, [&](const ImuSample &sample) {
+      while (imu.ring.size() == imu.ring.capacity()) {
+        imu.advance(1000);  // vTaskDelay(1)
+      }
+      publish(sample);
+    });
+    CHECK(!overrun);
+    return n;
+  };
+  // routeImuInterrupt(): configureFifo() for the watermark, or bypass
+  auto route = [&]() {
+    uint16_t words = watermark * SAMPLE_WORDS;
+    imu.writeRegister(IMU_REG_FIFO_CTRL5, 0x00);
+    if (!fifoMode) {
+      imu.writeRegister(IMU_REG_INT1_CTRL, 0x01);
+      return;
+    }
+    imu.writeRegister(IMU_REG_FIFO_CTRL1, words & 0xFF);
+    imu.writeRegister(IMU_REG_FIFO_CTRL2, (words >> 8) & 0x0F);
+    imu.writeRegister(IMU_REG_FIFO_CTRL3, 0x09);
+    imu.writeRegister(IMU_REG_FIFO_CTRL4, 0x00);
+    imu.writeRegister(IMU_REG_FIFO_CTRL5, 0x06);
+    imu.writeRegister(IMU_REG_INT1_CTRL, 0x08);
+  };
+  // SensorTask's acquisition loop, late on the watermark or on data-ready
+  auto stream = [&](double untilUs) {
+    while (imu.now < untilUs) {
+      if (fifoMode) {
+        imu.advance(watermark * period + rand() % 2000);
+        drain();
+        continue;
+      }
+      uint32_t next = imu.samples();
+      while (imu.samples() == next) {
+        imu.advance(period / 16);
+      }
+      imu.advance(50 + rand() % 300);
+      ImuSample sample;
+      if (readImuBurst(imu, sample)) {
+        sample.timestamp = (uint32_t)imu.sampleTime(World::seqOf(sample));  // sampleInstantUs
+        publish(sample);
+      }
+    }
+  };
+
+  route();
+  stream(armUs);
+  uint16_t preRoll = motionPreRollSamples(preRollMs, (uint32_t)period);
+  armImuWakeUp(imu, 0, preRoll, THRESHOLD);
+  sent.clear();
+  while (!imu.int1() && imu.now < onsetUs + 2e6) {
+    imu.advance(period);
+  }
+  CHECK(imu.int1());
+  // SensorTask wakes on the notification while other tasks run
+  imu.advance(200 + rand() % 3000);
+  uint32_t wakeSeq = imu.wakeSeq;
+  CHECK(takeImuWakeUp(imu));
+
+  // disarmWakeOnMotion(true)
+  releaseImuWakeUp(imu);
+  if (fifoMode) {
+    drain();
+    resumeImuFifo(imu, watermark);
+  } else {
+    while (drain() > 1 || imu.ring.size() > imu.ring.capacity() / 4) {
+      if (imu.ring.size() > imu.ring.capacity() / 4) {
+        imu.advance(1000);  // vTaskDelay(1)
+      }
+    }
+    route();
+  }
+  size_t preRollEnd = sent.size();
+  stream(imu.now + 2e6);
+
+  Outcome o = {preRoll, 0, 0, 0, 0, 0, 0, false, 0};
+  uint32_t first = World::seqOf(sent.front());
+  o.history = wakeSeq - first;
+  uint32_t onsetSeq = (uint32_t)ceil(onsetUs / period) - 1;
+  o.onsetLeadMs = (wakeSeq - (double)onsetSeq) * period / 1000;
+  o.onsetSent = onsetSeq >= first;
+  for (size_t i = 0; i < sent.size(); i++) {
+    o.torn += !imu.whole(sent[i]);
+    if (i > 0) {
+      uint32_t seq = World::seqOf(sent[i]), previous = World::seqOf(sent[i - 1]);
+      o.missing += seq > previous + 1 ? seq - previous - 1 : 0;
+      o.joinGap += i == preRollEnd && seq > previous + 1 ? seq - previous - 1 : 0;
+      o.repeats += seq <= previous;
+    }
+    if (i < preRollEnd) {
+      double error = fabs(sent[i].timestamp - imu.sampleTime(World::seqOf(sent[i])));
+      o.worstStampUs = error > o.worstStampUs ? error : o.worstStampUs;
+    }
+  }
+  return o;
+}
+
+static void preRoll(bool fifoMode)
+{
+  const uint16_t rates[] = {13, 52, 104, 416, 1660};
+  const uint16_t preRolls[] = {250, 1000, 5000};
+  struct { const char *name; Trace trace; } traces[] = {{"jerk", jerk}, {"lean", lean}};
+  printf("%s acquisition\n", fifoMode ? "FIFO" : "Data-ready");
+  srand(25);
+  for (const auto &t : traces) {
+    for (uint16_t rate : rates) {
+      for (uint16_t ms : preRolls) {
+        double period = rate == 13 ? 80000 : 1e6 / rate;
+        Outcome worst = {0, UINT32_MAX, 0, 0, 0, 0, 0, true, 0};
+        uint32_t mostMissing = 0, mostLater = 0;
+        for (int trial = 0; trial < 10; trial++) {
+          Outcome o = run(rate, ms, t.trace, 6 + rand() % 8, fifoMode);
+          worst.preRoll = o.preRoll;
+          worst.history = o.history < worst.history ? o.history : worst.history;
+          worst.torn += o.torn;
+          worst.repeats += o.repeats;
+          worst.worstStampUs = o.worstStampUs > worst.worstStampUs ? o.worstStampUs : worst.worstStampUs;
+          mostMissing = o.missing > mostMissing ? o.missing : mostMissing;
+          worst.joinGap = o.joinGap > worst.joinGap ? o.joinGap : worst.joinGap;
+          mostLater = o.missing - o.joinGap > mostLater ? o.missing - o.joinGap : mostLater;
+          // The onset goes out whenever the pre-roll reaches back to it
+          if (o.onsetLeadMs < (o.preRoll - 1) * period / 1000 - 10) {
+            worst.onsetSent &= o.onsetSent;
+          }
+          worst.onsetLeadMs = o.onsetLeadMs > worst.onsetLeadMs ? o.onsetLeadMs : worst.onsetLeadMs;
+        }
+        printf("  %-4s %4u Hz, %4u ms: pre-roll %3u samples, at least %3u before the wake sent, "
+               "onset up to %3.0f ms before the wake%s, stamps within %5.0f us, %u lost at the join, "
+               "%u in all\n",
+               t.name, rate, ms, worst.preRoll, worst.history, worst.onsetLeadMs,
+               worst.onsetSent ? "" : " missed", worst.worstStampUs, worst.joinGap, mostMissing);
+        CHECK(worst.torn == 0 && worst.repeats == 0);
+        // FIFO mode hands over without a gap. Data-ready mode loses what lands
+        // during its last pass and the switch, and past 1 kHz it cannot keep
+        // up with the ODR at all, a burst read is most of a sample period.
+        CHECK(fifoMode ? mostMissing == 0 : worst.joinGap <= 3);
+        CHECK(fifoMode || period < 1000 || mostLater == 0);
+        // The FIFO rolls on until SensorTask releases it, up to 3.2 ms late
+        // and a few bus transactions on
+        CHECK(worst.history + 1 + (uint32_t)ceil(3700 / period) >= worst.preRoll);
+        CHECK(worst.onsetSent);
+        // Stamped back at the nominal period from the drain
+        CHECK(worst.worstStampUs < period + 500);
+      }
+    }
+  }
+}
+
+static void limits()
+{
+  CHECK(motionPreRollSamples(1000, 1000000 / 52) == 52);
+  CHECK(motionPreRollSamples(0, 1000000 / 52) == 1);
+  CHECK(motionPreRollSamples(60000, 1000000 / 1660) == MOTION_FIFO_SAMPLES);
+  // The pre-roll and a drain's worth of new samples fit the FIFO
+  CHECK(MOTION_FIFO_SAMPLES * SAMPLE_WORDS < FIFO_WORDS);
+  int16_t still[3] = {0, 0, ACCEL_LSB_PER_G};
+  int16_t nudged[3] = {1024, 0, ACCEL_LSB_PER_G};
+  int16_t knocked[3] = {1025, 0, ACCEL_LSB_PER_G};
+  CHECK(!motionSlopeExceeds(still, nudged, THRESHOLD));
+  CHECK(motionSlopeExceeds(still, knocked, THRESHOLD));
+}
+
+int main()
+{
+  limits();
+  preRoll(true);
+  preRoll(false);
+  return testResult("test_wake_on_motion");
+}
@@ -0,0 +1,117 @@
+// The sample clock across the 24-bit RTC counter wrap, read with the overflow
+// interrupt serviced and still pending, and the wall clock computed from it:
+// rollovers of the time of day, the 32-bit timestamp wrap and the drift
+// correction over a day.
+#include <stdint.h>
+#include <stdlib.h>
+#include "TestCheck.h"
+#include "SampleClock.h"
+#include "WallClock.h"
+
+#define RTC_WRAP (1UL << 24)
+
+// An RTC2 read at true tick count `ticks`. Read from a context that outranks
+// RTC2_IRQn, the overflow interrupt has not run since serviced; the event
+// flag is sampled lag ticks after the counter.
+static uint64_t readTicks(uint64_t ticks, uint64_t serviced, uint32_t lag)
+{
+  uint32_t overflows = (uint32_t)(serviced >> 24);
+  uint32_t counter = (uint32_t)(ticks & (RTC_WRAP - 1));
+  bool pending = (ticks + lag) >> 24 > overflows;
+  return extendRtcCounter(overflows, counter, pending);
+}
+
+static void counterWrap()
+{
+  srand(14);
+  uint32_t wrong = 0;
+  uint64_t previous = 0;
+  bool rising = true;
+  for (uint64_t wrap = RTC_WRAP; wrap <= 5 * (uint64_t)RTC_WRAP; wrap += RTC_WRAP) {
+    for (uint64_t ticks = wrap - 3000; ticks < wrap + 3000; ticks++) {
+      uint32_t lag = rand() % 4;
+      // Overflow interrupt serviced 0 to 2000 ticks after the wrap, or not
+      // yet when this read comes from a higher priority
+      uint64_t serviceAt = wrap + rand() % 2000;
+      uint64_t serviced = ticks >= serviceAt ? ticks : wrap - 1;
+      uint64_t read = readTicks(ticks, serviced, lag);
+      wrong += read != ticks;
+      rising &= read >= previous;
+      previous = read;
+    }
+  }
+  CHECK(wrong == 0);
+  CHECK(rising);
+  // 2^24 ticks are exactly 512 s
+  CHECK(sampleClockTicksToMicros(RTC_WRAP) == 512000000ULL);
+  CHECK(sampleClockTicksToMicros(RTC_WRAP - 1) < 512000000ULL);
+  CHECK(sampleClockTicksToMicros(1ULL << 40) == (1000000ULL << 40) / SAMPLE_CLOCK_HZ);
+}
+
+// 2023/09/30 23:59:58, as the firmware is set from its build time
+#define SET_UNIX 1696118398UL
+
+static uint32_t msOfDay(const TimeOfDay &t)
+{
+  return ((t.hour * 60 + t.minute) * 60 + t.second) * 1000 + t.millis;
+}
+
+// Every ms across midnight and a minute rollover, with the sample clock
+// crossing its 24-bit wrap underneath: each field from one reading, so the
+// time of day moves on by exactly 1 ms and never tears
+static void rollovers()
+{
+  WallClockModel model = {0, 0, 0};
+  uint64_t setAt = sampleClockTicksToMicros(RTC_WRAP - 32768);  // A second before the wrap
+  model = wallClockModelSet(model, setAt, SET_UNIX);
+  uint32_t torn = 0;
+  uint32_t previous = msOfDay(timeOfDayAt(wallClockModelAt(model, setAt)));
+  CHECK(previous == 86398000);
+  for (uint32_t ms = 1; ms < 70000; ms++) {
+    TimeOfDay now = timeOfDayAt(wallClockModelAt(model, setAt + ms * 1000ULL));
+    uint32_t expected = (previous + 1) % 86400000;
+    torn += msOfDay(now) != expected;
+    previous = msOfDay(now);
+  }
+  CHECK(torn == 0);
+  TimeOfDay midnight = timeOfDayAt(wallClockModelAt(model, setAt + 2000000));
+  CHECK(midnight.hour == 0 && midnight.minute == 0 && midnight.second == 0 && midnight.millis == 0);
+  TimeOfDay later = timeOfDayAt(wallClockModelAt(model, setAt + 3662000000ULL));
+  CHECK(later.hour == 1 && later.minute == 1 && later.second == 0);
+}
+
+// A 32-bit timestamp taken shortly before the 32-bit wrap of the sample clock
+// in us, widened after it
+static void timestampWrap()
+{
+  uint64_t wrap = 1ULL << 32;
+  CHECK(widenMicros(wrap + 100, (uint32_t)(wrap - 50)) == wrap - 50);
+  CHECK(widenMicros(wrap + 100, 60) == wrap + 60);
+  CHECK(widenMicros(3 * wrap + 5, (uint32_t)(3 * wrap + 5)) == 3 * wrap + 5);
+  // Up to 71 minutes back
+  CHECK(widenMicros(5 * wrap, (uint32_t)(5 * wrap - 4000000000ULL)) == 5 * wrap - 4000000000ULL);
+}
+
+// A day on a clock running 50 ppm slow, corrected to within a microsecond,
+// and the correction kept when the time is set again
+static void drift()
+{
+  WallClockModel model = {1000000, 0, 50000};
+  uint64_t day = 86400000000ULL;
+  int64_t error = (int64_t)wallClockModelAt(model, 1000000 + day) - (int64_t)(1000000 + day + day / 20000);
+  CHECK(error >= -1 && error <= 1);
+  WallClockModel set = wallClockModelSet(model, 2000000, SET_UNIX);
+  CHECK(set.driftPpb == 50000 && set.refUs == 2000000);
+  CHECK(wallClockModelAt(set, 2000000) == SET_UNIX * 1000000ULL);
+  // Before the reference the correction runs the other way
+  CHECK(wallClockModelAt(set, 1000000) == SET_UNIX * 1000000ULL - 1000000 - 50);
+}
+
+int main()
+{
+  counterWrap();
+  rollovers();
+  timestampWrap();
+  drift();
+  return testResult("test_wall_clock");
+}
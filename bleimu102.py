@@ -4,6 +4,9 @@ import datetime
 import csv
 import re
 import os
+import struct
+import binascii
+import time
 from itertools import count, takewhile
 from typing import Iterator
 from bleak import BleakClient, BleakScanner
@@ -20,6 +23,16 @@ print("Press 'tt' to set the time of ble device.")
 print("Press 'rr' to start logging data!")
 print("Press 'ss' to stop logging data.")
 print("Press 'dd' to disconnect ble devices!")
+print("Press 'oo' to offload data the devices recorded while disconnected.")
+print("Type 'cfg <odr Hz> <accel g> <gyro dps> <accel bandwidth Hz>' to reconfigure the IMUs, e.g. 'cfg 104 8 1000 100'.")
+print("Type 'quat <n>' to stream on-device orientation, one quaternion every n samples, 'raw' to go back to raw samples.")
+print("Type 'packed' to stream the raw samples losslessly compressed.")
+print("Type 'gait <gyro axis 0-2> [inv]' to stream gait events and strides instead of samples.")
+print("Type 'dec <1|2|4|8> [log]' to stream at a fraction of the ODR, 'log' keeps the full rate in the device's flash log.")
+print("Type 'wom <threshold 1-63> <idle s> <pre-roll ms>' to pause a still stream until the device moves, 'wom off' to stream continuously.")
+print("Press 'st' to show the devices' transmit, sampling and logging statistics.")
+print("Press 'ff' to show the CPU cycles the on-device fusion takes.")
+print("Press 'yy' to synchronise the device clocks to this computer, repeated every minute after that.")
 print("After stop logging data or disconnection, data will save to folder 'subfolder'")
 print("Odd number IMUs will save to date_time_L.csv, Odd number IMUs will save to date_time_R.csv") 
 
@@ -27,6 +40,133 @@ print("Odd number IMUs will save to date_time_L.csv, Odd number IMUs will save t
 UART_SERVICE_UUID = "6E400001-B5A3-F393-E0A9-E50E24DCCA9E"
 UART_RX_CHAR_UUID = "6E400002-B5A3-F393-E0A9-E50E24DCCA9E"
 UART_TX_CHAR_UUID = "6E400003-B5A3-F393-E0A9-E50E24DCCA9E"
+# Flash log offload characteristic of the firmware's telemetry service
+OFFLOAD_CHAR_UUID = "5E1F0003-9A3C-4F6B-8D2E-7C4B1A2F6E30"
+# Negotiated link parameters: MTU, data length, PHY, interval, requested interval, capacity, stream rate
+LINK_CHAR_UUID = "5E1F0004-9A3C-4F6B-8D2E-7C4B1A2F6E30"
+LINK_INFO = struct.Struct('<HHBHHII')
+
+# Binary IMU frame (see FrameEncoder in the firmware), little-endian
+# header: version << 4 | type, flags, device id, sample count, sequence, base timestamp (us)
+# sample: timestamp delta (us), accel XYZ, gyro XYZ
+# Quaternion frames (stream format 'quat') carry timestamp delta, w, x, y, z in Q14
+FRAME_VERSION = 1
+FRAME_TYPE_IMU = 1
+FRAME_TYPE_QUAT = 4
+FRAME_TYPE_GAIT = 5
+FRAME_TYPE_PACKED = 6
+# Offloads open each flash log segment with a segment frame: header, then the
+# segment's start time as full 64-bit wall clock us
+FRAME_TYPE_SEGMENT = 7
+FRAME_SEGMENT_START = struct.Struct('<Q')
+FRAME_FLAG_DROPPED = 0x01
+FRAME_FLAG_LOGGED = 0x02
+FRAME_FLAG_LOG_END = 0x04
+FRAME_HEADER = struct.Struct('<BBBBHI')
+FRAME_SAMPLE = struct.Struct('<H6h')
+FRAME_QUAT = struct.Struct('<H4h')
+QUAT_ONE = 16384
+# Gait frames (stream format 'gait'): delta in 32 us ticks, event, four fields
+FRAME_GAIT = struct.Struct('<H5h')
+FRAME_GAIT_SHIFT = 5
+GAIT_STRIDE = 3
+GAIT_EVENTS = {1: "heel strike", 2: "toe off", GAIT_STRIDE: "stride"}
+# Packed frames (stream format 'packed'): header, frame length, first sample,
+# then Rice coded residuals, see the packed frame layout in the firmware
+FRAME_PACKED_START = 23
+PACKED_CHANNELS = 7
+RICE_ESCAPE = 20
+RICE_RAW_BITS = 17
+RICE_MEAN_SHIFT = 4
+RICE_INITIAL_MEAN = 8
+
+# Binary commands (see CommandParser in the firmware):
+# SOF, opcode, payload length, payload, CRC-16/CCITT-FALSE of opcode..payload
+CMD_SOF = 0xA5
+CMD_SET_TIME = 0x01
+CMD_SET_ODR = 0x02
+CMD_START_STREAM = 0x03
+CMD_STOP_STREAM = 0x04
+CMD_GET_STATS = 0x05
+CMD_SYNC_REQUEST = 0x06
+CMD_SYNC_RESULT = 0x07
+CMD_OFFLOAD = 0x08
+CMD_SET_CONFIG = 0x09
+CMD_GET_CONFIG = 0x0A
+CMD_SET_STREAM = 0x0B
+CMD_GET_FUSION = 0x0C
+CMD_SET_DECIMATION = 0x0D
+DECIMATION_LOG_FULL_RATE = 0x01
+CMD_SET_MOTION = 0x0E
+MOTION_CONFIG = struct.Struct('<BBHH')  # enabled, threshold, idle seconds, pre-roll milliseconds
+IMU_CONFIG = struct.Struct('<4H')  # ODR, accel range, gyro range, accel bandwidth
+STREAM_BINARY = 1
+STREAM_QUATERNION = 2
+STREAM_GAIT = 3
+STREAM_PACKED = 4
+FUSION_STATS = struct.Struct('<4I')  # updates, average, maximum and last cycles per update
+# CMD_GET_STATS reply: TxStats then AcqStats, see the firmware for the fields
+TX_STATS = struct.Struct('<8I2H')
+ACQ_STATS = struct.Struct('<10I')
+CMD_STATUS = {0: "ok", 1: "unknown command", 2: "bad length", 3: "bad value", 4: "busy",
+              5: "offload characteristic not subscribed", 6: "aborted"}
+FRAME_TYPE_RESPONSE = 3
+RESPONSE_HEADER = struct.Struct('<BBBBB')
+
+def encode_command(opcode, payload=b''):
+    body = bytes([opcode, len(payload)]) + payload
+    return bytes([CMD_SOF]) + body + struct.pack('<H', binascii.crc_hqx(body, 0xFFFF))
+
+# Two-way time sync (see the sync frame layout in the firmware)
+FRAME_TYPE_SYNC = 2
+SYNC_ROUNDS = 24  # the firmware follows the least delayed reply of a burst
+SYNC_PERIOD = 60  # seconds between sync bursts, the firmware fits its clock drift across them
+SYNC_REQUEST_PAYLOAD = struct.Struct('<BQ')
+SYNC_REPLY_FRAME = struct.Struct('<BBBBQQQ')
+SYNC_RESULT_PAYLOAD = struct.Struct('<BqI')
+
+# Local wall clock in us, the same naive local time the 'tt' command sets
+def host_micros():
+    return time.time_ns() // 1000 + time.localtime().tm_gmtoff * 1000000
+
+# Frame timestamps are the low 32 bits of the device wall clock. Live frames
+# are just sent and extend to full microseconds with the host clock; offloaded
+# ones can be hours old and extend with the start of their log segment, which
+# they are within 30 minutes of.
+def unwrap_timestamp(timestamp, segment_start=None):
+    if segment_start is None:
+        now = host_micros()
+        return now - ((now - timestamp) & 0xFFFFFFFF)
+    return segment_start + ((timestamp - segment_start + 0x80000000) & 0xFFFFFFFF) - 0x80000000
+
+# Samples of a packed frame as (delta, accel XYZ, gyro XYZ) like FRAME_SAMPLE
+def unpack_samples(frame):
+    bits = int.from_bytes(frame, 'little')
+    bit_pos = FRAME_PACKED_START * 8
+    def get_bits(n):
+        nonlocal bit_pos
+        value = (bits >> bit_pos) & ((1 << n) - 1)
+        bit_pos += n
+        return value
+
+    values = list(struct.unpack_from('<6h', frame, FRAME_HEADER.size + 1))
+    samples = [(0, *values)]
+    means = [RICE_INITIAL_MEAN << RICE_MEAN_SHIFT] * PACKED_CHANNELS
+    delta = 0
+    for _ in range(frame[3] - 1):
+        residuals = []
+        for c in range(PACKED_CHANNELS):
+            k = max((means[c] >> RICE_MEAN_SHIFT).bit_length() - 1, 0)
+            q = 0
+            while q < RICE_ESCAPE and get_bits(1):
+                q += 1
+            u = get_bits(RICE_RAW_BITS) if q == RICE_ESCAPE else (q << k) | get_bits(k)
+            means[c] += u - (means[c] >> RICE_MEAN_SHIFT)
+            residuals.append((u >> 1) ^ -(u & 1))
+        delta += residuals[0]
+        values = [v + r for v, r in zip(values, residuals[1:])]
+        samples.append((delta, *values))
+    return samples
 
 # Dictionary to store connected clients and their indices
 connected_clients = {}  
@@ -100,37 +240,21 @@ async def main():
         with open("received_data.txt", "a") as file:
             file.write(f"{device_index}: {data}\n") """
     # Function to save received data to a CSV file
-    def decode_byte_stream(filename, byte_stream):
-        # Decode the device name
-        index = 0
-        pack_time = 14
-        device_name = ''
-        while byte_stream[index] != ord(','):
-            device_name += chr(byte_stream[index])
-            index += 1
-        index += 1  # Skip the delimiter
-        #print(device_name)
-
-        # Initialize lists to store the decoded values
-        miliBuffer = []
-        sensorBuffer = []
-
-        # Decode miliBuffer values
-        for _ in range(pack_time):
-            value = (byte_stream[index] << 24) | (byte_stream[index + 1] << 16) | (byte_stream[index + 2] << 8) | byte_stream[index + 3]
-            miliBuffer.append(value)
-            index += 4
-        index += 1  # Skip the delimiter
-        #print(miliBuffer)
-
-        # Decode sensorBuffer values (16-bit integers)
-        for _ in range(6 * pack_time):
-            value = (byte_stream[index] << 8) | byte_stream[index + 1]
-            if value & 0x8000:  # if sign bit is set (16-bit: 32768-65535)
-                value = -((value ^ 0xFFFF) + 1)  # 2's complement sign conversion
-            sensorBuffer.append(value)
-            index += 2
-        #print(sensorBuffer)
+    def decode_frame(filename, device_name, frame, segment_start=None):
+        version_type, flags, device_id, sample_count, sequence, timestamp = FRAME_HEADER.unpack_from(frame, 0)
+        if filename is None:
+            return
+        if flags & FRAME_FLAG_DROPPED:
+            print(f"{device_name}: samples dropped before frame {sequence}")
+        if flags & FRAME_FLAG_LOG_END:
+            print(f"{device_name}: offload complete")
+            return
+        if version_type & 0x0F == FRAME_TYPE_QUAT:
+            decode_quat_frame(os.path.splitext(filename)[0] + "_quat.csv", device_name, frame, segment_start)
+            return
+        if version_type & 0x0F == FRAME_TYPE_GAIT:
+            decode_gait_frame(os.path.splitext(filename)[0] + "_gait.csv", device_name, frame, segment_start)
+            return
 
         # Check if the file exists and is non-empty
         file_exists = os.path.isfile(filename) and os.path.getsize(filename) > 0
@@ -140,22 +264,180 @@ async def main():
             csvwriter = csv.writer(csvfile)
             # Write the header only if the file does not already exist
             if not file_exists:
-                csvwriter.writerow(['Device Name', 'miliBuffer'] + [f'sensorBuffer_{i}' for i in range(1, 7)])
-
-            # Write the data rows
-            for i in range(pack_time):
-                row = [device_name, miliBuffer[i]] + sensorBuffer[i * 6:(i + 1) * 6]
-                csvwriter.writerow(row)
+                csvwriter.writerow(['Device Name', 'sequence', 'timestamp_us'] + [f'sensorBuffer_{i}' for i in range(1, 7)])
+
+            # Write the data rows, the first delta is 0 so it carries the base timestamp
+            timestamp = unwrap_timestamp(timestamp, segment_start)
+            if version_type & 0x0F == FRAME_TYPE_PACKED:
+                samples = unpack_samples(frame)
+            else:
+                samples = [FRAME_SAMPLE.unpack_from(frame, FRAME_HEADER.size + i * FRAME_SAMPLE.size) for i in range(sample_count)]
+            for delta, *axes in samples:
+                timestamp += delta
+                csvwriter.writerow([device_name, sequence, timestamp] + axes)
+
+    # Orientation goes to its own file next to the raw samples
+    def decode_quat_frame(filename, device_name, frame, segment_start=None):
+        _, _, _, sample_count, sequence, timestamp = FRAME_HEADER.unpack_from(frame, 0)
+        file_exists = os.path.isfile(filename) and os.path.getsize(filename) > 0
+        with open(filename, 'a', newline='') as csvfile:
+            csvwriter = csv.writer(csvfile)
+            if not file_exists:
+                csvwriter.writerow(['Device Name', 'sequence', 'timestamp_us', 'qw', 'qx', 'qy', 'qz'])
+            timestamp = unwrap_timestamp(timestamp, segment_start)
+            for i in range(sample_count):
+                delta, *quat = FRAME_QUAT.unpack_from(frame, FRAME_HEADER.size + i * FRAME_QUAT.size)
+                timestamp += delta
+                csvwriter.writerow([device_name, sequence, timestamp] + [q / QUAT_ONE for q in quat])
+
+    # Heel strike and toe off rows carry the angular velocity, stride rows the
+    # stride, stance and swing times and the mid-swing peak
+    def decode_gait_frame(filename, device_name, frame, segment_start=None):
+        _, _, _, sample_count, sequence, timestamp = FRAME_HEADER.unpack_from(frame, 0)
+        file_exists = os.path.isfile(filename) and os.path.getsize(filename) > 0
+        with open(filename, 'a', newline='') as csvfile:
+            csvwriter = csv.writer(csvfile)
+            if not file_exists:
+                csvwriter.writerow(['Device Name', 'sequence', 'timestamp_us', 'event',
+                                    'gyro_dps', 'stride_ms', 'stance_ms', 'swing_ms', 'swing_peak_dps'])
+            timestamp = unwrap_timestamp(timestamp, segment_start)
+            for i in range(sample_count):
+                delta, event, *fields = FRAME_GAIT.unpack_from(frame, FRAME_HEADER.size + i * FRAME_GAIT.size)
+                timestamp += delta << FRAME_GAIT_SHIFT
+                if event == GAIT_STRIDE:
+                    row = ['', fields[0], fields[1], fields[2], fields[3] / 10]
+                else:
+                    row = [fields[0] / 10, '', '', '', '']
+                csvwriter.writerow([device_name, sequence, timestamp, GAIT_EVENTS.get(event, event)] + row)
+
+    # Frames larger than the negotiated MTU arrive split over several notifications.
+    # IMU frames go to filename (dropped when it is None), sync replies to on_sync
+    # and command responses are reported when they carry an error. An offload
+    # passes segment, a dict holding the start time of the log segment being read.
+    def decode_byte_stream(filename, device_name, pending, byte_stream, on_sync=None, segment=None):
+        pending.extend(byte_stream)
+        while len(pending) >= FRAME_HEADER.size:
+            version_type = pending[0]
+            frame_type = version_type & 0x0F
+            if version_type >> 4 != FRAME_VERSION or frame_type not in (FRAME_TYPE_IMU, FRAME_TYPE_QUAT, FRAME_TYPE_GAIT, FRAME_TYPE_PACKED,
+                                                                        FRAME_TYPE_SEGMENT, FRAME_TYPE_SYNC, FRAME_TYPE_RESPONSE):
+                print(f"{device_name}: unknown frame 0x{version_type:02x}, resynchronising")
+                pending.clear()
+                return
+            if frame_type == FRAME_TYPE_SYNC:
+                frame_len = SYNC_REPLY_FRAME.size
+            elif frame_type == FRAME_TYPE_RESPONSE:
+                frame_len = RESPONSE_HEADER.size + pending[4]
+            elif frame_type == FRAME_TYPE_SEGMENT:
+                frame_len = FRAME_HEADER.size + FRAME_SEGMENT_START.size
+            elif frame_type == FRAME_TYPE_QUAT:
+                frame_len = FRAME_HEADER.size + pending[3] * FRAME_QUAT.size
+            elif frame_type == FRAME_TYPE_GAIT:
+                frame_len = FRAME_HEADER.size + pending[3] * FRAME_GAIT.size
+            elif frame_type == FRAME_TYPE_PACKED:
+                if len(pending) <= FRAME_HEADER.size:
+                    return
+                frame_len = pending[FRAME_HEADER.size]
+            else:
+                frame_len = FRAME_HEADER.size + pending[3] * FRAME_SAMPLE.size
+            if len(pending) < frame_len:
+                return
+            if frame_type == FRAME_TYPE_SYNC:
+                if on_sync:
+                    on_sync(bytes(pending[:frame_len]))
+            elif frame_type == FRAME_TYPE_SEGMENT:
+                if segment is not None:
+                    segment['start'], = FRAME_SEGMENT_START.unpack_from(pending, FRAME_HEADER.size)
+            elif frame_type == FRAME_TYPE_RESPONSE:
+                _, status, _, opcode, _ = RESPONSE_HEADER.unpack_from(pending, 0)
+                if status != 0:
+                    print(f"{device_name}: command 0x{opcode:02x} failed, {CMD_STATUS.get(status, status)}")
+                elif opcode == CMD_GET_FUSION:
+                    updates, average, maximum, last = FUSION_STATS.unpack_from(pending, RESPONSE_HEADER.size)
+                    print(f"{device_name}: fusion {updates} updates, {average} cycles average, {maximum} max, {last} last")
+                elif opcode == CMD_GET_STATS:
+                    (dropped, sent, retried, frames_dropped, accepted, rejected, completed, wakeups,
+                     depth, high_water) = TX_STATS.unpack_from(pending, RESPONSE_HEADER.size)
+                    (periods, period_min, period_max, period_mean, jitter_rms, missed, overruns,
+                     logged, log_errors, command_errors) = ACQ_STATS.unpack_from(pending, RESPONSE_HEADER.size + TX_STATS.size)
+                    print(f"{device_name}: {sent} frames sent, {retried} retried, {frames_dropped} dropped, "
+                          f"{dropped} samples dropped, queue {depth} (max {high_water}), {wakeups} wakeups")
+                    print(f"{device_name}: sample period {period_mean} us ({period_min}-{period_max}) over {periods}, "
+                          f"jitter {jitter_rms} us rms, {missed} missed, {overruns} FIFO overruns")
+                    print(f"{device_name}: {logged} frames logged, {log_errors} log errors, {command_errors} bad commands")
+            else:
+                decode_frame(filename, device_name, bytes(pending[:frame_len]),
+                             segment.get('start') if segment is not None else None)
+            del pending[:frame_len]
     
     # Function to handle data received from the device
     def handle_rx(index, _, data: bytearray):
+        t4 = host_micros()
         device_index = connected_clients.get(index, "Unknown")
         #print(f"Received from device {device_index}:", data)
-        if start_flag:
-            # Process the bytearray to extract the data
-            decode_byte_stream(filename, data)
+        # Process the bytearray to extract the data, samples are only kept while logging
+        decode_byte_stream(filename if start_flag else None, matching_devices[index].name,
+                           rx_buffers.setdefault(index, bytearray()), data,
+                           lambda frame: handle_sync_reply(index, frame, t4))
+
+    def handle_sync_reply(index, frame, t4):
+        waiter = sync_waiters.pop(index, None)
+        if waiter and not waiter.done():
+            waiter.set_result((frame, t4))
+
+    async def write_uart(client, data):
+        nus = client.services.get_service(UART_SERVICE_UUID)
+        rx_char = nus.get_characteristic(UART_RX_CHAR_UUID)
+        for s in sliced(data, rx_char.max_write_without_response_size):
+            await client.write_gatt_char(rx_char, s, response=False)
+
+    # NTP style exchanges: the device follows the reply that reached this
+    # computer the fastest, so its frames carry timestamps in this computer's clock
+    async def sync_clock(index, client):
+        best = None
+        for seq in range(SYNC_ROUNDS):
+            waiter = loop.create_future()
+            sync_waiters[index] = waiter
+            t1 = host_micros()
+            await write_uart(client, encode_command(CMD_SYNC_REQUEST, SYNC_REQUEST_PAYLOAD.pack(seq, t1)))
+            try:
+                frame, t4 = await asyncio.wait_for(waiter, 1.0)
+            except asyncio.TimeoutError:
+                continue
+            _, _, _, reply_seq, reply_t1, t2, t3 = SYNC_REPLY_FRAME.unpack(frame)
+            if reply_seq != seq or reply_t1 != t1:
+                continue
+            offset = ((t1 - t2) + (t4 - t3)) // 2
+            delay = max((t4 - t1) - (t3 - t2), 0)
+            await write_uart(client, encode_command(CMD_SYNC_RESULT, SYNC_RESULT_PAYLOAD.pack(seq, offset, delay)))
+            if best is None or delay < best:
+                best = delay
+        sync_waiters.pop(index, None)
+        if best is None:
+            print(f"Device {index}: no sync replies")
+        else:
+            print(f"Device {index}: synchronised, best round trip {best} us")
+
+    async def periodic_sync():
+        while connected_clients:
+            for index, client in list(connected_clients.items()):
+                await sync_clock(index, client)
+            await asyncio.sleep(SYNC_PERIOD)
+
+    # Flash log offload arrives as back to back frames on its own characteristic
+    def handle_offload(index, _, data: bytearray):
+        decode_byte_stream(offload_filename, matching_devices[index].name, offload_buffers.setdefault(index, bytearray()), data,
+                           segment=offload_segments.setdefault(index, {}))
+
+    def handle_link(index, _, data: bytearray):
+        mtu, data_length, phy, interval, requested, capacity, required = LINK_INFO.unpack(data)
+        print(f"{matching_devices[index].name}: MTU {mtu}, data length {data_length}, {phy}M PHY, "
+              f"interval {interval * 1.25} ms (asked {requested * 1.25} ms), capacity {capacity} B/s for {required} B/s")
 
     def reconstruct_csv(input_file, output_file_L, output_file_R):
+        # Nothing of this kind was streamed, e.g. no raw samples in quaternion mode
+        if not os.path.isfile(input_file):
+            return
         with open(input_file, 'r', newline='') as infile:
             reader = csv.reader(infile)
             header = next(reader)  # Read the header
@@ -175,9 +457,21 @@ async def main():
                     elif device_name[-1] == 'R':
                         writer_R.writerow(row)
 
+    # The raw samples and the quaternion and gait files next to them
+    def split_recordings(input_file, output_file_L, output_file_R):
+        for suffix in ("", "_quat", "_gait"):
+            named = lambda f: os.path.splitext(f)[0] + suffix + ".csv"
+            reconstruct_csv(named(input_file), named(output_file_L), named(output_file_R))
+
     
     # Connect to the selected devices and set up notifications and data handling
     connected_clients = {}  # Initialize as a dictionary
+    rx_buffers = {}  # Partial frames per device index
+    sync_waiters = {}  # Pending sync reply per device index
+    sync_task = None
+    offload_buffers = {}
+    offload_segments = {}
+    offload_filename = os.path.join(subfolder, "offload.csv")
     # Full path including the subfolder
     current_time = datetime.datetime.now().strftime("%Y%m%d_%H%M%S")
     filename = os.path.join(subfolder, f"rxdata_{current_time}.csv")
@@ -188,6 +482,8 @@ async def main():
         client = BleakClient(selected_device, disconnected_callback=handle_disconnect)
         await client.connect()
         await client.start_notify(UART_TX_CHAR_UUID, lambda _, data, index=index: handle_rx(index, _, data))
+        await client.start_notify(OFFLOAD_CHAR_UUID, lambda _, data, index=index: handle_offload(index, _, data))
+        await client.start_notify(LINK_CHAR_UUID, lambda _, data, index=index: handle_link(index, _, data))
         connected_clients[index] = client  # Use index as the key
         print(f"Connected to device {index}: {selected_device.name}")
 
@@ -199,14 +495,81 @@ async def main():
         # Check if the input is "datetime" to send the current date and time
         if data.decode('utf-8').lower() == "tt":
             time_to_send = datetime.datetime.now().strftime("%Y/%m/%d %H:%M:%S")
-            data = time_to_send.encode('utf-8')
+            command = encode_command(CMD_SET_TIME, struct.pack('<I', host_micros() // 1000000))
             for index, client in connected_clients.items():
-                nus = client.services.get_service(UART_SERVICE_UUID)
-                rx_char = nus.get_characteristic(UART_RX_CHAR_UUID)
-                for s in sliced(data, rx_char.max_write_without_response_size):
-                    await client.write_gatt_char(rx_char, s, response=False)
+                await write_uart(client, command)
             print("Sending current date and time:", time_to_send)
 
+        fields = data.decode('utf-8').lower().split()
+        if len(fields) == 5 and fields[0] == "cfg" and all(f.isdigit() for f in fields[1:]):
+            command = encode_command(CMD_SET_CONFIG, IMU_CONFIG.pack(*(int(f) for f in fields[1:])))
+            for index, client in connected_clients.items():
+                await write_uart(client, command)
+            print("Sending IMU configuration:", ' '.join(fields[1:]))
+
+        if len(fields) == 2 and fields[0] == "quat" and fields[1].isdigit() and 0 < int(fields[1]) < 256:
+            command = encode_command(CMD_SET_STREAM, bytes([STREAM_QUATERNION, int(fields[1])]))
+            for index, client in connected_clients.items():
+                await write_uart(client, command)
+            print(f"Streaming orientation, one quaternion every {fields[1]} samples")
+
+        if 2 <= len(fields) <= 3 and fields[0] == "gait" and fields[1] in ("0", "1", "2") and fields[2:] in ([], ["inv"]):
+            axis = int(fields[1]) | (0x80 if fields[2:] else 0)
+            command = encode_command(CMD_SET_STREAM, bytes([STREAM_GAIT, axis]))
+            for index, client in connected_clients.items():
+                await write_uart(client, command)
+            print("Streaming gait events on gyro axis", ' '.join(fields[1:]))
+
+        if 2 <= len(fields) <= 3 and fields[0] == "dec" and fields[1] in ("1", "2", "4", "8") and fields[2:] in ([], ["log"]):
+            flags = DECIMATION_LOG_FULL_RATE if fields[2:] else 0
+            command = encode_command(CMD_SET_DECIMATION, bytes([int(fields[1]), flags]))
+            for index, client in connected_clients.items():
+                await write_uart(client, command)
+            print(f"Streaming at 1/{fields[1]} of the ODR" + (", full rate to flash" if flags else ""))
+
+        if len(fields) == 4 and fields[0] == "wom" and all(f.isdigit() for f in fields[1:]):
+            payload = MOTION_CONFIG.pack(1, int(fields[1]), int(fields[2]), int(fields[3]))
+            command = encode_command(CMD_SET_MOTION, payload)
+            for index, client in connected_clients.items():
+                await write_uart(client, command)
+            print(f"Waiting for motion after {fields[2]} s still, sending {fields[3]} ms before it")
+
+        if data.decode('utf-8').lower() == "wom off":
+            command = encode_command(CMD_SET_MOTION, MOTION_CONFIG.pack(0, 1, 30, 1000))
+            for index, client in connected_clients.items():
+                await write_uart(client, command)
+            print("Streaming continuously")
+
+        if data.decode('utf-8').lower() == "packed":
+            command = encode_command(CMD_SET_STREAM, bytes([STREAM_PACKED, 0]))
+            for index, client in connected_clients.items():
+                await write_uart(client, command)
+            print("Streaming packed samples")
+
+        if data.decode('utf-8').lower() == "raw":
+            command = encode_command(CMD_SET_STREAM, bytes([STREAM_BINARY, 1]))
+            for index, client in connected_clients.items():
+                await write_uart(client, command)
+            print("Streaming raw samples")
+
+        if data.decode('utf-8').lower() == "st":
+            for index, client in connected_clients.items():
+                await write_uart(client, encode_command(CMD_GET_STATS))
+
+        if data.decode('utf-8').lower() == "ff":
+            for index, client in connected_clients.items():
+                await write_uart(client, encode_command(CMD_GET_FUSION))
+
+        if data.decode('utf-8').lower() == "yy":
+            if sync_task is None or sync_task.done():
+                sync_task = asyncio.ensure_future(periodic_sync())
+
+        if data.decode('utf-8').lower() == "oo":
+            offload_filename = os.path.join(subfolder, f"offload_{datetime.datetime.now().strftime('%Y%m%d_%H%M%S')}.csv")
+            for index, client in connected_clients.items():
+                await client.write_gatt_char(OFFLOAD_CHAR_UUID, b'\x01', response=True)
+            print("Offloading recorded data to", offload_filename)
+
         if data.decode('utf-8').lower() == "rr":
             current_time = datetime.datetime.now().strftime("%Y%m%d_%H%M%S")
             # Full path including the subfolder
@@ -218,15 +581,17 @@ async def main():
         
         if data.decode('utf-8').lower() == "ss":
             start_flag = False
-            reconstruct_csv(filename, output_file_L, output_file_R)
+            split_recordings(filename, output_file_L, output_file_R)
             print('Stop to logging data!')
 
         # Check if the input is "Disconnect" to disconnect all devices
         if data.decode('utf-8').lower() == "dd":
             print("Disconnecting all devices...")
+            if sync_task is not None:
+                sync_task.cancel()
             if start_flag:
                 start_flag = False
-                reconstruct_csv(filename, output_file_L, output_file_R)
+                split_recordings(filename, output_file_L, output_file_R)
             for index, client in connected_clients.items():
                 await client.disconnect()
                 print(f"Disconnected device {index}: {client.address}")